@@ -250,6 +250,23 @@ setup_pt_uart(
     return SUCCESS;
 }
 
+static status_t
+setup_pt_io(
+    struct vm_t *vm, uint64_t port, uint64_t size)
+{
+    status_t ret = SUCCESS;
+
+    if (size != 0) {
+        ret = hypercall_domain_op__add_pt_io(vm->domainid, port, size);
+        if (ret != SUCCESS) {
+            BFDEBUG("setup_pt_io: hypercall_domain_op__add_pt_io failed\n");
+            return ret;
+        }
+    }
+
+    return SUCCESS;
+}
+
 /* -------------------------------------------------------------------------- */
 /* GPA Functions                                                              */
 /* -------------------------------------------------------------------------- */
@@ -656,6 +673,11 @@ common_create_vm_from_bzimage(
         return ret;
     }
 
+    ret = setup_pt_io(vm, args->pt_io, args->pt_io_size);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
     args->domainid = vm->domainid;
     return SUCCESS;
 }
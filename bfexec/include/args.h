@@ -51,7 +51,14 @@ parse_args(int argc, char *argv[])
     ("initrd", "The VM's initrd path", value<std::string>(), "[path]")
     ("cmdline", "Additional Linux command line arguments", value<std::string>(), "[text]")
     ("uart", "Give the VM an emulated UART", value<uint64_t>(), "[port #]")
-    ("pt_uart", "Pass-through a UART to VM", value<uint64_t>(), "[port #]");
+    ("pt_uart", "Pass-through a UART to VM", value<uint64_t>(), "[port #]")
+    ("pt_io", "Pass-through a range of I/O ports to the VM", value<std::string>(), "[port:size]")
+    ("pv_console", "Give the VM a paravirtual console ring")
+    ("disk", "Give the VM a virtio block device backed by a file", value<std::string>(), "[path]")
+    ("net", "Give the VM a virtio network device", value<std::string>(), "[tap:ifname|unix:path:peer|switch:dir]")
+    ("vsock", "Give the VM a virtio socket device backed by a unix socket", value<std::string>(), "[path]")
+    ("halt_poll_ns", "Max time a vCPU polls before sleeping (0 disables)", value<uint64_t>(), "[ns]")
+    ("timer_slack_ns", "The timer slack of the VM's vCPU threads", value<uint64_t>(), "[ns]");
 
     auto args = options.parse(argc, argv);
 
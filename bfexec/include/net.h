@@ -0,0 +1,176 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef NET_H
+#define NET_H
+
+#include <chrono>
+#include <string>
+#include <cstdint>
+
+namespace bfn
+{
+
+/// Net
+///
+/// The host side of a VM's virtio network device. Every frame that is sent
+/// or received is prefixed with a 12 byte virtio_net_hdr_v1, so checksum
+/// and segmentation offload requests are passed through as is. Three
+/// backends are supported:
+///
+/// - tap:<ifname> uses a tap device (with IFF_VNET_HDR), which connects
+///   the VM to the host's network stack.
+/// - unix:<path>:<peer> uses an AF_UNIX datagram socket that is bound to
+///   path, and sends to peer. Two VMs that point at each other's path are
+///   connected with a virtual cable.
+/// - switch:<dir> attaches the VM to the VMM's net switch, which forwards
+///   frames between the VMs on the switch without involving the host. No
+///   frames go through the backend. Instead, an AF_UNIX datagram socket
+///   that is bound to <dir>/<port> (where the port is our pid) is used to
+///   wake up the VMs that the switch delivered frames to.
+///
+class net
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param spec the backend to use (see above)
+    ///
+    explicit net(const std::string &spec);
+
+    /// Destructor
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    ~net();
+
+    /// Set Offloads
+    ///
+    /// Tells the backend which offloads the guest accepted, so that it only
+    /// hands the guest frames that the guest can handle.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param features the virtio-net features accepted by the guest
+    ///
+    void set_offloads(uint64_t features);
+
+    /// Wait
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param timeout the max amount of time to wait
+    /// @return returns true if a frame can be received, false otherwise
+    ///
+    bool wait(std::chrono::milliseconds timeout);
+
+    /// Receive
+    ///
+    /// Receives a single frame without blocking.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param buf the buffer to receive the frame into
+    /// @param size the size of buf
+    /// @return returns the size of the frame, or 0 if there is no frame
+    ///
+    std::size_t recv(void *buf, std::size_t size);
+
+    /// Send
+    ///
+    /// Sends a single frame. Same as a real network, a frame that cannot
+    /// be sent (e.g. the peer is not running) is dropped.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param buf the frame to send
+    /// @param size the size of the frame
+    ///
+    void send(const void *buf, std::size_t size);
+
+    /// Port
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return returns the port the VM attaches to the VMM's net switch
+    ///     with, or 0 if the backend is not switch:<dir>
+    ///
+    uint64_t port() const noexcept;
+
+    /// Wake
+    ///
+    /// Wakes up the VM that is attached to the net switch with the
+    /// provided port (from the same directory).
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param port the port of the VM to wake up
+    ///
+    void wake(uint64_t port);
+
+    /// Drain
+    ///
+    /// Discards every pending wake up. Once this returns, wait() only
+    /// returns true if the VM was woken up again.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    void drain();
+
+private:
+
+    int m_fd{-1};
+    bool m_tap{};
+    uint64_t m_port{};
+
+    std::string m_dir;
+    std::string m_path;
+    std::string m_peer;
+
+public:
+
+    /// @cond
+
+    net(net &&) = delete;
+    net &operator=(net &&) = delete;
+
+    net(const net &) = delete;
+    net &operator=(const net &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
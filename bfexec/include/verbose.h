@@ -44,4 +44,40 @@
         u = std::thread(uart_thread);                                                                                                       \
     }
 
+#define halt_poll_verbose()                                                                                                                 \
+    if (verbose) {                                                                                                                          \
+        std::cout << '\n';                                                                                                                  \
+        std::cout << bfcolor_cyan    "vCPU halt polling:\n" bfcolor_end;                                                                    \
+        std::cout << bfcolor_magenta "--------------------------------------------------------------------------------\n" bfcolor_end;      \
+        std::cout << "             polls" bfcolor_yellow " | " << bfcolor_green << hp.polls << bfcolor_end "\n";                            \
+        std::cout << "  successful polls" bfcolor_yellow " | " << bfcolor_green << hp.successful_polls << bfcolor_end "\n";                 \
+        std::cout << "     wasted cycles" bfcolor_yellow " | " << bfcolor_green << hp.wasted_cycles << bfcolor_end "\n";                    \
+        std::cout << "  final window(ns)" bfcolor_yellow " | " << bfcolor_green << hp.poll_ns << bfcolor_end "\n";                          \
+    }
+
+#define jitter_verbose()                                                                                                                    \
+    if (verbose) {                                                                                                                          \
+        std::cout << '\n';                                                                                                                  \
+        std::cout << bfcolor_cyan    "vCPU wakeup jitter:\n" bfcolor_end;                                                                   \
+        std::cout << bfcolor_magenta "--------------------------------------------------------------------------------\n" bfcolor_end;      \
+        std::cout << "           wakeups" bfcolor_yellow " | " << bfcolor_green << jitter.wakeups << bfcolor_end "\n";                      \
+        std::cout << "      late wakeups" bfcolor_yellow " | " << bfcolor_green << jitter.late_wakeups << bfcolor_end "\n";                 \
+        std::cout << "      avg late(ns)" bfcolor_yellow " | " << bfcolor_green << (jitter.late_wakeups ? jitter.total_late_ns / jitter.late_wakeups : 0) << bfcolor_end "\n";\
+        std::cout << "      max late(ns)" bfcolor_yellow " | " << bfcolor_green << jitter.max_late_ns << bfcolor_end "\n";                  \
+    }
+
+#define virtio_net_verbose()                                                                                                                \
+    if (verbose) {                                                                                                                          \
+        auto stats = g_virtio_net_ring->stats;                                                                                              \
+        auto secs = std::max(duration<double>(steady_clock::now() - start).count(), 1.0);                                                   \
+        std::cout << '\n';                                                                                                                  \
+        std::cout << bfcolor_cyan    "Virtio net" << (g_net->port() != 0 ? " (net switch port " + std::to_string(g_net->port()) + ")" : "") << ":\n" bfcolor_end;\
+        std::cout << bfcolor_magenta "--------------------------------------------------------------------------------\n" bfcolor_end;      \
+        std::cout << "        tx packets" bfcolor_yellow " | " << bfcolor_green << stats.tx_packets << " (" << (stats.tx_packets / secs) << "/s)" << bfcolor_end "\n";\
+        std::cout << "          tx bytes" bfcolor_yellow " | " << bfcolor_green << stats.tx_bytes << " (" << (stats.tx_bytes / secs) << "/s)" << bfcolor_end "\n";\
+        std::cout << "        rx packets" bfcolor_yellow " | " << bfcolor_green << stats.rx_packets << " (" << (stats.rx_packets / secs) << "/s)" << bfcolor_end "\n";\
+        std::cout << "          rx bytes" bfcolor_yellow " | " << bfcolor_green << stats.rx_bytes << " (" << (stats.rx_bytes / secs) << "/s)" << bfcolor_end "\n";\
+        std::cout << "           dropped" bfcolor_yellow " | " << bfcolor_green << stats.dropped << bfcolor_end "\n";                       \
+    }
+
 #endif
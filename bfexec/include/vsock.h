@@ -0,0 +1,243 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VSOCK_H
+#define VSOCK_H
+
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+
+// -----------------------------------------------------------------------------
+// Defines
+// -----------------------------------------------------------------------------
+
+#ifndef VSOCK_BUF_ALLOC
+#define VSOCK_BUF_ALLOC 0x40000
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace bfn
+{
+
+/// Vsock
+///
+/// The host side of a VM's virtio socket device. Packets from the guest
+/// are handed to send(), and the packets for the guest are taken from
+/// recv(). Each packet is a 44 byte virtio_vsock_hdr followed by its
+/// payload. Every connection is backed by an AF_UNIX stream socket, which
+/// follows the same conventions as Firecracker, so host tools do not have
+/// to know anything about vsock:
+///
+/// - To connect to port P in the guest, a host tool connects to <path>,
+///   and writes "CONNECT P\n". Once the guest accepts, "OK <port>\n" is
+///   written back (where port is the host side port of the connection),
+///   after which the socket carries the stream. If the guest refuses, the
+///   socket is closed.
+/// - When the guest connects to port P on the host (CID 2), the
+///   connection is made to <path>_P, which a host tool has to be
+///   listening on.
+///
+/// Flow control uses the credit that is part of every packet: the guest
+/// never sends more than VSOCK_BUF_ALLOC bytes that have not been written
+/// to the host socket yet, and the host socket is only read when the
+/// guest has room for what is read. A slow reader on either side stalls
+/// its own connection, and nothing else.
+///
+/// This is not thread safe, except for kick().
+///
+class vsock
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param path the path of the unix socket to listen on (see above)
+    /// @param guest_cid the CID of the guest
+    ///
+    vsock(const std::string &path, uint64_t guest_cid);
+
+    /// Destructor
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    ~vsock();
+
+    /// Wait
+    ///
+    /// Waits for any of the host sockets, or for kick(), and processes
+    /// whatever woke us up (e.g. a new connection from a host tool).
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param timeout the max amount of time to wait
+    /// @param rx true if the caller can take packets (i.e. the ring has
+    ///     room), in which case the host sockets are also waited on for
+    ///     data to read
+    /// @return returns true if recv() has a packet, false otherwise
+    ///
+    bool wait(std::chrono::milliseconds timeout, bool rx);
+
+    /// Receive
+    ///
+    /// Returns the next packet for the guest, without blocking.
+    ///
+    /// @expects size >= VIRTIO_VSOCK_HDR_SIZE + VIRTIO_VSOCK_RX_PAYLOAD
+    /// @ensures none
+    ///
+    /// @param buf the buffer to receive the packet into
+    /// @param size the size of buf
+    /// @return returns the size of the packet, or 0 if there is no packet
+    ///
+    std::size_t recv(void *buf, std::size_t size);
+
+    /// Send
+    ///
+    /// Processes a single packet from the guest.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param buf the packet to process
+    /// @param size the size of the packet
+    ///
+    void send(const void *buf, std::size_t size);
+
+    /// Kick
+    ///
+    /// Wakes up wait(). This can be called from any thread.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    void kick();
+
+    /// Reset
+    ///
+    /// Closes every connection (the guest reset its device, so all of its
+    /// sockets are gone).
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    void reset();
+
+private:
+
+#pragma pack(push, 1)
+
+    struct hdr_t {
+        uint64_t src_cid;
+        uint64_t dst_cid;
+        uint32_t src_port;
+        uint32_t dst_port;
+        uint32_t len;
+        uint16_t type;
+        uint16_t op;
+        uint32_t flags;
+        uint32_t buf_alloc;
+        uint32_t fwd_cnt;
+    };
+
+#pragma pack(pop)
+
+    struct conn_t {
+        int fd;
+        uint32_t host_port;
+        uint32_t guest_port;
+
+        bool connected;
+        bool readable;
+        bool host_eof;
+        bool guest_eof;
+        bool guest_rcv_shut;
+
+        uint32_t peer_buf_alloc;
+        uint32_t peer_fwd_cnt;
+        uint32_t tx_cnt;
+        uint32_t fwd_cnt;
+        uint32_t fwd_advertised;
+
+        std::vector<uint8_t> out;
+    };
+
+    using key_type = uint64_t;
+
+    key_type key(uint32_t host_port, uint32_t guest_port) const noexcept;
+    uint32_t credit(const conn_t &conn) const noexcept;
+    bool readable(const conn_t &conn) const noexcept;
+    bool done(const conn_t &conn) const noexcept;
+
+    hdr_t make_hdr(conn_t &conn, uint16_t op, uint32_t flags = 0);
+    void queue(conn_t &conn, uint16_t op, uint32_t flags = 0);
+    void queue_rst(uint32_t host_port, uint32_t guest_port);
+
+    void accept_host();
+    void handshake(int fd);
+    void connect_host(const hdr_t &hdr);
+
+    void flush(key_type key);
+    void close_conn(key_type key);
+    void reset_conn(key_type key);
+
+private:
+
+    int m_fd{-1};
+    int m_kick[2]{-1, -1};
+
+    std::string m_path;
+    uint64_t m_guest_cid;
+    uint32_t m_next_port;
+
+    std::unordered_map<key_type, conn_t> m_conns;
+    std::unordered_map<int, std::string> m_handshakes;
+
+    std::deque<hdr_t> m_ctrl;
+    std::deque<key_type> m_readable;
+
+public:
+
+    /// @cond
+
+    vsock(vsock &&) = delete;
+    vsock &operator=(vsock &&) = delete;
+
+    vsock(const vsock &) = delete;
+    vsock &operator=(const vsock &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
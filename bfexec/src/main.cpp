@@ -23,13 +23,19 @@
 #include <bfdebug.h>
 #include <bfstring.h>
 #include <bfaffinity.h>
+#include <bfgpalayout.h>
 #include <bfbuilderinterface.h>
 #include <bftsc.h>
 
 #include <list>
+#include <mutex>
+#include <atomic>
 #include <memory>
 #include <chrono>
+#include <random>
 #include <thread>
+#include <algorithm>
+#include <condition_variable>
 #include <fstream>
 #include <iostream>
 
@@ -37,18 +43,29 @@
 #include <cmdl.h>
 #include <file.h>
 #include <ioctl.h>
+#include <net.h>
+#include <vsock.h>
 #include <verbose.h>
 
 #if defined(WIN32) || defined(__CYGWIN__)
 #include <windows.h>
 #else
+#include <time.h>
+#include <errno.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
+#endif
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 using namespace std::chrono;
 
 vcpuid_t g_vcpuid;
 domainid_t g_domainid;
+uint64_t g_tsc_freq_khz;
 
 auto ctl = std::make_unique<ioctl>();
 
@@ -87,6 +104,16 @@ dl_timespec_get()
 }
 #endif
 
+inline void
+cpu_relax()
+{
+#ifdef WIN32
+    _mm_pause();
+#else
+    __asm__ __volatile__ ("pause");
+#endif
+}
+
 inline uint64_t
 rdtsc()
 {
@@ -112,11 +139,71 @@ init_tsc()
     // Boxy doesn't support pre-skylake CPUs because of unreliable tsc freq.
     // We don't actually need the tsc freq info here but we can use it to
     // check whether the CPU is supported.
-    if (!calibrate_tsc_freq_khz()) {
+    g_tsc_freq_khz = calibrate_tsc_freq_khz();
+    if (g_tsc_freq_khz == 0) {
         throw std::runtime_error("missing tsc info. system not supported");
     }
 }
 
+inline uint64_t
+nsec_to_tsc(uint64_t nsec)
+{
+    return
+        ((nsec / 1000000) * g_tsc_freq_khz) +
+        (((nsec % 1000000) * g_tsc_freq_khz) / 1000000);
+}
+
+inline uint64_t
+tsc_to_nsec(uint64_t tsc)
+{
+    return
+        ((tsc / g_tsc_freq_khz) * 1000000) +
+        (((tsc % g_tsc_freq_khz) * 1000000) / g_tsc_freq_khz);
+}
+
+// -----------------------------------------------------------------------------
+// Sleep
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// When the guest yields, the VMM returns the absolute TSC of the guest's next
+// event instead of a relative number of nanoseconds. This way, the time it
+// takes to get from the VMM to here doesn't add up. We convert the TSC to an
+// absolute CLOCK_MONOTONIC time by sampling both clocks at the same time and
+// then sleep using TIMER_ABSTIME.
+//
+
+void
+sleep_until_tsc(uint64_t deadline)
+{
+#ifdef WIN32
+    if (auto tsc = rdtsc(); tsc < deadline) {
+        std::this_thread::sleep_for(nanoseconds(tsc_to_nsec(deadline - tsc)));
+    }
+#else
+    struct timespec ts;
+
+    auto tsc = rdtsc();
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    if (tsc >= deadline) {
+        return;
+    }
+
+    auto nsec = tsc_to_nsec(deadline - tsc) + static_cast<uint64_t>(ts.tv_nsec);
+
+    ts.tv_sec += static_cast<time_t>(nsec / 1000000000);
+    ts.tv_nsec = static_cast<long>(nsec % 1000000000);
+
+    while (true) {
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) != EINTR) {
+            break;
+        }
+    }
+#endif
+}
+
 // -----------------------------------------------------------------------------
 // Wall Clock
 // -----------------------------------------------------------------------------
@@ -177,6 +264,292 @@ set_wallclock()
     return ret == SUCCESS;
 }
 
+// -----------------------------------------------------------------------------
+// Events
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// An event is used to wake up a thread that is waiting on the guest (e.g.
+// the console thread). The vCPU thread signals the event when the guest
+// notifies us (run_op notify), and the waiting thread falls back to a
+// timeout so that a lost notification only delays output.
+//
+
+struct event_t {
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool signaled{};
+};
+
+void
+event_signal(event_t &event)
+{
+    {
+        std::lock_guard lock(event.mutex);
+        event.signaled = true;
+    }
+
+    event.cond.notify_one();
+}
+
+void
+event_wait(event_t &event)
+{
+    std::unique_lock lock(event.mutex);
+
+    event.cond.wait(lock, [&] { return event.signaled; });
+    event.signaled = false;
+}
+
+bool
+event_wait(event_t &event, nanoseconds timeout)
+{
+    std::unique_lock lock(event.mutex);
+
+    auto signaled =
+        event.cond.wait_for(lock, timeout, [&] { return event.signaled; });
+
+    event.signaled = false;
+    return signaled;
+}
+
+bool
+event_wait_until(event_t &event, steady_clock::time_point until)
+{
+    std::unique_lock lock(event.mutex);
+
+    auto signaled =
+        event.cond.wait_until(lock, until, [&] { return event.signaled; });
+
+    event.signaled = false;
+    return signaled;
+}
+
+bool
+event_try_wait(event_t &event)
+{
+    std::lock_guard lock(event.mutex);
+
+    auto signaled = event.signaled;
+    event.signaled = false;
+
+    return signaled;
+}
+
+event_t g_uart_event;
+event_t g_console_event;
+event_t g_virtio_blk_event;
+event_t g_virtio_net_tx_event;
+event_t g_virtio_net_rx_event;
+
+// Note:
+//
+// The vsock backend has its own wakeup (g_vsock->kick()), as its thread
+// sleeps on the host's sockets and not on an event.
+//
+
+std::unique_ptr<bfn::vsock> g_vsock;
+
+// Note:
+//
+// When the UART's buffer is full, the guest's OUT does not complete, and
+// the vCPU returns with boxy_notify__uart_full. Instead of running the
+// guest again (which would just return again), the vCPU thread blocks until
+// the UART thread has dumped the buffer. The number of dumps is used
+// instead of an event_t so that every vCPU thread that is waiting wakes up.
+//
+
+std::mutex g_uart_dump_mutex;
+std::condition_variable g_uart_dump_cond;
+uint64_t g_uart_dumps{};
+
+void
+uart_dumped()
+{
+    {
+        std::lock_guard lock(g_uart_dump_mutex);
+        g_uart_dumps++;
+    }
+
+    g_uart_dump_cond.notify_all();
+}
+
+void
+wait_for_uart_dump()
+{
+    std::unique_lock lock(g_uart_dump_mutex);
+    auto dumps = g_uart_dumps;
+
+    event_signal(g_uart_event);
+
+    g_uart_dump_cond.wait_for(lock, milliseconds(100), [&] {
+        return g_uart_dumps != dumps;
+    });
+}
+
+// Note:
+//
+// The vCPU event wakes up a vCPU thread that is sleeping on a yield when a
+// backend has work for the guest (e.g. a completed virtio block request, or
+// a received frame).
+// The VMM only delivers the completion once the vCPU is resumed, so without
+// this, the guest would not see it until its next timer fires. The event
+// is only used when such a backend exists, as a plain sleep is cheaper.
+//
+
+event_t g_vcpu_event;
+bool g_vcpu_event_enabled = false;
+
+bool
+vcpu_sleep_until_tsc(uint64_t deadline)
+{
+    if (!g_vcpu_event_enabled) {
+        sleep_until_tsc(deadline);
+        return true;
+    }
+
+    // Note:
+    //
+    // Same as sleep_until_tsc(), the deadline is converted to an absolute
+    // steady_clock time (CLOCK_MONOTONIC) by sampling both clocks at the
+    // same time, so the time it takes to get to the wait doesn't add up.
+    //
+
+    auto tsc = rdtsc();
+    auto now = steady_clock::now();
+
+    if (tsc < deadline) {
+        auto until = now + nanoseconds(tsc_to_nsec(deadline - tsc));
+        return !event_wait_until(g_vcpu_event, until);
+    }
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Halt Polling
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// When the guest yields, the VMM tells us how long it has until its next
+// event. For short waits, the time it takes the host to put this thread to
+// sleep and wake it back up is longer than the wait itself, which means the
+// guest's timers fire late. To deal with this, we sleep until we are within
+// the poll window of the deadline, and then we spin (with pause) for the
+// rest. The poll window is adjusted using the same approach as KVM: if we
+// wake up too late, the window grows, and if we end up spinning for most of
+// the window, the window shrinks. A max window of 0 disables polling. While
+// spinning, we also check the vCPU event, so that a backend that has work
+// for the guest does not have to wait for the deadline.
+//
+
+#define HALT_POLL_NS_GROW_START 10000
+
+uint64_t g_halt_poll_ns_max = 200000;
+
+struct halt_poll_t {
+    uint64_t poll_ns{};
+
+    uint64_t polls{};
+    uint64_t successful_polls{};
+    uint64_t wasted_cycles{};
+};
+
+void
+halt_poll_grow(halt_poll_t &hp)
+{
+    hp.poll_ns = hp.poll_ns == 0 ? HALT_POLL_NS_GROW_START : hp.poll_ns * 2;
+
+    if (hp.poll_ns > g_halt_poll_ns_max) {
+        hp.poll_ns = g_halt_poll_ns_max;
+    }
+}
+
+void
+halt_poll_shrink(halt_poll_t &hp)
+{
+    hp.poll_ns /= 2;
+
+    if (hp.poll_ns < HALT_POLL_NS_GROW_START) {
+        hp.poll_ns = 0;
+    }
+}
+
+void
+halt_poll(halt_poll_t &hp, uint64_t deadline)
+{
+    if (g_halt_poll_ns_max == 0) {
+        vcpu_sleep_until_tsc(deadline);
+        return;
+    }
+
+    auto poll_tsc = nsec_to_tsc(hp.poll_ns);
+
+    auto slept = deadline > rdtsc() + poll_tsc;
+    if (slept && !vcpu_sleep_until_tsc(deadline - poll_tsc)) {
+        return;
+    }
+
+    hp.polls++;
+
+    auto start = rdtsc();
+    if (start >= deadline) {
+
+        // The host woke us up after the deadline, so the poll window was
+        // not large enough to hide the host's wakeup latency.
+
+        halt_poll_grow(hp);
+        return;
+    }
+
+    while (rdtsc() < deadline) {
+        if (g_vcpu_event_enabled && event_try_wait(g_vcpu_event)) {
+            break;
+        }
+
+        cpu_relax();
+    }
+
+    auto spun = rdtsc() - start;
+
+    hp.successful_polls++;
+    hp.wasted_cycles += spun;
+
+    if (slept && spun > poll_tsc / 2) {
+        halt_poll_shrink(hp);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Wakeup Jitter
+// -----------------------------------------------------------------------------
+
+struct jitter_t {
+    uint64_t wakeups{};
+    uint64_t late_wakeups{};
+    uint64_t total_late_ns{};
+    uint64_t max_late_ns{};
+};
+
+void
+record_jitter(jitter_t &jitter, uint64_t deadline)
+{
+    jitter.wakeups++;
+
+    if (auto tsc = rdtsc(); tsc > deadline) {
+        auto late_ns = tsc_to_nsec(tsc - deadline);
+
+        jitter.late_wakeups++;
+        jitter.total_late_ns += late_ns;
+
+        if (late_ns > jitter.max_late_ns) {
+            jitter.max_late_ns = late_ns;
+        }
+    }
+}
+
 // -----------------------------------------------------------------------------
 // vCPU Thread
 // -----------------------------------------------------------------------------
@@ -184,6 +557,14 @@ set_wallclock()
 void
 vcpu_thread(vcpuid_t vcpuid)
 {
+    halt_poll_t hp{};
+    jitter_t jitter{};
+
+    auto ___ = gsl::finally([&] {
+        halt_poll_verbose();
+        jitter_verbose();
+    });
+
     while (true) {
         auto ret = hypercall_run_op(vcpuid, 0, 0);
 
@@ -192,14 +573,47 @@ vcpu_thread(vcpuid_t vcpuid)
                 continue;
 
             case hypercall_enum_run_op__yield:
-                if (auto nsec = run_op_ret_arg(ret); nsec > 0) {
-                    std::this_thread::sleep_for(nanoseconds(nsec));
+                if (auto deadline = run_op_ret_yield_tsc(ret); deadline > 0) {
+                    halt_poll(hp, deadline);
+                    record_jitter(jitter, deadline);
                 }
                 else {
                     std::this_thread::yield();
                 }
                 continue;
 
+            case hypercall_enum_run_op__notify:
+                switch (run_op_ret_arg(ret)) {
+                    case boxy_notify__console:
+                        event_signal(g_console_event);
+                        break;
+
+                    case boxy_notify__virtio_blk:
+                        event_signal(g_virtio_blk_event);
+                        break;
+
+                    case boxy_notify__virtio_net:
+                        event_signal(g_virtio_net_tx_event);
+                        event_signal(g_virtio_net_rx_event);
+                        break;
+
+                    case boxy_notify__virtio_vsock:
+                        g_vsock->kick();
+                        break;
+
+                    case boxy_notify__uart:
+                        event_signal(g_uart_event);
+                        break;
+
+                    case boxy_notify__uart_full:
+                        wait_for_uart_dump();
+                        break;
+
+                    default:
+                        break;
+                }
+                continue;
+
             case hypercall_enum_run_op__set_wallclock:
                 if (!set_wallclock()) {
                     std::cerr << "[0x" << std::hex << vcpuid << std::dec << "] ";
@@ -235,6 +649,7 @@ vcpu_thread(vcpuid_t vcpuid)
 // -----------------------------------------------------------------------------
 
 bool g_process_uart = true;
+char *g_uart_buffer = nullptr;
 
 #if defined(WIN32) || defined(__CYGWIN__)
 
@@ -373,99 +788,716 @@ update_output(char *buffer)
 void
 uart_thread()
 {
-    auto buf = reinterpret_cast<char *>(alloc_locked_buffer(UART_MAX_BUFFER));
+    auto buf = g_uart_buffer;
 
-    auto ___ = gsl::finally([&](){
-        free_locked_buffer(buf, UART_MAX_BUFFER);
-    });
+    // Note:
+    //
+    // The VMM only starts notifying us once the UART has been dumped, so
+    // we dump first and then wait. The event stays signaled if output
+    // shows up between the dump and the wait, so nothing is missed, and an
+    // idle VM never wakes us up.
+    //
 
     while (g_process_uart && update_output(buf)) {
-        std::this_thread::sleep_for(milliseconds(100));
+        uart_dumped();
+        event_wait(g_uart_event);
     }
 
     update_output(buf);
+    uart_dumped();
 }
 
 // -----------------------------------------------------------------------------
-// Signal Handling
+// Console Thread
 // -----------------------------------------------------------------------------
 
-#include <signal.h>
+bool g_process_console = true;
+struct boxy_console_ring *g_console_ring = nullptr;
 
 void
-kill_signal_handler(void)
+drain_console()
 {
-    status_t ret;
+    auto ring = g_console_ring;
 
-    std::cout << '\n';
-    std::cout << '\n';
-    std::cout << "killing VM: " << g_domainid << '\n';
+    auto prod = reinterpret_cast<volatile uint64_t *>(&ring->prod);
+    auto cons = reinterpret_cast<volatile uint64_t *>(&ring->cons);
 
-    ret = hypercall_vcpu_op__kill_vcpu(g_vcpuid);
-    if (ret != SUCCESS) {
-        BFALERT("__vcpu_op__kill_vcpu failed\n");
-        return;
-    }
+    uint64_t tail = *cons;
 
-    return;
-}
+    while (true) {
+        uint64_t head = *prod;
+        std::atomic_thread_fence(std::memory_order_acquire);
 
-void
-sig_handler(int sig)
-{
-    bfignored(sig);
-    return kill_signal_handler();
-}
+        if (head - tail > CONSOLE_RING_SIZE) {
+            std::cerr << "[ERROR]: console ring corrupt!!!\n";
+            tail = head;
+        }
 
-void
-setup_kill_signal_handler(void)
-{
-    signal(SIGINT, sig_handler);
-    signal(SIGTERM, sig_handler);
+        while (tail != head) {
+            uint64_t off = tail & (CONSOLE_RING_SIZE - 1);
+            uint64_t len = std::min(head - tail, CONSOLE_RING_SIZE - off);
 
-#ifdef SIGQUIT
-    signal(SIGQUIT, sig_handler);
-#endif
-}
+            std::cout.write(&ring->data[off], gsl::narrow_cast<int>(len));
+            tail += len;
+        }
 
-// -----------------------------------------------------------------------------
-// Attach to VM
-// -----------------------------------------------------------------------------
+        // Note:
+        //
+        // The guest only notifies us when it writes to an empty ring, so
+        // once cons is published, we have to check prod one more time.
+        // Otherwise, data written while we were draining could sit in the
+        // ring until the next timeout.
+        //
 
-static int
-attach_to_vm(const args_type &args)
-{
-    bfignored(args);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        *cons = tail;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
 
-    g_vcpuid = hypercall_vcpu_op__create_vcpu(g_domainid);
-    if (g_vcpuid == INVALID_VCPUID) {
-        throw std::runtime_error("__vcpu_op__create_vcpu failed");
+        if (*prod == tail) {
+            break;
+        }
     }
 
-    std::thread t(vcpu_thread, g_vcpuid);
-    std::thread u;
-
-    output_vm_uart_verbose();
-
-    t.join();
-
-    if (verbose) {
-        g_process_uart = false;
-        u.join();
-    }
+    std::cout.flush();
+}
 
-    if (hypercall_vcpu_op__destroy_vcpu(g_vcpuid) != SUCCESS) {
-        std::cerr << "__vcpu_op__destroy_vcpu failed\n";
+void
+console_thread()
+{
+    while (g_process_console) {
+        drain_console();
+        event_wait(g_console_event, milliseconds(100));
     }
 
-    return EXIT_SUCCESS;
+    drain_console();
 }
 
 // -----------------------------------------------------------------------------
-// Create VM
+// Virtio Block Thread
 // -----------------------------------------------------------------------------
 
-static void
+// Note:
+//
+// The VMM emulates the virtio block device and copies each request's data
+// into a slot in the virtio block ring. All we have to do is perform the
+// I/O on the disk image and post a response. Requests are consumed in
+// batches, and the VMM is only told about the responses once per batch
+// (via the vCPU event), which keeps the number of VM exits per request
+// low when the guest has a lot of I/O in flight.
+//
+
+bool g_process_virtio_blk = true;
+std::fstream g_disk;
+
+// Note:
+//
+// std::fstream::flush() only hands our buffer to the OS, which is not
+// enough for VIRTIO_BLK_T_FLUSH (the guest expects the data to be on
+// stable storage once the flush completes). The fstream has no way to
+// get at its file descriptor, so the disk is opened a second time, and
+// that descriptor is synced instead. Syncing a file flushes its data no
+// matter which descriptor wrote it.
+//
+
+#ifdef WIN32
+HANDLE g_disk_sync = INVALID_HANDLE_VALUE;
+#else
+int g_disk_sync = -1;
+#endif
+
+void
+open_disk_sync(const std::string &path)
+{
+#ifdef WIN32
+    g_disk_sync = CreateFileA(
+        path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (g_disk_sync == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("unable to open disk for sync: " + path);
+    }
+#else
+    g_disk_sync = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (g_disk_sync < 0) {
+        throw std::runtime_error("unable to open disk for sync: " + path);
+    }
+#endif
+}
+
+void
+close_disk_sync()
+{
+#ifdef WIN32
+    if (g_disk_sync != INVALID_HANDLE_VALUE) {
+        CloseHandle(g_disk_sync);
+        g_disk_sync = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (g_disk_sync >= 0) {
+        close(g_disk_sync);
+        g_disk_sync = -1;
+    }
+#endif
+}
+
+bool
+sync_disk()
+{
+    if (!g_disk.flush()) {
+        return false;
+    }
+
+#ifdef WIN32
+    return FlushFileBuffers(g_disk_sync) != 0;
+#else
+    return fdatasync(g_disk_sync) == 0;
+#endif
+}
+
+struct boxy_virtio_blk_ring *g_virtio_blk_ring = nullptr;
+
+uint32_t
+virtio_blk_do(const struct boxy_virtio_blk_req &req)
+{
+    auto ring = g_virtio_blk_ring;
+
+    if (req.slot >= VIRTIO_BLK_RING_SLOTS || req.len > VIRTIO_BLK_SLOT_SIZE) {
+        return VIRTIO_BLK_S_IOERR;
+    }
+
+    auto off = static_cast<std::streamoff>(req.sector * VIRTIO_BLK_SECTOR_SIZE);
+    auto len = static_cast<std::streamsize>(req.len);
+    auto buf = reinterpret_cast<char *>(ring->data[req.slot]);
+
+    g_disk.clear();
+
+    switch (req.type) {
+        case VIRTIO_BLK_T_IN:
+            g_disk.seekg(off);
+            g_disk.read(buf, len);
+            break;
+
+        case VIRTIO_BLK_T_OUT:
+            g_disk.seekp(off);
+            g_disk.write(buf, len);
+            break;
+
+        case VIRTIO_BLK_T_FLUSH:
+            return sync_disk() ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+
+        default:
+            return VIRTIO_BLK_S_UNSUPP;
+    }
+
+    return g_disk.good() ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+}
+
+void
+drain_virtio_blk()
+{
+    auto ring = g_virtio_blk_ring;
+
+    auto req_prod = reinterpret_cast<volatile uint64_t *>(&ring->req_prod);
+    auto req_cons = reinterpret_cast<volatile uint64_t *>(&ring->req_cons);
+    auto rsp_prod = reinterpret_cast<volatile uint64_t *>(&ring->rsp_prod);
+
+    uint64_t done = 0;
+    uint64_t tail = *req_cons;
+    uint64_t rsp = *rsp_prod;
+
+    while (true) {
+        uint64_t head = *req_prod;
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (head - tail > VIRTIO_BLK_RING_SLOTS) {
+            std::cerr << "[ERROR]: virtio block ring corrupt!!!\n";
+            tail = head;
+        }
+
+        if (tail == head) {
+            break;
+        }
+
+        // Note:
+        //
+        // Every request owns a slot until its response has been consumed,
+        // so the response ring can never overflow. The requests are copied
+        // out of the ring before they are processed, as the VMM is free to
+        // reuse a request entry as soon as req_cons is published.
+        //
+
+        for (; tail != head; tail++, rsp++) {
+            auto req = ring->req[tail & (VIRTIO_BLK_RING_SLOTS - 1)];
+            req.status = virtio_blk_do(req);
+
+            ring->rsp[rsp & (VIRTIO_BLK_RING_SLOTS - 1)] = req;
+            done++;
+        }
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        *req_cons = tail;
+        *rsp_prod = rsp;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    if (done > 0) {
+        event_signal(g_vcpu_event);
+    }
+}
+
+void
+virtio_blk_thread()
+{
+    while (g_process_virtio_blk) {
+        drain_virtio_blk();
+        event_wait(g_virtio_blk_event, milliseconds(100));
+    }
+
+    drain_virtio_blk();
+}
+
+// -----------------------------------------------------------------------------
+// Virtio Net Threads
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The VMM copies the frames that the guest transmits into the tx half of
+// the virtio net ring, and the rx half is filled with the frames we receive
+// from the backend. Both halves are processed in batches: the VMM notifies
+// us once per batch of transmitted frames, and the VMM is told about a
+// batch of received frames once (via the vCPU event).
+//
+// When the VM is attached to the VMM's net switch, the ring's halves are
+// not used. Instead, the VMM hands us the ports of the VMs that the switch
+// delivered frames to (the wake list), which we wake up through the
+// backend. Likewise, the rx thread wakes our vCPU up when another VM
+// delivers frames to us.
+//
+
+bool g_process_virtio_net = true;
+std::unique_ptr<bfn::net> g_net;
+struct boxy_virtio_net_ring *g_virtio_net_ring = nullptr;
+
+void
+drain_virtio_net_tx()
+{
+    auto ring = g_virtio_net_ring;
+
+    auto tx_prod = reinterpret_cast<volatile uint64_t *>(&ring->tx_prod);
+    auto tx_cons = reinterpret_cast<volatile uint64_t *>(&ring->tx_cons);
+
+    auto wake = false;
+    uint64_t tail = *tx_cons;
+
+    while (true) {
+        uint64_t head = *tx_prod;
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (head - tail > VIRTIO_NET_RING_SLOTS) {
+            std::cerr << "[ERROR]: virtio net ring corrupt!!!\n";
+            tail = head;
+        }
+
+        if (tail == head) {
+            break;
+        }
+
+        // If the tx half is full, the VMM has stopped taking frames from
+        // the guest, and only looks again once we make room.
+
+        if (head - tail == VIRTIO_NET_RING_SLOTS) {
+            wake = true;
+        }
+
+        for (; tail != head; tail++) {
+            auto slot = tail % VIRTIO_NET_RING_SLOTS;
+
+            if (auto len = ring->tx_len[slot]; len <= VIRTIO_NET_SLOT_SIZE) {
+                g_net->send(&ring->tx[slot][0], len);
+            }
+        }
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        *tx_cons = tail;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    if (wake) {
+        event_signal(g_vcpu_event);
+    }
+}
+
+void
+drain_virtio_net_wake()
+{
+    auto ring = g_virtio_net_ring;
+
+    auto wake_prod = reinterpret_cast<volatile uint64_t *>(&ring->wake_prod);
+    auto wake_cons = reinterpret_cast<volatile uint64_t *>(&ring->wake_cons);
+
+    uint64_t tail = *wake_cons;
+    uint64_t head = *wake_prod;
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (head - tail > VIRTIO_NET_RING_SLOTS) {
+        std::cerr << "[ERROR]: virtio net wake list corrupt!!!\n";
+        tail = head;
+    }
+
+    for (; tail != head; tail++) {
+        g_net->wake(ring->wake[tail % VIRTIO_NET_RING_SLOTS]);
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    *wake_cons = tail;
+}
+
+void
+virtio_net_tx_thread()
+{
+    auto features = reinterpret_cast<volatile uint64_t *>(
+        &g_virtio_net_ring->features
+    );
+
+    uint64_t offloads = 0;
+
+    while (g_process_virtio_net) {
+        if (auto f = *features; f != offloads) {
+            g_net->set_offloads(f);
+            offloads = f;
+        }
+
+        drain_virtio_net_tx();
+        drain_virtio_net_wake();
+
+        event_wait(g_virtio_net_tx_event, milliseconds(100));
+    }
+
+    drain_virtio_net_tx();
+}
+
+void
+virtio_net_rx_thread()
+{
+    auto ring = g_virtio_net_ring;
+
+    auto rx_prod = reinterpret_cast<volatile uint64_t *>(&ring->rx_prod);
+    auto rx_cons = reinterpret_cast<volatile uint64_t *>(&ring->rx_cons);
+
+    uint64_t head = *rx_prod;
+
+    if (g_net->port() != 0) {
+        while (g_process_virtio_net) {
+            if (g_net->wait(milliseconds(100))) {
+                g_net->drain();
+                event_signal(g_vcpu_event);
+            }
+        }
+
+        return;
+    }
+
+    while (g_process_virtio_net) {
+        if (head - *rx_cons >= VIRTIO_NET_RING_SLOTS) {
+            event_wait(g_virtio_net_rx_event, milliseconds(100));
+            continue;
+        }
+
+        if (!g_net->wait(milliseconds(100))) {
+            continue;
+        }
+
+        auto start = head;
+
+        while (head - *rx_cons < VIRTIO_NET_RING_SLOTS) {
+            auto slot = head % VIRTIO_NET_RING_SLOTS;
+
+            auto len = g_net->recv(&ring->rx[slot][0], VIRTIO_NET_SLOT_SIZE);
+            if (len == 0) {
+                break;
+            }
+
+            ring->rx_len[slot] = len;
+            head++;
+        }
+
+        if (head != start) {
+            std::atomic_thread_fence(std::memory_order_release);
+            *rx_prod = head;
+
+            event_signal(g_vcpu_event);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Virtio Vsock Thread
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Same as the virtio net ring, the VMM copies the packets that the guest
+// transmits into the tx half of the virtio vsock ring, and we fill the rx
+// half with the packets that g_vsock has for the guest. Unlike the net
+// threads, a single thread does both, as every packet from the guest can
+// change what we have for the guest (e.g. a connection request, or more
+// credit), and the other way around. The thread sleeps in g_vsock->wait(),
+// which the vCPU thread kicks when the VMM notifies us.
+//
+
+bool g_process_virtio_vsock = true;
+struct boxy_virtio_vsock_ring *g_virtio_vsock_ring = nullptr;
+
+bool
+drain_virtio_vsock_tx()
+{
+    auto ring = g_virtio_vsock_ring;
+
+    auto tx_prod = reinterpret_cast<volatile uint64_t *>(&ring->tx_prod);
+    auto tx_cons = reinterpret_cast<volatile uint64_t *>(&ring->tx_cons);
+
+    auto wake = false;
+    uint64_t tail = *tx_cons;
+
+    while (true) {
+        uint64_t head = *tx_prod;
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (head - tail > VIRTIO_VSOCK_RING_SLOTS) {
+            std::cerr << "[ERROR]: virtio vsock ring corrupt!!!\n";
+            tail = head;
+        }
+
+        if (tail == head) {
+            break;
+        }
+
+        // If the tx half is full, the VMM has stopped taking packets from
+        // the guest, and only looks again once we make room.
+
+        if (head - tail == VIRTIO_VSOCK_RING_SLOTS) {
+            wake = true;
+        }
+
+        for (; tail != head; tail++) {
+            auto slot = tail % VIRTIO_VSOCK_RING_SLOTS;
+
+            if (auto len = ring->tx_len[slot]; len <= VIRTIO_VSOCK_SLOT_SIZE) {
+                g_vsock->send(&ring->tx[slot][0], len);
+            }
+        }
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        *tx_cons = tail;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    return wake;
+}
+
+void
+virtio_vsock_thread()
+{
+    auto ring = g_virtio_vsock_ring;
+
+    auto rx_prod = reinterpret_cast<volatile uint64_t *>(&ring->rx_prod);
+    auto rx_cons = reinterpret_cast<volatile uint64_t *>(&ring->rx_cons);
+    auto resets = reinterpret_cast<volatile uint64_t *>(&ring->resets);
+
+    uint64_t head = *rx_prod;
+    uint64_t reset = *resets;
+
+    while (g_process_virtio_vsock) {
+        g_vsock->wait(
+            milliseconds(100), head - *rx_cons < VIRTIO_VSOCK_RING_SLOTS);
+
+        if (auto r = *resets; r != reset) {
+            g_vsock->reset();
+            reset = r;
+        }
+
+        auto wake = drain_virtio_vsock_tx();
+        auto start = head;
+
+        while (head - *rx_cons < VIRTIO_VSOCK_RING_SLOTS) {
+            auto slot = head % VIRTIO_VSOCK_RING_SLOTS;
+
+            auto len =
+                g_vsock->recv(&ring->rx[slot][0], VIRTIO_VSOCK_SLOT_SIZE);
+
+            if (len == 0) {
+                break;
+            }
+
+            ring->rx_len[slot] = len;
+            head++;
+        }
+
+        if (head != start) {
+            std::atomic_thread_fence(std::memory_order_release);
+            *rx_prod = head;
+
+            wake = true;
+        }
+
+        if (wake) {
+            event_signal(g_vcpu_event);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Signal Handling
+// -----------------------------------------------------------------------------
+
+#include <signal.h>
+
+void
+kill_signal_handler(void)
+{
+    status_t ret;
+
+    std::cout << '\n';
+    std::cout << '\n';
+    std::cout << "killing VM: " << g_domainid << '\n';
+
+    ret = hypercall_vcpu_op__kill_vcpu(g_vcpuid);
+    if (ret != SUCCESS) {
+        BFALERT("__vcpu_op__kill_vcpu failed\n");
+        return;
+    }
+
+    return;
+}
+
+void
+sig_handler(int sig)
+{
+    bfignored(sig);
+    return kill_signal_handler();
+}
+
+void
+setup_kill_signal_handler(void)
+{
+    signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+
+#ifdef SIGQUIT
+    signal(SIGQUIT, sig_handler);
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Attach to VM
+// -----------------------------------------------------------------------------
+
+static int
+attach_to_vm(const args_type &args)
+{
+    if (args.count("halt_poll_ns")) {
+        g_halt_poll_ns_max = args["halt_poll_ns"].as<uint64_t>();
+    }
+
+    // Note:
+    //
+    // The timer slack is per thread and is inherited by any thread that is
+    // created, so setting it here applies to every vCPU thread in this VM.
+    //
+
+#if !defined(WIN32) && !defined(__CYGWIN__)
+    if (args.count("timer_slack_ns")) {
+        auto slack = args["timer_slack_ns"].as<uint64_t>();
+        if (prctl(PR_SET_TIMERSLACK, slack, 0, 0, 0) != 0) {
+            std::cerr << "PR_SET_TIMERSLACK failed (errno: " << errno << ")\n";
+        }
+    }
+#endif
+
+    g_vcpuid = hypercall_vcpu_op__create_vcpu(g_domainid);
+    if (g_vcpuid == INVALID_VCPUID) {
+        throw std::runtime_error("__vcpu_op__create_vcpu failed");
+    }
+
+    std::thread t(vcpu_thread, g_vcpuid);
+    std::thread u;
+    std::thread c;
+    std::thread b;
+    std::thread ntx;
+    std::thread nrx;
+    std::thread v;
+
+    output_vm_uart_verbose();
+
+    if (g_console_ring != nullptr) {
+        c = std::thread(console_thread);
+    }
+
+    if (g_virtio_blk_ring != nullptr) {
+        b = std::thread(virtio_blk_thread);
+    }
+
+    auto start = steady_clock::now();
+
+    if (g_virtio_net_ring != nullptr) {
+        ntx = std::thread(virtio_net_tx_thread);
+        nrx = std::thread(virtio_net_rx_thread);
+    }
+
+    if (g_virtio_vsock_ring != nullptr) {
+        v = std::thread(virtio_vsock_thread);
+    }
+
+    t.join();
+
+    if (verbose) {
+        g_process_uart = false;
+        event_signal(g_uart_event);
+        u.join();
+    }
+
+    if (c.joinable()) {
+        g_process_console = false;
+        event_signal(g_console_event);
+        c.join();
+    }
+
+    if (b.joinable()) {
+        g_process_virtio_blk = false;
+        event_signal(g_virtio_blk_event);
+        b.join();
+    }
+
+    if (ntx.joinable()) {
+        g_process_virtio_net = false;
+        event_signal(g_virtio_net_tx_event);
+        event_signal(g_virtio_net_rx_event);
+        ntx.join();
+        nrx.join();
+
+        virtio_net_verbose();
+    }
+
+    if (v.joinable()) {
+        g_process_virtio_vsock = false;
+        g_vsock->kick();
+        v.join();
+    }
+
+    if (hypercall_vcpu_op__destroy_vcpu(g_vcpuid) != SUCCESS) {
+        std::cerr << "__vcpu_op__destroy_vcpu failed\n";
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// -----------------------------------------------------------------------------
+// Create VM
+// -----------------------------------------------------------------------------
+
+static void
 create_vm_from_bzimage(const args_type &args)
 {
     create_vm_from_bzimage_args ioctl_args {};
@@ -507,6 +1539,44 @@ create_vm_from_bzimage(const args_type &args)
         );
     }
 
+    uint64_t pt_io = 0;
+    uint64_t pt_io_size = 0;
+    if (args.count("pt_io")) {
+        auto range = args["pt_io"].as<std::string>();
+        auto colon = range.find(':');
+
+        if (colon == std::string::npos) {
+            throw cxxopts::OptionException("pt_io must be [port:size]");
+        }
+
+        pt_io = std::stoull(range.substr(0, colon), nullptr, 0);
+        pt_io_size = std::stoull(range.substr(colon + 1), nullptr, 0);
+    }
+
+    if (args.count("disk")) {
+        cmdl.add(
+            "virtio_mmio.device=" + bfn::to_string(VIRTIO_BLK_SIZE, 16) + "@" +
+            bfn::to_string(VIRTIO_BLK_GPA, 16) + ":" +
+            std::to_string(VIRTIO_BLK_IRQ)
+        );
+    }
+
+    if (args.count("net")) {
+        cmdl.add(
+            "virtio_mmio.device=" + bfn::to_string(VIRTIO_NET_SIZE, 16) + "@" +
+            bfn::to_string(VIRTIO_NET_GPA, 16) + ":" +
+            std::to_string(VIRTIO_NET_IRQ)
+        );
+    }
+
+    if (args.count("vsock")) {
+        cmdl.add(
+            "virtio_mmio.device=" + bfn::to_string(VIRTIO_VSOCK_SIZE, 16) +
+            "@" + bfn::to_string(VIRTIO_VSOCK_GPA, 16) + ":" +
+            std::to_string(VIRTIO_VSOCK_IRQ)
+        );
+    }
+
     if (args.count("cmdline")) {
         cmdl.add(args["cmdline"].as<std::string>());
     }
@@ -519,6 +1589,8 @@ create_vm_from_bzimage(const args_type &args)
     ioctl_args.cmdl_size = cmdl.size();
     ioctl_args.uart = uart;
     ioctl_args.pt_uart = pt_uart;
+    ioctl_args.pt_io = pt_io;
+    ioctl_args.pt_io_size = pt_io_size;
     ioctl_args.size = size;
 
     ctl->call_ioctl_create_vm_from_bzimage(ioctl_args);
@@ -549,12 +1621,200 @@ protected_main(const args_type &args)
         set_affinity(0);
     }
 
+    // Note:
+    //
+    // The UART buffer and the virtio rings stay mapped into the VMM and
+    // the console ring is mapped into the guest, so all of them have to
+    // outlive the VM. This is why they are allocated before the VM is
+    // created, and freed after the VM is destroyed.
+    //
+
+    if (verbose) {
+        g_uart_buffer =
+            static_cast<char *>(alloc_locked_buffer(UART_MAX_BUFFER));
+
+        if (g_uart_buffer == nullptr) {
+            throw std::runtime_error("unable to allocate the uart buffer");
+        }
+    }
+
+    auto ____ = gsl::finally([&] {
+        if (g_uart_buffer != nullptr) {
+            free_locked_buffer(g_uart_buffer, UART_MAX_BUFFER);
+        }
+    });
+
+    struct boxy_console_ring *ring = nullptr;
+    if (args.count("pv_console")) {
+        ring = static_cast<struct boxy_console_ring *>(
+            alloc_locked_buffer(sizeof(struct boxy_console_ring))
+        );
+
+        if (ring == nullptr) {
+            throw std::runtime_error("unable to allocate the console ring");
+        }
+    }
+
+    auto ___ = gsl::finally([&] {
+        if (ring != nullptr) {
+            free_locked_buffer(ring, sizeof(struct boxy_console_ring));
+        }
+    });
+
+    struct boxy_virtio_blk_ring *blk = nullptr;
+    if (args.count("disk")) {
+        auto path = args["disk"].as<std::string>();
+
+        g_disk.open(path, std::ios::in | std::ios::out | std::ios::binary);
+        if (!g_disk.is_open()) {
+            throw std::runtime_error("unable to open disk: " + path);
+        }
+
+        open_disk_sync(path);
+
+        g_disk.seekg(0, std::ios::end);
+        auto size = static_cast<uint64_t>(g_disk.tellg());
+
+        blk = static_cast<struct boxy_virtio_blk_ring *>(
+            alloc_locked_buffer(sizeof(struct boxy_virtio_blk_ring))
+        );
+
+        if (blk == nullptr) {
+            throw std::runtime_error("unable to allocate the block ring");
+        }
+
+        blk->capacity = size / VIRTIO_BLK_SECTOR_SIZE;
+        g_vcpu_event_enabled = true;
+    }
+
+    auto _____ = gsl::finally([&] {
+        if (blk != nullptr) {
+            free_locked_buffer(blk, sizeof(struct boxy_virtio_blk_ring));
+        }
+
+        close_disk_sync();
+    });
+
+    struct boxy_virtio_net_ring *net = nullptr;
+    if (args.count("net")) {
+        g_net = std::make_unique<bfn::net>(args["net"].as<std::string>());
+
+        net = static_cast<struct boxy_virtio_net_ring *>(
+            alloc_locked_buffer(sizeof(struct boxy_virtio_net_ring))
+        );
+
+        if (net == nullptr) {
+            throw std::runtime_error("unable to allocate the net ring");
+        }
+
+        // A random, locally administered, unicast MAC, so that more than
+        // one VM can be put on the same network.
+
+        std::random_device rd;
+        net->mac[0] = 0x02;
+        for (std::size_t i = 1; i < sizeof(net->mac); i++) {
+            net->mac[i] = static_cast<uint8_t>(rd());
+        }
+
+        g_vcpu_event_enabled = true;
+    }
+
+    auto ______ = gsl::finally([&] {
+        if (net != nullptr) {
+            free_locked_buffer(net, sizeof(struct boxy_virtio_net_ring));
+        }
+    });
+
+    struct boxy_virtio_vsock_ring *vsock = nullptr;
+    if (args.count("vsock")) {
+        g_vsock = std::make_unique<bfn::vsock>(
+            args["vsock"].as<std::string>(), VIRTIO_VSOCK_GUEST_CID
+        );
+
+        vsock = static_cast<struct boxy_virtio_vsock_ring *>(
+            alloc_locked_buffer(sizeof(struct boxy_virtio_vsock_ring))
+        );
+
+        if (vsock == nullptr) {
+            throw std::runtime_error("unable to allocate the vsock ring");
+        }
+
+        vsock->guest_cid = VIRTIO_VSOCK_GUEST_CID;
+        g_vcpu_event_enabled = true;
+    }
+
+    auto _______ = gsl::finally([&] {
+        if (vsock != nullptr) {
+            free_locked_buffer(vsock, sizeof(struct boxy_virtio_vsock_ring));
+        }
+    });
+
     create_vm_from_bzimage(args);
 
     auto __ = gsl::finally([&] {
         ctl->call_ioctl_destroy(g_domainid);
     });
 
+    if (g_uart_buffer != nullptr) {
+        auto ret = hypercall_domain_op__register_uart_buffer(
+            g_domainid, g_uart_buffer
+        );
+
+        if (ret != SUCCESS) {
+            throw std::runtime_error(
+                "__domain_op__register_uart_buffer failed");
+        }
+    }
+
+    if (ring != nullptr) {
+        auto ret = hypercall_domain_op__set_console_ring(g_domainid, ring);
+        if (ret != SUCCESS) {
+            throw std::runtime_error("__domain_op__set_console_ring failed");
+        }
+
+        g_console_ring = ring;
+    }
+
+    if (blk != nullptr) {
+        auto ret = hypercall_domain_op__set_virtio_blk_ring(g_domainid, blk);
+        if (ret != SUCCESS) {
+            throw std::runtime_error(
+                "__domain_op__set_virtio_blk_ring failed");
+        }
+
+        g_virtio_blk_ring = blk;
+    }
+
+    if (net != nullptr) {
+        auto ret = hypercall_domain_op__set_virtio_net_ring(g_domainid, net);
+        if (ret != SUCCESS) {
+            throw std::runtime_error(
+                "__domain_op__set_virtio_net_ring failed");
+        }
+
+        g_virtio_net_ring = net;
+
+        if (auto port = g_net->port(); port != 0) {
+            ret = hypercall_domain_op__attach_net_switch(g_domainid, port);
+            if (ret != SUCCESS) {
+                throw std::runtime_error(
+                    "__domain_op__attach_net_switch failed");
+            }
+        }
+    }
+
+    if (vsock != nullptr) {
+        auto ret =
+            hypercall_domain_op__set_virtio_vsock_ring(g_domainid, vsock);
+
+        if (ret != SUCCESS) {
+            throw std::runtime_error(
+                "__domain_op__set_virtio_vsock_ring failed");
+        }
+
+        g_virtio_vsock_ring = vsock;
+    }
+
     return attach_to_vm(args);
 }
 
@@ -0,0 +1,267 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// TIDY_EXCLUSION=-cppcoreguidelines-pro-type-vararg
+//
+// Reason:
+//    The Linux APIs require the use of var-args, so this test has to be
+//    disabled.
+//
+
+#include <net.h>
+
+#include <bfhypercall.h>
+
+#include <array>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/if_tun.h>
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+namespace bfn
+{
+
+static sockaddr_un
+unix_addr(const std::string &path)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("invalid unix socket path: " + path);
+    }
+
+    std::strncpy(&addr.sun_path[0], path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+net::net(const std::string &spec)
+{
+    if (spec.compare(0, 4, "tap:") == 0) {
+        auto name = spec.substr(4);
+
+        if (name.empty() || name.size() >= IFNAMSIZ) {
+            throw std::runtime_error("invalid tap device name: " + name);
+        }
+
+        if ((m_fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0) {
+            throw std::runtime_error("failed to open /dev/net/tun");
+        }
+
+        ifreq ifr{};
+        ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+        std::strncpy(&ifr.ifr_name[0], name.c_str(), IFNAMSIZ - 1);
+
+        if (ioctl(m_fd, TUNSETIFF, &ifr) < 0) {
+            close(m_fd);
+            throw std::runtime_error("TUNSETIFF failed: " + name);
+        }
+
+        int hdr_size = VIRTIO_NET_HDR_SIZE;
+        if (ioctl(m_fd, TUNSETVNETHDRSZ, &hdr_size) < 0) {
+            close(m_fd);
+            throw std::runtime_error("TUNSETVNETHDRSZ failed: " + name);
+        }
+
+        m_tap = true;
+        this->set_offloads(0);
+
+        return;
+    }
+
+    if (spec.compare(0, 5, "unix:") == 0) {
+        auto colon = spec.find(':', 5);
+
+        if (colon == std::string::npos) {
+            throw std::runtime_error("net must be unix:<path>:<peer>");
+        }
+
+        m_path = spec.substr(5, colon - 5);
+        m_peer = spec.substr(colon + 1);
+
+        auto addr = unix_addr(m_path);
+        unix_addr(m_peer);
+
+        m_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_fd < 0) {
+            throw std::runtime_error("failed to create unix socket");
+        }
+
+        unlink(m_path.c_str());
+
+        if (bind(m_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+            close(m_fd);
+            throw std::runtime_error("failed to bind unix socket: " + m_path);
+        }
+
+        return;
+    }
+
+    if (spec.compare(0, 7, "switch:") == 0) {
+        m_dir = spec.substr(7);
+        m_path = m_dir + "/" + std::to_string(getpid());
+
+        auto addr = unix_addr(m_path);
+
+        m_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_fd < 0) {
+            throw std::runtime_error("failed to create unix socket");
+        }
+
+        unlink(m_path.c_str());
+
+        if (bind(m_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+            close(m_fd);
+            throw std::runtime_error("failed to bind unix socket: " + m_path);
+        }
+
+        m_port = static_cast<uint64_t>(getpid());
+        return;
+    }
+
+    throw std::runtime_error(
+        "net must be tap:<ifname>, unix:<path>:<peer> or switch:<dir>");
+}
+
+net::~net()
+{
+    close(m_fd);
+
+    if (!m_path.empty()) {
+        unlink(m_path.c_str());
+    }
+}
+
+void
+net::set_offloads(uint64_t features)
+{
+    if (!m_tap) {
+        return;
+    }
+
+    // Note:
+    //
+    // The tap device's offloads tell the host what it is allowed to hand
+    // us (i.e. what the guest can receive). What the guest sends is
+    // described by each frame's header, which the tap device always
+    // accepts.
+    //
+
+    unsigned int offloads = 0;
+
+    if ((features & (1ULL << VIRTIO_NET_F_GUEST_CSUM)) != 0) {
+        offloads |= TUN_F_CSUM;
+
+        if ((features & (1ULL << VIRTIO_NET_F_GUEST_TSO4)) != 0) {
+            offloads |= TUN_F_TSO4;
+        }
+
+        if ((features & (1ULL << VIRTIO_NET_F_GUEST_TSO6)) != 0) {
+            offloads |= TUN_F_TSO6;
+        }
+    }
+
+    if (ioctl(m_fd, TUNSETOFFLOAD, offloads) < 0) {
+        std::cerr << "TUNSETOFFLOAD failed (errno: " << errno << ")\n";
+    }
+}
+
+bool
+net::wait(std::chrono::milliseconds timeout)
+{
+    pollfd pfd{m_fd, POLLIN, 0};
+    return poll(&pfd, 1, static_cast<int>(timeout.count())) > 0;
+}
+
+std::size_t
+net::recv(void *buf, std::size_t size)
+{
+    auto ret = m_tap ? read(m_fd, buf, size) : ::recv(m_fd, buf, size, 0);
+    return ret > 0 ? static_cast<std::size_t>(ret) : 0;
+}
+
+void
+net::send(const void *buf, std::size_t size)
+{
+    if (m_port != 0) {
+        return;
+    }
+
+    if (m_tap) {
+        bfignored(write(m_fd, buf, size));
+        return;
+    }
+
+    auto addr = unix_addr(m_peer);
+
+    bfignored(sendto(
+        m_fd, buf, size, 0, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)
+    ));
+}
+
+uint64_t
+net::port() const noexcept
+{ return m_port; }
+
+void
+net::wake(uint64_t port)
+{
+    if (m_port == 0) {
+        return;
+    }
+
+    // Note:
+    //
+    // Like a frame, a wake up that cannot be sent (e.g. the VM has exited)
+    // is dropped. If the VM's socket is full, it has not run since it was
+    // last woken up, so there is nothing left to do either.
+    //
+
+    auto addr = unix_addr(m_dir + "/" + std::to_string(port));
+    char doorbell = 0;
+
+    bfignored(sendto(
+        m_fd, &doorbell, 1, 0, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)
+    ));
+}
+
+void
+net::drain()
+{
+    std::array<char, 64> buf{};
+    while (::recv(m_fd, buf.data(), buf.size(), 0) > 0) { }
+}
+
+}
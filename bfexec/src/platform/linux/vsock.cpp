@@ -0,0 +1,707 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// TIDY_EXCLUSION=-cppcoreguidelines-pro-type-vararg
+//
+// Reason:
+//    The Linux APIs require the use of var-args, so this test has to be
+//    disabled.
+//
+
+#include <vsock.h>
+
+#include <bfhypercall.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+constexpr const uint16_t vsock_type_stream{1};
+
+constexpr const uint16_t vsock_op_request{1};
+constexpr const uint16_t vsock_op_response{2};
+constexpr const uint16_t vsock_op_rst{3};
+constexpr const uint16_t vsock_op_shutdown{4};
+constexpr const uint16_t vsock_op_rw{5};
+constexpr const uint16_t vsock_op_credit_update{6};
+constexpr const uint16_t vsock_op_credit_request{7};
+
+constexpr const uint32_t vsock_shutdown_rcv{1};
+constexpr const uint32_t vsock_shutdown_send{2};
+
+// The host side ports of the connections that host tools make (the
+// connections the guest makes use the port the guest connected to).
+
+constexpr const uint32_t vsock_first_host_port{1U << 30};
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+namespace bfn
+{
+
+static sockaddr_un
+unix_addr(const std::string &path)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("invalid unix socket path: " + path);
+    }
+
+    std::strncpy(&addr.sun_path[0], path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+static bool
+would_block() noexcept
+{ return errno == EAGAIN || errno == EWOULDBLOCK; }
+
+vsock::vsock(const std::string &path, uint64_t guest_cid) :
+    m_path{path},
+    m_guest_cid{guest_cid},
+    m_next_port{vsock_first_host_port}
+{
+    static_assert(sizeof(hdr_t) == VIRTIO_VSOCK_HDR_SIZE);
+
+    auto addr = unix_addr(m_path);
+
+    if (pipe2(&m_kick[0], O_NONBLOCK | O_CLOEXEC) < 0) {
+        throw std::runtime_error("failed to create the vsock kick pipe");
+    }
+
+    m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_fd < 0) {
+        ::close(m_kick[0]);
+        ::close(m_kick[1]);
+        throw std::runtime_error("failed to create unix socket");
+    }
+
+    unlink(m_path.c_str());
+
+    if (bind(m_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        listen(m_fd, SOMAXCONN) < 0) {
+        ::close(m_fd);
+        ::close(m_kick[0]);
+        ::close(m_kick[1]);
+        throw std::runtime_error("failed to listen on unix socket: " + m_path);
+    }
+}
+
+vsock::~vsock()
+{
+    for (const auto &[key, conn] : m_conns) {
+        ::close(conn.fd);
+    }
+
+    for (const auto &[fd, line] : m_handshakes) {
+        ::close(fd);
+    }
+
+    ::close(m_fd);
+    ::close(m_kick[0]);
+    ::close(m_kick[1]);
+
+    unlink(m_path.c_str());
+}
+
+bool
+vsock::wait(std::chrono::milliseconds timeout, bool rx)
+{
+    std::vector<pollfd> fds;
+    std::vector<key_type> keys;
+
+    fds.push_back({m_kick[0], POLLIN, 0});
+    fds.push_back({m_fd, POLLIN, 0});
+
+    for (const auto &[fd, line] : m_handshakes) {
+        fds.push_back({fd, POLLIN, 0});
+    }
+
+    auto first = fds.size();
+
+    // Note:
+    //
+    // A connection is only waited on for what it can do right now: it is
+    // read once the guest has given us credit (and the ring has room), and
+    // written once it has data from the guest that did not fit into the
+    // socket. Waiting on anything else (e.g. a peer that hung up while the
+    // guest is not reading) would make poll() return right away.
+    //
+
+    for (const auto &[key, conn] : m_conns) {
+        short events = 0;
+
+        if (rx && !conn.readable && this->readable(conn)) {
+            events |= POLLIN;
+        }
+
+        if (!conn.out.empty()) {
+            events |= POLLOUT;
+        }
+
+        if (events != 0) {
+            fds.push_back({conn.fd, events, 0});
+            keys.push_back(key);
+        }
+    }
+
+    auto ready = rx && (!m_ctrl.empty() || !m_readable.empty());
+    auto ms = ready ? 0 : static_cast<int>(timeout.count());
+
+    if (poll(fds.data(), fds.size(), ms) <= 0) {
+        return ready;
+    }
+
+    if (fds.at(0).revents != 0) {
+        std::array<char, 64> buf{};
+        while (read(m_kick[0], buf.data(), buf.size()) > 0) { }
+    }
+
+    if (fds.at(1).revents != 0) {
+        this->accept_host();
+    }
+
+    for (std::size_t i = 2; i < first; i++) {
+        if (fds.at(i).revents != 0) {
+            this->handshake(fds.at(i).fd);
+        }
+    }
+
+    for (std::size_t i = first; i < fds.size(); i++) {
+        auto key = keys.at(i - first);
+        auto revents = fds.at(i).revents;
+
+        if ((revents & (POLLOUT | POLLERR | POLLHUP)) != 0) {
+            this->flush(key);
+        }
+
+        if ((revents & (POLLIN | POLLERR | POLLHUP)) != 0) {
+            if (auto iter = m_conns.find(key); iter != m_conns.end()) {
+                auto &conn = iter->second;
+
+                if (!conn.readable && this->readable(conn)) {
+                    conn.readable = true;
+                    m_readable.push_back(key);
+                }
+            }
+        }
+    }
+
+    return rx && (!m_ctrl.empty() || !m_readable.empty());
+}
+
+std::size_t
+vsock::recv(void *buf, std::size_t size)
+{
+    auto pkt = static_cast<uint8_t *>(buf);
+
+    while (true) {
+        if (!m_ctrl.empty()) {
+            std::memcpy(pkt, &m_ctrl.front(), sizeof(hdr_t));
+            m_ctrl.pop_front();
+
+            return sizeof(hdr_t);
+        }
+
+        if (m_readable.empty()) {
+            return 0;
+        }
+
+        auto key = m_readable.front();
+        m_readable.pop_front();
+
+        auto iter = m_conns.find(key);
+        if (iter == m_conns.end()) {
+            continue;
+        }
+
+        auto &conn = iter->second;
+        conn.readable = false;
+
+        if (!this->readable(conn)) {
+            continue;
+        }
+
+        auto room = std::min<std::size_t>({
+            this->credit(conn),
+            VIRTIO_VSOCK_RX_PAYLOAD,
+            size - sizeof(hdr_t)
+        });
+
+        auto ret = ::recv(conn.fd, pkt + sizeof(hdr_t), room, 0);
+
+        if (ret < 0) {
+            if (!would_block() && errno != EINTR) {
+                this->reset_conn(key);
+            }
+
+            continue;
+        }
+
+        if (ret == 0) {
+
+            // The host tool will not send anything else. The guest can
+            // still send to it until the guest closes its socket.
+
+            conn.host_eof = true;
+            this->queue(conn, vsock_op_shutdown, vsock_shutdown_send);
+
+            if (this->done(conn)) {
+                this->reset_conn(key);
+            }
+
+            continue;
+        }
+
+        auto len = static_cast<uint32_t>(ret);
+        auto hdr = this->make_hdr(conn, vsock_op_rw);
+
+        hdr.len = len;
+        conn.tx_cnt += len;
+
+        std::memcpy(pkt, &hdr, sizeof(hdr_t));
+
+        // If the read filled the packet, there is probably more to read,
+        // so the connection goes to the back of the line (which keeps one
+        // busy connection from starving the others).
+
+        if (len == room && this->readable(conn)) {
+            conn.readable = true;
+            m_readable.push_back(key);
+        }
+
+        return sizeof(hdr_t) + len;
+    }
+}
+
+void
+vsock::send(const void *buf, std::size_t size)
+{
+    if (size < sizeof(hdr_t)) {
+        return;
+    }
+
+    hdr_t hdr{};
+    std::memcpy(&hdr, buf, sizeof(hdr_t));
+
+    auto data = static_cast<const uint8_t *>(buf) + sizeof(hdr_t);
+
+    if (hdr.len > size - sizeof(hdr_t) ||
+        hdr.src_cid != m_guest_cid ||
+        hdr.dst_cid != VIRTIO_VSOCK_HOST_CID) {
+        return;
+    }
+
+    auto key = this->key(hdr.dst_port, hdr.src_port);
+    auto iter = m_conns.find(key);
+
+    if (hdr.type != vsock_type_stream || iter == m_conns.end()) {
+        if (hdr.type == vsock_type_stream && hdr.op == vsock_op_request) {
+            this->connect_host(hdr);
+            return;
+        }
+
+        if (hdr.op != vsock_op_rst) {
+            this->queue_rst(hdr.dst_port, hdr.src_port);
+        }
+
+        return;
+    }
+
+    auto &conn = iter->second;
+
+    conn.peer_buf_alloc = hdr.buf_alloc;
+    conn.peer_fwd_cnt = hdr.fwd_cnt;
+
+    switch (hdr.op) {
+        case vsock_op_response: {
+            if (conn.connected) {
+                this->reset_conn(key);
+                break;
+            }
+
+            // Note:
+            //
+            // Nothing has been written to the host tool's socket yet, so
+            // the reply always fits, and it does not count against the
+            // guest's credit.
+            //
+
+            auto ok = "OK " + std::to_string(conn.host_port) + "\n";
+
+            if (::send(conn.fd, ok.data(), ok.size(), MSG_NOSIGNAL) < 0) {
+                this->reset_conn(key);
+                break;
+            }
+
+            conn.connected = true;
+            break;
+        }
+
+        case vsock_op_rw:
+            if (!conn.connected || conn.guest_eof ||
+                conn.out.size() + hdr.len > VSOCK_BUF_ALLOC) {
+                this->reset_conn(key);
+                break;
+            }
+
+            conn.out.insert(conn.out.end(), data, data + hdr.len);
+            this->flush(key);
+            break;
+
+        case vsock_op_credit_update:
+            break;
+
+        case vsock_op_credit_request:
+            this->queue(conn, vsock_op_credit_update);
+            break;
+
+        case vsock_op_shutdown:
+            if ((hdr.flags & vsock_shutdown_rcv) != 0) {
+                conn.guest_rcv_shut = true;
+            }
+
+            if ((hdr.flags & vsock_shutdown_send) != 0) {
+                conn.guest_eof = true;
+            }
+
+            this->flush(key);
+            break;
+
+        case vsock_op_rst:
+            this->close_conn(key);
+            break;
+
+        default:
+            this->reset_conn(key);
+            break;
+    }
+}
+
+void
+vsock::kick()
+{
+    char doorbell = 0;
+    bfignored(write(m_kick[1], &doorbell, 1));
+}
+
+void
+vsock::reset()
+{
+    for (const auto &[key, conn] : m_conns) {
+        ::close(conn.fd);
+    }
+
+    m_conns.clear();
+    m_ctrl.clear();
+    m_readable.clear();
+}
+
+// -----------------------------------------------------------------------------
+// Connections
+// -----------------------------------------------------------------------------
+
+vsock::key_type
+vsock::key(uint32_t host_port, uint32_t guest_port) const noexcept
+{ return (static_cast<key_type>(host_port) << 32) | guest_port; }
+
+uint32_t
+vsock::credit(const conn_t &conn) const noexcept
+{
+    auto inflight = conn.tx_cnt - conn.peer_fwd_cnt;
+    return inflight < conn.peer_buf_alloc ? conn.peer_buf_alloc - inflight : 0;
+}
+
+bool
+vsock::readable(const conn_t &conn) const noexcept
+{
+    return conn.connected && !conn.host_eof && !conn.guest_rcv_shut &&
+           this->credit(conn) != 0;
+}
+
+bool
+vsock::done(const conn_t &conn) const noexcept
+{
+    return conn.guest_eof && conn.out.empty() &&
+           (conn.host_eof || conn.guest_rcv_shut);
+}
+
+vsock::hdr_t
+vsock::make_hdr(conn_t &conn, uint16_t op, uint32_t flags)
+{
+    hdr_t hdr{};
+
+    hdr.src_cid = VIRTIO_VSOCK_HOST_CID;
+    hdr.dst_cid = m_guest_cid;
+    hdr.src_port = conn.host_port;
+    hdr.dst_port = conn.guest_port;
+    hdr.type = vsock_type_stream;
+    hdr.op = op;
+    hdr.flags = flags;
+    hdr.buf_alloc = VSOCK_BUF_ALLOC;
+    hdr.fwd_cnt = conn.fwd_cnt;
+
+    conn.fwd_advertised = conn.fwd_cnt;
+    return hdr;
+}
+
+void
+vsock::queue(conn_t &conn, uint16_t op, uint32_t flags)
+{ m_ctrl.push_back(this->make_hdr(conn, op, flags)); }
+
+void
+vsock::queue_rst(uint32_t host_port, uint32_t guest_port)
+{
+    hdr_t hdr{};
+
+    hdr.src_cid = VIRTIO_VSOCK_HOST_CID;
+    hdr.dst_cid = m_guest_cid;
+    hdr.src_port = host_port;
+    hdr.dst_port = guest_port;
+    hdr.type = vsock_type_stream;
+    hdr.op = vsock_op_rst;
+
+    m_ctrl.push_back(hdr);
+}
+
+void
+vsock::accept_host()
+{
+    while (true) {
+        auto fd = accept4(m_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+
+        m_handshakes.emplace(fd, std::string{});
+    }
+}
+
+void
+vsock::handshake(int fd)
+{
+    auto &line = m_handshakes.at(fd);
+
+    auto drop = [&] {
+        ::close(fd);
+        m_handshakes.erase(fd);
+    };
+
+    // Note:
+    //
+    // The line is read one byte at a time, so that nothing that follows
+    // the line is consumed (the host tool is supposed to wait for OK, but
+    // does not have to).
+    //
+
+    while (true) {
+        char c;
+        auto ret = ::recv(fd, &c, 1, 0);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0 && would_block()) {
+            return;
+        }
+
+        if (ret <= 0 || line.size() > 32) {
+            return drop();
+        }
+
+        if (c == '\n') {
+            break;
+        }
+
+        line += c;
+    }
+
+    uint32_t port = 0;
+
+    try {
+        if (line.compare(0, 8, "CONNECT ") != 0) {
+            return drop();
+        }
+
+        auto val = std::stoull(line.substr(8));
+        if (val > UINT32_MAX) {
+            return drop();
+        }
+
+        port = static_cast<uint32_t>(val);
+    }
+    catch (...) {
+        return drop();
+    }
+
+    uint32_t host_port;
+
+    do {
+        host_port = m_next_port++;
+
+        if (m_next_port == 0) {
+            m_next_port = vsock_first_host_port;
+        }
+    }
+    while (m_conns.count(this->key(host_port, port)) != 0);
+
+    m_handshakes.erase(fd);
+
+    conn_t conn{};
+    conn.fd = fd;
+    conn.host_port = host_port;
+    conn.guest_port = port;
+
+    auto &c = m_conns.emplace(this->key(host_port, port), conn).first->second;
+    this->queue(c, vsock_op_request);
+}
+
+void
+vsock::connect_host(const hdr_t &hdr)
+{
+    auto path = m_path + "_" + std::to_string(hdr.dst_port);
+    auto fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    // Note:
+    //
+    // A non-blocking connect on a unix socket either succeeds right away,
+    // or fails (e.g. EAGAIN when the listener's backlog is full), in which
+    // case the guest is refused, same as when nothing is listening.
+    //
+
+    try {
+        auto addr = unix_addr(path);
+        auto sa = reinterpret_cast<sockaddr *>(&addr);
+
+        if (fd < 0 || connect(fd, sa, sizeof(addr)) < 0) {
+            throw std::runtime_error("connect failed: " + path);
+        }
+    }
+    catch (...) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+
+        this->queue_rst(hdr.dst_port, hdr.src_port);
+        return;
+    }
+
+    conn_t conn{};
+    conn.fd = fd;
+    conn.host_port = hdr.dst_port;
+    conn.guest_port = hdr.src_port;
+    conn.connected = true;
+    conn.peer_buf_alloc = hdr.buf_alloc;
+    conn.peer_fwd_cnt = hdr.fwd_cnt;
+
+    auto key = this->key(conn.host_port, conn.guest_port);
+    auto &c = m_conns.emplace(key, conn).first->second;
+
+    this->queue(c, vsock_op_response);
+}
+
+void
+vsock::flush(key_type key)
+{
+    auto iter = m_conns.find(key);
+    if (iter == m_conns.end()) {
+        return;
+    }
+
+    auto &conn = iter->second;
+
+    while (!conn.out.empty()) {
+        auto ret = ::send(
+            conn.fd, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0 && would_block()) {
+            break;
+        }
+
+        if (ret < 0) {
+            return this->reset_conn(key);
+        }
+
+        conn.out.erase(conn.out.begin(), conn.out.begin() + ret);
+        conn.fwd_cnt += static_cast<uint32_t>(ret);
+    }
+
+    // Note:
+    //
+    // The guest only learns that we made room through fwd_cnt, which is
+    // part of every packet we send. If we are not sending anything, the
+    // guest would eventually run out of credit, so once half of the buffer
+    // has been freed without the guest being told, we tell it.
+    //
+
+    if (conn.fwd_cnt - conn.fwd_advertised >= VSOCK_BUF_ALLOC / 2) {
+        this->queue(conn, vsock_op_credit_update);
+    }
+
+    if (conn.guest_eof && conn.out.empty()) {
+        shutdown(conn.fd, SHUT_WR);
+    }
+
+    if (this->done(conn)) {
+        this->reset_conn(key);
+    }
+}
+
+void
+vsock::close_conn(key_type key)
+{
+    if (auto iter = m_conns.find(key); iter != m_conns.end()) {
+        ::close(iter->second.fd);
+        m_conns.erase(iter);
+    }
+}
+
+void
+vsock::reset_conn(key_type key)
+{
+    if (auto iter = m_conns.find(key); iter != m_conns.end()) {
+        this->queue_rst(iter->second.host_port, iter->second.guest_port);
+        this->close_conn(key);
+    }
+}
+
+}
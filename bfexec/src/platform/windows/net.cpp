@@ -0,0 +1,83 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <net.h>
+
+#include <bftypes.h>
+#include <stdexcept>
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+namespace bfn
+{
+
+net::net(const std::string &spec)
+{
+    bfignored(spec);
+    throw std::runtime_error("virtio-net is not supported on Windows");
+}
+
+net::~net()
+{ }
+
+void
+net::set_offloads(uint64_t features)
+{ bfignored(features); }
+
+bool
+net::wait(std::chrono::milliseconds timeout)
+{
+    bfignored(timeout);
+    return false;
+}
+
+std::size_t
+net::recv(void *buf, std::size_t size)
+{
+    bfignored(buf);
+    bfignored(size);
+
+    return 0;
+}
+
+void
+net::send(const void *buf, std::size_t size)
+{
+    bfignored(buf);
+    bfignored(size);
+}
+
+uint64_t
+net::port() const noexcept
+{ return 0; }
+
+void
+net::wake(uint64_t port)
+{ bfignored(port); }
+
+void
+net::drain()
+{ }
+
+}
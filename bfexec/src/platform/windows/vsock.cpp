@@ -0,0 +1,79 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <vsock.h>
+
+#include <bftypes.h>
+#include <stdexcept>
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+namespace bfn
+{
+
+vsock::vsock(const std::string &path, uint64_t guest_cid) :
+    m_guest_cid{guest_cid},
+    m_next_port{}
+{
+    bfignored(path);
+    throw std::runtime_error("virtio-vsock is not supported on Windows");
+}
+
+vsock::~vsock()
+{ }
+
+bool
+vsock::wait(std::chrono::milliseconds timeout, bool rx)
+{
+    bfignored(timeout);
+    bfignored(rx);
+
+    return false;
+}
+
+std::size_t
+vsock::recv(void *buf, std::size_t size)
+{
+    bfignored(buf);
+    bfignored(size);
+
+    return 0;
+}
+
+void
+vsock::send(const void *buf, std::size_t size)
+{
+    bfignored(buf);
+    bfignored(size);
+}
+
+void
+vsock::kick()
+{ }
+
+void
+vsock::reset()
+{ }
+
+}
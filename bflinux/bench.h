@@ -0,0 +1,84 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <x86intrin.h>
+
+// -----------------------------------------------------------------------------
+// Benchmark Helpers
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The TLB benchmarks measure how long it takes to touch one byte in each of
+// a set of pages. When the TLB entries for the pages survive whatever the
+// benchmark does in between (e.g. a VM exit or a process switch), the walk
+// is as fast as a walk with a warm TLB.
+//
+
+constexpr const uint64_t num_pages{64};
+constexpr const uint64_t page_size{0x1000};
+
+static inline uint64_t
+tsc()
+{
+    _mm_lfence();
+    auto val = __rdtsc();
+    _mm_lfence();
+
+    return val;
+}
+
+static inline uint64_t
+walk(volatile uint8_t *buf)
+{
+    auto start = tsc();
+
+    for (uint64_t i = 0; i < num_pages; i++) {
+        buf[i * page_size];
+    }
+
+    return tsc() - start;
+}
+
+static inline volatile uint8_t *
+alloc_pages(const char *name)
+{
+    auto buf = mmap(
+        nullptr, num_pages * page_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+    if (buf == MAP_FAILED) {
+        printf("%s: mmap failed\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    return static_cast<volatile uint8_t *>(buf);
+}
+
+#endif
@@ -0,0 +1,111 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma GCC diagnostic ignored "-Wunused-result"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mount.h>
+
+#include "bench.h"
+
+// -----------------------------------------------------------------------------
+// Context Switch Benchmark
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Two processes on the same vCPU ping-pong a byte over a pair of pipes, so
+// every round trip is two process switches. Each process walks its own
+// pages (see bench.h) after every switch, and the walk right after the
+// switch is compared to a warm walk. With PCID, both numbers should be
+// close. To get the baseline without PCID, boot the guest with "nopcid".
+//
+
+constexpr const uint64_t num_samples{10000};
+
+static void
+pong(int rfd, int wfd)
+{
+    auto buf = alloc_pages("init-bench-ctxsw");
+    char c{};
+
+    while (read(rfd, &c, 1) == 1) {
+        walk(buf);
+        write(wfd, &c, 1);
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+int main(void)
+{
+    mount("proc", "/proc", "proc", 0, "");
+
+    freopen("/dev/ttyprintk", "w", stdout);
+    freopen("/dev/ttyprintk", "w", stderr);
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(0, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+
+    int ping_fds[2];
+    int pong_fds[2];
+
+    if (pipe(ping_fds) != 0 || pipe(pong_fds) != 0) {
+        printf("init-bench-ctxsw: pipe failed\n");
+        return EXIT_FAILURE;
+    }
+
+    if (fork() == 0) {
+        pong(ping_fds[0], pong_fds[1]);
+    }
+
+    auto buf = alloc_pages("init-bench-ctxsw");
+    printf("init-bench-ctxsw: touching %lu pages per switch\n", num_pages);
+
+    while (true) {
+        uint64_t warm{};
+        uint64_t cold{};
+        uint64_t round_trip{};
+
+        for (uint64_t i = 0; i < num_samples; i++) {
+            char c{};
+
+            auto start = tsc();
+            write(ping_fds[1], &c, 1);
+            read(pong_fds[0], &c, 1);
+            round_trip += tsc() - start;
+
+            cold += walk(buf);
+            warm += walk(buf);
+        }
+
+        printf("init-bench-ctxsw: round trip: %lu, after switch: %lu, "
+               "warm: %lu\n", round_trip / num_samples, cold / num_samples,
+               warm / num_samples);
+    }
+}
@@ -0,0 +1,88 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma GCC diagnostic ignored "-Wunused-result"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mount.h>
+
+#include "bench.h"
+
+// -----------------------------------------------------------------------------
+// TLB Benchmark
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Measures the walk (see bench.h) immediately after an interrupt has
+// bounced the guest out to dom0 and back, and compares it to a warm walk.
+// The interrupt is detected as a gap in an otherwise tight RDTSC loop.
+// With VPIDs, both numbers should be close. To get the baseline without
+// VPIDs, build the VMM with VPID_MAX=0.
+//
+
+constexpr const uint64_t num_samples{1000};
+constexpr const uint64_t gap_tsc{5000};
+
+static uint64_t
+wait_for_interrupt()
+{
+    auto prev = tsc();
+
+    while (true) {
+        auto next = tsc();
+        if (next - prev > gap_tsc) {
+            return next - prev;
+        }
+
+        prev = next;
+    }
+}
+
+int main(void)
+{
+    mount("proc", "/proc", "proc", 0, "");
+
+    freopen("/dev/ttyprintk", "w", stdout);
+    freopen("/dev/ttyprintk", "w", stderr);
+
+    auto buf = alloc_pages("init-bench-tlb");
+    printf("init-bench-tlb: touching %lu pages\n", num_pages);
+
+    while (true) {
+        uint64_t warm{};
+        uint64_t cold{};
+        uint64_t bounce{};
+
+        for (uint64_t i = 0; i < num_samples; i++) {
+            bounce += wait_for_interrupt();
+            cold += walk(buf);
+            warm += walk(buf);
+        }
+
+        printf("init-bench-tlb: bounce: %lu, after bounce: %lu, warm: %lu\n",
+               bounce / num_samples, cold / num_samples, warm / num_samples);
+    }
+}
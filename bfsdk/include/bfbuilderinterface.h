@@ -74,6 +74,12 @@ extern "C" {
  * @var create_vm_from_bzimage_args::pt_uart
  *     defaults to 0 (optional). If non zero, the hypervisor will be told to
  *     pass-through the provided uart.
+ * @var create_vm_from_bzimage_args::pt_io
+ *     defaults to 0 (optional). The first I/O port of a range of ports that
+ *     the hypervisor will be told to pass-through.
+ * @var create_vm_from_bzimage_args::pt_io_size
+ *     defaults to 0 (optional). If non zero, the number of I/O ports to
+ *     pass-through, starting at pt_io.
  * @var create_vm_from_bzimage_args::size
  *     the amount of RAM to give to the domain
  * @var create_vm_from_bzimage_args::domainid
@@ -91,6 +97,8 @@ struct create_vm_from_bzimage_args {
 
     uint64_t uart;
     uint64_t pt_uart;
+    uint64_t pt_io;
+    uint64_t pt_io_size;
 
     uint64_t size;
     uint64_t domainid;
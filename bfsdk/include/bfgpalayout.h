@@ -50,6 +50,8 @@ enum e820_type {
  *       0xEA000 +----------------------+  |
  *               | Initial GDT          |  |
  *       0xEB000 +----------------------+  |
+ *               | Console Ring         |  |
+ *       0xF0000 +----------------------+  |
  *               | Free                 |  |
  *      0x100000 +----------------------+ ---
  *               | Linux                |  | RAM
@@ -57,9 +59,21 @@ enum e820_type {
  *               | Usable RAM           |  |
  *    0xXXXXXXXX +----------------------+ ---
  *               |                      |  |
+ *    0xFEB00000 +----------------------+  | MMIO (not in the E820 map)
+ *               | Virtio Block         |  |
+ *    0xFEB01000 +----------------------+  |
+ *               | Virtio Net           |  |
+ *    0xFEB02000 +----------------------+  |
+ *               | Virtio Vsock         |  |
+ *    0xFEB03000 +----------------------+  |
+ *               |                      |  |
  *    0xFEC00000 +----------------------+ ---
  *               | Free                 |  | Reserved
  *    0xFFFFFFFF +----------------------+ ---
+ *               |                      |
+ *   0x100000000 +----------------------+ ---
+ *               | Grant Mappings       |  | Not in the E820 map
+ *   0x110000000 +----------------------+ ---
  *
  * All RAM addresses must have backing memory, and must be mapped as RWE as this
  * is memory that the kernel could attempt to use. Reserved memory can be
@@ -115,5 +129,30 @@ setup_e820_map(void *vm, uint64_t size)
 #define BOOT_PARAMS_PAGE_GPA    0xE8000
 #define COMMAND_LINE_PAGE_GPA   0xE9000
 #define INITIAL_GDT_GPA         0xEA000
+#define CONSOLE_RING_GPA        0xEB000
+
+/**
+ * The virtio-mmio devices are not enumerated by anything, so the guest is
+ * told about them on the command line (virtio_mmio.device=). The IRQ is
+ * the guest IRQ that the device's vIRQ is delivered as.
+ */
+#define VIRTIO_BLK_GPA          0xFEB00000
+#define VIRTIO_BLK_SIZE         0x1000
+#define VIRTIO_BLK_IRQ          5
+
+#define VIRTIO_NET_GPA          0xFEB01000
+#define VIRTIO_NET_SIZE         0x1000
+#define VIRTIO_NET_IRQ          6
+
+#define VIRTIO_VSOCK_GPA        0xFEB02000
+#define VIRTIO_VSOCK_SIZE       0x1000
+#define VIRTIO_VSOCK_IRQ        7
+
+/**
+ * A domU maps the grants of other domUs (see grant_op__map) inside of this
+ * window, which is never backed by RAM (as RAM stops below 4GB).
+ */
+#define GRANT_MAP_GPA           0x100000000
+#define GRANT_MAP_SIZE          0x10000000
 
 #endif
@@ -72,6 +72,8 @@ uint64_t _vmcall4(void *r1, void *r2, void *r3, void *r4) NOEXCEPT;
 #define hypercall_enum_uart_op 0x04
 #define hypercall_enum_virq_op 0x10
 #define hypercall_enum_vclock_op 0x11
+#define hypercall_enum_console_op 0x12
+#define hypercall_enum_grant_op 0x13
 
 #define bfopcode(a) ((a & 0x00FF000000000000) >> 48)
 
@@ -84,9 +86,25 @@ uint64_t _vmcall4(void *r1, void *r2, void *r3, void *r4) NOEXCEPT;
 #define hypercall_enum_run_op__continue 3
 #define hypercall_enum_run_op__yield 4
 #define hypercall_enum_run_op__set_wallclock 5
+#define hypercall_enum_run_op__notify 6
+
+#define boxy_notify__console 1
+#define boxy_notify__uart 2
+#define boxy_notify__virtio_blk 3
+#define boxy_notify__virtio_net 4
+#define boxy_notify__virtio_vsock 5
+#define boxy_notify__uart_full 6
+
+/*
+ * Note: the arg of a yield is the absolute TSC at which the vCPU should be
+ * executed again (not a relative time). The arg only has 60 bits, so the
+ * TSC is given in units of 16 ticks (rounded up), which covers the whole
+ * TSC. Use run_op_ret_yield_tsc to get the TSC back.
+ */
 
 #define run_op_ret_op(a) ((0x000000000000000FULL & a) >> 0)
 #define run_op_ret_arg(a) ((0xFFFFFFFFFFFFFFF0ULL & a) >> 4)
+#define run_op_ret_yield_tsc(a) (run_op_ret_arg(a) << 4)
 
 static inline vcpuid_t
 hypercall_run_op(vcpuid_t vcpuid, uint64_t arg1, uint64_t arg2)
@@ -138,6 +156,14 @@ hypercall_uart_ndec_op(uint16_t port, uint64_t val)
 #define hypercall_enum_domain_op__set_uart 0xBF02000000000200
 #define hypercall_enum_domain_op__set_pt_uart 0xBF02000000000201
 #define hypercall_enum_domain_op__dump_uart 0xBF02000000000202
+#define hypercall_enum_domain_op__set_console_ring 0xBF02000000000203
+#define hypercall_enum_domain_op__register_uart_buffer 0xBF02000000000204
+#define hypercall_enum_domain_op__set_cpuid_leaf 0xBF02000000000205
+#define hypercall_enum_domain_op__add_pt_io 0xBF02000000000206
+#define hypercall_enum_domain_op__set_virtio_blk_ring 0xBF02000000000207
+#define hypercall_enum_domain_op__set_virtio_net_ring 0xBF02000000000208
+#define hypercall_enum_domain_op__attach_net_switch 0xBF02000000000209
+#define hypercall_enum_domain_op__set_virtio_vsock_ring 0xBF0200000000020A
 
 #define hypercall_enum_domain_op__share_page_r 0xBF02000000000300
 #define hypercall_enum_domain_op__share_page_rw 0xBF02000000000301
@@ -286,6 +312,254 @@ hypercall_uart_ndec_op(uint16_t port, uint64_t val)
 
 #define UART_MAX_BUFFER 0x4000
 
+/*
+ * Note: once dom0 has dumped the UART at least once, the VMM notifies dom0
+ * (run_op notify, boxy_notify__uart) when the UART's buffer goes from empty
+ * to non-empty (once per dump), or crosses UART_NOTIFY_WATERMARK, so dom0
+ * never has to poll. If the buffer is full, the vCPU returns
+ * with boxy_notify__uart_full without completing the OUT, and dom0 should
+ * not run it again until the UART has been dumped, so output is never
+ * dropped.
+ */
+#define UART_NOTIFY_WATERMARK ((UART_MAX_BUFFER * 3) / 4)
+
+/*
+ * Console Ring
+ *
+ * A single producer (the guest), single consumer (bfexec) ring that is used
+ * by a guest to write to its console without a VM exit per character. The
+ * ring is allocated by bfexec and mapped into the guest at CONSOLE_RING_GPA.
+ * prod and cons are free running counters (i.e. they are never wrapped), so
+ * the ring is empty when prod == cons. The guest only needs to notify
+ * (console_op__notify) when it writes to an empty ring.
+ */
+#define CONSOLE_RING_SIZE 0x4000
+#define CONSOLE_RING_PAGES 5
+
+struct boxy_console_ring {
+    uint64_t prod;
+    uint64_t cons;
+    uint8_t pad[0x1000 - 16];
+    char data[CONSOLE_RING_SIZE];
+};
+
+/*
+ * Virtio Block Ring
+ *
+ * The registers and the virtqueue of the virtio-mmio block device (see
+ * VIRTIO_BLK_GPA) are emulated by the VMM, but the disk itself belongs to
+ * bfexec, which can only read its own memory. The VMM copies the data of
+ * each request between the guest's buffers and a slot in this ring, posts
+ * the request to req, and notifies bfexec (run_op notify,
+ * boxy_notify__virtio_blk). bfexec performs the I/O on the slot and posts
+ * the result to rsp. Completions are picked up by the VMM the next time the
+ * guest's vCPU is resumed, and are signaled to the guest using the
+ * boxy_virq__virtio_blk vIRQ.
+ *
+ * The VMM owns the slots, so there are never more than
+ * VIRTIO_BLK_RING_SLOTS requests in flight and neither ring can overflow.
+ * The prod and cons counters are free running (same as the console ring).
+ * capacity (in 512 byte sectors) is filled in by bfexec before the ring is
+ * given to the VMM.
+ */
+#define VIRTIO_BLK_RING_SLOTS 32
+#define VIRTIO_BLK_SLOT_SIZE 0x20000
+#define VIRTIO_BLK_SECTOR_SIZE 512
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_T_GET_ID 8
+
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+struct boxy_virtio_blk_req {
+    uint32_t type;
+    uint32_t status;
+    uint64_t sector;
+    uint64_t len;
+    uint64_t slot;
+};
+
+struct boxy_virtio_blk_ring {
+    uint64_t req_prod;
+    uint64_t req_cons;
+    uint64_t rsp_prod;
+    uint64_t rsp_cons;
+    uint64_t capacity;
+    uint8_t pad1[0x1000 - 40];
+    struct boxy_virtio_blk_req req[VIRTIO_BLK_RING_SLOTS];
+    struct boxy_virtio_blk_req rsp[VIRTIO_BLK_RING_SLOTS];
+    uint8_t pad2[0x1000 - (VIRTIO_BLK_RING_SLOTS * 64)];
+    uint8_t data[VIRTIO_BLK_RING_SLOTS][VIRTIO_BLK_SLOT_SIZE];
+};
+
+/*
+ * Virtio Net Ring
+ *
+ * Same as the virtio block ring, the virtio-mmio network device (see
+ * VIRTIO_NET_GPA) is emulated by the VMM, while the backend (a tap device
+ * or an AF_UNIX socket) belongs to bfexec. The ring has a tx half and an
+ * rx half, and each slot holds one frame, prefixed with the 12 byte
+ * virtio_net_hdr_v1 (which is also the header used by a tap device with
+ * IFF_VNET_HDR, so checksum and segmentation offload requests are passed
+ * through as is). tx_len and rx_len hold the size of each slot, header
+ * included.
+ *
+ * The VMM copies the frames the guest transmits into the tx half and
+ * notifies bfexec once per batch (run_op notify, boxy_notify__virtio_net).
+ * bfexec copies the frames it receives into the rx half, which the VMM
+ * moves into the guest's receive buffers the next time the guest's vCPU
+ * is resumed. bfexec is also notified when the VMM frees rx slots while
+ * the rx half is full, or when the guest changes the features it accepted
+ * (features, which bfexec uses to set up the tap device's offloads). The
+ * prod and cons counters are free running. mac is filled in by bfexec
+ * before the ring is given to the VMM.
+ *
+ * A device that is attached to the VMM's net switch (see
+ * hypercall_domain_op__attach_net_switch) has no backend. The frames the
+ * guest transmits are copied straight into the receive buffers of the
+ * other guests on the switch, and the tx and rx halves are not used.
+ * Instead, when a frame is delivered to a guest whose vCPU might be
+ * yielded, the sending domain's bfexec is notified, and the receiver's
+ * port is pushed onto the wake list, so that bfexec can wake the
+ * receiver's bfexec up (the port is the id the receiver attached with).
+ *
+ * stats is maintained by the VMM in both cases, and is only read by
+ * bfexec.
+ */
+#define VIRTIO_NET_RING_SLOTS 32
+#define VIRTIO_NET_SLOT_SIZE 0x11000
+#define VIRTIO_NET_HDR_SIZE 12
+
+#define VIRTIO_NET_F_CSUM 0
+#define VIRTIO_NET_F_GUEST_CSUM 1
+#define VIRTIO_NET_F_GUEST_TSO4 7
+#define VIRTIO_NET_F_GUEST_TSO6 8
+#define VIRTIO_NET_F_GUEST_ECN 9
+#define VIRTIO_NET_F_HOST_TSO4 11
+#define VIRTIO_NET_F_HOST_TSO6 12
+
+struct boxy_virtio_net_stats {
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t dropped;
+};
+
+struct boxy_virtio_net_ring {
+    uint64_t tx_prod;
+    uint64_t tx_cons;
+    uint64_t rx_prod;
+    uint64_t rx_cons;
+    uint64_t features;
+    uint8_t mac[6];
+    uint8_t pad1[2];
+    uint64_t tx_len[VIRTIO_NET_RING_SLOTS];
+    uint64_t rx_len[VIRTIO_NET_RING_SLOTS];
+    struct boxy_virtio_net_stats stats;
+    uint64_t wake_prod;
+    uint64_t wake_cons;
+    uint64_t wake[VIRTIO_NET_RING_SLOTS];
+    uint8_t pad2[0x1000 - 104 - (VIRTIO_NET_RING_SLOTS * 24)];
+    uint8_t tx[VIRTIO_NET_RING_SLOTS][VIRTIO_NET_SLOT_SIZE];
+    uint8_t rx[VIRTIO_NET_RING_SLOTS][VIRTIO_NET_SLOT_SIZE];
+};
+
+/*
+ * Virtio Vsock Ring
+ *
+ * Same as the virtio net ring, but for the virtio-mmio socket device (see
+ * VIRTIO_VSOCK_GPA), which gives the guest AF_VSOCK stream sockets that
+ * are connected to bfexec (VIRTIO_VSOCK_HOST_CID). Each slot holds one
+ * packet: a 44 byte virtio_vsock_hdr followed by its payload. The VMM
+ * never looks inside of a packet. Connections, and the credit based flow
+ * control that comes with them (buf_alloc and fwd_cnt), are handled by
+ * bfexec, so neither side ever sends more than the other has room for.
+ *
+ * The VMM copies the packets the guest transmits into the tx half and
+ * notifies bfexec once per batch (run_op notify, boxy_notify__virtio_vsock).
+ * bfexec copies the packets it has for the guest into the rx half, each
+ * with no more than VIRTIO_VSOCK_RX_PAYLOAD bytes of payload (the size of
+ * the guest's receive buffers). The VMM moves them into the guest the next
+ * time the guest's vCPU is resumed, and signals the guest using the
+ * boxy_virq__virtio_vsock vIRQ. Same as the net ring, bfexec is notified
+ * when the VMM frees rx slots while the rx half is full.
+ *
+ * guest_cid is filled in by bfexec before the ring is given to the VMM.
+ * resets is incremented by the VMM every time the guest resets the device
+ * (which closes every socket in the guest), and bfexec is notified, so
+ * that it can close the host side of every connection as well.
+ */
+#define VIRTIO_VSOCK_RING_SLOTS 32
+#define VIRTIO_VSOCK_SLOT_SIZE 0x11000
+#define VIRTIO_VSOCK_HDR_SIZE 44
+#define VIRTIO_VSOCK_RX_PAYLOAD 0x1000
+
+#define VIRTIO_VSOCK_HOST_CID 2
+#define VIRTIO_VSOCK_GUEST_CID 3
+
+struct boxy_virtio_vsock_ring {
+    uint64_t tx_prod;
+    uint64_t tx_cons;
+    uint64_t rx_prod;
+    uint64_t rx_cons;
+    uint64_t guest_cid;
+    uint64_t resets;
+    uint64_t tx_len[VIRTIO_VSOCK_RING_SLOTS];
+    uint64_t rx_len[VIRTIO_VSOCK_RING_SLOTS];
+    uint8_t pad1[0x1000 - 48 - (VIRTIO_VSOCK_RING_SLOTS * 16)];
+    uint8_t tx[VIRTIO_VSOCK_RING_SLOTS][VIRTIO_VSOCK_SLOT_SIZE];
+    uint8_t rx[VIRTIO_VSOCK_RING_SLOTS][VIRTIO_VSOCK_SLOT_SIZE];
+};
+
+/*
+ * Hypervisor CPUID Leaves
+ *
+ * Leaf 0x40000000 returns the largest hypervisor leaf in EAX and the
+ * "BoxyBoxyBoxy" signature in EBX, ECX and EDX. Leaf 0x40000001 returns
+ * the paravirtual features the guest can use in EAX (see
+ * boxy_cpuid_feature__*). Leaf 0x40000010 returns the TSC frequency (kHz)
+ * in EAX and the APIC timer frequency (kHz) in EBX. A value of 0 in EBX
+ * means the APIC timer is only supported in TSC-deadline mode. Any other
+ * leaf in this range returns 0.
+ */
+#define boxy_cpuid_leaf__signature 0x40000000
+#define boxy_cpuid_leaf__features 0x40000001
+#define boxy_cpuid_leaf__timing 0x40000010
+#define boxy_cpuid_leaf__max boxy_cpuid_leaf__timing
+
+#define boxy_cpuid_signature 0x79786F42
+
+#define boxy_cpuid_feature__vclock (1U << 0)
+#define boxy_cpuid_feature__vclock_timers (1U << 1)
+#define boxy_cpuid_feature__steal_time (1U << 2)
+#define boxy_cpuid_feature__tsc_deadline (1U << 3)
+#define boxy_cpuid_feature__virq (1U << 4)
+#define boxy_cpuid_feature__pv_console (1U << 5)
+#define boxy_cpuid_feature__pmu (1U << 6)
+#define boxy_cpuid_feature__grant_table (1U << 7)
+#define boxy_cpuid_feature__virq_batching (1U << 8)
+
+/*
+ * CPUID Leaf
+ *
+ * The values returned by CPUID for a given leaf/subleaf (see
+ * domain_op__set_cpuid_leaf). Each domU has a CPUID table that is built
+ * when the domain is created. bfexec can override any leaf in this table
+ * before the domain's vCPUs are created. Once any vCPU has been created,
+ * domain_op__set_cpuid_leaf returns FAILURE.
+ */
+struct boxy_cpuid_leaf {
+    uint32_t eax;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+};
+
 static inline domainid_t
 hypercall_domain_op__create_domain(void)
 {
@@ -347,6 +621,118 @@ hypercall_domain_op__dump_uart(domainid_t domainid, char *buffer)
     );
 }
 
+static inline status_t
+hypercall_domain_op__register_uart_buffer(domainid_t domainid, char *buffer)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__register_uart_buffer,
+        domainid,
+        bfrcast(uint64_t, buffer),
+        0
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__set_console_ring(
+    domainid_t foreign_domainid, struct boxy_console_ring *ring)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__set_console_ring,
+        foreign_domainid,
+        bfrcast(uint64_t, ring),
+        0
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__set_cpuid_leaf(
+    domainid_t foreign_domainid, uint32_t leaf, uint32_t subleaf,
+    struct boxy_cpuid_leaf *regs)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__set_cpuid_leaf,
+        foreign_domainid,
+        bfscast(uint64_t, leaf) | (bfscast(uint64_t, subleaf) << 32),
+        bfrcast(uint64_t, regs)
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__add_pt_io(
+    domainid_t foreign_domainid, uint64_t port, uint64_t size)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__add_pt_io,
+        foreign_domainid,
+        port,
+        size
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__set_virtio_blk_ring(
+    domainid_t foreign_domainid, struct boxy_virtio_blk_ring *ring)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__set_virtio_blk_ring,
+        foreign_domainid,
+        bfrcast(uint64_t, ring),
+        0
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__set_virtio_net_ring(
+    domainid_t foreign_domainid, struct boxy_virtio_net_ring *ring)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__set_virtio_net_ring,
+        foreign_domainid,
+        bfrcast(uint64_t, ring),
+        0
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__attach_net_switch(
+    domainid_t foreign_domainid, uint64_t port)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__attach_net_switch,
+        foreign_domainid,
+        port,
+        0
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__set_virtio_vsock_ring(
+    domainid_t foreign_domainid, struct boxy_virtio_vsock_ring *ring)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__set_virtio_vsock_ring,
+        foreign_domainid,
+        bfrcast(uint64_t, ring),
+        0
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
 static inline status_t
 hypercall_domain_op__share_page_r(
     domainid_t foreign_domainid, uint64_t gpa, uint64_t foreign_gpa)
@@ -641,9 +1027,23 @@ hypercall_vcpu_op__destroy_vcpu(vcpuid_t vcpuid)
 /* -------------------------------------------------------------------------- */
 
 #define boxy_virq__vclock_event_handler 0xBF00000000000201
+#define boxy_virq__pmu_interrupt 0xBF00000000000202
+#define boxy_virq__virtio_blk 0xBF00000000000203
+#define boxy_virq__virtio_net 0xBF00000000000204
+#define boxy_virq__virtio_vsock 0xBF00000000000205
+
+/*
+ * Note: by default, each vIRQ is delivered with its own Hypervisor Callback
+ * Vector IRQ. If CPUID reports boxy_cpuid_feature__virq_batching, the guest
+ * can opt in to batching with enable_virq_batching, after which a single
+ * Hypervisor Callback Vector IRQ can carry more than one vIRQ (e.g. when
+ * several vclock timers expire at once), and the guest must call
+ * get_next_virq until it returns FAILURE.
+ */
 
 #define hypercall_enum_virq_op__set_hypervisor_callback_vector 0xBF10000000000100
 #define hypercall_enum_virq_op__get_next_virq 0xBF10000000000101
+#define hypercall_enum_virq_op__enable_virq_batching 0xBF10000000000102
 
 static inline uint64_t
 hypercall_virq_op__set_hypervisor_callback_vector(uint64_t vector)
@@ -659,6 +1059,13 @@ hypercall_virq_op__get_next_virq(void)
         hypercall_enum_virq_op__get_next_virq, 0, 0, 0);
 }
 
+static inline status_t
+hypercall_virq_op__enable_virq_batching(void)
+{
+    return _vmcall(
+        hypercall_enum_virq_op__enable_virq_batching, 0, 0, 0);
+}
+
 /* -------------------------------------------------------------------------- */
 /* Virtual Clock                                                              */
 /* -------------------------------------------------------------------------- */
@@ -671,6 +1078,27 @@ hypercall_virq_op__get_next_virq(void)
 #define hypercall_enum_vclock_op__set_guest_wallclock_rtc 0xBF11000000000106
 #define hypercall_enum_vclock_op__set_guest_wallclock_tsc 0xBF11000000000107
 #define hypercall_enum_vclock_op__get_guest_wallclock 0xBF11000000000108
+#define hypercall_enum_vclock_op__set_timer 0xBF11000000000109
+#define hypercall_enum_vclock_op__cancel_timer 0xBF1100000000010A
+#define hypercall_enum_vclock_op__set_steal_time_gpa 0xBF1100000000010B
+
+/*
+ * Steal Time
+ *
+ * Uses the same layout as KVM's steal time structure. The steal field is
+ * the total number of nanoseconds that the vCPU was runnable, but was not
+ * executing because the host (or another guest) was. The version is odd
+ * while the VMM is updating the structure. The structure must be 64 byte
+ * aligned.
+ */
+struct boxy_steal_time {
+    uint64_t steal;
+    uint32_t version;
+    uint32_t flags;
+    uint8_t preempted;
+    uint8_t u8_pad[3];
+    uint32_t pad[11];
+};
 
 static inline uint64_t
 hypercall_vclock_op__get_tsc_freq_khz(void)
@@ -686,6 +1114,27 @@ hypercall_vclock_op__set_next_event(uint64_t tsc_delta)
         hypercall_enum_vclock_op__set_next_event, tsc_delta, 0, 0);
 }
 
+static inline status_t
+hypercall_vclock_op__set_timer(uint64_t virq, uint64_t tsc_delta)
+{
+    return _vmcall(
+        hypercall_enum_vclock_op__set_timer, virq, tsc_delta, 0);
+}
+
+static inline status_t
+hypercall_vclock_op__cancel_timer(uint64_t virq)
+{
+    return _vmcall(
+        hypercall_enum_vclock_op__cancel_timer, virq, 0, 0);
+}
+
+static inline status_t
+hypercall_vclock_op__set_steal_time_gpa(uint64_t gpa)
+{
+    return _vmcall(
+        hypercall_enum_vclock_op__set_steal_time_gpa, gpa, 0, 0);
+}
+
 static inline status_t
 hypercall_vclock_op__reset_host_wallclock(void)
 {
@@ -748,6 +1197,134 @@ hypercall_vclock_op__get_guest_wallclock(
         &op, sec, nsec, tsc);
 }
 
+/* -------------------------------------------------------------------------- */
+/* Console                                                                    */
+/* -------------------------------------------------------------------------- */
+
+#define hypercall_enum_console_op__get_ring 0xBF12000000000100
+#define hypercall_enum_console_op__notify 0xBF12000000000101
+
+static inline uint64_t
+hypercall_console_op__get_ring(void)
+{
+    return _vmcall(
+        hypercall_enum_console_op__get_ring, 0, 0, 0);
+}
+
+static inline status_t
+hypercall_console_op__notify(void)
+{
+    return _vmcall(
+        hypercall_enum_console_op__notify, 0, 0, 0);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Grant Tables                                                               */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Grant Table
+ *
+ * A domU shares pages of its RAM with another domU by publishing grant
+ * entries in its grant table, which is made of pages of its own memory that
+ * it registers with grant_op__set_table. An entry is identified by its
+ * index (the grant reference), and names the page that is granted (gpa),
+ * the domain that is allowed to map it (domid), and whether or not it can
+ * be written. A page can only be granted writable if the granter can
+ * write to it. The granter owns flags, domid and gpa, while mapped is owned
+ * by the VMM and holds the number of times the entry is currently mapped.
+ *
+ * The peer maps a batch of grants into its own physical address space (at
+ * an address inside of the grant window, see GRANT_MAP_GPA) with a single
+ * grant_op__map, and unmaps them with a single grant_op__unmap. Each op in
+ * the batch gets its own status. The EPT is updated for the whole batch,
+ * followed by a single INVEPT. The granter can revoke its grants at any
+ * time with grant_op__revoke, which removes them from every domain that
+ * has them mapped. A peer that accesses a revoked grant faults, so grants
+ * should only be revoked (or the entry reused) once mapped is 0. Both are
+ * done for every grant when a domain is destroyed.
+ *
+ * The EPT changes are made on the CPU that executes the hypercall. Any
+ * other CPU flushes the domain's EPT the next time it resumes one of the
+ * domain's vCPUs, and grant_op__unmap and grant_op__revoke do not return
+ * (or drop mapped to 0) until every vCPU of the domain has either done so
+ * or left the guest, so once mapped is 0, the page is no longer reachable.
+ */
+#define BOXY_GRANT_TABLE_MAX_PAGES 16
+#define BOXY_GRANT_BATCH_MAX 128
+
+#define BOXY_GRANT_PERMIT (1ULL << 0)
+#define BOXY_GRANT_READONLY (1ULL << 1)
+
+#define BOXY_GRANT_MAP_WRITE (1ULL << 0)
+
+struct boxy_grant_entry {
+    uint64_t flags;
+    domainid_t domid;
+    uint64_t gpa;
+    uint64_t mapped;
+};
+
+struct boxy_grant_op {
+    uint64_t ref;
+    uint64_t gpa;
+    uint64_t flags;
+    uint64_t status;
+};
+
+#define BOXY_GRANT_ENTRIES_PER_PAGE                                             \
+    (0x1000 / sizeof(struct boxy_grant_entry))
+
+#define hypercall_enum_grant_op__set_table 0xBF13000000000100
+#define hypercall_enum_grant_op__map 0xBF13000000000101
+#define hypercall_enum_grant_op__unmap 0xBF13000000000102
+#define hypercall_enum_grant_op__revoke 0xBF13000000000103
+
+static inline status_t
+hypercall_grant_op__set_table(struct boxy_grant_entry *table, uint64_t pages)
+{
+    return _vmcall(
+        hypercall_enum_grant_op__set_table,
+        bfrcast(uint64_t, table),
+        pages,
+        0
+    );
+}
+
+static inline status_t
+hypercall_grant_op__map(
+    domainid_t granter_domainid, struct boxy_grant_op *ops, uint64_t num)
+{
+    return _vmcall(
+        hypercall_enum_grant_op__map,
+        granter_domainid,
+        bfrcast(uint64_t, ops),
+        num
+    );
+}
+
+static inline status_t
+hypercall_grant_op__unmap(struct boxy_grant_op *ops, uint64_t num)
+{
+    return _vmcall(
+        hypercall_enum_grant_op__unmap,
+        bfrcast(uint64_t, ops),
+        num,
+        0
+    );
+}
+
+static inline status_t
+hypercall_grant_op__revoke(struct boxy_grant_op *ops, uint64_t num)
+{
+    return _vmcall(
+        hypercall_enum_grant_op__revoke,
+        bfrcast(uint64_t, ops),
+        num,
+        0
+    );
+}
+
 #pragma pack(pop)
 
 #endif
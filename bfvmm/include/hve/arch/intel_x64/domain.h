@@ -22,10 +22,21 @@
 #ifndef DOMAIN_INTEL_X64_BOXY_H
 #define DOMAIN_INTEL_X64_BOXY_H
 
+#include <array>
+#include <atomic>
 #include <vector>
 #include <memory>
+#include <mutex>
 
 #include "uart.h"
+#include "grant_table.h"
+#include "emulation/cpuid.h"
+#include "emulation/mmio.h"
+#include "emulation/mtrr.h"
+#include "emulation/pio.h"
+#include "virt/virtio_blk.h"
+#include "virt/virtio_net.h"
+#include "virt/virtio_vsock.h"
 #include "../../../domain/domain.h"
 #include "../../../domain/domain_manager.h"
 
@@ -40,6 +51,10 @@ namespace boxy::intel_x64
 
 class vcpu;
 
+/// The EPT state of a vCPU that is not in the guest (see add_ept_user())
+///
+constexpr const uint64_t ept_state_exited{~0ULL};
+
 /// Domain
 ///
 class domain : public boxy::domain
@@ -190,6 +205,95 @@ public:
     ///
     void unmap(uintptr_t gpa);
 
+    /// GPA to HPA
+    ///
+    /// Converts a guest physical address to a host physical address using
+    /// the domain's EPT. Throws if the gpa is not mapped.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address to convert
+    /// @return returns the host physical address, and the address of the
+    ///     EPT entry that maps it
+    ///
+    std::pair<uintptr_t, uintptr_t> gpa_to_hpa(uintptr_t gpa);
+
+    /// Is Writable
+    ///
+    /// Throws if the gpa is not mapped.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address to check
+    /// @return returns true if the domain's EPT allows the domain to write
+    ///     to the gpa, false otherwise
+    ///
+    bool is_writable(uintptr_t gpa);
+
+    /// Invalidate EPT
+    ///
+    /// Records that mappings were removed from the domain's EPT. The caller
+    /// is responsible for flushing the current CPU, and for calling
+    /// sync_ept() before the memory that was unmapped can be reused. Every
+    /// other CPU flushes the next time it resumes one of the domain's vCPUs
+    /// (see ept_generation()).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the new EPT generation
+    ///
+    uint64_t invalidate_ept() noexcept;
+
+    /// Sync EPT
+    ///
+    /// Waits until every vCPU of the domain has either left the guest, or
+    /// entered it at (and therefore flushed) the given EPT generation or
+    /// later. A vCPU leaves the guest on its next VM exit, which an
+    /// external interrupt or the preemption timer guarantees, so the wait
+    /// is bounded. Once this returns, no CPU can still use a mapping that
+    /// was removed before the generation was reached.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param generation the generation returned by invalidate_ept()
+    ///
+    void sync_ept(uint64_t generation) const noexcept;
+
+    /// Add EPT User
+    ///
+    /// Registers a vCPU's EPT state with the domain so that sync_ept() can
+    /// wait on it. The state holds the EPT generation the vCPU entered the
+    /// guest at, or ept_state_exited while the vCPU is not in the guest.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param state the vCPU's EPT state
+    ///
+    void add_ept_user(gsl::not_null<const std::atomic<uint64_t> *> state);
+
+    /// Remove EPT User
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param state the vCPU's EPT state
+    ///
+    void remove_ept_user(const std::atomic<uint64_t> *state) noexcept;
+
+    /// EPT Generation
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of times invalidate_ept() was called
+    ///
+    uint64_t ept_generation() const noexcept;
+
     /// Release Virtual Address
     ///
     /// Returns any unused page tables back to the heap, releasing memory and
@@ -209,8 +313,8 @@ public:
 
     /// Set UART
     ///
-    /// If set, enables the use of an emulated UART that will be created
-    /// during the vCPU's construction
+    /// If set, enables the emulated UART at the provided port. The other
+    /// default UARTs remain on the domain's pio_bus, but are disabled.
     ///
     /// @expects
     /// @ensures
@@ -221,27 +325,30 @@ public:
 
     /// Set Pass-Through UART
     ///
-    /// If set, passes through a UART to the VM during each vCPU's
-    /// construction.
+    /// If set, passes through a UART to the VM by adding its ports to the
+    /// domain's pio_bus as a pass-through range (replacing the emulated
+    /// UART at the same port). Throws once any vCPU has been created.
     ///
     /// @expects
     /// @ensures
     ///
     /// @param uart the port of the serial device to pass through
     ///
-    void set_pt_uart(uart::port_type uart) noexcept;
+    void set_pt_uart(uart::port_type uart);
 
-    /// Setup vCPU UARTs
+    /// Add Pass-Through I/O Ports
     ///
-    /// Given a vCPU, this function will setup all of the UARTs based
-    /// on how the domain have been configured.
+    /// Passes through [port, port + size) to the VM. Throws if a device
+    /// owns any of these ports, or once any vCPU has been created, as the
+    /// vCPUs' I/O bitmaps are only set up when they are created.
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param vcpu the vCPU to setup
+    /// @param port the first port to pass through
+    /// @param size the number of ports to pass through
     ///
-    void setup_vcpu_uarts(gsl::not_null<vcpu *> vcpu);
+    void add_pt_io(pio_bus::port_type port, uint32_t size);
 
     /// Dump UART
     ///
@@ -257,6 +364,228 @@ public:
     ///
     uint64_t dump_uart(const gsl::span<char> &buffer);
 
+    /// Register UART Buffer
+    ///
+    /// Registers a dom0 buffer (of UART_MAX_BUFFER bytes) that stays mapped
+    /// into the VMM until the domain is destroyed. Once registered,
+    /// dump_uart() can be used to dump the UART without having to map the
+    /// buffer on each call.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param buffer the VMM's mapping of the dom0 buffer
+    ///
+    void register_uart_buffer(bfvmm::x64::unique_map<char> &&buffer);
+
+    /// Has UART Buffer
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if register_uart_buffer() has been called
+    ///
+    bool has_uart_buffer() const noexcept;
+
+    /// Dump UART (Registered Buffer)
+    ///
+    /// Same as dump_uart(buffer), but dumps into the registered buffer. This
+    /// function will throw if a buffer has not been registered.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of bytes transferred to the buffer
+    ///
+    uint64_t dump_uart();
+
+    /// Set Console Ring
+    ///
+    /// Maps the console ring (see struct boxy_console_ring) into the
+    /// domain at CONSOLE_RING_GPA. The ring is owned by dom0 and is
+    /// provided as a list of HPAs, one for each page of the ring.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param hpas the HPA of each page in the console ring
+    ///
+    void set_console_ring(
+        const std::array<uintptr_t, CONSOLE_RING_PAGES> &hpas);
+
+    /// Console Ring
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the GPA of the console ring, or 0 if the domain
+    ///     does not have a console ring.
+    ///
+    uintptr_t console_ring() const noexcept;
+
+    /// Set CPUID Leaf
+    ///
+    /// Overrides (or adds) a leaf in the domain's CPUID table. The table is
+    /// read by all of the domain's vCPUs (some of it when the vCPU is
+    /// created), so this throws once any of the domain's vCPUs have been
+    /// created.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param leaf the CPUID leaf (EAX)
+    /// @param subleaf the CPUID subleaf (ECX)
+    /// @param regs the values returned to the guest
+    ///
+    void set_cpuid_leaf(
+        uint32_t leaf, uint32_t subleaf, const struct boxy_cpuid_leaf &regs);
+
+    /// CPUID Leaf
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param leaf the CPUID leaf (EAX)
+    /// @param subleaf the CPUID subleaf (ECX)
+    /// @return returns the leaf from the domain's CPUID table, or nullptr
+    ///     if the leaf is not in the table
+    ///
+    const struct boxy_cpuid_leaf *cpuid_leaf(
+        uint32_t leaf, uint32_t subleaf) const noexcept;
+
+    /// vCPU Created
+    ///
+    /// Tells the domain that one of its vCPUs has been created. From then
+    /// on, the domain's CPUID table can no longer be changed.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void vcpu_created() noexcept;
+
+    /// MTRRs
+    ///
+    /// Note that the memory type of a page is calculated when the page is
+    /// mapped, so MTRR changes only affect pages mapped after the change.
+    /// Pages that are RAM on the host are always mapped write-back.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the domain's (emulated) MTRRs
+    ///
+    mtrr_ranges &mtrrs() noexcept;
+
+    /// MMIO Bus
+    ///
+    /// The emulated MMIO devices of this domain. A device's range must not
+    /// be mapped in EPT, so that accesses to it trap.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the domain's MMIO bus
+    ///
+    mmio_bus &mmio() noexcept;
+
+    /// Port I/O Bus
+    ///
+    /// The emulated and passed through I/O ports of this domain. Devices
+    /// and pass-through ranges must be added before the domain's vCPUs are
+    /// created.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the domain's port I/O bus
+    ///
+    pio_bus &pio() noexcept;
+
+    /// Set Virtio Block Ring
+    ///
+    /// Gives the domain a virtio-mmio block device at VIRTIO_BLK_GPA. The
+    /// disk is provided by dom0 through the provided ring (see struct
+    /// boxy_virtio_blk_ring), which must outlive the domain. This must be
+    /// called before the domain's vCPUs are created.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param ring the ring shared with dom0
+    ///
+    void set_virtio_blk_ring(
+        bfvmm::x64::unique_map<struct boxy_virtio_blk_ring> &&ring);
+
+    /// Virtio Block Device
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the domain's virtio-blk device, or nullptr if the
+    ///     domain does not have one
+    ///
+    virtio_blk *blk() const noexcept;
+
+    /// Set Virtio Net Ring
+    ///
+    /// Gives the domain a virtio-mmio network device at VIRTIO_NET_GPA. The
+    /// backend is provided by dom0 through the provided ring (see struct
+    /// boxy_virtio_net_ring), which must outlive the domain. This must be
+    /// called before the domain's vCPUs are created.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param ring the ring shared with dom0
+    ///
+    void set_virtio_net_ring(
+        bfvmm::x64::unique_map<struct boxy_virtio_net_ring> &&ring);
+
+    /// Virtio Net Device
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the domain's virtio-net device, or nullptr if the
+    ///     domain does not have one
+    ///
+    virtio_net *net() const noexcept;
+
+    /// Set Virtio Vsock Ring
+    ///
+    /// Gives the domain a virtio-mmio socket device at VIRTIO_VSOCK_GPA.
+    /// The host side of the guest's sockets is provided by dom0 through the
+    /// provided ring (see struct boxy_virtio_vsock_ring), which must outlive
+    /// the domain. This must be called before the domain's vCPUs are
+    /// created.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param ring the ring shared with dom0
+    ///
+    void set_virtio_vsock_ring(
+        bfvmm::x64::unique_map<struct boxy_virtio_vsock_ring> &&ring);
+
+    /// Virtio Vsock Device
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the domain's virtio-vsock device, or nullptr if the
+    ///     domain does not have one
+    ///
+    virtio_vsock *vsock() const noexcept;
+
+    /// Grant Table
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the domain's grant table
+    ///
+    grant_table &grants() noexcept;
+
 public:
 
     /// Domain Registers
@@ -423,18 +752,42 @@ private:
     void setup_dom0();
     void setup_domU();
 
+    void add_virtio_device(
+        uintptr_t gpa, uint64_t size, virtio_mmio *device);
+
+    bfvmm::intel_x64::ept::mmap::memory_type memory_type(
+        uintptr_t gpa, uintptr_t hpa) const noexcept;
+
+    void identity_map(uintptr_t addr, uintptr_t size);
+
 private:
 
     bfvmm::intel_x64::ept::mmap m_ept_map;
     bfvmm::intel_x64::vcpu_global_state_t m_vcpu_global_state;
 
     uart::port_type m_uart_port{};
-    uart::port_type m_pt_uart_port{};
     uart m_uart_3F8{0x3F8};
     uart m_uart_2F8{0x2F8};
     uart m_uart_3E8{0x3E8};
     uart m_uart_2E8{0x2E8};
     std::unique_ptr<uart> m_pt_uart{};
+    bfvmm::x64::unique_map<char> m_uart_buffer{};
+
+    uintptr_t m_console_ring{};
+    cpuid_table m_cpuid_table{};
+    std::atomic<bool> m_vcpu_created{};
+    mtrr_ranges m_mtrrs{};
+    mtrr_ranges m_host_mtrrs{};
+    mmio_bus m_mmio_bus{};
+    pio_bus m_pio_bus{};
+    std::unique_ptr<virtio_blk> m_virtio_blk{};
+    std::unique_ptr<virtio_net> m_virtio_net{};
+    std::unique_ptr<virtio_vsock> m_virtio_vsock{};
+
+    std::atomic<uint64_t> m_ept_generation{};
+    mutable std::mutex m_ept_users_mutex{};
+    std::vector<const std::atomic<uint64_t> *> m_ept_users{};
+    grant_table m_grant_table{this};
 
     uint64_t m_rax{};
     uint64_t m_rbx{};
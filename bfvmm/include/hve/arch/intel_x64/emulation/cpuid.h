@@ -22,9 +22,13 @@
 #ifndef EMULATION_CPUID_INTEL_X64_BOXY_H
 #define EMULATION_CPUID_INTEL_X64_BOXY_H
 
+#include <bfhypercall.h>
+
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
 #include <bfvmm/hve/arch/intel_x64/vmexit/cpuid.h>
 
+#include <vector>
+
 // -----------------------------------------------------------------------------
 // Definitions
 // -----------------------------------------------------------------------------
@@ -34,6 +38,84 @@ namespace boxy::intel_x64
 
 class vcpu;
 
+class cpuid_table
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    cpuid_table() = default;
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~cpuid_table() = default;
+
+    /// Init
+    ///
+    /// Fills in the table with the default domU profile. Each leaf is read
+    /// from the current CPU once, and the masks that hide unsupported
+    /// features are applied here so that an exit is just a lookup.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void init();
+
+    /// Set
+    ///
+    /// Adds a leaf to the table (or replaces it if it already exists). The
+    /// subleaf is ignored for leaves that are not indexed by ECX.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param leaf the CPUID leaf (EAX)
+    /// @param subleaf the CPUID subleaf (ECX)
+    /// @param regs the values returned to the guest
+    ///
+    void set(
+        uint32_t leaf, uint32_t subleaf, const struct boxy_cpuid_leaf &regs);
+
+    /// Get
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param leaf the CPUID leaf (EAX)
+    /// @param subleaf the CPUID subleaf (ECX)
+    /// @return returns the leaf if it is in the table, nullptr otherwise
+    ///
+    const struct boxy_cpuid_leaf *get(
+        uint32_t leaf, uint32_t subleaf) const noexcept;
+
+private:
+
+    struct entry_t {
+        uint64_t key;
+        struct boxy_cpuid_leaf regs;
+    };
+
+    std::vector<entry_t> m_entries;
+
+public:
+
+    /// @cond
+
+    cpuid_table(cpuid_table &&) = default;
+    cpuid_table &operator=(cpuid_table &&) = default;
+
+    cpuid_table(const cpuid_table &) = delete;
+    cpuid_table &operator=(const cpuid_table &) = delete;
+
+    /// @endcond
+};
+
 class cpuid_handler
 {
 public:
@@ -59,29 +141,14 @@ public:
 
     /// @cond
 
-    bool handle_0x00000000(vcpu_t *vcpu);
-    bool handle_0x00000001(vcpu_t *vcpu);
-    bool handle_0x00000002(vcpu_t *vcpu);
-    bool handle_0x00000004(vcpu_t *vcpu);
-    bool handle_0x00000006(vcpu_t *vcpu);
-    bool handle_0x00000007(vcpu_t *vcpu);
-    bool handle_0x0000000A(vcpu_t *vcpu);
-    bool handle_0x0000000B(vcpu_t *vcpu);
-    bool handle_0x0000000D(vcpu_t *vcpu);
-    bool handle_0x0000000F(vcpu_t *vcpu);
-    bool handle_0x00000010(vcpu_t *vcpu);
-    bool handle_0x80000000(vcpu_t *vcpu);
-    bool handle_0x80000001(vcpu_t *vcpu);
-    bool handle_0x80000002(vcpu_t *vcpu);
-    bool handle_0x80000003(vcpu_t *vcpu);
-    bool handle_0x80000004(vcpu_t *vcpu);
-    bool handle_0x80000007(vcpu_t *vcpu);
-    bool handle_0x80000008(vcpu_t *vcpu);
-
-    bool handle_0x40000000(vcpu_t *vcpu);
+    bool handle(vcpu_t *vcpu);
 
     /// @endcond
 
+private:
+
+    uint32_t xsave_size(uint64_t xcr0) const noexcept;
+
 private:
 
     vcpu *m_vcpu;
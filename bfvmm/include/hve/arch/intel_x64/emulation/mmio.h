@@ -0,0 +1,210 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef EMULATION_MMIO_INTEL_X64_BOXY_H
+#define EMULATION_MMIO_INTEL_X64_BOXY_H
+
+#include <bfvmm/hve/arch/intel_x64/vcpu.h>
+
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+class vcpu;
+
+/// MMIO Bus
+///
+/// The set of emulated MMIO devices in a domain. Each device registers a
+/// range of guest physical addresses that is never mapped in EPT, so any
+/// access to it generates an EPT violation. The mmio_handler decodes the
+/// instruction that performed the access and forwards it to the device
+/// that owns the address.
+///
+/// The ranges are kept sorted by address so that finding the device that
+/// owns an address is a binary search, regardless of how many devices the
+/// domain has. Devices should be added before the domain's vCPUs are run.
+///
+class mmio_bus
+{
+public:
+
+    /// Info
+    ///
+    /// The access that is being emulated. For a read, the device fills in
+    /// val. For a write, val is the value being written. In both cases,
+    /// size is the size of the access in bytes (1, 2, 4 or 8).
+    ///
+    struct info_t {
+        uintptr_t gpa;
+        uint64_t size;
+        uint64_t val;
+    };
+
+    using handler_delegate_t = delegate<bool(vcpu *, info_t &)>;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    mmio_bus() = default;
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~mmio_bus() = default;
+
+    /// Add Device
+    ///
+    /// Registers a device that owns [gpa, gpa + size). Throws if the range
+    /// overlaps a range that is already registered.
+    ///
+    /// @expects size != 0
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address of the start of the range
+    /// @param size the size of the range in bytes
+    /// @param read the handler to call when the guest reads from the range
+    /// @param write the handler to call when the guest writes to the range
+    ///
+    void add_device(
+        uintptr_t gpa, uint64_t size,
+        const handler_delegate_t &read, const handler_delegate_t &write);
+
+    /// Is MMIO
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address to look up
+    /// @return returns true if a device owns gpa
+    ///
+    bool is_mmio(uintptr_t gpa) const noexcept;
+
+    /// Read
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU that performed the access
+    /// @param info the access to emulate
+    /// @return returns false if no device owns all of the access, or the
+    ///     device could not emulate the access, true otherwise
+    ///
+    bool read(vcpu *vcpu, info_t &info) const;
+
+    /// Write
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU that performed the access
+    /// @param info the access to emulate
+    /// @return returns false if no device owns all of the access, or the
+    ///     device could not emulate the access, true otherwise
+    ///
+    bool write(vcpu *vcpu, info_t &info) const;
+
+private:
+
+    struct entry_t {
+        uintptr_t gpa;
+        uint64_t size;
+        handler_delegate_t read;
+        handler_delegate_t write;
+    };
+
+    const entry_t *find(uintptr_t gpa, uint64_t size) const noexcept;
+
+private:
+
+    std::vector<entry_t> m_entries;
+
+public:
+
+    /// @cond
+
+    mmio_bus(mmio_bus &&) = default;
+    mmio_bus &operator=(mmio_bus &&) = default;
+
+    mmio_bus(const mmio_bus &) = delete;
+    mmio_bus &operator=(const mmio_bus &) = delete;
+
+    /// @endcond
+};
+
+class mmio_handler
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this handler
+    ///
+    mmio_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~mmio_handler() = default;
+
+public:
+
+    /// @cond
+
+    bool handle(vcpu_t *vcpu);
+
+    /// @endcond
+
+private:
+
+    vcpu *m_vcpu;
+
+public:
+
+    /// @cond
+
+    mmio_handler(mmio_handler &&) = default;
+    mmio_handler &operator=(mmio_handler &&) = default;
+
+    mmio_handler(const mmio_handler &) = delete;
+    mmio_handler &operator=(const mmio_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -23,8 +23,20 @@
 #define EMULATION_MTRR_INTEL_X64_BOXY_H
 
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
-#include <bfvmm/hve/arch/intel_x64/vmexit/rdmsr.h>
-#include <bfvmm/hve/arch/intel_x64/vmexit/wrmsr.h>
+
+#include <array>
+
+// -----------------------------------------------------------------------------
+// Defines
+// -----------------------------------------------------------------------------
+
+#ifndef MTRR_MAX_VARIABLE_RANGES
+#define MTRR_MAX_VARIABLE_RANGES 16
+#endif
+
+#ifndef MTRR_GUEST_VARIABLE_RANGES
+#define MTRR_GUEST_VARIABLE_RANGES 8
+#endif
 
 // -----------------------------------------------------------------------------
 // Definitions
@@ -35,6 +47,150 @@ namespace boxy::intel_x64
 
 class vcpu;
 
+/// MTRR Ranges
+///
+/// A set of MTRRs (MTRRCAP, MTRRdefType, the fixed ranges and the variable
+/// ranges). A domU uses this to emulate its MTRRs and the host MTRRs are
+/// captured in one so that a physical address can be looked up without
+/// having to read the MSRs.
+///
+class mtrr_ranges
+{
+public:
+
+    /// Memory Types
+    ///
+    static constexpr const uint64_t uncacheable{0};
+    static constexpr const uint64_t write_combining{1};
+    static constexpr const uint64_t write_through{4};
+    static constexpr const uint64_t write_protected{5};
+    static constexpr const uint64_t write_back{6};
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    mtrr_ranges() = default;
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~mtrr_ranges() = default;
+
+    /// Init Guest
+    ///
+    /// Sets up the MTRRs a domU sees on boot: MTRR_GUEST_VARIABLE_RANGES
+    /// variable ranges (all disabled), fixed ranges and WC support, with
+    /// everything (including the fixed ranges) defaulting to write-back.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void init_guest();
+
+    /// Init Host
+    ///
+    /// Reads the MTRRs from the current CPU.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void init_host();
+
+    /// Is MTRR
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the MSR to check
+    /// @return returns true if the MSR is one of the MTRRs in this set
+    ///
+    bool is_mtrr(uint32_t msr) const noexcept;
+
+    /// Read MSR
+    ///
+    /// @expects is_mtrr(msr)
+    /// @ensures
+    ///
+    /// @param msr the MTRR to read
+    /// @return returns the value of the MTRR
+    ///
+    uint64_t rdmsr(uint32_t msr) const noexcept;
+
+    /// Write MSR
+    ///
+    /// @expects is_mtrr(msr)
+    /// @ensures
+    ///
+    /// @param msr the MTRR to write
+    /// @param val the value to write
+    /// @return returns false if the write would #GP on real hardware (i.e.
+    ///     the MTRR is read-only, or val sets a reserved bit or an invalid
+    ///     memory type), true otherwise
+    ///
+    bool wrmsr(uint32_t msr, uint64_t val) noexcept;
+
+    /// Memory Type
+    ///
+    /// Returns the memory type of a physical address using the same rules
+    /// as the hardware (i.e. fixed ranges first, then the variable ranges
+    /// and then the default type).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param addr the physical address to look up
+    /// @return returns the memory type of addr
+    ///
+    uint64_t memory_type(uintptr_t addr) const noexcept;
+
+    /// Is Uniform
+    ///
+    /// Returns true if every address in [addr, addr + size) has the same
+    /// memory type, meaning the range can be mapped using a single large
+    /// page. This is conservative: a range that overlaps the fixed ranges
+    /// is only uniform if it is a single 4k page.
+    ///
+    /// @expects addr is aligned to size, and size is a power of 2
+    /// @ensures
+    ///
+    /// @param addr the physical address of the start of the range
+    /// @param size the size of the range
+    /// @return returns true if the range has a single memory type
+    ///
+    bool is_uniform(uintptr_t addr, uintptr_t size) const noexcept;
+
+private:
+
+    bool is_valid_type(uint64_t type) const noexcept;
+    uint64_t fixed_type(uintptr_t addr) const noexcept;
+
+private:
+
+    uint64_t m_cap{};
+    uint64_t m_def_type{};
+    uint64_t m_phys_mask{};
+
+    std::array<uint64_t, 11> m_fixed{};
+    std::array<uint64_t, MTRR_MAX_VARIABLE_RANGES> m_physbase{};
+    std::array<uint64_t, MTRR_MAX_VARIABLE_RANGES> m_physmask{};
+
+public:
+
+    /// @cond
+
+    mtrr_ranges(mtrr_ranges &&) = default;
+    mtrr_ranges &operator=(mtrr_ranges &&) = default;
+
+    mtrr_ranges(const mtrr_ranges &) = delete;
+    mtrr_ranges &operator=(const mtrr_ranges &) = delete;
+
+    /// @endcond
+};
+
 class mtrr_handler
 {
 public:
@@ -60,29 +216,14 @@ public:
 
     /// @cond
 
-    bool handle_rdmsr_0x000000FE(
-        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
-    bool handle_wrmsr_0x000000FE(
-        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
-    bool handle_rdmsr_0x00000200(
-        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
-    bool handle_wrmsr_0x00000200(
-        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
-    bool handle_rdmsr_0x00000201(
-        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
-    bool handle_wrmsr_0x00000201(
-        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
-    bool handle_rdmsr_0x000002FF(
-        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
-    bool handle_wrmsr_0x000002FF(
-        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+    bool handle_rdmsr(vcpu_t *vcpu);
+    bool handle_wrmsr(vcpu_t *vcpu);
 
     /// @endcond
 
 private:
 
     vcpu *m_vcpu;
-    uint64_t m_mtrr_def_type{0xC00};
 
 public:
 
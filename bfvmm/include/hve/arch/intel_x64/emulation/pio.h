@@ -0,0 +1,163 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef EMULATION_PIO_INTEL_X64_BOXY_H
+#define EMULATION_PIO_INTEL_X64_BOXY_H
+
+#include <bfvmm/hve/arch/intel_x64/vcpu.h>
+
+#include <array>
+#include <memory>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+class vcpu;
+
+/// Port I/O Bus
+///
+/// The I/O ports of a domain. A device registers a contiguous block of
+/// ports once (per domain, not per vCPU), and a block of ports can be
+/// passed through to the hardware instead. Every other port follows the
+/// default policy of an empty ISA bus: reads return all ones and writes
+/// are ignored.
+///
+/// The owner of each port is stored in a two level table (one byte per
+/// port, allocated 256 ports at a time, and only for the parts of the
+/// port space that are used), so dispatching an I/O instruction exit is
+/// a constant time lookup. Devices and pass-through ranges should be
+/// added before the domain's vCPUs are created.
+///
+class pio_bus
+{
+public:
+
+    using port_type = uint16_t;
+    using handler_delegate_t = delegate<bool(vcpu_t *)>;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    pio_bus() = default;
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~pio_bus() = default;
+
+    /// Add Device
+    ///
+    /// Registers a device that owns [port, port + size). The device's
+    /// handler is given the I/O instruction exit. If it returns false, the
+    /// access follows the default policy. A port can only be owned by one
+    /// device.
+    ///
+    /// @expects size != 0
+    /// @ensures
+    ///
+    /// @param port the first port of the block
+    /// @param size the number of ports in the block
+    /// @param d the handler to call when the guest accesses the block
+    ///
+    void add_device(port_type port, uint32_t size, const handler_delegate_t &d);
+
+    /// Add Pass-Through
+    ///
+    /// Passes [port, port + size) through to the hardware. Throws if a
+    /// device owns any of these ports, unless replace_device is true (e.g.
+    /// a pass-through UART replacing the emulated one). The ports are
+    /// cleared from the I/O bitmaps of each vCPU in setup_vcpu(), so they
+    /// never exit. As a result, this must be called before any vCPU is
+    /// set up.
+    ///
+    /// @expects size != 0
+    /// @ensures
+    ///
+    /// @param port the first port of the block
+    /// @param size the number of ports in the block
+    /// @param replace_device if true, the ports can be owned by a device
+    ///
+    void add_pass_through(
+        port_type port, uint32_t size, bool replace_device = false);
+
+    /// Setup vCPU
+    ///
+    /// Applies the pass-through ranges to a vCPU's I/O bitmaps. The vCPU
+    /// must already be trapping on all I/O accesses.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU to setup
+    ///
+    void setup_vcpu(gsl::not_null<vcpu *> vcpu) const;
+
+    /// Handle
+    ///
+    /// Dispatches an I/O instruction exit to the device that owns the port.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU that generated the exit
+    /// @return returns true if the exit was handled, false otherwise
+    ///
+    bool handle(vcpu_t *vcpu) const;
+
+private:
+
+    uint8_t owner(port_type port) const noexcept;
+    void set_owner(port_type port, uint32_t size, uint8_t owner);
+
+    bool handle_default(vcpu_t *vcpu) const;
+
+private:
+
+    std::array<std::unique_ptr<std::array<uint8_t, 256>>, 256> m_owners{};
+    std::vector<handler_delegate_t> m_devices;
+    std::vector<std::pair<port_type, uint32_t>> m_pass_through;
+
+public:
+
+    /// @cond
+
+    pio_bus(pio_bus &&) = default;
+    pio_bus &operator=(pio_bus &&) = default;
+
+    pio_bus(const pio_bus &) = delete;
+    pio_bus &operator=(const pio_bus &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -0,0 +1,319 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EMULATION_TABLE_INTEL_X64_BOXY_H
+#define EMULATION_TABLE_INTEL_X64_BOXY_H
+
+#include <bfvmm/hve/arch/intel_x64/vcpu.h>
+#include <bfvmm/hve/arch/intel_x64/vmexit/rdmsr.h>
+#include <bfvmm/hve/arch/intel_x64/vmexit/wrmsr.h>
+#include <bfvmm/hve/arch/intel_x64/vmexit/io_instruction.h>
+
+// -----------------------------------------------------------------------------
+// Notes
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Registering an emulator with the base vCPU (e.g. emulate_rdmsr) allocates
+// a delegate for each MSR/port on each vCPU, and we create a lot of
+// vCPUs. Instead, each handler keeps a static, read-only table of the things
+// it emulates (shared by every vCPU) and registers a single exit handler per
+// exit reason that looks up the table. Anything that is not in the table is
+// left to the base vCPU (i.e. the exit handler returns false), so the base
+// behavior is unchanged. CPUID is handled by the domain's cpuid_table.
+//
+// The tables are small, so a linear search is used. The emulators are called
+// with the same info_t structures and follow the same rules (ignore_write
+// and ignore_advance) as the base vCPU's emulators.
+//
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+template<typename T>
+struct msr_entry_t {
+    uint32_t msr;
+    bool (T::*rdmsr)(vcpu_t *, bfvmm::intel_x64::rdmsr_handler::info_t &);
+    bool (T::*wrmsr)(vcpu_t *, bfvmm::intel_x64::wrmsr_handler::info_t &);
+};
+
+template<typename T>
+struct io_entry_t {
+    uint16_t offset;
+    bool (T::*in)(
+        vcpu_t *, bfvmm::intel_x64::io_instruction_handler::info_t &);
+    bool (T::*out)(
+        vcpu_t *, bfvmm::intel_x64::io_instruction_handler::info_t &);
+};
+
+/// Emulate RDMSR
+///
+/// @expects
+/// @ensures
+///
+/// @param self the handler that owns the table
+/// @param vcpu the vcpu that generated the exit
+/// @param table the table of emulated MSRs
+/// @return returns true if the MSR was emulated, false otherwise
+///
+template<typename T, std::size_t N> bool
+emulate_rdmsr(T *self, vcpu_t *vcpu, const msr_entry_t<T> (&table)[N])
+{
+    auto msr = gsl::narrow_cast<uint32_t>(vcpu->rcx());
+
+    for (const auto &entry : table) {
+        if (entry.msr != msr) {
+            continue;
+        }
+
+        bfvmm::intel_x64::rdmsr_handler::info_t info{};
+
+        if (!(self->*entry.rdmsr)(vcpu, info)) {
+            return false;
+        }
+
+        if (!info.ignore_write) {
+            vcpu->set_rax(info.val & 0x00000000FFFFFFFF);
+            vcpu->set_rdx(info.val >> 32);
+        }
+
+        return info.ignore_advance ? true : vcpu->advance();
+    }
+
+    return false;
+}
+
+/// Emulate WRMSR
+///
+/// @expects
+/// @ensures
+///
+/// @param self the handler that owns the table
+/// @param vcpu the vcpu that generated the exit
+/// @param table the table of emulated MSRs
+/// @return returns true if the MSR was emulated, false otherwise
+///
+template<typename T, std::size_t N> bool
+emulate_wrmsr(T *self, vcpu_t *vcpu, const msr_entry_t<T> (&table)[N])
+{
+    auto msr = gsl::narrow_cast<uint32_t>(vcpu->rcx());
+
+    for (const auto &entry : table) {
+        if (entry.msr != msr) {
+            continue;
+        }
+
+        bfvmm::intel_x64::wrmsr_handler::info_t info{};
+
+        info.val =
+            ((vcpu->rdx() & 0x00000000FFFFFFFF) << 32) |
+            ((vcpu->rax() & 0x00000000FFFFFFFF) << 0);
+
+        if (!(self->*entry.wrmsr)(vcpu, info)) {
+            return false;
+        }
+
+        return info.ignore_advance ? true : vcpu->advance();
+    }
+
+    return false;
+}
+
+/// Emulate IO Instruction
+///
+/// Only emulates non-string IO instructions. String instructions are left
+/// to the caller (or the base vCPU).
+///
+/// @expects
+/// @ensures
+///
+/// @param self the handler that owns the table
+/// @param vcpu the vcpu that generated the exit
+/// @param base the port that the table's offsets are relative to
+/// @param table the table of emulated ports
+/// @return returns true if the port was emulated, false otherwise
+///
+template<typename T, std::size_t N> bool
+emulate_io_instruction(
+    T *self, vcpu_t *vcpu, uint16_t base, const io_entry_t<T> (&table)[N])
+{
+    namespace io = vmcs_n::exit_qualification::io_instruction;
+    auto eq = vmcs_n::exit_qualification::get();
+
+    if (io::string_instruction::is_enabled(eq)) {
+        return false;
+    }
+
+    auto port = io::port_number::get(eq);
+
+    for (const auto &entry : table) {
+        if (port != static_cast<uint64_t>(base) + entry.offset) {
+            continue;
+        }
+
+        bfvmm::intel_x64::io_instruction_handler::info_t info{};
+
+        info.port_number = port;
+        info.size_of_access = io::size_of_access::get(eq);
+
+        uint64_t mask = 0x00000000FFFFFFFF;
+        switch (info.size_of_access) {
+            case io::size_of_access::one_byte:
+                mask = 0x00000000000000FF;
+                break;
+
+            case io::size_of_access::two_byte:
+                mask = 0x000000000000FFFF;
+                break;
+
+            default:
+                break;
+        }
+
+        if (io::direction::get(eq) == io::direction::in) {
+            if (!(self->*entry.in)(vcpu, info)) {
+                return false;
+            }
+
+            if (!info.ignore_write) {
+                auto rax = mask == 0x00000000FFFFFFFF ? 0 : vcpu->rax();
+                vcpu->set_rax((rax & ~mask) | (info.val & mask));
+            }
+        }
+        else {
+            info.val = vcpu->rax() & mask;
+
+            if (!(self->*entry.out)(vcpu, info)) {
+                return false;
+            }
+        }
+
+        return info.ignore_advance ? true : vcpu->advance();
+    }
+
+    return false;
+}
+
+// -----------------------------------------------------------------------------
+// String Instructions
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// String instructions use RSI, RDI and RCX at the instruction's address
+// size. Like any other write to a 32-bit register, a 32-bit update clears
+// the upper half of the register, while a 16-bit update leaves the rest of
+// the register alone.
+//
+
+/// Address Register
+///
+/// @expects
+/// @ensures
+///
+/// @param val the value of RSI, RDI or RCX
+/// @param addr_size the address size of the instruction (2, 4 or 8)
+/// @return returns the part of val that the instruction uses
+///
+inline uint64_t
+addr_reg(uint64_t val, uint64_t addr_size) noexcept
+{
+    if (addr_size == 8) {
+        return val;
+    }
+
+    return val & ((1ULL << (addr_size * 8)) - 1);
+}
+
+/// Address Register Add
+///
+/// @expects
+/// @ensures
+///
+/// @param val the value of RSI, RDI or RCX
+/// @param step the amount to add (i.e. ~size + 1 to subtract size)
+/// @param addr_size the address size of the instruction (2, 4 or 8)
+/// @return returns the new value of the register
+///
+inline uint64_t
+addr_add(uint64_t val, uint64_t step, uint64_t addr_size) noexcept
+{
+    if (addr_size >= 4) {
+        return addr_reg(val + step, addr_size);
+    }
+
+    auto mask = addr_reg(~0ULL, addr_size);
+    return (val & ~mask) | ((val + step) & mask);
+}
+
+/// IO String Address Size
+///
+/// Returns the address size of the INS/OUTS instruction that generated the
+/// current exit, as reported in the VM-exit instruction information.
+///
+/// @expects
+/// @ensures
+///
+/// @return returns the address size of the instruction (2, 4 or 8)
+///
+inline uint64_t
+io_string_addr_size()
+{
+    auto info = vmcs_n::vm_exit_instruction_information::get();
+
+    switch ((info >> 7U) & 0x7U) {
+        case 0:
+            return 2;
+
+        case 1:
+            return 4;
+
+        default:
+            return 8;
+    }
+}
+
+/// IO String Segment
+///
+/// @expects
+/// @ensures
+///
+/// @return returns the segment register used by the OUTS instruction that
+///     generated the current exit (0 = ES, 1 = CS, 2 = SS, 3 = DS, 4 = FS,
+///     5 = GS). DS is the default.
+///
+inline uint64_t
+io_string_segment()
+{
+    auto info = vmcs_n::vm_exit_instruction_information::get();
+    return (info >> 15U) & 0x7U;
+}
+
+constexpr const uint64_t io_string_segment_ds{3};
+
+}
+
+#endif
@@ -0,0 +1,193 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef GRANT_TABLE_INTEL_X64_BOXY_H
+#define GRANT_TABLE_INTEL_X64_BOXY_H
+
+#include <bfhypercall.h>
+#include <bfvmm/hve/arch/intel_x64/vcpu.h>
+
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+class vcpu;
+class domain;
+
+/// Grant Table
+///
+/// Every domU has a grant table, which plays two roles. As the granter, it
+/// holds the guest's table of grant entries (see struct boxy_grant_entry),
+/// and remembers which domains have each entry mapped. As the peer, it
+/// remembers which grants of other domains are mapped into the domain's
+/// grant window (see GRANT_MAP_GPA).
+///
+/// Batches are processed one op at a time, but the TLB is only flushed once
+/// per batch: every domain that lost a mapping is marked (see
+/// domain::invalidate_ept()), and a single INVEPT is executed on the current
+/// CPU at the end of the batch. Before the batch returns, it waits until
+/// every vCPU of those domains has flushed or left the guest (see
+/// domain::sync_ept()), and only then clears the mapped field of the
+/// entries, so a granter never reuses a page that a peer can still reach.
+/// All grant tables share a single lock, as an op can touch the tables of
+/// two domains (and a revoke can touch any number of them).
+///
+class grant_table
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param dom the domain that owns the grant table
+    ///
+    explicit grant_table(gsl::not_null<domain *> dom);
+
+    /// Destructor
+    ///
+    /// Revokes every grant of the domain from the domains that have it
+    /// mapped, and releases every grant the domain has mapped.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~grant_table();
+
+    /// Set Table
+    ///
+    /// Registers the guest's table of grant entries. The table cannot be
+    /// replaced while any of its grants are mapped, and cannot live in the
+    /// domain's grant window.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU that registers the table
+    /// @param gva the guest virtual address of the table (0 removes it)
+    /// @param pages the size of the table in pages
+    ///
+    void set_table(vcpu *vcpu, uintptr_t gva, uint64_t pages);
+
+    /// Map
+    ///
+    /// Maps a batch of grants of another domain into this domain's grant
+    /// window (ref, gpa and flags of each op are inputs).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param granter the domain that published the grants
+    /// @param ops the batch of ops
+    /// @return returns true if every op succeeded, false otherwise (the
+    ///     status of each op tells which ones failed)
+    ///
+    bool map(grant_table &granter, gsl::span<struct boxy_grant_op> ops);
+
+    /// Unmap
+    ///
+    /// Unmaps a batch of grants from this domain's grant window (gpa of
+    /// each op is the input). Returns once no CPU can reach the pages.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param ops the batch of ops
+    /// @return returns true if every op succeeded, false otherwise
+    ///
+    bool unmap(gsl::span<struct boxy_grant_op> ops);
+
+    /// Revoke
+    ///
+    /// Removes a batch of this domain's grants from every domain that has
+    /// them mapped (ref of each op is the input). Returns once no CPU can
+    /// reach the pages.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param ops the batch of ops
+    /// @return returns true if every op succeeded, false otherwise
+    ///
+    bool revoke(gsl::span<struct boxy_grant_op> ops);
+
+private:
+
+    struct mapping_t {
+        grant_table *granter;
+        uint64_t ref;
+    };
+
+    struct user_t {
+        grant_table *peer;
+        uintptr_t gpa;
+    };
+
+    struct batch_t {
+        std::unordered_set<domain *> domains;
+        std::vector<std::pair<grant_table *, uint64_t>> refs;
+    };
+
+    void map_one(grant_table &granter, const struct boxy_grant_op &op);
+    void unmap_one(uintptr_t gpa, batch_t &batch);
+    void revoke_one(uint64_t ref, batch_t &batch);
+
+    void release(uintptr_t gpa);
+    static void flush(const batch_t &batch) noexcept;
+
+    struct boxy_grant_entry *entry(uint64_t ref) const noexcept;
+    void set_mapped(uint64_t ref) noexcept;
+
+private:
+
+    domain *m_domain;
+
+    std::vector<bfvmm::x64::unique_map<struct boxy_grant_entry>> m_table{};
+    uint64_t m_entries{};
+
+    std::unordered_map<uintptr_t, mapping_t> m_mapped{};
+    std::unordered_multimap<uint64_t, user_t> m_users{};
+
+public:
+
+    /// @cond
+
+    grant_table(grant_table &&) = delete;
+    grant_table &operator=(grant_table &&) = delete;
+
+    grant_table(const grant_table &) = delete;
+    grant_table &operator=(const grant_table &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
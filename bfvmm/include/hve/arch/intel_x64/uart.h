@@ -73,53 +73,49 @@ public:
     ///
     /// Enables the emulation of the UART. When this is enabled, the UART
     /// becomes active, presenting itself as present and capable of recording
-    /// string data.
+    /// string data. Until then, all reads to this UART from the guest will
+    /// result in zero while all writes to this UART will be ignored.
     ///
-    /// @expects
-    /// @ensures
-    ///
-    /// @param vcpu the vcpu to enable this UART on
-    ///
-    void enable(gsl::not_null<vcpu *> vcpu);
-
-    /// Disable
-    ///
-    /// Disables the UART. All reads to this UART from the guest will result
-    /// in zero while all writes to this UART will be ignored.
-    ///
-    /// @expects
-    /// @ensures
-    ///
-    /// @param vcpu the vcpu to disable this UART on
-    ///
-    void disable(gsl::not_null<vcpu *> vcpu);
-
-    /// Pass-Through
+    /// Note:
     ///
-    /// Instead of emulating the UART, this will cause the UART to be passed
-    /// through to the guest, physically giving the guest the device. Special
-    /// care should be used when enabling this feature as the guest will own
-    /// the device and be externally accessible.
+    /// The UART is added to the domain's pio_bus once (see io_handler), so
+    /// this applies to every vCPU in the domain. To pass the UART through
+    /// to the guest instead, its ports are added to the pio_bus as a
+    /// pass-through range.
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param vcpu the vcpu to pass-through this UART on
-    ///
-    void pass_through(gsl::not_null<vcpu *> vcpu);
+    void enable() noexcept;
 
     /// Dump
     ///
     /// Dumps the contents of the UARTs buffer into a gsl::span so that it
     /// can be given to an app that is providing the UART buffer to the
-    /// user.
+    /// user. Once this has been called, the UART notifies the parent vCPU
+    /// when its buffer stops being empty, crosses UART_NOTIFY_WATERMARK or
+    /// is full.
     ///
     /// @param buffer the buffer to dump the contents of the UART into
     /// @return the number of bytes transferred to the buffer
     ///
     uint64_t dump(const gsl::span<char> &buffer);
 
-private:
+    /// Port
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the base port of this UART
+    ///
+    port_type port() const noexcept
+    { return m_port; }
+
+public:
+
+    /// @cond
+
+    bool io_handler(vcpu_t *vcpu);
 
     bool io_zero_handler(
         vcpu_t *vcpu, bfvmm::intel_x64::io_instruction_handler::info_t &info);
@@ -160,24 +156,41 @@ private:
     bool reg7_out_handler(
         vcpu_t *vcpu, bfvmm::intel_x64::io_instruction_handler::info_t &info);
 
+    /// @endcond
+
+private:
+
+    bool outs_handler(vcpu_t *vcpu);
+
     bool dlab() const
     { return m_line_control_register & 0x80; }
 
+    bool fifo_enabled() const
+    { return m_fifo_control_register & 0x01; }
+
     void write(const char c);
     void write(const char *str);
 
+    std::size_t transmit(const gsl::span<const char> &data, uint64_t &notify);
+
+    void notify(vcpu_t *vcpu, uint64_t event, bool advance);
+
     bool vmcall_dispatch(vcpu *vcpu);
 
 private:
 
     port_type m_port{};
+    bool m_enabled{};
 
     std::mutex m_mutex{};
     std::size_t m_index{};
     std::array<char, UART_MAX_BUFFER> m_buffer{};
+    bool m_consumer{};
 
     data_type m_baud_rate_l{};
     data_type m_baud_rate_h{};
+    data_type m_interrupt_enable_register{};
+    data_type m_fifo_control_register{};
     data_type m_line_control_register{};
 
 };
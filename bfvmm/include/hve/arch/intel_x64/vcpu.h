@@ -27,6 +27,7 @@
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
 
 #include "domain.h"
+#include "vpid.h"
 
 #include "vmexit/exception.h"
 #include "vmexit/external_interrupt.h"
@@ -36,17 +37,25 @@
 #include "vmexit/nmi_window.h"
 #include "vmexit/preemption_timer.h"
 #include "vmexit/vmcall.h"
+#include "vmexit/xsetbv.h"
 
+#include "vmcall/console_op.h"
 #include "vmcall/domain_op.h"
+#include "vmcall/grant_op.h"
 #include "vmcall/run_op.h"
 #include "vmcall/vcpu_op.h"
 
 #include "emulation/cpuid.h"
+#include "emulation/mmio.h"
 #include "emulation/mtrr.h"
 #include "emulation/x2apic.h"
 
+#include "virt/pmu.h"
 #include "virt/vclock.h"
 #include "virt/virq.h"
+#include "virt/virtio_blk.h"
+#include "virt/virtio_net.h"
+#include "virt/virtio_vsock.h"
 
 //------------------------------------------------------------------------------
 // Definition
@@ -114,6 +123,15 @@ public:
     ///
     VIRTUAL domain::domainid_type domid() const noexcept;
 
+    /// Domain
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the domain this vCPU belongs to
+    ///
+    VIRTUAL domain *dom() const noexcept;
+
     //--------------------------------------------------------------------------
     // VMCall
     //--------------------------------------------------------------------------
@@ -227,14 +245,14 @@ public:
     /// Return (Yield)
     ///
     /// Return to the parent vCPU (i.e. resume the parent), and tell the parent
-    /// to put the child vCPU asleep for the specified number of nanoseconds
+    /// to put the child vCPU asleep until the specified absolute TSC
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param nsec the number of nanoseconds to sleep
+    /// @param tsc the TSC at which the child vCPU should wake up
     ///
-    VIRTUAL void return_yield(uint64_t nsec);
+    VIRTUAL void return_yield(uint64_t tsc);
 
     /// Return (Set Wall Clock)
     ///
@@ -246,6 +264,19 @@ public:
     ///
     VIRTUAL void return_set_wallclock();
 
+    /// Return (Notify)
+    ///
+    /// Return to the parent vCPU (i.e. resume the parent), and tell the parent
+    /// that the guest has signaled an event (e.g. the console ring has data)
+    /// and then resume back to the guest
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param event the boxy_notify__ event being signaled
+    ///
+    VIRTUAL void return_notify(uint64_t event);
+
     //--------------------------------------------------------------------------
     // Control
     //--------------------------------------------------------------------------
@@ -307,6 +338,30 @@ public:
     ///
     VIRTUAL void inject_virtual_interrupt(uint64_t vector);
 
+    /// Queue vIRQs
+    ///
+    /// Queues a batch of virtual IRQs. If the guest has enabled vIRQ
+    /// batching, a single Hypervisor Callback Vector IRQ is used, and the
+    /// guest drains the batch using get_next_virq.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void queue_virtual_interrupts(
+        const gsl::span<const uint64_t> &vectors);
+
+    /// Inject vIRQs
+    ///
+    /// Injects a batch of virtual IRQs. If the guest has enabled vIRQ
+    /// batching, a single Hypervisor Callback Vector IRQ is used, and the
+    /// guest drains the batch using get_next_virq.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void inject_virtual_interrupts(
+        const gsl::span<const uint64_t> &vectors);
+
     //--------------------------------------------------------------------------
     // Virtual Clock
     //--------------------------------------------------------------------------
@@ -364,6 +419,99 @@ public:
     ///
     VIRTUAL std::pair<struct timespec, uint64_t> get_host_wallclock() const;
 
+    /// TSC Frequency (kHz)
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the TSC's frequency (kHz) as calibrated by this vCPU
+    ///
+    VIRTUAL uint64_t tsc_freq_khz() const noexcept;
+
+    /// Begin Steal Time
+    ///
+    /// Marks the point at which this vCPU is runnable but is no longer
+    /// executing (i.e. it was handed back to its parent).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param tsc the TSC at which this vCPU is runnable
+    /// @param preempted true if the vCPU was preempted
+    ///
+    VIRTUAL void begin_steal_time(uint64_t tsc, bool preempted) noexcept;
+
+    /// End Steal Time
+    ///
+    /// Publishes the steal time accumulated since begin_steal_time() to the
+    /// guest (if the guest registered a steal time structure).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void end_steal_time() noexcept;
+
+    //--------------------------------------------------------------------------
+    // PMU
+    //--------------------------------------------------------------------------
+
+    /// Switch PMU
+    ///
+    /// Makes the provided child vCPU's PMU state the state that is in
+    /// hardware. This should only be called on a dom0 vCPU.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param guest the child vCPU that is about to be resumed
+    ///
+    VIRTUAL void switch_pmu(gsl::not_null<vcpu *> guest);
+
+    /// Save PMU
+    ///
+    /// Saves this vCPU's PMU state from hardware.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void save_pmu();
+
+    /// Load PMU
+    ///
+    /// Loads this vCPU's PMU state into hardware.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void load_pmu();
+
+    /// Is PMU Active
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if this vCPU's guest has ever enabled a PMU
+    ///     counter
+    ///
+    VIRTUAL bool is_pmu_active() const noexcept;
+
+    //--------------------------------------------------------------------------
+    // VPID
+    //--------------------------------------------------------------------------
+
+    /// Flush VPID
+    ///
+    /// Flushes the TLB entries tagged with this vCPU's VPID on the current
+    /// CPU. This has to be done each time the vCPU runs on a different CPU
+    /// than the last time it ran, as the entries that CPU holds for this
+    /// VPID might be stale (or might belong to a vCPU that used the VPID
+    /// before this vCPU).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void flush_vpid();
+
     //--------------------------------------------------------------------------
     // Fault
     //--------------------------------------------------------------------------
@@ -380,6 +528,8 @@ public:
 
 private:
 
+    void setup_vpid();
+
     void write_dom0_guest_state(domain *domain);
     void write_domU_guest_state(domain *domain);
 
@@ -393,6 +543,7 @@ private:
 
     bool m_killed{};
     vcpu *m_parent_vcpu{};
+    uint16_t m_vpid{};
 
 private:
 
@@ -404,17 +555,25 @@ private:
     nmi_window_handler m_nmi_window_handler;
     preemption_timer_handler m_preemption_timer_handler;
     vmcall_handler m_vmcall_handler;
+    xsetbv_handler m_xsetbv_handler;
 
     run_op_handler m_run_op_handler;
+    console_op_handler m_console_op_handler;
     domain_op_handler m_domain_op_handler;
+    grant_op_handler m_grant_op_handler;
     vcpu_op_handler m_vcpu_op_handler;
 
     cpuid_handler m_cpuid_handler;
+    mmio_handler m_mmio_handler;
     mtrr_handler m_mtrr_handler;
     x2apic_handler m_x2apic_handler;
 
+    pmu_handler m_pmu_handler;
     vclock_handler m_vclock_handler;
     virq_handler m_virq_handler;
+    virtio_blk_handler m_virtio_blk_handler;
+    virtio_net_handler m_virtio_net_handler;
+    virtio_vsock_handler m_virtio_vsock_handler;
 };
 
 }
@@ -0,0 +1,187 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VIRT_NET_SWITCH_INTEL_X64_BOXY_H
+#define VIRT_NET_SWITCH_INTEL_X64_BOXY_H
+
+#include <bfhypercall.h>
+
+#include "virtio_mmio.h"
+
+#include <array>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+
+// -----------------------------------------------------------------------------
+// Defines
+// -----------------------------------------------------------------------------
+
+/// Net Switch Max MACs
+///
+/// The number of MACs the net switch can learn. Once the table is full,
+/// frames sent to a MAC that has not been learned are flooded.
+///
+#ifndef NET_SWITCH_MAX_MACS
+#define NET_SWITCH_MAX_MACS 1024
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+class vcpu;
+class virtio_net;
+
+/// Net Switch
+///
+/// A learning L2 switch that connects the virtio-net devices of domUs
+/// running on the same host. A device that is attached to the switch (a
+/// port) has no backend in bfexec. Instead, the frames its guest transmits
+/// are copied straight from the guest's transmit buffers into the receive
+/// buffers of the destination guest (or guests), without going through
+/// dom0.
+///
+/// The source MAC of every frame is learned. Frames sent to a MAC that
+/// has been learned are only delivered to the port it was learned on,
+/// while all other frames (broadcast, multicast and unknown unicast) are
+/// flooded to every other port. A frame is dropped (and counted as such
+/// by the destination) if the destination guest has no receive buffers.
+///
+class net_switch
+{
+public:
+
+    /// Frame
+    ///
+    /// A frame that is being forwarded. The chain is the transmit chain in
+    /// the source guest, and hdr holds the start of the frame (the
+    /// virtio_net_hdr_v1, followed by the destination and source MACs).
+    /// A frame is only valid as long as the source device has not been
+    /// reset (i.e. generation has not changed).
+    ///
+    struct frame_t {
+        uint16_t head;
+        uint64_t len;
+        uint64_t generation;
+        std::vector<virtq_desc_t> chain;
+        std::array<uint8_t, VIRTIO_NET_HDR_SIZE + 12> hdr;
+    };
+
+    /// Get Singleton Instance
+    ///
+    /// @expects none
+    /// @ensures ret != nullptr
+    ///
+    /// @return a singleton instance of net_switch
+    ///
+    static net_switch *instance() noexcept;
+
+    /// Attach
+    ///
+    /// Adds a device to the switch. The id has to be unique, as it is used
+    /// by bfexec to tell which domain to wake up.
+    ///
+    /// @expects port != nullptr
+    /// @ensures
+    ///
+    /// @param port the device to add
+    /// @param id the id of the port
+    ///
+    void attach(virtio_net *port, uint64_t id);
+
+    /// Detach
+    ///
+    /// Removes a device from the switch, along with every MAC that was
+    /// learned on it. Once this returns, the switch no longer touches the
+    /// device.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param port the device to remove
+    ///
+    void detach(virtio_net *port) noexcept;
+
+    /// Forward
+    ///
+    /// Forwards every frame the guest of the provided port has made
+    /// available on its transmit queue. This must be called from one of
+    /// the port's vCPUs, without holding the port's lock.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU of the source port's domain
+    /// @param src the source port
+    /// @return returns true if at least one frame was forwarded or dropped
+    ///     (i.e. the source port's used ring has to be published)
+    ///
+    bool forward(vcpu *vcpu, virtio_net *src);
+
+private:
+
+    net_switch() = default;
+
+    void learn(virtio_net *port) noexcept;
+    void deliver(vcpu *vcpu, virtio_net *src, virtio_net *dst);
+
+private:
+
+    std::mutex m_mutex;
+
+    std::vector<virtio_net *> m_ports;
+    std::unordered_map<uint64_t, virtio_net *> m_macs;
+
+    frame_t m_frame{};
+
+public:
+
+    /// @cond
+
+    net_switch(net_switch &&) = delete;
+    net_switch &operator=(net_switch &&) = delete;
+
+    net_switch(const net_switch &) = delete;
+    net_switch &operator=(const net_switch &) = delete;
+
+    /// @endcond
+};
+
+}
+
+/// Net Switch Macro
+///
+/// The following macro can be used to quickly call the net switch.
+/// This call is guaranteed to not be NULL
+///
+/// @expects none
+/// @ensures ret != nullptr
+///
+#define g_net_switch                                                            \
+    boxy::intel_x64::net_switch::instance()
+
+#endif
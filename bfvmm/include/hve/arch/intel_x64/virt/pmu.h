@@ -0,0 +1,197 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef VIRT_PMU_INTEL_X64_BOXY_H
+#define VIRT_PMU_INTEL_X64_BOXY_H
+
+#include <bfvmm/hve/arch/intel_x64/vcpu.h>
+
+#include <array>
+
+// -----------------------------------------------------------------------------
+// Defines
+// -----------------------------------------------------------------------------
+
+#ifndef PMU_MAX_GP_COUNTERS
+#define PMU_MAX_GP_COUNTERS 8
+#endif
+
+#ifndef PMU_MAX_FIXED_COUNTERS
+#define PMU_MAX_FIXED_COUNTERS 3
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+class vcpu;
+
+class pmu_handler
+{
+public:
+
+    /// Constructor
+    ///
+    /// The number of counters a domU vCPU gets is taken from CPUID leaf 0xA
+    /// in the domain's CPUID table (and is limited to what the host has),
+    /// so it can be configured using domain_op__set_cpuid_leaf.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this handler
+    ///
+    pmu_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~pmu_handler() = default;
+
+    /// Switch To
+    ///
+    /// Called on a dom0 vCPU's handler before one of its children is
+    /// resumed. If the child's PMU state is not already in hardware, the
+    /// current state (dom0's or another child's) is saved and the child's
+    /// is loaded. The dom0 vCPU reloads its own state the next time it is
+    /// resumed, so the PMU is only switched on a world switch. Nothing is
+    /// switched for a child that has never enabled a counter, unless dom0
+    /// has counters running.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param guest the child vCPU that is about to be resumed
+    ///
+    VIRTUAL void switch_to(gsl::not_null<vcpu *> guest);
+
+    /// Save
+    ///
+    /// Saves this vCPU's PMU state from hardware.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void save();
+
+    /// Load
+    ///
+    /// Loads this vCPU's PMU state into hardware.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void load();
+
+    /// Is Active
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the guest has ever enabled a counter, in
+    ///     which case its state is in hardware while it runs
+    ///
+    VIRTUAL bool is_active() const noexcept;
+
+    /// Is RDPMC Safe
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the guest can execute RDPMC without
+    ///     exiting (i.e. it owns every counter in hardware while it runs,
+    ///     which is only the case once it is active)
+    ///
+    VIRTUAL bool is_rdpmc_safe() const noexcept;
+
+public:
+
+    /// @cond
+
+    bool handle_rdmsr(vcpu_t *vcpu);
+    bool handle_wrmsr(vcpu_t *vcpu);
+    bool handle_rdpmc(vcpu_t *vcpu);
+    bool handle_nmi(vcpu_t *vcpu);
+
+    void resume_delegate_dom0(vcpu_t *vcpu);
+    void resume_delegate_domU(vcpu_t *vcpu);
+
+    /// @endcond
+
+private:
+
+    void setup_dom0();
+    void setup_domU();
+
+    bool rdmsr(uint32_t msr, uint64_t &val);
+    bool wrmsr(uint32_t msr, uint64_t val);
+
+    void activate();
+
+    uint64_t global_ctrl_mask() const noexcept;
+    uint64_t pmi_mask() const noexcept;
+
+private:
+
+    vcpu *m_vcpu;
+    vcpu *m_guest{};
+
+    uint32_t m_version{};
+    uint32_t m_num_gp{};
+    uint32_t m_num_fixed{};
+    uint64_t m_gp_width_mask{};
+    uint64_t m_fixed_width_mask{};
+    bool m_full_width{};
+    bool m_rdpmc_safe{};
+    bool m_pmi{};
+    bool m_active{};
+
+    std::array<uint64_t, PMU_MAX_GP_COUNTERS> m_evtsel{};
+    std::array<uint64_t, PMU_MAX_GP_COUNTERS> m_pmc{};
+    std::array<uint64_t, PMU_MAX_FIXED_COUNTERS> m_fixed_ctr{};
+
+    uint64_t m_fixed_ctr_ctrl{};
+    uint64_t m_global_ctrl{};
+    uint64_t m_global_status{};
+    bool m_pending_pmi{};
+
+public:
+
+    /// @cond
+
+    pmu_handler(pmu_handler &&) = default;
+    pmu_handler &operator=(pmu_handler &&) = default;
+
+    pmu_handler(const pmu_handler &) = delete;
+    pmu_handler &operator=(const pmu_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
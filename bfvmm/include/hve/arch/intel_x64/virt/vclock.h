@@ -23,6 +23,19 @@
 #define VIRT_VCLOCK_INTEL_X64_BOXY_H
 
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
+#include <bfvmm/hve/arch/intel_x64/vmexit/rdmsr.h>
+#include <bfvmm/hve/arch/intel_x64/vmexit/wrmsr.h>
+
+#include <array>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// Defines
+// -----------------------------------------------------------------------------
+
+#ifndef VCLOCK_MAX_TIMERS
+#define VCLOCK_MAX_TIMERS 16
+#endif
 
 // -----------------------------------------------------------------------------
 // Definitions
@@ -47,6 +60,17 @@ public:
     vclock_handler(
         gsl::not_null<vcpu *> vcpu);
 
+    /// Timer
+    ///
+    /// An outstanding guest timer. The tsc is the absolute (host) TSC at
+    /// which the timer expires and the virq is the vIRQ that is delivered
+    /// when it does. A vIRQ can only have one outstanding timer.
+    ///
+    struct timer_t {
+        uint64_t tsc;
+        uint64_t virq;
+    };
+
     //--------------------------------------------------------------------------
     // Host Time
     //--------------------------------------------------------------------------
@@ -184,6 +208,37 @@ public:
     ///
     VIRTUAL uint64_t nsec_to_tsc(uint64_t nsec) const noexcept;
 
+    //--------------------------------------------------------------------------
+    // Steal Time
+    //--------------------------------------------------------------------------
+
+    /// Begin Steal Time
+    ///
+    /// Called when the vCPU is handed back to its parent. Any time that
+    /// elapses between the provided TSC and the next call to end_steal_time()
+    /// is time that the vCPU was runnable, but was not executing.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param tsc the TSC at which the vCPU is runnable again (i.e. now, or
+    ///     the next clock event if the vCPU is yielding)
+    /// @param preempted true if the vCPU was preempted (i.e. it did not
+    ///     yield)
+    ///
+    VIRTUAL void begin_steal_time(uint64_t tsc, bool preempted) noexcept;
+
+    /// End Steal Time
+    ///
+    /// Called by the parent when the vCPU is about to execute again. The
+    /// elapsed steal time (if any) is added to the guest's steal time
+    /// structure.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void end_steal_time() noexcept;
+
 public:
 
     /// @cond
@@ -191,8 +246,35 @@ public:
     bool handle_yield(vcpu *vcpu);
     bool handle_preemption_timer(vcpu *vcpu);
 
+    bool handle_rdmsr(vcpu_t *vcpu);
+    bool handle_wrmsr(vcpu_t *vcpu);
+
+    bool handle_rdmsr_0x000006E0(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x000006E0(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+    bool handle_rdmsr_0x00000832(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x00000832(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+    bool handle_rdmsr_0x00000838(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x00000838(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+    bool handle_rdmsr_0x00000839(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x00000839(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+    bool handle_rdmsr_0x0000083E(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x0000083E(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+
     void vclock_op__get_tsc_freq_khz(vcpu *vcpu);
     void vclock_op__set_next_event(vcpu *vcpu);
+    void vclock_op__set_timer(vcpu *vcpu);
+    void vclock_op__cancel_timer(vcpu *vcpu);
+    void vclock_op__set_steal_time_gpa(vcpu *vcpu);
     void vclock_op__reset_host_wallclock(vcpu *vcpu);
     void vclock_op__set_host_wallclock_rtc(vcpu *vcpu);
     void vclock_op__set_host_wallclock_tsc(vcpu *vcpu);
@@ -212,8 +294,21 @@ private:
     void setup_dom0();
     void setup_domU();
 
-    void queue_vclock_event();
-    void inject_vclock_event();
+    void arm_timer(uint64_t virq, uint64_t tsc);
+    void cancel_timer(uint64_t virq);
+
+    std::size_t pop_timers(
+        uint64_t tsc, std::array<uint64_t, VCLOCK_MAX_TIMERS> &virqs);
+
+    void queue_expired_timers(uint64_t tsc);
+    void inject_next_timers();
+
+    void queue_tsc_deadline_event();
+    void inject_tsc_deadline_event();
+
+    uint64_t next_event_tsc() const noexcept;
+    void queue_expired_events(uint64_t tsc);
+    void yield_until(vcpu *vcpu, uint64_t next_event);
 
 private:
 
@@ -221,7 +316,14 @@ private:
 
     uint64_t m_tsc_freq_khz{};
     uint64_t m_pet_decrement{};
-    uint64_t m_next_event_tsc{};
+    std::vector<timer_t> m_timers;
+    uint64_t m_tsc_deadline{};
+
+    uint64_t m_steal_tsc{};
+    bfvmm::x64::unique_map<struct boxy_steal_time> m_steal_time{};
+
+    uint64_t m_0x00000832{1U << 16U};
+    uint64_t m_0x0000083E{0};
 
     uint64_t m_host_wc_tsc{};
     struct timespec m_host_wc_rtc{};
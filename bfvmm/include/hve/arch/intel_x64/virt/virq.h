@@ -83,12 +83,40 @@ public:
     ///
     void inject_virtual_interrupt(uint64_t vector);
 
+    /// Queue vIRQs
+    ///
+    /// Queues a batch of virtual IRQs to be delivered to a guest VM. If the
+    /// guest has enabled vIRQ batching, the Hypervisor Callback Vector IRQ
+    /// is only queued once for the entire batch, and the guest calls
+    /// get_next_virq until it fails to drain all of the vIRQs. Otherwise,
+    /// this is the same as calling queue_virtual_interrupt() for each vIRQ.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vectors the vIRQs to queue
+    ///
+    void queue_virtual_interrupts(const gsl::span<const uint64_t> &vectors);
+
+    /// Inject vIRQs
+    ///
+    /// Same as queue_virtual_interrupts(), but injects the Hypervisor
+    /// Callback Vector IRQ instead of queuing it.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vectors the vIRQs to inject
+    ///
+    void inject_virtual_interrupts(const gsl::span<const uint64_t> &vectors);
+
 public:
 
     /// @cond
 
     void virq_op__set_hypervisor_callback_vector(vcpu *vcpu);
     void virq_op__get_next_virq(vcpu *vcpu);
+    void virq_op__enable_virq_batching(vcpu *vcpu);
 
     bool dispatch(vcpu *vcpu);
 
@@ -99,6 +127,7 @@ private:
     vcpu *m_vcpu;
 
     uint64_t m_hypervisor_callback_vector{};
+    bool m_batching{};
     bfvmm::intel_x64::interrupt_queue m_interrupt_queue;
 
 public:
@@ -0,0 +1,207 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VIRT_VIRTIO_BLK_INTEL_X64_BOXY_H
+#define VIRT_VIRTIO_BLK_INTEL_X64_BOXY_H
+
+#include <bfhypercall.h>
+#include <bfvmm/hve/arch/intel_x64/vcpu.h>
+
+#include "virtio_mmio.h"
+
+#include <array>
+#include <atomic>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// Defines
+// -----------------------------------------------------------------------------
+
+#ifndef VIRTIO_BLK_QUEUE_SIZE
+#define VIRTIO_BLK_QUEUE_SIZE 128
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+class vcpu;
+
+/// Virtio Block Device
+///
+/// A virtio-mmio block device with a single virtqueue. The registers and
+/// the virtqueue live in the VMM (the virtqueue itself is in guest RAM),
+/// while the disk is provided by bfexec through a
+/// boxy_virtio_blk_ring. A notify from the guest moves every available
+/// request into a slot of the ring, and bfexec is told about the whole
+/// batch once. Completions are moved back into the used ring (and a single
+/// vIRQ is queued) the next time one of the domain's vCPUs is resumed.
+///
+class virtio_blk : public virtio_mmio
+{
+public:
+
+    using ring_type = struct boxy_virtio_blk_ring;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param ring the ring shared with bfexec (mapped into the VMM)
+    ///
+    explicit virtio_blk(bfvmm::x64::unique_map<ring_type> &&ring);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~virtio_blk() override = default;
+
+    /// Resume
+    ///
+    /// Completes any requests that bfexec has finished, and restarts the
+    /// queue if it was stalled waiting for a free slot. This is called
+    /// every time a vCPU of the domain is resumed, so if there is nothing
+    /// to do, it does not take the lock.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU that is being resumed
+    /// @return returns true if bfexec has new requests and needs to be
+    ///     notified, false otherwise
+    ///
+    bool resume(vcpu *vcpu);
+
+protected:
+
+    /// @cond
+
+    uint64_t read_config(
+        uint64_t offset, uint64_t size) const noexcept override;
+
+    void queue_notify(vcpu *vcpu, std::size_t index) override;
+    void device_status(uint32_t status) noexcept override;
+
+    /// @endcond
+
+private:
+
+    struct slot_t {
+        bool busy;
+        bool orphaned;
+        uint16_t head;
+        uint32_t type;
+        uint64_t len;
+        uintptr_t status;
+        std::vector<std::pair<uintptr_t, uint32_t>> segs;
+    };
+
+    void process_queue(vcpu *vcpu);
+    bool process_request(vcpu *vcpu, uint16_t head);
+    void process_completions(vcpu *vcpu);
+
+    void complete(
+        vcpu *vcpu, uint16_t head, uintptr_t status, uint8_t val,
+        uint32_t len);
+
+private:
+
+    bfvmm::x64::unique_map<ring_type> m_ring;
+    uint64_t m_capacity{};
+
+    uint64_t m_req_prod{};
+    bool m_stalled{};
+
+    std::array<slot_t, VIRTIO_BLK_RING_SLOTS> m_slots{};
+    std::vector<uint64_t> m_free_slots;
+    std::vector<virtq_desc_t> m_chain;
+
+    std::atomic<bool> m_kick{};
+
+public:
+
+    /// @cond
+
+    virtio_blk(virtio_blk &&) = delete;
+    virtio_blk &operator=(virtio_blk &&) = delete;
+
+    virtio_blk(const virtio_blk &) = delete;
+    virtio_blk &operator=(const virtio_blk &) = delete;
+
+    /// @endcond
+};
+
+class virtio_blk_handler
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this handler
+    ///
+    virtio_blk_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~virtio_blk_handler() = default;
+
+public:
+
+    /// @cond
+
+    void resume_delegate(vcpu_t *vcpu);
+
+    /// @endcond
+
+private:
+
+    vcpu *m_vcpu;
+
+public:
+
+    /// @cond
+
+    virtio_blk_handler(virtio_blk_handler &&) = default;
+    virtio_blk_handler &operator=(virtio_blk_handler &&) = default;
+
+    virtio_blk_handler(const virtio_blk_handler &) = delete;
+    virtio_blk_handler &operator=(const virtio_blk_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -0,0 +1,655 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VIRT_VIRTIO_MMIO_INTEL_X64_BOXY_H
+#define VIRT_VIRTIO_MMIO_INTEL_X64_BOXY_H
+
+#include <bfvmm/hve/arch/intel_x64/vcpu.h>
+
+#include "../emulation/mmio.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+class vcpu;
+
+constexpr const uint64_t virtio_ring_f_event_idx{1ULL << 29};
+constexpr const uint64_t virtio_f_version_1{1ULL << 32};
+
+constexpr const uint16_t virtq_desc_f_next{0x1};
+constexpr const uint16_t virtq_desc_f_write{0x2};
+
+/// Virtqueue Descriptor
+///
+struct virtq_desc_t {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+/// Virtqueue
+///
+/// A split virtqueue in guest RAM. The queue is mapped into the VMM once,
+/// when the guest makes it ready, instead of on every notify. Everything
+/// that the guest can change is read once (using a volatile access) and
+/// then validated, so a misbehaving guest can only hurt itself.
+///
+/// The used ring's index is not published by push(). Instead, the device
+/// pushes as many buffers as it has, and then publishes them all at once
+/// with publish(), which also tells the device if the guest wants to be
+/// interrupted (honoring VIRTIO_RING_F_EVENT_IDX if it was negotiated).
+///
+class virtq
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param num_max the max number of entries the guest can ask for
+    ///
+    explicit virtq(uint32_t num_max) noexcept;
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~virtq() = default;
+
+    /// Setup
+    ///
+    /// Maps the queue using the addresses that the guest programmed, and
+    /// marks the queue as ready. Throws if the queue cannot be mapped.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU used to map the queue
+    /// @param event_idx true if VIRTIO_RING_F_EVENT_IDX was negotiated
+    ///
+    void setup(vcpu_t *vcpu, bool event_idx);
+
+    /// Reset
+    ///
+    /// Unmaps the queue and restores the queue's registers to their
+    /// initial values.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void reset() noexcept;
+
+    /// Ready
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the queue has been set up by the guest
+    ///
+    bool ready() const noexcept;
+
+    /// Empty
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the guest has not made any new buffers
+    ///     available
+    ///
+    bool empty() const noexcept;
+
+    /// Pop
+    ///
+    /// Removes the next available descriptor chain from the avail ring.
+    /// Throws if the avail ring is corrupt.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param head returns the head of the descriptor chain
+    /// @return returns false if the avail ring is empty, true otherwise
+    ///
+    bool pop(uint16_t &head);
+
+    /// Chain
+    ///
+    /// Walks the descriptor chain that starts at head. Indirect
+    /// descriptors are not supported (and not offered).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param head the head of the descriptor chain
+    /// @param chain returns the descriptors in the chain
+    /// @return returns false if the chain is malformed, true otherwise
+    ///
+    bool chain(uint16_t head, std::vector<virtq_desc_t> &chain) const;
+
+    /// Push
+    ///
+    /// Adds a used buffer to the used ring. The buffer is not seen by the
+    /// guest until publish() is called.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param head the head of the descriptor chain that was used
+    /// @param len the number of bytes written to the chain
+    ///
+    void push(uint16_t head, uint32_t len) noexcept;
+
+    /// Publish
+    ///
+    /// Publishes every buffer that was pushed since the last publish.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the guest should be interrupted
+    ///
+    bool publish() noexcept;
+
+    /// Enable Notify
+    ///
+    /// Asks the guest to notify the device the next time it makes a buffer
+    /// available. The caller should check empty() afterwards, as the guest
+    /// might have made a buffer available before it saw the request.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable_notify() noexcept;
+
+    /// Disable Notify
+    ///
+    /// Tells the guest that it does not need to notify the device when it
+    /// makes a buffer available (e.g. the device is stalled and will look
+    /// at the queue on its own once it can make progress).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_notify() noexcept;
+
+private:
+
+    volatile uint16_t *avail(std::size_t i) const noexcept;
+    volatile uint16_t *used16(std::size_t i) const noexcept;
+    volatile uint32_t *used32(std::size_t i) const noexcept;
+
+private:
+
+    uint32_t m_num_max;
+
+    uint32_t m_num;
+    uint32_t m_ready{};
+    uint64_t m_desc_gpa{};
+    uint64_t m_driver_gpa{};
+    uint64_t m_device_gpa{};
+
+    bfvmm::x64::unique_map<uint64_t> m_desc{};
+    bfvmm::x64::unique_map<uint16_t> m_avail{};
+    bfvmm::x64::unique_map<uint16_t> m_used{};
+
+    bool m_event_idx{};
+    uint16_t m_last_avail{};
+    uint16_t m_used_idx{};
+    uint16_t m_used_published{};
+
+    friend class virtio_mmio;
+
+public:
+
+    /// @cond
+
+    virtq(virtq &&) = default;
+    virtq &operator=(virtq &&) = default;
+
+    virtq(const virtq &) = delete;
+    virtq &operator=(const virtq &) = delete;
+
+    /// @endcond
+};
+
+/// Virtio MMIO Device
+///
+/// The virtio-mmio (version 2) transport. This emulates the registers that
+/// are common to every virtio-mmio device (feature negotiation, status,
+/// the queues and the interrupt), and leaves the config space, the queue
+/// notifications and the device's own state to the device.
+///
+/// The registers are protected by m_mutex, which devices also hold while
+/// they work on their queues (e.g. when a backend completes a request).
+///
+class virtio_mmio
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param device_id the virtio device id
+    /// @param features the features that the device offers
+    /// @param queues the number of virtqueues the device has
+    /// @param queue_size the max size of each virtqueue
+    /// @param virq the vIRQ that is used to interrupt the guest
+    ///
+    virtio_mmio(
+        uint32_t device_id, uint64_t features, std::size_t queues,
+        uint32_t queue_size, uint64_t virq);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    virtual ~virtio_mmio() = default;
+
+public:
+
+    /// @cond
+
+    bool mmio_read(vcpu *vcpu, mmio_bus::info_t &info);
+    bool mmio_write(vcpu *vcpu, mmio_bus::info_t &info);
+
+    /// @endcond
+
+protected:
+
+    /// Read Config
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param offset the offset into the device's config space
+    /// @param size the size of the read in bytes
+    /// @return returns the value read from the config space
+    ///
+    virtual uint64_t read_config(
+        uint64_t offset, uint64_t size) const noexcept = 0;
+
+    /// Queue Notify
+    ///
+    /// Called (with m_mutex held) when the guest notifies a queue that is
+    /// ready.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU that performed the notify
+    /// @param index the queue that was notified
+    ///
+    virtual void queue_notify(vcpu *vcpu, std::size_t index) = 0;
+
+    /// Device Status
+    ///
+    /// Called (with m_mutex held) when the guest changes the device's
+    /// status. A status of 0 means the device was reset, in which case the
+    /// queues have already been reset.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param status the new device status
+    ///
+    virtual void device_status(uint32_t status) noexcept = 0;
+
+    /// Negotiated
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param feature the feature to check (e.g. virtio_f_version_1)
+    /// @return returns true if the guest accepted the feature
+    ///
+    bool negotiated(uint64_t feature) const noexcept;
+
+    /// Features
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the features that the guest accepted
+    ///
+    uint64_t features() const noexcept;
+
+    /// Queue
+    ///
+    /// @expects index < number of queues
+    /// @ensures
+    ///
+    /// @param index the queue to return
+    /// @return returns the requested queue
+    ///
+    virtq &queue(std::size_t index);
+
+    /// Needs Reset
+    ///
+    /// Tells the guest that the device hit an error that it cannot recover
+    /// from without a reset (e.g. a corrupt queue).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void needs_reset() noexcept;
+
+    /// Notify Guest
+    ///
+    /// Publishes the used buffers of every queue, and queues the device's
+    /// vIRQ if the guest wants to be interrupted. A vIRQ is only queued if
+    /// the guest has acknowledged the last one. The guest acknowledges the
+    /// interrupt before it looks at the used rings, so anything published
+    /// after the acknowledgement gets its own vIRQ.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU to queue the vIRQ on
+    ///
+    void notify_guest(vcpu *vcpu);
+
+protected:
+
+    mutable std::mutex m_mutex;
+
+private:
+
+    void reset() noexcept;
+
+private:
+
+    uint32_t m_device_id;
+    uint64_t m_device_features;
+    uint64_t m_virq;
+
+    uint32_t m_status{};
+    uint32_t m_device_features_sel{};
+    uint32_t m_driver_features_sel{};
+    uint64_t m_driver_features{};
+    uint32_t m_interrupt_status{};
+    uint32_t m_config_generation{};
+
+    uint32_t m_queue_sel{};
+    std::vector<virtq> m_queues;
+
+public:
+
+    /// @cond
+
+    virtio_mmio(virtio_mmio &&) = delete;
+    virtio_mmio &operator=(virtio_mmio &&) = delete;
+
+    virtio_mmio(const virtio_mmio &) = delete;
+    virtio_mmio &operator=(const virtio_mmio &) = delete;
+
+    /// @endcond
+};
+
+/// Bounce Ring
+///
+/// The parts of a ring shared with bfexec (e.g. boxy_virtio_net_ring) that
+/// virtio_bounce uses. Each half of the ring has a producer and consumer
+/// index, and a fixed number of slots of a fixed size, along with the
+/// length of what is in each slot.
+///
+struct bounce_ring_t {
+    volatile uint64_t *tx_prod;
+    volatile uint64_t *tx_cons;
+    volatile uint64_t *rx_prod;
+    volatile uint64_t *rx_cons;
+
+    uint64_t *tx_len;
+    uint64_t *rx_len;
+
+    uint8_t *tx;
+    uint8_t *rx;
+
+    uint64_t slots;
+    uint64_t slot_size;
+};
+
+/// Make Bounce Ring
+///
+/// @expects r != nullptr
+/// @ensures
+///
+/// @param r the ring shared with bfexec (mapped into the VMM)
+/// @return returns the bounce ring that describes r
+///
+template<typename T>
+bounce_ring_t
+make_bounce_ring(T *r) noexcept
+{
+    return {
+        reinterpret_cast<volatile uint64_t *>(&r->tx_prod),
+        reinterpret_cast<volatile uint64_t *>(&r->tx_cons),
+        reinterpret_cast<volatile uint64_t *>(&r->rx_prod),
+        reinterpret_cast<volatile uint64_t *>(&r->rx_cons),
+        &r->tx_len[0],
+        &r->rx_len[0],
+        &r->tx[0][0],
+        &r->rx[0][0],
+        sizeof(r->rx_len) / sizeof(r->rx_len[0]),
+        sizeof(r->rx[0])
+    };
+}
+
+/// Virtio Bounce Device
+///
+/// A virtio-mmio device with a receive queue and a transmit queue whose
+/// backend lives in bfexec, and is reached through a bounce ring. Every
+/// buffer the guest has made available is copied into the ring when the
+/// guest notifies the transmit queue, and bfexec is told about the whole
+/// batch once. Buffers from bfexec are moved into the guest's receive
+/// buffers by process_rx().
+///
+/// If the guest is out of receive buffers, what bfexec posted stays in the
+/// ring until the guest makes a buffer available, and if bfexec has every
+/// tx slot, the transmit queue is stalled until bfexec catches up (see
+/// rx_pending() and tx_pending()). The device only decides what it accepts
+/// in each direction.
+///
+class virtio_bounce : public virtio_mmio
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param device_id the virtio device id
+    /// @param features the features that the device offers
+    /// @param queues the number of virtqueues the device has (the first
+    ///     two are the receive and transmit queues)
+    /// @param queue_size the max size of each virtqueue
+    /// @param virq the vIRQ that is used to interrupt the guest
+    /// @param ring the ring shared with bfexec
+    ///
+    virtio_bounce(
+        uint32_t device_id, uint64_t features, std::size_t queues,
+        uint32_t queue_size, uint64_t virq, const bounce_ring_t &ring);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~virtio_bounce() override = default;
+
+protected:
+
+    /// Rx Accept
+    ///
+    /// Called for every buffer bfexec posted before it is moved into the
+    /// guest. The device can update the buffer (e.g. its header) in place.
+    ///
+    /// @expects len <= the ring's slot size
+    /// @ensures
+    ///
+    /// @param data the buffer in the ring
+    /// @param len the length of the buffer
+    /// @return returns false if the buffer should be dropped
+    ///
+    virtual bool rx_accept(uint8_t *data, uint64_t len) noexcept = 0;
+
+    /// Rx Done
+    ///
+    /// Called once a buffer has been moved into the guest.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param len the length of the buffer
+    ///
+    virtual void rx_done(uint64_t len) noexcept;
+
+    /// Tx Accept
+    ///
+    /// Called for every buffer copied out of the guest before it is posted
+    /// to bfexec.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param data the buffer in the ring
+    /// @param len the length of the buffer, or 0 if the guest's chain was
+    ///     malformed
+    /// @return returns false if the buffer should be dropped
+    ///
+    virtual bool tx_accept(const uint8_t *data, uint64_t len) noexcept = 0;
+
+    /// Rx Pending
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if bfexec posted buffers that process_rx()
+    ///     has not looked at yet
+    ///
+    bool rx_pending() const noexcept;
+
+    /// Tx Pending
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the transmit queue is stalled, and bfexec
+    ///     has freed a slot since
+    ///
+    bool tx_pending() const noexcept;
+
+    /// Process Rx
+    ///
+    /// Moves what bfexec posted into the guest's receive buffers. Called
+    /// with m_mutex held.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU used to map the guest's buffers
+    ///
+    void process_rx(vcpu *vcpu);
+
+    /// Process Tx
+    ///
+    /// Copies every buffer the guest has made available on the transmit
+    /// queue into the ring. Called with m_mutex held.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU used to map the guest's buffers
+    ///
+    void process_tx(vcpu *vcpu);
+
+    /// Chain Room
+    ///
+    /// Reads the chain starting at head into m_chain.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param q the queue the chain belongs to
+    /// @param head the head of the chain
+    /// @return returns the number of bytes the chain can hold, or 0 if the
+    ///     chain is malformed or is not writable
+    ///
+    uint64_t chain_room(const virtq &q, uint16_t head);
+
+    /// Reset Bounce
+    ///
+    /// Restarts both queues. Called by the device when the guest resets it.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void reset_bounce() noexcept;
+
+protected:
+
+    std::vector<virtq_desc_t> m_chain;
+    std::atomic<bool> m_kick{};
+
+private:
+
+    bool receive(vcpu *vcpu, const uint8_t *data, uint64_t len);
+    bool transmit(vcpu *vcpu, uint16_t head);
+
+private:
+
+    bounce_ring_t m_bounce;
+    uint64_t m_tx_prod{};
+
+    std::atomic<bool> m_rx_stalled{};
+    std::atomic<bool> m_tx_stalled{};
+
+public:
+
+    /// @cond
+
+    virtio_bounce(virtio_bounce &&) = delete;
+    virtio_bounce &operator=(virtio_bounce &&) = delete;
+
+    virtio_bounce(const virtio_bounce &) = delete;
+    virtio_bounce &operator=(const virtio_bounce &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
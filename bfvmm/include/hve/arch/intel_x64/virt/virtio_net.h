@@ -0,0 +1,260 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VIRT_VIRTIO_NET_INTEL_X64_BOXY_H
+#define VIRT_VIRTIO_NET_INTEL_X64_BOXY_H
+
+#include <bfhypercall.h>
+#include <bfvmm/hve/arch/intel_x64/vcpu.h>
+
+#include "virtio_mmio.h"
+#include "net_switch.h"
+
+#include <array>
+#include <atomic>
+
+// -----------------------------------------------------------------------------
+// Defines
+// -----------------------------------------------------------------------------
+
+#ifndef VIRTIO_NET_QUEUE_SIZE
+#define VIRTIO_NET_QUEUE_SIZE 256
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+class vcpu;
+
+/// Virtio Net Device
+///
+/// A virtio-mmio network device with a receive queue and a transmit queue.
+/// The backend is provided by bfexec through a boxy_virtio_net_ring (see
+/// virtio_bounce). Frames received by bfexec are moved into the guest's
+/// receive buffers (and a single vIRQ is queued) the next time one of the
+/// domain's vCPUs is resumed.
+///
+/// Notifications are suppressed in both directions using
+/// VIRTIO_RING_F_EVENT_IDX: the guest is only asked to notify a queue when
+/// the device is waiting on it, and the guest is only interrupted when it
+/// asked to be.
+///
+/// Once attached to the net switch, the ring's tx and rx halves are no
+/// longer used. Frames are forwarded by the switch from the guest's
+/// transmit buffers directly into the receive buffers of other guests
+/// (see net_switch).
+///
+class virtio_net : public virtio_bounce
+{
+public:
+
+    using ring_type = struct boxy_virtio_net_ring;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param ring the ring shared with bfexec (mapped into the VMM)
+    ///
+    explicit virtio_net(bfvmm::x64::unique_map<ring_type> &&ring);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~virtio_net() override;
+
+    /// Attach to the Net Switch
+    ///
+    /// Connects the device to the net switch instead of bfexec. This must
+    /// be done before the domain's vCPUs are run for the first time.
+    ///
+    /// @expects port != 0
+    /// @ensures
+    ///
+    /// @param port the id bfexec uses to wake the domain up (see
+    ///     boxy_virtio_net_ring)
+    ///
+    void attach(uint64_t port);
+
+    /// Port
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the id the device was attached to the net switch
+    ///     with, or 0 if it is not attached
+    ///
+    uint64_t port() const noexcept;
+
+    /// Set vCPU
+    ///
+    /// Records a vCPU of the domain, which the net switch uses to map the
+    /// guest's receive buffers when another guest sends it a frame. Only
+    /// the first vCPU is recorded.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU to record
+    ///
+    void set_vcpu(vcpu *vcpu);
+
+    /// Clear vCPU
+    ///
+    /// Forgets the recorded vCPU (if it is the one provided). This must be
+    /// called before the vCPU is destroyed.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU to forget
+    ///
+    void clear_vcpu(vcpu *vcpu);
+
+    /// Resume
+    ///
+    /// Moves any frames that bfexec has received into the guest, and
+    /// restarts the transmit queue if it was stalled waiting for bfexec.
+    /// When attached to the net switch, this forwards the frames the guest
+    /// has transmitted, and interrupts the guest if the switch delivered
+    /// frames to it. This is called every time a vCPU of the domain is
+    /// resumed, so if there is nothing to do, it does not take the lock.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU that is being resumed
+    /// @return returns true if bfexec needs to be notified, false
+    ///     otherwise
+    ///
+    bool resume(vcpu *vcpu);
+
+protected:
+
+    /// @cond
+
+    uint64_t read_config(
+        uint64_t offset, uint64_t size) const noexcept override;
+
+    void queue_notify(vcpu *vcpu, std::size_t index) override;
+    void device_status(uint32_t status) noexcept override;
+
+    bool rx_accept(uint8_t *data, uint64_t len) noexcept override;
+    void rx_done(uint64_t len) noexcept override;
+    bool tx_accept(const uint8_t *data, uint64_t len) noexcept override;
+
+    /// @endcond
+
+private:
+
+    bool rx_allowed(const uint8_t *hdr, uint64_t len) const noexcept;
+
+    bool switch_pop(vcpu *vcpu, net_switch::frame_t &frame);
+    bool switch_chain(vcpu *vcpu, net_switch::frame_t &frame);
+    void switch_done(const net_switch::frame_t &frame) noexcept;
+    bool switch_rx(vcpu *vcpu, const net_switch::frame_t &frame);
+    bool switch_wake(uint64_t port) noexcept;
+
+private:
+
+    bfvmm::x64::unique_map<ring_type> m_ring;
+    std::array<uint8_t, 6> m_mac{};
+
+    uint64_t m_port{};
+    uint64_t m_generation{};
+    vcpu *m_switch_vcpu{};
+
+    std::atomic<bool> m_switch_tx{};
+    std::atomic<bool> m_switch_rx{};
+    std::atomic<bool> m_doorbell{};
+
+    friend class net_switch;
+
+public:
+
+    /// @cond
+
+    virtio_net(virtio_net &&) = delete;
+    virtio_net &operator=(virtio_net &&) = delete;
+
+    virtio_net(const virtio_net &) = delete;
+    virtio_net &operator=(const virtio_net &) = delete;
+
+    /// @endcond
+};
+
+class virtio_net_handler
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this handler
+    ///
+    virtio_net_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~virtio_net_handler();
+
+public:
+
+    /// @cond
+
+    void resume_delegate(vcpu_t *vcpu);
+
+    /// @endcond
+
+private:
+
+    vcpu *m_vcpu;
+
+public:
+
+    /// @cond
+
+    virtio_net_handler(virtio_net_handler &&) = default;
+    virtio_net_handler &operator=(virtio_net_handler &&) = default;
+
+    virtio_net_handler(const virtio_net_handler &) = delete;
+    virtio_net_handler &operator=(const virtio_net_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -0,0 +1,181 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VIRT_VIRTIO_VSOCK_INTEL_X64_BOXY_H
+#define VIRT_VIRTIO_VSOCK_INTEL_X64_BOXY_H
+
+#include <bfhypercall.h>
+#include <bfvmm/hve/arch/intel_x64/vcpu.h>
+
+#include "virtio_mmio.h"
+
+// -----------------------------------------------------------------------------
+// Defines
+// -----------------------------------------------------------------------------
+
+#ifndef VIRTIO_VSOCK_QUEUE_SIZE
+#define VIRTIO_VSOCK_QUEUE_SIZE 128
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+class vcpu;
+
+/// Virtio Vsock Device
+///
+/// A virtio-mmio socket device with a receive queue, a transmit queue and
+/// an event queue (which is never used). The guest's AF_VSOCK sockets are
+/// connected to bfexec through a boxy_virtio_vsock_ring, which is handled
+/// the same way as the virtio net ring (see virtio_bounce). Packets from
+/// bfexec are moved into the guest's receive buffers (and a single vIRQ is
+/// queued) the next time one of the domain's vCPUs is resumed.
+///
+/// Unlike a frame, a packet is never dropped because the guest is out of
+/// receive buffers, as that would corrupt the stream. Instead, the packet
+/// stays in the ring until the guest makes a buffer available, and bfexec
+/// stops sending once the rx half is full.
+///
+class virtio_vsock : public virtio_bounce
+{
+public:
+
+    using ring_type = struct boxy_virtio_vsock_ring;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param ring the ring shared with bfexec (mapped into the VMM)
+    ///
+    explicit virtio_vsock(bfvmm::x64::unique_map<ring_type> &&ring);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~virtio_vsock() override = default;
+
+    /// Resume
+    ///
+    /// Moves any packets that bfexec has posted into the guest, and
+    /// restarts the transmit queue if it was stalled waiting for bfexec.
+    /// This is called every time a vCPU of the domain is resumed, so if
+    /// there is nothing to do, it does not take the lock.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU that is being resumed
+    /// @return returns true if bfexec needs to be notified, false
+    ///     otherwise
+    ///
+    bool resume(vcpu *vcpu);
+
+protected:
+
+    /// @cond
+
+    uint64_t read_config(
+        uint64_t offset, uint64_t size) const noexcept override;
+
+    void queue_notify(vcpu *vcpu, std::size_t index) override;
+    void device_status(uint32_t status) noexcept override;
+
+    bool rx_accept(uint8_t *data, uint64_t len) noexcept override;
+    bool tx_accept(const uint8_t *data, uint64_t len) noexcept override;
+
+    /// @endcond
+
+private:
+
+    bfvmm::x64::unique_map<ring_type> m_ring;
+    uint64_t m_guest_cid{};
+
+public:
+
+    /// @cond
+
+    virtio_vsock(virtio_vsock &&) = delete;
+    virtio_vsock &operator=(virtio_vsock &&) = delete;
+
+    virtio_vsock(const virtio_vsock &) = delete;
+    virtio_vsock &operator=(const virtio_vsock &) = delete;
+
+    /// @endcond
+};
+
+class virtio_vsock_handler
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this handler
+    ///
+    virtio_vsock_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~virtio_vsock_handler() = default;
+
+public:
+
+    /// @cond
+
+    void resume_delegate(vcpu_t *vcpu);
+
+    /// @endcond
+
+private:
+
+    vcpu *m_vcpu;
+
+public:
+
+    /// @cond
+
+    virtio_vsock_handler(virtio_vsock_handler &&) = default;
+    virtio_vsock_handler &operator=(virtio_vsock_handler &&) = default;
+
+    virtio_vsock_handler(const virtio_vsock_handler &) = delete;
+    virtio_vsock_handler &operator=(const virtio_vsock_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -60,6 +60,14 @@ private:
     void domain_op__set_uart(vcpu *vcpu);
     void domain_op__set_pt_uart(vcpu *vcpu);
     void domain_op__dump_uart(vcpu *vcpu);
+    void domain_op__set_console_ring(vcpu *vcpu);
+    void domain_op__register_uart_buffer(vcpu *vcpu);
+    void domain_op__set_cpuid_leaf(vcpu *vcpu);
+    void domain_op__add_pt_io(vcpu *vcpu);
+    void domain_op__set_virtio_blk_ring(vcpu *vcpu);
+    void domain_op__set_virtio_net_ring(vcpu *vcpu);
+    void domain_op__attach_net_switch(vcpu *vcpu);
+    void domain_op__set_virtio_vsock_ring(vcpu *vcpu);
 
     void domain_op__share_page_r(vcpu *vcpu);
     void domain_op__share_page_rw(vcpu *vcpu);
@@ -0,0 +1,101 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VMCALL_GRANT_INTEL_X64_BOXY_H
+#define VMCALL_GRANT_INTEL_X64_BOXY_H
+
+#include <bfvmm/hve/arch/intel_x64/vcpu.h>
+
+#include <atomic>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+class vcpu;
+
+class grant_op_handler
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    grant_op_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~grant_op_handler();
+
+public:
+
+    /// @cond
+
+    bool exit_handler(vcpu_t *vcpu);
+    void resume_delegate(vcpu_t *vcpu);
+
+    /// @endcond
+
+private:
+
+    void grant_op__set_table(vcpu *vcpu);
+    void grant_op__map(vcpu *vcpu);
+    void grant_op__unmap(vcpu *vcpu);
+    void grant_op__revoke(vcpu *vcpu);
+
+    void flushed() noexcept;
+    bool dispatch(vcpu *vcpu);
+
+private:
+
+    vcpu *m_vcpu;
+
+    uint64_t m_ept_generation{};
+    vcpu *m_ept_parent{};
+
+    std::atomic<uint64_t> m_ept_state{~0ULL};
+
+public:
+
+    /// @cond
+
+    grant_op_handler(grant_op_handler &&) = delete;
+    grant_op_handler &operator=(grant_op_handler &&) = delete;
+
+    grant_op_handler(const grant_op_handler &) = delete;
+    grant_op_handler &operator=(const grant_op_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
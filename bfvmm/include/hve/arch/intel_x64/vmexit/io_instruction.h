@@ -55,6 +55,18 @@ public:
     ///
     ~io_instruction_handler() = default;
 
+public:
+
+    /// @cond
+
+    bool handle(vcpu_t *vcpu);
+
+    /// @endcond
+
+private:
+
+    vcpu *m_vcpu;
+
 public:
 
     /// @cond
@@ -75,6 +75,9 @@ public:
 
     /// @cond
 
+    bool handle_rdmsr(vcpu_t *vcpu);
+    bool handle_wrmsr(vcpu_t *vcpu);
+
     bool handle_rdmsr_0x00000034(
         vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
     bool handle_wrmsr_0x00000034(
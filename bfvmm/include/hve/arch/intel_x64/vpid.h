@@ -0,0 +1,131 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VPID_INTEL_X64_BOXY_H
+#define VPID_INTEL_X64_BOXY_H
+
+#include <array>
+#include <mutex>
+#include <cstdint>
+
+// -----------------------------------------------------------------------------
+// Defines
+// -----------------------------------------------------------------------------
+
+/// VPID Max
+///
+/// The largest VPID handed out by the VPID allocator. Setting this to 0
+/// disables VPIDs altogether, in which case every vCPU runs with VPID 0
+/// and the TLB is flushed on every VM entry and VM exit.
+///
+#ifndef VPID_MAX
+#define VPID_MAX 0xFFFF
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+/// VPID Allocator
+///
+/// Hands out a unique VPID to every vCPU (dom0 and domU alike) so that the
+/// TLB entries of the host and of each guest are tagged, and survive world
+/// switches. VPID 0 is reserved for VMX root and is never handed out.
+///
+class vpid_allocator
+{
+public:
+
+    /// Get Singleton Instance
+    ///
+    /// @expects none
+    /// @ensures ret != nullptr
+    ///
+    /// @return a singleton instance of vpid_allocator
+    ///
+    static vpid_allocator *instance() noexcept;
+
+    /// Allocate
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns a free VPID, or 0 if all of the VPIDs are in use
+    ///     (meaning that the vCPU should run without a VPID)
+    ///
+    uint16_t allocate() noexcept;
+
+    /// Free
+    ///
+    /// Returns a VPID to the allocator. The caller is responsible for
+    /// flushing the TLB entries that are tagged with the VPID (at least on
+    /// the current CPU). The next vCPU to get the VPID flushes it on any
+    /// other CPU the first time it runs there.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vpid the VPID to free
+    ///
+    void free(uint16_t vpid) noexcept;
+
+private:
+
+    vpid_allocator() noexcept = default;
+
+private:
+
+    std::mutex m_mutex;
+
+    uint64_t m_next{1};
+    std::array<uint64_t, (VPID_MAX + 64) / 64> m_used{};
+
+public:
+
+    /// @cond
+
+    vpid_allocator(vpid_allocator &&) = delete;
+    vpid_allocator &operator=(vpid_allocator &&) = delete;
+
+    vpid_allocator(const vpid_allocator &) = delete;
+    vpid_allocator &operator=(const vpid_allocator &) = delete;
+
+    /// @endcond
+};
+
+}
+
+/// VPID Allocator Macro
+///
+/// The following macro can be used to quickly call the VPID allocator.
+/// This call is guaranteed to not be NULL
+///
+/// @expects none
+/// @ensures ret != nullptr
+///
+#define g_vpid                                                                  \
+    boxy::intel_x64::vpid_allocator::instance()
+
+#endif
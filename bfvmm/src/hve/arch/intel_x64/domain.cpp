@@ -24,8 +24,19 @@
 
 #include <hve/arch/intel_x64/domain.h>
 
+#include <algorithm>
+
 using namespace bfvmm::intel_x64;
 
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+constexpr const uintptr_t page_size_4k{0x1000};
+constexpr const uintptr_t page_size_1g{0x40000000};
+
+constexpr const uint64_t ept_write_access{0x2};
+
 // -----------------------------------------------------------------------------
 // Implementation
 // -----------------------------------------------------------------------------
@@ -47,111 +58,285 @@ domain::domain(domainid_type domainid) :
 void
 domain::setup_dom0()
 {
-    // TODO:
+    m_host_mtrrs.init_host();
+
+    auto [eax, ebx, ecx, edx] = ::x64::cpuid::get(0x80000008, 0, 0, 0);
+    bfignored(ebx);
+    bfignored(ecx);
+    bfignored(edx);
+
+    // Note:
     //
-    // This should be changes to fix a couple of issues:
-    // - We should calculate the max physical address range using CPUID
-    //   and fill in EPT all the way to the end of addressable memory.
-    // - We should fill in EPT using 1 gig pages and then when we donate memory
-    //   the logic for doing this should be able to handle 1 gig pages.
-    // - 1 gig pages should be used because VMWare is not supported anways,
-    //   so we should assume that 1 gig page support is required. Once again,
-    //   legacy support is not a focus of this project
+    // Dom0 is identity mapped all the way to the end of addressable memory
+    // using 1g pages. A 1g page is only broken up into 2m and 4k pages if
+    // the host's MTRRs give it more than one memory type (e.g. the first
+    // 1g and the MMIO hole below 4g). This keeps the number of EPT walks
+    // that dom0 pays on a TLB miss as close to native as possible. A 4
+    // level EPT cannot map more than 48 bits, no matter what CPUID says.
     //
 
-    ept::identity_map(
-        m_ept_map, MAX_PHYS_ADDR
-    );
+    auto max_phys_addr = 1ULL << std::min<uint64_t>(eax & 0xFFU, 48);
+
+    for (uintptr_t addr = 0; addr < max_phys_addr; addr += page_size_1g) {
+        this->identity_map(addr, page_size_1g);
+    }
 }
 
 void
 domain::setup_domU()
-{ }
+{
+    m_cpuid_table.init();
+
+    m_mtrrs.init_guest();
+    m_host_mtrrs.init_host();
+
+    // Note:
+    //
+    // The 4 default com ports are always on the bus, even if they are not
+    // being emulated. This is because the Linux guest will attempt to probe
+    // these ports, and a disabled UART reads as zero (which is what tells
+    // the guest that there is nothing there) instead of all ones.
+    //
+
+    for (auto u : {&m_uart_3F8, &m_uart_2F8, &m_uart_3E8, &m_uart_2E8}) {
+        m_pio_bus.add_device(u->port(), 8, {&uart::io_handler, u});
+    }
+}
+
+ept::mmap::memory_type
+domain::memory_type(uintptr_t gpa, uintptr_t hpa) const noexcept
+{
+    // Note:
+    //
+    // The guest's MTRRs are not used by the hardware when EPT is enabled.
+    // Instead, the memory type in the EPT entry is combined with the
+    // guest's PAT. Host RAM is always mapped WB, regardless of what the
+    // guest's MTRRs say. Anything else (i.e. device memory) keeps its host
+    // type only if the guest agrees, and is UC otherwise. The guest can
+    // still use its PAT to get WC for device memory, as PAT WC overrides
+    // UC.
+    //
+
+    auto host = m_host_mtrrs.memory_type(hpa);
+    if (host == mtrr_ranges::write_back || this->id() == 0) {
+        return static_cast<ept::mmap::memory_type>(host);
+    }
+
+    if (m_mtrrs.memory_type(gpa) == host) {
+        return static_cast<ept::mmap::memory_type>(host);
+    }
+
+    return static_cast<ept::mmap::memory_type>(mtrr_ranges::uncacheable);
+}
 
 void
 domain::map_1g_r(uintptr_t gpa, uintptr_t hpa)
-{ m_ept_map.map_1g(gpa, hpa, ept::mmap::attr_type::read_only); }
+{
+    m_ept_map.map_1g(
+        gpa, hpa, ept::mmap::attr_type::read_only,
+        this->memory_type(gpa, hpa)
+    );
+}
 
 void
 domain::map_2m_r(uintptr_t gpa, uintptr_t hpa)
-{ m_ept_map.map_2m(gpa, hpa, ept::mmap::attr_type::read_only); }
+{
+    m_ept_map.map_2m(
+        gpa, hpa, ept::mmap::attr_type::read_only,
+        this->memory_type(gpa, hpa)
+    );
+}
 
 void
 domain::map_4k_r(uintptr_t gpa, uintptr_t hpa)
-{ m_ept_map.map_4k(gpa, hpa, ept::mmap::attr_type::read_only); }
+{
+    m_ept_map.map_4k(
+        gpa, hpa, ept::mmap::attr_type::read_only,
+        this->memory_type(gpa, hpa)
+    );
+}
 
 void
 domain::map_1g_rw(uintptr_t gpa, uintptr_t hpa)
-{ m_ept_map.map_1g(gpa, hpa, ept::mmap::attr_type::read_write); }
+{
+    m_ept_map.map_1g(
+        gpa, hpa, ept::mmap::attr_type::read_write,
+        this->memory_type(gpa, hpa)
+    );
+}
 
 void
 domain::map_2m_rw(uintptr_t gpa, uintptr_t hpa)
-{ m_ept_map.map_2m(gpa, hpa, ept::mmap::attr_type::read_write); }
+{
+    m_ept_map.map_2m(
+        gpa, hpa, ept::mmap::attr_type::read_write,
+        this->memory_type(gpa, hpa)
+    );
+}
 
 void
 domain::map_4k_rw(uintptr_t gpa, uintptr_t hpa)
-{ m_ept_map.map_4k(gpa, hpa, ept::mmap::attr_type::read_write); }
+{
+    m_ept_map.map_4k(
+        gpa, hpa, ept::mmap::attr_type::read_write,
+        this->memory_type(gpa, hpa)
+    );
+}
 
 void
 domain::map_1g_rwe(uintptr_t gpa, uintptr_t hpa)
-{ m_ept_map.map_1g(gpa, hpa, ept::mmap::attr_type::read_write_execute); }
+{
+    m_ept_map.map_1g(
+        gpa, hpa, ept::mmap::attr_type::read_write_execute,
+        this->memory_type(gpa, hpa)
+    );
+}
 
 void
 domain::map_2m_rwe(uintptr_t gpa, uintptr_t hpa)
-{ m_ept_map.map_2m(gpa, hpa, ept::mmap::attr_type::read_write_execute); }
+{
+    m_ept_map.map_2m(
+        gpa, hpa, ept::mmap::attr_type::read_write_execute,
+        this->memory_type(gpa, hpa)
+    );
+}
 
 void
 domain::map_4k_rwe(uintptr_t gpa, uintptr_t hpa)
-{ m_ept_map.map_4k(gpa, hpa, ept::mmap::attr_type::read_write_execute); }
+{
+    m_ept_map.map_4k(
+        gpa, hpa, ept::mmap::attr_type::read_write_execute,
+        this->memory_type(gpa, hpa)
+    );
+}
 
 void
 domain::unmap(uintptr_t gpa)
 { m_ept_map.unmap(gpa); }
 
-void
-domain::release(uintptr_t gpa)
-{ m_ept_map.release(gpa); }
+std::pair<uintptr_t, uintptr_t>
+domain::gpa_to_hpa(uintptr_t gpa)
+{ return m_ept_map.virt_to_phys(gpa); }
 
-void
-domain::set_uart(uart::port_type uart) noexcept
-{ m_uart_port = uart; }
+bool
+domain::is_writable(uintptr_t gpa)
+{
+    auto [entry, unused] = m_ept_map.entry(gpa);
+    bfignored(unused);
 
-void
-domain::set_pt_uart(uart::port_type uart) noexcept
-{ m_pt_uart_port = uart; }
+    return (entry.get() & ept_write_access) != 0;
+}
+
+uint64_t
+domain::invalidate_ept() noexcept
+{ return ++m_ept_generation; }
+
+uint64_t
+domain::ept_generation() const noexcept
+{ return m_ept_generation; }
 
 void
-domain::setup_vcpu_uarts(gsl::not_null<vcpu *> vcpu)
+domain::sync_ept(uint64_t generation) const noexcept
 {
+    std::lock_guard lock(m_ept_users_mutex);
+
     // Note:
     //
-    // We explicitly disable the 4 default com ports. This is because the
-    // Linux guest will attempt to probe these ports so they need to be
-    // handled by something.
+    // A vCPU stores 0 before it reads the generation on resume, so if it
+    // still reads as exited here, it has not read the generation yet, and
+    // will see (and flush for) the new one. The VMM cannot send IPIs, so
+    // instead of flushing the other CPUs, we wait for them to flush
+    // themselves.
     //
 
-    m_uart_3F8.disable(vcpu);
-    m_uart_2F8.disable(vcpu);
-    m_uart_3E8.disable(vcpu);
-    m_uart_2E8.disable(vcpu);
+    for (const auto state : m_ept_users) {
+        while (*state < generation) {
+            __builtin_ia32_pause();
+        }
+    }
+}
 
-    if (m_pt_uart_port == 0) {
-        switch (m_uart_port) {
-            case 0x3F8: m_uart_3F8.enable(vcpu); break;
-            case 0x2F8: m_uart_2F8.enable(vcpu); break;
-            case 0x3E8: m_uart_3E8.enable(vcpu); break;
-            case 0x2E8: m_uart_2E8.enable(vcpu); break;
+void
+domain::add_ept_user(gsl::not_null<const std::atomic<uint64_t> *> state)
+{
+    std::lock_guard lock(m_ept_users_mutex);
+    m_ept_users.push_back(state);
+}
 
-            default:
-                break;
-        };
+void
+domain::remove_ept_user(const std::atomic<uint64_t> *state) noexcept
+{
+    std::lock_guard lock(m_ept_users_mutex);
+
+    m_ept_users.erase(
+        std::remove(m_ept_users.begin(), m_ept_users.end(), state),
+        m_ept_users.end()
+    );
+}
+
+void
+domain::release(uintptr_t gpa)
+{ m_ept_map.release(gpa); }
+
+void
+domain::identity_map(uintptr_t addr, uintptr_t size)
+{
+    if (size == page_size_4k) {
+        this->map_4k_rwe(addr, addr);
+        return;
     }
-    else {
-        m_pt_uart = std::make_unique<uart>(m_pt_uart_port);
-        m_pt_uart->pass_through(vcpu);
+
+    if (m_host_mtrrs.is_uniform(addr, size)) {
+        if (size == page_size_1g) {
+            this->map_1g_rwe(addr, addr);
+        }
+        else {
+            this->map_2m_rwe(addr, addr);
+        }
+
+        return;
+    }
+
+    auto next = size >> 9U;
+    for (auto end = addr + size; addr < end; addr += next) {
+        this->identity_map(addr, next);
     }
 }
 
+void
+domain::set_uart(uart::port_type uart) noexcept
+{
+    m_uart_port = uart;
+
+    for (auto u : {&m_uart_3F8, &m_uart_2F8, &m_uart_3E8, &m_uart_2E8}) {
+        if (u->port() == uart) {
+            u->enable();
+        }
+    }
+}
+
+void
+domain::set_pt_uart(uart::port_type uart)
+{
+    if (m_vcpu_created) {
+        throw std::runtime_error("set_pt_uart: vCPUs already created");
+    }
+
+    m_pio_bus.add_pass_through(uart, 8, true);
+    m_pt_uart = std::make_unique<boxy::intel_x64::uart>(uart);
+}
+
+void
+domain::add_pt_io(pio_bus::port_type port, uint32_t size)
+{
+    if (m_vcpu_created) {
+        throw std::runtime_error("add_pt_io: vCPUs already created");
+    }
+
+    bfdebug_nhex(1, "passing through port", port);
+    m_pio_bus.add_pass_through(port, size);
+}
+
 uint64_t
 domain::dump_uart(const gsl::span<char> &buffer)
 {
@@ -173,6 +358,154 @@ domain::dump_uart(const gsl::span<char> &buffer)
     return 0;
 }
 
+void
+domain::register_uart_buffer(bfvmm::x64::unique_map<char> &&buffer)
+{
+    if (m_uart_buffer) {
+        throw std::runtime_error("uart buffer already registered");
+    }
+
+    m_uart_buffer = std::move(buffer);
+}
+
+bool
+domain::has_uart_buffer() const noexcept
+{ return static_cast<bool>(m_uart_buffer); }
+
+uint64_t
+domain::dump_uart()
+{
+    if (!m_uart_buffer) {
+        throw std::runtime_error("uart buffer not registered");
+    }
+
+    return this->dump_uart(gsl::span(m_uart_buffer.get(), UART_MAX_BUFFER));
+}
+
+void
+domain::set_console_ring(
+    const std::array<uintptr_t, CONSOLE_RING_PAGES> &hpas)
+{
+    if (m_console_ring != 0) {
+        throw std::runtime_error("console ring already set");
+    }
+
+    for (std::size_t i = 0; i < hpas.size(); i++) {
+        auto gpa = CONSOLE_RING_GPA + (i * BAREFLANK_PAGE_SIZE);
+        this->map_4k_rw(gpa, hpas.at(i));
+    }
+
+    m_console_ring = CONSOLE_RING_GPA;
+
+    if (auto leaf = m_cpuid_table.get(boxy_cpuid_leaf__features, 0)) {
+        auto regs = *leaf;
+        regs.eax |= boxy_cpuid_feature__pv_console;
+
+        m_cpuid_table.set(boxy_cpuid_leaf__features, 0, regs);
+    }
+}
+
+uintptr_t
+domain::console_ring() const noexcept
+{ return m_console_ring; }
+
+void
+domain::set_cpuid_leaf(
+    uint32_t leaf, uint32_t subleaf, const struct boxy_cpuid_leaf &regs)
+{
+    if (m_vcpu_created) {
+        throw std::runtime_error("set_cpuid_leaf: vCPUs already created");
+    }
+
+    m_cpuid_table.set(leaf, subleaf, regs);
+}
+
+const struct boxy_cpuid_leaf *
+domain::cpuid_leaf(uint32_t leaf, uint32_t subleaf) const noexcept
+{ return m_cpuid_table.get(leaf, subleaf); }
+
+void
+domain::vcpu_created() noexcept
+{ m_vcpu_created = true; }
+
+mtrr_ranges &
+domain::mtrrs() noexcept
+{ return m_mtrrs; }
+
+mmio_bus &
+domain::mmio() noexcept
+{ return m_mmio_bus; }
+
+pio_bus &
+domain::pio() noexcept
+{ return m_pio_bus; }
+
+void
+domain::set_virtio_blk_ring(
+    bfvmm::x64::unique_map<struct boxy_virtio_blk_ring> &&ring)
+{
+    if (m_virtio_blk) {
+        throw std::runtime_error("virtio-blk ring already set");
+    }
+
+    m_virtio_blk = std::make_unique<virtio_blk>(std::move(ring));
+    this->add_virtio_device(
+        VIRTIO_BLK_GPA, VIRTIO_BLK_SIZE, m_virtio_blk.get());
+}
+
+virtio_blk *
+domain::blk() const noexcept
+{ return m_virtio_blk.get(); }
+
+void
+domain::set_virtio_net_ring(
+    bfvmm::x64::unique_map<struct boxy_virtio_net_ring> &&ring)
+{
+    if (m_virtio_net) {
+        throw std::runtime_error("virtio-net ring already set");
+    }
+
+    m_virtio_net = std::make_unique<virtio_net>(std::move(ring));
+    this->add_virtio_device(
+        VIRTIO_NET_GPA, VIRTIO_NET_SIZE, m_virtio_net.get());
+}
+
+virtio_net *
+domain::net() const noexcept
+{ return m_virtio_net.get(); }
+
+void
+domain::set_virtio_vsock_ring(
+    bfvmm::x64::unique_map<struct boxy_virtio_vsock_ring> &&ring)
+{
+    if (m_virtio_vsock) {
+        throw std::runtime_error("virtio-vsock ring already set");
+    }
+
+    m_virtio_vsock = std::make_unique<virtio_vsock>(std::move(ring));
+    this->add_virtio_device(
+        VIRTIO_VSOCK_GPA, VIRTIO_VSOCK_SIZE, m_virtio_vsock.get());
+}
+
+virtio_vsock *
+domain::vsock() const noexcept
+{ return m_virtio_vsock.get(); }
+
+grant_table &
+domain::grants() noexcept
+{ return m_grant_table; }
+
+void
+domain::add_virtio_device(
+    uintptr_t gpa, uint64_t size, virtio_mmio *device)
+{
+    m_mmio_bus.add_device(
+        gpa, size,
+        {&virtio_mmio::mmio_read, device},
+        {&virtio_mmio::mmio_write, device}
+    );
+}
+
 #define domain_reg(reg)                                                         \
     uint64_t                                                                    \
     domain::reg() const noexcept                                                \
@@ -22,260 +22,417 @@
 #include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/emulation/cpuid.h>
 
-#define EMULATE_CPUID(a,b)                                                     \
-    m_vcpu->add_cpuid_emulator(a, {&cpuid_handler::b, this});
+#include <algorithm>
 
 // -----------------------------------------------------------------------------
-// Implementation
+// Helpers
 // -----------------------------------------------------------------------------
 
-namespace boxy::intel_x64
+static bool
+is_indexed(uint32_t leaf) noexcept
 {
+    switch (leaf) {
+        case 0x00000004:
+        case 0x00000007:
+        case 0x0000000B:
+        case 0x0000000D:
+        case 0x0000000F:
+        case 0x00000010:
+            return true;
+
+        default:
+            return false;
+    }
+}
 
-cpuid_handler::cpuid_handler(
-    gsl::not_null<vcpu *> vcpu
-) :
-    m_vcpu{vcpu}
+static uint64_t
+key(uint32_t leaf, uint32_t subleaf) noexcept
 {
-    using namespace vmcs_n;
-
-    if (vcpu->is_dom0()) {
-        return;
+    if (!is_indexed(leaf)) {
+        subleaf = 0;
     }
 
-    vcpu->enable_cpuid_whitelisting();
-
-    EMULATE_CPUID(0x00000000, handle_0x00000000);
-    EMULATE_CPUID(0x00000001, handle_0x00000001);
-    EMULATE_CPUID(0x00000002, handle_0x00000002);
-    EMULATE_CPUID(0x00000004, handle_0x00000004);
-    EMULATE_CPUID(0x00000006, handle_0x00000006);
-    EMULATE_CPUID(0x00000007, handle_0x00000007);
-    EMULATE_CPUID(0x0000000A, handle_0x0000000A);
-    EMULATE_CPUID(0x0000000B, handle_0x0000000B);
-    EMULATE_CPUID(0x0000000D, handle_0x0000000D);
-    EMULATE_CPUID(0x0000000F, handle_0x0000000F);
-    EMULATE_CPUID(0x00000010, handle_0x00000010);
-    EMULATE_CPUID(0x80000000, handle_0x80000000);
-    EMULATE_CPUID(0x80000001, handle_0x80000001);
-    EMULATE_CPUID(0x80000002, handle_0x80000002);
-    EMULATE_CPUID(0x80000003, handle_0x80000003);
-    EMULATE_CPUID(0x80000004, handle_0x80000004);
-    EMULATE_CPUID(0x80000007, handle_0x80000007);
-    EMULATE_CPUID(0x80000008, handle_0x80000008);
-
-    EMULATE_CPUID(0x40000000, handle_0x40000000);
+    return (static_cast<uint64_t>(leaf) << 32U) | subleaf;
 }
 
+static struct boxy_cpuid_leaf
+host_cpuid(uint32_t leaf, uint32_t subleaf = 0)
+{
+    auto [eax, ebx, ecx, edx] = ::x64::cpuid::get(leaf, 0, subleaf, 0);
+
+    return {
+        gsl::narrow_cast<uint32_t>(eax),
+        gsl::narrow_cast<uint32_t>(ebx),
+        gsl::narrow_cast<uint32_t>(ecx),
+        gsl::narrow_cast<uint32_t>(edx)
+    };
+}
+
+// Note:
+//
+// These are the XSAVE-managed state components a domU can enable in XCR0
+// (x87, SSE, AVX and the three AVX-512 components). Supervisor state
+// (i.e. IA32_XSS) is not supported as XSAVES/XRSTORS are disabled.
+//
+
+constexpr const uint32_t xcr0_x87{1U << 0U};
+constexpr const uint32_t xcr0_sse{1U << 1U};
+constexpr const uint32_t xcr0_avx{1U << 2U};
+constexpr const uint32_t xcr0_avx512{0xE0U};
+constexpr const uint32_t xcr0_legacy_size{576U};
+
 // -----------------------------------------------------------------------------
-// Handlers
+// Implementation
 // -----------------------------------------------------------------------------
 
-bool
-cpuid_handler::handle_0x00000000(vcpu_t *vcpu)
+namespace boxy::intel_x64
 {
-    vcpu->execute_cpuid();
-    return vcpu->advance();
-}
 
-bool
-cpuid_handler::handle_0x00000001(vcpu_t *vcpu)
+// -----------------------------------------------------------------------------
+// CPUID Table
+// -----------------------------------------------------------------------------
+
+void
+cpuid_table::init()
 {
-    vcpu->execute_cpuid();
+    struct boxy_cpuid_leaf regs{};
+
+    // Note:
+    //
+    // XCR0 is limited to what the host supports. AVX-512 is only exposed
+    // if all three of its state components are supported, and AVX (and
+    // everything that depends on it) is only exposed if its state
+    // component is supported.
+    //
+
+    auto xcr0 = host_cpuid(0x0000000D, 0).eax;
+    xcr0 &= xcr0_x87 | xcr0_sse | xcr0_avx | xcr0_avx512;
+
+    if ((xcr0 & xcr0_avx) == 0 || (xcr0 & xcr0_avx512) != xcr0_avx512) {
+        xcr0 &= ~xcr0_avx512;
+    }
 
-    vcpu->set_rcx(vcpu->rcx() & 0x61FC3203);
-    vcpu->set_rdx(vcpu->rdx() & 0x1FCBFBFB);
+    auto avx = (xcr0 & xcr0_avx) != 0;
+    auto avx512 = (xcr0 & xcr0_avx512) != 0;
+
+    this->set(0x00000000, 0, host_cpuid(0x00000000));
 
     // Note:
     //
-    // The following tells Linux that it is in a VM.
+    // Bit 31 of ECX tells Linux that it is in a VM. The TSC deadline timer
+    // (bit 24 of ECX) is emulated by the vclock using the VMX preemption
+    // timer, so it is always reported, regardless of what the hardware
+    // supports. The initial APIC ID is cleared so that it matches the
+    // x2APIC ID (which is always 0). OSXSAVE (bit 27 of ECX) reflects the
+    // guest's CR4 and is filled in by the CPUID handler. PCID (bit 17 of
+    // ECX) needs no emulation as CR4.PCIDE is owned by the guest.
     //
 
-    vcpu->set_rcx(vcpu->rcx() | 0x80000000);
+    regs = host_cpuid(0x00000001);
+    regs.ebx &= 0x00FFFFFF;
+    regs.ecx &= 0x75FE3203;
+    regs.ecx |= 0x80000000;
+    regs.ecx |= 0x01000000;
+    regs.edx &= 0x1FCBFBFB;
 
-    return vcpu->advance();
-}
+    if (!avx) {
+        regs.ecx &= ~0x30001000U;
+    }
 
-bool
-cpuid_handler::handle_0x00000002(vcpu_t *vcpu)
-{
-    vcpu->execute_cpuid();
-    return vcpu->advance();
-}
+    this->set(0x00000001, 0, regs);
 
-bool
-cpuid_handler::handle_0x00000004(vcpu_t *vcpu)
-{
-    vcpu->execute_cpuid();
+    this->set(0x00000002, 0, host_cpuid(0x00000002));
 
-    vcpu->set_rax(vcpu->rax() & 0x000003FF);
-    vcpu->set_rax(vcpu->rax() | 0x04004000);
-    vcpu->set_rdx(vcpu->rdx() & 0x00000007);
+    for (uint32_t subleaf = 0; ; subleaf++) {
+        auto host = host_cpuid(0x00000004, subleaf);
 
-    return vcpu->advance();
-}
+        regs = host;
+        regs.eax &= 0x000003FF;
+        regs.eax |= 0x04004000;
+        regs.edx &= 0x00000007;
+        this->set(0x00000004, subleaf, regs);
 
-bool
-cpuid_handler::handle_0x00000006(vcpu_t *vcpu)
-{
-    vcpu->set_rax(0);
-    vcpu->set_rbx(0);
-    vcpu->set_rcx(0);
-    vcpu->set_rdx(0);
+        if ((host.eax & 0x1F) == 0) {
+            break;
+        }
+    }
 
-    return vcpu->advance();
-}
+    auto host_0x00000007 = host_cpuid(0x00000007, 0);
 
-bool
-cpuid_handler::handle_0x00000007(vcpu_t *vcpu)
-{
-    if (vcpu->gr2() != 0) {
-        return vcpu->advance();
+    regs = host_0x00000007;
+    regs.eax = 0;
+    regs.ebx &= 0x019C27F9;
+    regs.ecx &= 0x00000700;
+    regs.edx = 0;
+
+    if (!avx) {
+        regs.ebx &= ~0x00000020U;
+        regs.ecx &= ~0x00000600U;
     }
 
-    vcpu->execute_cpuid();
+    if (avx512) {
+        regs.ebx |= host_0x00000007.ebx & 0xDC230000;
+        regs.ecx |= host_0x00000007.ecx & 0x00005842;
+        regs.edx |= host_0x00000007.edx & 0x0000000C;
+    }
 
-    vcpu->set_rax(0);
-    vcpu->set_rbx(vcpu->rbx() & 0x019C23D9);
-    vcpu->set_rcx(0);
-    vcpu->set_rdx(0);
+    this->set(0x00000007, 0, regs);
 
-    return vcpu->advance();
-}
+    regs = host_cpuid(0x0000000D, 0);
+    regs.eax = xcr0;
+    regs.ebx = xcr0_legacy_size;
+    regs.ecx = xcr0_legacy_size;
+    regs.edx = 0;
 
-bool
-cpuid_handler::handle_0x0000000A(vcpu_t *vcpu)
-{
-    vcpu->execute_cpuid();
+    for (uint32_t i = 2; i < 32; i++) {
+        if ((xcr0 & (1U << i)) == 0) {
+            continue;
+        }
 
-    vcpu->set_rax(0);
-    vcpu->set_rbx(vcpu->rbx() & 0x0000007F);
-    vcpu->set_rcx(0);
-    vcpu->set_rdx(0);
+        auto component = host_cpuid(0x0000000D, i);
+        component.ecx &= 0x00000002;
+        component.edx = 0;
+        this->set(0x0000000D, i, component);
 
-    return vcpu->advance();
-}
+        regs.ecx = std::max(regs.ecx, component.ebx + component.eax);
+    }
 
-bool
-cpuid_handler::handle_0x0000000B(vcpu_t *vcpu)
-{
-    vcpu->set_rax(0);
-    vcpu->set_rbx(0);
-    vcpu->set_rcx(0);
-    vcpu->set_rdx(0);
+    this->set(0x0000000D, 0, regs);
 
-    return vcpu->advance();
-}
+    regs = host_cpuid(0x0000000D, 1);
+    regs.eax &= 0x00000007;
+    regs.ebx = 0;
+    regs.ecx = 0;
+    regs.edx = 0;
+    this->set(0x0000000D, 1, regs);
 
-bool
-cpuid_handler::handle_0x0000000D(vcpu_t *vcpu)
-{
-    vcpu->set_rax(0);
-    vcpu->set_rbx(0);
-    vcpu->set_rcx(0);
-    vcpu->set_rdx(0);
+    // Note:
+    //
+    // The PMU is exposed as an architectural PMU (version 2) with as many
+    // counters as the host has (see pmu_handler). The number of counters
+    // can be lowered by overriding this leaf.
+    //
 
-    return vcpu->advance();
-}
+    regs = host_cpuid(0x0000000A);
+    if ((regs.eax & 0xFF) >= 2) {
+        auto num_gp =
+            std::min<uint32_t>((regs.eax >> 8U) & 0xFF, PMU_MAX_GP_COUNTERS);
+        auto num_fixed =
+            std::min<uint32_t>(regs.edx & 0x1F, PMU_MAX_FIXED_COUNTERS);
+
+        regs.eax = (regs.eax & 0xFFFF0000) | (num_gp << 8U) | 2U;
+        regs.ebx &= 0x0000007F;
+        regs.ecx = 0;
+        regs.edx = (regs.edx & 0x00001FE0) | num_fixed;
+    }
+    else {
+        regs.eax = 0;
+        regs.ebx &= 0x0000007F;
+        regs.ecx = 0;
+        regs.edx = 0;
+    }
+    this->set(0x0000000A, 0, regs);
+
+    regs = host_cpuid(0x80000000);
+    regs.ebx = 0;
+    regs.ecx = 0;
+    regs.edx = 0;
+    this->set(0x80000000, 0, regs);
+
+    regs = host_cpuid(0x80000001);
+    regs.ebx = 0;
+    regs.ecx &= 0x00000121;
+    regs.edx &= 0x24100800;
+    this->set(0x80000001, 0, regs);
+
+    this->set(0x80000002, 0, host_cpuid(0x80000002));
+    this->set(0x80000003, 0, host_cpuid(0x80000003));
+    this->set(0x80000004, 0, host_cpuid(0x80000004));
+
+    regs = host_cpuid(0x80000007);
+    regs.eax = 0;
+    regs.ebx = 0;
+    regs.ecx = 0;
+    this->set(0x80000007, 0, regs);
+
+    regs = host_cpuid(0x80000008);
+    regs.eax &= 0x0000FFFF;
+    regs.ebx = 0;
+    regs.ecx = 0;
+    regs.edx = 0;
+    this->set(0x80000008, 0, regs);
 
-bool
-cpuid_handler::handle_0x0000000F(vcpu_t *vcpu)
-{
-    vcpu->set_rax(0);
-    vcpu->set_rbx(0);
-    vcpu->set_rcx(0);
-    vcpu->set_rdx(0);
+    // Note:
+    //
+    // The PV console feature is added once the domain is given a console
+    // ring (see domain::set_console_ring), and the timing leaf's TSC
+    // frequency is filled in by the CPUID handler as each vCPU calibrates
+    // its own.
+    //
 
-    return vcpu->advance();
-}
+    uint32_t features =
+        boxy_cpuid_feature__vclock |
+        boxy_cpuid_feature__vclock_timers |
+        boxy_cpuid_feature__steal_time |
+        boxy_cpuid_feature__tsc_deadline |
+        boxy_cpuid_feature__virq |
+        boxy_cpuid_feature__virq_batching |
+        boxy_cpuid_feature__grant_table;
+
+    if ((this->get(0x0000000A, 0)->eax & 0xFF) >= 2) {
+        features |= boxy_cpuid_feature__pmu;
+    }
 
-bool
-cpuid_handler::handle_0x00000010(vcpu_t *vcpu)
-{
-    vcpu->set_rax(0);
-    vcpu->set_rbx(0);
-    vcpu->set_rcx(0);
-    vcpu->set_rdx(0);
+    this->set(boxy_cpuid_leaf__signature, 0, {
+        boxy_cpuid_leaf__max,
+        boxy_cpuid_signature,
+        boxy_cpuid_signature,
+        boxy_cpuid_signature
+    });
 
-    return vcpu->advance();
+    this->set(boxy_cpuid_leaf__features, 0, {features, 0, 0, 0});
+    this->set(boxy_cpuid_leaf__timing, 0, {0, 0, 0, 0});
 }
 
-bool
-cpuid_handler::handle_0x80000000(vcpu_t *vcpu)
+void
+cpuid_table::set(
+    uint32_t leaf, uint32_t subleaf, const struct boxy_cpuid_leaf &regs)
 {
-    vcpu->execute_cpuid();
+    auto k = key(leaf, subleaf);
 
-    vcpu->set_rbx(0);
-    vcpu->set_rcx(0);
-    vcpu->set_rdx(0);
+    auto iter = std::lower_bound(
+        m_entries.begin(), m_entries.end(), k,
+        [](const entry_t & entry, uint64_t k) { return entry.key < k; }
+    );
 
-    return vcpu->advance();
+    if (iter != m_entries.end() && iter->key == k) {
+        iter->regs = regs;
+        return;
+    }
+
+    m_entries.insert(iter, {k, regs});
 }
 
-bool
-cpuid_handler::handle_0x80000001(vcpu_t *vcpu)
+const struct boxy_cpuid_leaf *
+cpuid_table::get(uint32_t leaf, uint32_t subleaf) const noexcept
 {
-    vcpu->execute_cpuid();
+    auto k = key(leaf, subleaf);
 
-    vcpu->set_rbx(0);
-    vcpu->set_rcx(vcpu->rcx() & 0x00000121);
-    vcpu->set_rdx(vcpu->rdx() & 0x24100800);
+    auto iter = std::lower_bound(
+        m_entries.begin(), m_entries.end(), k,
+        [](const entry_t & entry, uint64_t k) { return entry.key < k; }
+    );
 
-    return vcpu->advance();
-}
+    if (iter != m_entries.end() && iter->key == k) {
+        return &iter->regs;
+    }
 
-bool
-cpuid_handler::handle_0x80000002(vcpu_t *vcpu)
-{
-    vcpu->execute_cpuid();
-    return vcpu->advance();
+    return nullptr;
 }
 
-bool
-cpuid_handler::handle_0x80000003(vcpu_t *vcpu)
-{
-    vcpu->execute_cpuid();
-    return vcpu->advance();
-}
+// -----------------------------------------------------------------------------
+// CPUID Handler
+// -----------------------------------------------------------------------------
 
-bool
-cpuid_handler::handle_0x80000004(vcpu_t *vcpu)
+cpuid_handler::cpuid_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
 {
-    vcpu->execute_cpuid();
-    return vcpu->advance();
+    using namespace vmcs_n;
+
+    if (vcpu->is_dom0()) {
+        return;
+    }
+
+    vcpu->add_exit_handler_for_reason(
+        exit_reason::basic_exit_reason::cpuid,
+        {&cpuid_handler::handle, this}
+    );
 }
 
 bool
-cpuid_handler::handle_0x80000007(vcpu_t *vcpu)
+cpuid_handler::handle(vcpu_t *vcpu)
 {
-    vcpu->execute_cpuid();
+    // Note:
+    //
+    // Any leaf (or subleaf) that is not in the domain's table returns 0,
+    // which is the same thing CPUID whitelisting does.
+    //
 
-    vcpu->set_rax(0);
-    vcpu->set_rbx(0);
-    vcpu->set_rcx(0);
-    vcpu->set_rcx(0);
+    auto leaf = gsl::narrow_cast<uint32_t>(vcpu->rax());
+    auto subleaf = gsl::narrow_cast<uint32_t>(vcpu->rcx());
 
-    return vcpu->advance();
-}
+    auto dom = m_vcpu->dom();
+    auto regs = dom->cpuid_leaf(leaf, subleaf);
 
-bool
-cpuid_handler::handle_0x80000008(vcpu_t *vcpu)
-{
-    vcpu->execute_cpuid();
+    if (regs == nullptr) {
+        vcpu->set_rax(0);
+        vcpu->set_rbx(0);
+        vcpu->set_rcx(0);
+        vcpu->set_rdx(0);
+
+        return vcpu->advance();
+    }
 
-    vcpu->set_rax(vcpu->rax() & 0x0000FFFF);
-    vcpu->set_rbx(0);
-    vcpu->set_rcx(0);
-    vcpu->set_rdx(0);
+    vcpu->set_rax(regs->eax);
+    vcpu->set_rbx(regs->ebx);
+    vcpu->set_rcx(regs->ecx);
+    vcpu->set_rdx(regs->edx);
+
+    // Note:
+    //
+    // The following bits depend on the guest's state and cannot be
+    // precomputed:
+    // - OSXSAVE (leaf 1, ECX bit 27) is a copy of CR4.OSXSAVE
+    // - leaf 0xD, subleaf 0, EBX is the size of the XSAVE area for the
+    //   state components that are currently enabled in XCR0
+    // - the timing leaf's TSC frequency is calibrated by each vCPU
+    //
+
+    switch (leaf) {
+        case 0x00000001:
+            if ((regs->ecx & 0x04000000) != 0) {
+                if ((vcpu->cr4() & 0x00040000) != 0) {
+                    vcpu->set_rcx(regs->ecx | 0x08000000);
+                }
+            }
+            break;
+
+        case 0x0000000D:
+            if (subleaf == 0) {
+                vcpu->set_rbx(xsave_size(vcpu->xcr0()));
+            }
+            break;
+
+        case boxy_cpuid_leaf__timing:
+            vcpu->set_rax(m_vcpu->tsc_freq_khz() & 0xFFFFFFFF);
+            break;
+
+        default:
+            break;
+    }
 
     return vcpu->advance();
 }
 
-bool
-cpuid_handler::handle_0x40000000(vcpu_t *vcpu)
+uint32_t
+cpuid_handler::xsave_size(uint64_t xcr0) const noexcept
 {
-    vcpu->set_rax(0xBFBFBFBF);
-    return vcpu->advance();
+    auto size = xcr0_legacy_size;
+    auto dom = m_vcpu->dom();
+
+    for (uint32_t i = 2; i < 32; i++) {
+        if ((xcr0 & (1ULL << i)) == 0) {
+            continue;
+        }
+
+        if (auto component = dom->cpuid_leaf(0x0000000D, i)) {
+            size = std::max(size, component->ebx + component->eax);
+        }
+    }
+
+    return size;
 }
 
 }
@@ -0,0 +1,674 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/emulation/mmio.h>
+#include <hve/arch/intel_x64/emulation/table.h>
+
+#include <algorithm>
+#include <cstring>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+constexpr const uint64_t eq_data_write{0x0000000000000002};
+constexpr const uint64_t eq_instruction_fetch{0x0000000000000004};
+constexpr const uint64_t eq_linear_address_valid{0x0000000000000080};
+constexpr const uint64_t eq_translated_address{0x0000000000000100};
+
+constexpr const uint64_t cs_l{0x0000000000002000};
+constexpr const uint64_t cs_d{0x0000000000004000};
+constexpr const uint64_t rflags_df{0x0000000000000400};
+
+constexpr const uint64_t max_insn_len{15};
+
+// -----------------------------------------------------------------------------
+// Instruction Decoder
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The guest physical address of an MMIO access is provided by the EPT
+// violation, so the decoder only has to figure out what the instruction
+// does with it, and how long the instruction is (the VM-exit instruction
+// length is not valid for EPT violations). Only the instructions that
+// compilers and drivers actually use for MMIO are supported: MOV (to,
+// from and immediate), MOVZX, MOV moffs, MOVS and STOS. Anything else is
+// left to the default EPT violation handler.
+//
+
+struct insn_t {
+    uint64_t len;
+    uint64_t opcode;
+    uint64_t size;
+    uint64_t reg;
+    uint64_t reg_size;
+    uint64_t addr_size;
+    uint64_t imm;
+    bool rex;
+    bool rep;
+};
+
+static bool
+decode_modrm(
+    const gsl::span<const uint8_t> &buf, uint64_t &i, uint64_t rex,
+    uint64_t addr_size, insn_t &insn)
+{
+    if (i >= static_cast<uint64_t>(buf.size())) {
+        return false;
+    }
+
+    auto modrm = buf[gsl::narrow_cast<std::ptrdiff_t>(i++)];
+    auto mod = (modrm >> 6U) & 0x3U;
+    auto rm = modrm & 0x7U;
+
+    insn.reg = ((modrm >> 3U) & 0x7U) | ((rex & 0x4U) << 1U);
+
+    // Note:
+    //
+    // A register operand cannot be the source of an EPT violation, and
+    // 16-bit addressing is not supported.
+    //
+
+    if (mod == 3 || addr_size == 2) {
+        return false;
+    }
+
+    if (rm == 4) {
+        if (i >= static_cast<uint64_t>(buf.size())) {
+            return false;
+        }
+
+        auto sib = buf[gsl::narrow_cast<std::ptrdiff_t>(i++)];
+        if (mod == 0 && (sib & 0x7U) == 5) {
+            i += 4;
+        }
+    }
+
+    if (mod == 0 && rm == 5) {
+        i += 4;
+    }
+
+    if (mod == 1) {
+        i += 1;
+    }
+
+    if (mod == 2) {
+        i += 4;
+    }
+
+    return i <= static_cast<uint64_t>(buf.size());
+}
+
+static bool
+decode_imm(
+    const gsl::span<const uint8_t> &buf, uint64_t &i, uint64_t size,
+    insn_t &insn)
+{
+    if (i + size > static_cast<uint64_t>(buf.size())) {
+        return false;
+    }
+
+    insn.imm = 0;
+    for (uint64_t b = 0; b < size; b++) {
+        auto byte = buf[gsl::narrow_cast<std::ptrdiff_t>(i++)];
+        insn.imm |= static_cast<uint64_t>(byte) << (b * 8);
+    }
+
+    return true;
+}
+
+static bool
+decode(
+    const gsl::span<const uint8_t> &buf, bool long_mode, bool default32,
+    insn_t &insn)
+{
+    uint64_t i{};
+    uint64_t rex{};
+
+    bool opsize{};
+    bool addrsize{};
+
+    insn = {};
+
+    for (; i < static_cast<uint64_t>(buf.size()); i++) {
+        auto byte = buf[gsl::narrow_cast<std::ptrdiff_t>(i)];
+
+        if (byte == 0x66) {
+            opsize = true;
+        }
+        else if (byte == 0x67) {
+            addrsize = true;
+        }
+        else if (byte == 0xF2 || byte == 0xF3) {
+            insn.rep = true;
+        }
+        else if (byte == 0x26 || byte == 0x2E || byte == 0x36 ||
+                 byte == 0x3E || byte == 0x64 || byte == 0x65) {
+            continue;
+        }
+        else {
+            break;
+        }
+    }
+
+    if (i < static_cast<uint64_t>(buf.size()) && long_mode) {
+        if ((buf[gsl::narrow_cast<std::ptrdiff_t>(i)] & 0xF0U) == 0x40) {
+            rex = buf[gsl::narrow_cast<std::ptrdiff_t>(i++)];
+            insn.rex = true;
+        }
+    }
+
+    if (i >= static_cast<uint64_t>(buf.size())) {
+        return false;
+    }
+
+    insn.opcode = buf[gsl::narrow_cast<std::ptrdiff_t>(i++)];
+    if (insn.opcode == 0x0F) {
+        if (i >= static_cast<uint64_t>(buf.size())) {
+            return false;
+        }
+
+        insn.opcode = 0x0F00U | buf[gsl::narrow_cast<std::ptrdiff_t>(i++)];
+    }
+
+    uint64_t size = (default32 != opsize) ? 4 : 2;
+    if ((rex & 0x8U) != 0) {
+        size = 8;
+    }
+
+    uint64_t addr_size = default32 ? 4 : 2;
+    if (long_mode) {
+        addr_size = addrsize ? 4 : 8;
+    }
+    else if (addrsize) {
+        addr_size = default32 ? 2 : 4;
+    }
+
+    insn.size = (insn.opcode & 0x1U) == 0 ? 1 : size;
+    insn.reg_size = insn.size;
+    insn.addr_size = addr_size;
+
+    switch (insn.opcode) {
+        case 0x88:
+        case 0x89:
+        case 0x8A:
+        case 0x8B:
+            if (!decode_modrm(buf, i, rex, addr_size, insn)) {
+                return false;
+            }
+            break;
+
+        case 0xC6:
+        case 0xC7:
+            if (!decode_modrm(buf, i, rex, addr_size, insn) || insn.reg != 0) {
+                return false;
+            }
+
+            if (!decode_imm(buf, i, std::min<uint64_t>(insn.size, 4), insn)) {
+                return false;
+            }
+
+            if (insn.size == 8 && (insn.imm & 0x80000000U) != 0) {
+                insn.imm |= 0xFFFFFFFF00000000U;
+            }
+            break;
+
+        case 0xA0:
+        case 0xA1:
+        case 0xA2:
+        case 0xA3:
+            i += addr_size;
+            break;
+
+        case 0xA4:
+        case 0xA5:
+        case 0xAA:
+        case 0xAB:
+            break;
+
+        case 0x0FB6:
+        case 0x0FB7:
+            if (!decode_modrm(buf, i, rex, addr_size, insn)) {
+                return false;
+            }
+
+            insn.reg_size = size;
+            insn.size = (insn.opcode == 0x0FB6) ? 1 : 2;
+            break;
+
+        default:
+            return false;
+    }
+
+    insn.len = i;
+    return i <= static_cast<uint64_t>(buf.size());
+}
+
+// -----------------------------------------------------------------------------
+// Register Helpers
+// -----------------------------------------------------------------------------
+
+static uint64_t
+mask(uint64_t size) noexcept
+{ return size == 8 ? 0xFFFFFFFFFFFFFFFF : (1ULL << (size * 8)) - 1; }
+
+static uint64_t
+reg(vcpu_t *vcpu, uint64_t index)
+{
+    switch (index) {
+        case 0: return vcpu->rax();
+        case 1: return vcpu->rcx();
+        case 2: return vcpu->rdx();
+        case 3: return vcpu->rbx();
+        case 4: return vcpu->rsp();
+        case 5: return vcpu->rbp();
+        case 6: return vcpu->rsi();
+        case 7: return vcpu->rdi();
+        case 8: return vcpu->r08();
+        case 9: return vcpu->r09();
+        case 10: return vcpu->r10();
+        case 11: return vcpu->r11();
+        case 12: return vcpu->r12();
+        case 13: return vcpu->r13();
+        case 14: return vcpu->r14();
+        default: return vcpu->r15();
+    }
+}
+
+static void
+set_reg(vcpu_t *vcpu, uint64_t index, uint64_t val)
+{
+    switch (index) {
+        case 0: return vcpu->set_rax(val);
+        case 1: return vcpu->set_rcx(val);
+        case 2: return vcpu->set_rdx(val);
+        case 3: return vcpu->set_rbx(val);
+        case 4: return vcpu->set_rsp(val);
+        case 5: return vcpu->set_rbp(val);
+        case 6: return vcpu->set_rsi(val);
+        case 7: return vcpu->set_rdi(val);
+        case 8: return vcpu->set_r08(val);
+        case 9: return vcpu->set_r09(val);
+        case 10: return vcpu->set_r10(val);
+        case 11: return vcpu->set_r11(val);
+        case 12: return vcpu->set_r12(val);
+        case 13: return vcpu->set_r13(val);
+        case 14: return vcpu->set_r14(val);
+        default: return vcpu->set_r15(val);
+    }
+}
+
+static uint64_t
+get_operand(vcpu_t *vcpu, const insn_t &insn, uint64_t index)
+{
+    // Note:
+    //
+    // Without a REX prefix, byte registers 4-7 are AH, CH, DH and BH.
+    //
+
+    if (insn.size == 1 && !insn.rex && index >= 4 && index < 8) {
+        return (reg(vcpu, index - 4) >> 8U) & 0xFFU;
+    }
+
+    return reg(vcpu, index) & mask(insn.size);
+}
+
+static void
+set_operand(vcpu_t *vcpu, const insn_t &insn, uint64_t index, uint64_t val)
+{
+    auto size = insn.reg_size;
+
+    if (size == 1 && !insn.rex && index >= 4 && index < 8) {
+        auto old = reg(vcpu, index - 4) & ~0xFF00ULL;
+        return set_reg(vcpu, index - 4, old | ((val & 0xFFU) << 8U));
+    }
+
+    // Note:
+    //
+    // 32-bit writes zero extend to 64 bits. 8-bit and 16-bit writes leave
+    // the rest of the register alone.
+    //
+
+    if (size >= 4) {
+        return set_reg(vcpu, index, val & mask(size));
+    }
+
+    auto old = reg(vcpu, index) & ~mask(size);
+    set_reg(vcpu, index, old | (val & mask(size)));
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+// -----------------------------------------------------------------------------
+// MMIO Bus
+// -----------------------------------------------------------------------------
+
+void
+mmio_bus::add_device(
+    uintptr_t gpa, uint64_t size,
+    const handler_delegate_t &read, const handler_delegate_t &write)
+{
+    expects(size != 0);
+
+    auto iter = std::lower_bound(
+        m_entries.begin(), m_entries.end(), gpa,
+    [](const auto & entry, uintptr_t gpa) {
+        return entry.gpa < gpa;
+    });
+
+    if (iter != m_entries.end() && gpa + size > iter->gpa) {
+        throw std::runtime_error("mmio_bus: range overlaps another device");
+    }
+
+    if (iter != m_entries.begin()) {
+        auto prev = std::prev(iter);
+        if (prev->gpa + prev->size > gpa) {
+            throw std::runtime_error("mmio_bus: range overlaps another device");
+        }
+    }
+
+    m_entries.insert(iter, {gpa, size, read, write});
+}
+
+bool
+mmio_bus::is_mmio(uintptr_t gpa) const noexcept
+{ return this->find(gpa, 1) != nullptr; }
+
+bool
+mmio_bus::read(vcpu *vcpu, info_t &info) const
+{
+    if (auto entry = this->find(info.gpa, info.size)) {
+        if (entry->read(vcpu, info)) {
+            info.val &= mask(info.size);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool
+mmio_bus::write(vcpu *vcpu, info_t &info) const
+{
+    if (auto entry = this->find(info.gpa, info.size)) {
+        return entry->write(vcpu, info);
+    }
+
+    return false;
+}
+
+const mmio_bus::entry_t *
+mmio_bus::find(uintptr_t gpa, uint64_t size) const noexcept
+{
+    auto iter = std::upper_bound(
+        m_entries.begin(), m_entries.end(), gpa,
+    [](uintptr_t gpa, const auto & entry) {
+        return gpa < entry.gpa;
+    });
+
+    if (iter == m_entries.begin()) {
+        return nullptr;
+    }
+
+    --iter;
+
+    // Note:
+    //
+    // An access that starts in a device but runs past the end of its range
+    // is not given to the device, as the device would have to emulate
+    // memory it does not own.
+    //
+
+    auto offset = gpa - iter->gpa;
+    if (offset >= iter->size || size > iter->size - offset) {
+        return nullptr;
+    }
+
+    return &*iter;
+}
+
+// -----------------------------------------------------------------------------
+// MMIO Handler
+// -----------------------------------------------------------------------------
+
+static bool
+emulate_string(
+    vcpu *vcpu, const mmio_bus &bus, uint64_t eq, mmio_bus::info_t &info,
+    const insn_t &insn)
+{
+    auto size = insn.size;
+    auto step = size;
+    auto addr_size = insn.addr_size;
+
+    if ((vmcs_n::guest_rflags::get() & rflags_df) != 0) {
+        step = ~size + 1;
+    }
+
+    // Note:
+    //
+    // For MOVS, the side that caused the violation is the MMIO side, and
+    // the other side is assumed to be RAM. MOVS between two MMIO devices
+    // is not supported.
+    //
+
+    if (insn.opcode == 0xAA || insn.opcode == 0xAB) {
+        info.val = vcpu->rax() & mask(size);
+        if (!bus.write(vcpu, info)) {
+            return false;
+        }
+    }
+    else if ((eq & eq_data_write) != 0) {
+        auto src = vcpu->map_gva_4k<uint8_t>(
+            addr_reg(vcpu->rsi(), addr_size), size);
+        std::memcpy(&info.val, src.get(), size);
+
+        if (!bus.write(vcpu, info)) {
+            return false;
+        }
+
+        vcpu->set_rsi(addr_add(vcpu->rsi(), step, addr_size));
+    }
+    else {
+        if (!bus.read(vcpu, info)) {
+            return false;
+        }
+
+        auto dst = vcpu->map_gva_4k<uint8_t>(
+            addr_reg(vcpu->rdi(), addr_size), size);
+        std::memcpy(dst.get(), &info.val, size);
+
+        vcpu->set_rsi(addr_add(vcpu->rsi(), step, addr_size));
+    }
+
+    vcpu->set_rdi(addr_add(vcpu->rdi(), step, addr_size));
+
+    // Note:
+    //
+    // A REP prefix is emulated one iteration per exit. RIP is only moved
+    // past the instruction once RCX reaches 0. Until then, the guest
+    // executes the instruction again, which generates the next exit.
+    //
+
+    if (insn.rep) {
+        vcpu->set_rcx(addr_add(vcpu->rcx(), ~0ULL, addr_size));
+        if (addr_reg(vcpu->rcx(), addr_size) != 0) {
+            return true;
+        }
+    }
+
+    vcpu->set_rip(vcpu->rip() + insn.len);
+    return true;
+}
+
+mmio_handler::mmio_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{
+    using namespace vmcs_n;
+
+    if (vcpu->is_dom0()) {
+        return;
+    }
+
+    vcpu->add_exit_handler_for_reason(
+        exit_reason::basic_exit_reason::ept_violation,
+        {&mmio_handler::handle, this}
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+mmio_handler::handle(vcpu_t *vcpu)
+{
+    using namespace vmcs_n;
+
+    auto eq = exit_qualification::get();
+    auto gpa = guest_physical_address::get();
+    const auto &bus = m_vcpu->dom()->mmio();
+
+    if (!bus.is_mmio(gpa) || (eq & eq_instruction_fetch) != 0) {
+        return false;
+    }
+
+    // Note:
+    //
+    // If the violation happened while the CPU was walking the guest's page
+    // tables, the guest put its page tables in MMIO, which is a guest bug.
+    //
+
+    if ((eq & eq_linear_address_valid) == 0 ||
+        (eq & eq_translated_address) == 0) {
+        return false;
+    }
+
+    insn_t insn{};
+
+    auto ar = vcpu->cs_access_rights();
+    auto long_mode = (ar & cs_l) != 0;
+    auto default32 = long_mode || (ar & cs_d) != 0;
+
+    auto rip = vcpu->rip();
+    auto len = std::min(max_insn_len, 0x1000 - (rip & 0xFFF));
+
+    {
+        auto buf = vcpu->map_gva_4k<uint8_t>(rip, len);
+        auto span = gsl::span<const uint8_t>(
+            buf.get(), gsl::narrow_cast<std::ptrdiff_t>(len));
+
+        if (!decode(span, long_mode, default32, insn)) {
+            insn.len = 0;
+        }
+    }
+
+    // Note:
+    //
+    // Only map across a page boundary if we have to, as the next page
+    // might not be mapped at all.
+    //
+
+    if (insn.len == 0 && len != max_insn_len) {
+        auto buf = vcpu->map_gva_4k<uint8_t>(rip, max_insn_len);
+        auto span = gsl::span<const uint8_t>(
+            buf.get(), gsl::narrow_cast<std::ptrdiff_t>(max_insn_len));
+
+        if (!decode(span, long_mode, default32, insn)) {
+            return false;
+        }
+    }
+
+    if (insn.len == 0) {
+        return false;
+    }
+
+    mmio_bus::info_t info{gpa, insn.size, 0};
+
+    switch (insn.opcode) {
+        case 0x88:
+        case 0x89:
+            info.val = get_operand(vcpu, insn, insn.reg);
+            if (!bus.write(m_vcpu, info)) {
+                return false;
+            }
+            break;
+
+        case 0xA2:
+        case 0xA3:
+            info.val = get_operand(vcpu, insn, 0);
+            if (!bus.write(m_vcpu, info)) {
+                return false;
+            }
+            break;
+
+        case 0xC6:
+        case 0xC7:
+            info.val = insn.imm & mask(insn.size);
+            if (!bus.write(m_vcpu, info)) {
+                return false;
+            }
+            break;
+
+        case 0x8A:
+        case 0x8B:
+        case 0x0FB6:
+        case 0x0FB7:
+            if (!bus.read(m_vcpu, info)) {
+                return false;
+            }
+
+            set_operand(vcpu, insn, insn.reg, info.val);
+            break;
+
+        case 0xA0:
+        case 0xA1:
+            if (!bus.read(m_vcpu, info)) {
+                return false;
+            }
+
+            set_operand(vcpu, insn, 0, info.val);
+            break;
+
+        case 0xA4:
+        case 0xA5:
+        case 0xAA:
+        case 0xAB:
+            return emulate_string(m_vcpu, bus, eq, info, insn);
+
+        default:
+            return false;
+    }
+
+    vcpu->set_rip(rip + insn.len);
+    return true;
+}
+
+}
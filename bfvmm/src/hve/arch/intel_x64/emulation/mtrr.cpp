@@ -22,124 +22,431 @@
 #include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/emulation/mtrr.h>
 
-#define EMULATE_MSR(a,r,w)                                                      \
-    m_vcpu->emulate_rdmsr(a, {&mtrr_handler::r, this});                         \
-    m_vcpu->emulate_wrmsr(a, {&mtrr_handler::w, this});
+#include <algorithm>
 
 // -----------------------------------------------------------------------------
-// Implementation
+// Definitions
 // -----------------------------------------------------------------------------
 
-namespace boxy::intel_x64
-{
+constexpr const uint32_t ia32_mtrrcap{0x000000FE};
+constexpr const uint32_t ia32_mtrr_physbase0{0x00000200};
+constexpr const uint32_t ia32_mtrr_fix64k_00000{0x00000250};
+constexpr const uint32_t ia32_mtrr_fix16k_80000{0x00000258};
+constexpr const uint32_t ia32_mtrr_fix16k_a0000{0x00000259};
+constexpr const uint32_t ia32_mtrr_fix4k_c0000{0x00000268};
+constexpr const uint32_t ia32_mtrr_fix4k_f8000{0x0000026F};
+constexpr const uint32_t ia32_mtrr_def_type{0x000002FF};
 
-mtrr_handler::mtrr_handler(
-    gsl::not_null<vcpu *> vcpu
-) :
-    m_vcpu{vcpu}
+constexpr const uint64_t mtrrcap_vcnt{0x00000000000000FF};
+constexpr const uint64_t mtrrcap_fix{0x0000000000000100};
+constexpr const uint64_t mtrrcap_wc{0x0000000000000400};
+
+constexpr const uint64_t def_type_type{0x00000000000000FF};
+constexpr const uint64_t def_type_fe{0x0000000000000400};
+constexpr const uint64_t def_type_e{0x0000000000000800};
+
+constexpr const uint64_t physmask_valid{0x0000000000000800};
+
+static int
+fixed_index(uint32_t msr) noexcept
 {
-    using namespace vmcs_n;
+    switch (msr) {
+        case ia32_mtrr_fix64k_00000:
+            return 0;
+        case ia32_mtrr_fix16k_80000:
+            return 1;
+        case ia32_mtrr_fix16k_a0000:
+            return 2;
+        default:
+            break;
+    }
 
-    if (vcpu->is_dom0()) {
-        return;
+    if (msr >= ia32_mtrr_fix4k_c0000 && msr <= ia32_mtrr_fix4k_f8000) {
+        return gsl::narrow_cast<int>(msr - ia32_mtrr_fix4k_c0000) + 3;
     }
 
-    EMULATE_MSR(0x000000FE, handle_rdmsr_0x000000FE, handle_wrmsr_0x000000FE);
-    EMULATE_MSR(0x00000200, handle_rdmsr_0x00000200, handle_wrmsr_0x00000200);
-    EMULATE_MSR(0x00000201, handle_rdmsr_0x00000201, handle_wrmsr_0x00000201);
-    EMULATE_MSR(0x000002FF, handle_rdmsr_0x000002FF, handle_wrmsr_0x000002FF);
+    return -1;
 }
 
 // -----------------------------------------------------------------------------
-// Handlers
+// Implementation
 // -----------------------------------------------------------------------------
 
-// Note:
-//
-// For now this MTRR handler creates a single variable range that tells the
-// guest that all of memory is cacheable. Once we add support for VT-d, we
-// will need to make this more granular to ensure that we mimic the same
-// cache type that the actual hardware states for any pass-through devices.
-//
+namespace boxy::intel_x64
+{
 
-bool
-mtrr_handler::handle_rdmsr_0x000000FE(
-    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+// -----------------------------------------------------------------------------
+// MTRR Ranges
+// -----------------------------------------------------------------------------
+
+void
+mtrr_ranges::init_guest()
 {
-    bfignored(vcpu);
+    auto [eax, ebx, ecx, edx] = ::x64::cpuid::get(0x80000008, 0, 0, 0);
+    bfignored(ebx);
+    bfignored(ecx);
+    bfignored(edx);
 
-    info.val = 1;
-    return true;
+    m_phys_mask = ((1ULL << (eax & 0xFF)) - 1) & ~0xFFFULL;
+
+    m_cap = MTRR_GUEST_VARIABLE_RANGES | mtrrcap_fix | mtrrcap_wc;
+    m_def_type = def_type_e | def_type_fe | write_back;
+
+    m_fixed.fill(0x0606060606060606);
+    m_physbase.fill(0);
+    m_physmask.fill(0);
+}
+
+void
+mtrr_ranges::init_host()
+{
+    using namespace ::x64::msrs;
+
+    auto [eax, ebx, ecx, edx] = ::x64::cpuid::get(0x80000008, 0, 0, 0);
+    bfignored(ebx);
+    bfignored(ecx);
+    bfignored(edx);
+
+    m_phys_mask = ((1ULL << (eax & 0xFF)) - 1) & ~0xFFFULL;
+
+    m_cap = get(ia32_mtrrcap);
+    m_def_type = get(ia32_mtrr_def_type);
+
+    auto vcnt = std::min<uint64_t>(
+        m_cap & mtrrcap_vcnt, MTRR_MAX_VARIABLE_RANGES);
+
+    m_cap = (m_cap & ~mtrrcap_vcnt) | vcnt;
+
+    for (uint32_t i = 0; i < vcnt; i++) {
+        m_physbase.at(i) = get(ia32_mtrr_physbase0 + (i * 2));
+        m_physmask.at(i) = get(ia32_mtrr_physbase0 + (i * 2) + 1);
+    }
+
+    if ((m_cap & mtrrcap_fix) != 0) {
+        m_fixed.at(0) = get(ia32_mtrr_fix64k_00000);
+        m_fixed.at(1) = get(ia32_mtrr_fix16k_80000);
+        m_fixed.at(2) = get(ia32_mtrr_fix16k_a0000);
+
+        for (uint32_t i = 0; i < 8; i++) {
+            m_fixed.at(i + 3) = get(ia32_mtrr_fix4k_c0000 + i);
+        }
+    }
 }
 
 bool
-mtrr_handler::handle_wrmsr_0x000000FE(
-    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+mtrr_ranges::is_mtrr(uint32_t msr) const noexcept
 {
-    bfignored(info);
+    if (msr == ia32_mtrrcap || msr == ia32_mtrr_def_type) {
+        return true;
+    }
+
+    auto vcnt = gsl::narrow_cast<uint32_t>(m_cap & mtrrcap_vcnt);
+    if (msr >= ia32_mtrr_physbase0 && msr < ia32_mtrr_physbase0 + vcnt * 2) {
+        return true;
+    }
+
+    return (m_cap & mtrrcap_fix) != 0 && fixed_index(msr) >= 0;
+}
+
+uint64_t
+mtrr_ranges::rdmsr(uint32_t msr) const noexcept
+{
+    switch (msr) {
+        case ia32_mtrrcap:
+            return m_cap;
+        case ia32_mtrr_def_type:
+            return m_def_type;
+        default:
+            break;
+    }
+
+    if (auto index = fixed_index(msr); index >= 0) {
+        return m_fixed.at(gsl::narrow_cast<std::size_t>(index));
+    }
 
-    vcpu->halt("wrmsr to 0xFE is not supported");
-    return false;
+    auto i = (msr - ia32_mtrr_physbase0) / 2;
+    return (msr & 1U) == 0 ? m_physbase.at(i) : m_physmask.at(i);
 }
 
 bool
-mtrr_handler::handle_rdmsr_0x00000200(
-    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+mtrr_ranges::wrmsr(uint32_t msr, uint64_t val) noexcept
 {
-    bfignored(vcpu);
+    switch (msr) {
+        case ia32_mtrrcap:
+            return false;
+
+        case ia32_mtrr_def_type:
+            if ((val & ~(def_type_type | def_type_fe | def_type_e)) != 0) {
+                return false;
+            }
+
+            if (!this->is_valid_type(val & def_type_type)) {
+                return false;
+            }
+
+            m_def_type = val;
+            return true;
+
+        default:
+            break;
+    }
+
+    if (auto index = fixed_index(msr); index >= 0) {
+        for (auto i = 0U; i < 64U; i += 8U) {
+            if (!this->is_valid_type((val >> i) & 0xFF)) {
+                return false;
+            }
+        }
+
+        m_fixed.at(gsl::narrow_cast<std::size_t>(index)) = val;
+        return true;
+    }
+
+    auto i = (msr - ia32_mtrr_physbase0) / 2;
+
+    if ((msr & 1U) == 0) {
+        if ((val & ~(m_phys_mask | 0xFF)) != 0) {
+            return false;
+        }
+
+        if (!this->is_valid_type(val & 0xFF)) {
+            return false;
+        }
+
+        m_physbase.at(i) = val;
+    }
+    else {
+        if ((val & ~(m_phys_mask | physmask_valid)) != 0) {
+            return false;
+        }
+
+        m_physmask.at(i) = val;
+    }
 
-    info.val = 0x6;
     return true;
 }
 
-bool
-mtrr_handler::handle_wrmsr_0x00000200(
-    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+uint64_t
+mtrr_ranges::memory_type(uintptr_t addr) const noexcept
 {
-    bfignored(info);
+    if ((m_def_type & def_type_e) == 0) {
+        return uncacheable;
+    }
 
-    vcpu->halt("wrmsr to 0x200 is not supported");
-    return false;
+    if (addr < 0x100000 && (m_def_type & def_type_fe) != 0) {
+        if ((m_cap & mtrrcap_fix) != 0) {
+            return this->fixed_type(addr);
+        }
+    }
+
+    // Note:
+    //
+    // If more than one variable range matches, UC wins, WT wins over WB
+    // and any other overlap is undefined (which we treat as UC).
+    //
+
+    bool matched{};
+    uint64_t type{};
+
+    auto vcnt = m_cap & mtrrcap_vcnt;
+    for (std::size_t i = 0; i < vcnt; i++) {
+        auto mask = m_physmask.at(i);
+        if ((mask & physmask_valid) == 0) {
+            continue;
+        }
+
+        mask &= m_phys_mask;
+        if ((addr & mask) != (m_physbase.at(i) & mask)) {
+            continue;
+        }
+
+        auto range_type = m_physbase.at(i) & 0xFF;
+
+        if (!matched) {
+            type = range_type;
+            matched = true;
+            continue;
+        }
+
+        if (type == range_type) {
+            continue;
+        }
+
+        if (type == uncacheable || range_type == uncacheable) {
+            return uncacheable;
+        }
+
+        if ((type == write_through && range_type == write_back) ||
+            (type == write_back && range_type == write_through)) {
+            type = write_through;
+            continue;
+        }
+
+        return uncacheable;
+    }
+
+    return matched ? type : m_def_type & def_type_type;
 }
 
 bool
-mtrr_handler::handle_rdmsr_0x00000201(
-    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+mtrr_ranges::is_uniform(uintptr_t addr, uintptr_t size) const noexcept
 {
-    bfignored(vcpu);
+    if ((m_def_type & def_type_e) == 0) {
+        return true;
+    }
+
+    if (addr < 0x100000 && size > 0x1000) {
+        if ((m_def_type & def_type_fe) != 0 && (m_cap & mtrrcap_fix) != 0) {
+            return false;
+        }
+    }
+
+    // Note:
+    //
+    // A variable range either never matches the range (the bits of the
+    // mask above size differ from the base), or it matches all of it
+    // (none of the bits of the mask are below size). Anything else means
+    // that only part of the range is covered.
+    //
+
+    auto vcnt = m_cap & mtrrcap_vcnt;
+    for (std::size_t i = 0; i < vcnt; i++) {
+        auto mask = m_physmask.at(i);
+        if ((mask & physmask_valid) == 0) {
+            continue;
+        }
+
+        mask &= m_phys_mask;
+        auto high = mask & ~(size - 1);
+
+        if ((addr & high) != (m_physbase.at(i) & high)) {
+            continue;
+        }
+
+        if ((mask & (size - 1)) != 0) {
+            return false;
+        }
+    }
 
-    info.val = 0x0;
     return true;
 }
 
 bool
-mtrr_handler::handle_wrmsr_0x00000201(
-    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+mtrr_ranges::is_valid_type(uint64_t type) const noexcept
+{
+    switch (type) {
+        case uncacheable:
+        case write_through:
+        case write_protected:
+        case write_back:
+            return true;
+
+        case write_combining:
+            return (m_cap & mtrrcap_wc) != 0;
+
+        default:
+            return false;
+    }
+}
+
+uint64_t
+mtrr_ranges::fixed_type(uintptr_t addr) const noexcept
+{
+    std::size_t index{};
+    std::size_t byte{};
+
+    if (addr < 0x80000) {
+        index = 0;
+        byte = addr >> 16U;
+    }
+    else if (addr < 0xC0000) {
+        auto i = (addr - 0x80000) >> 14U;
+        index = 1 + (i / 8);
+        byte = i % 8;
+    }
+    else {
+        auto i = (addr - 0xC0000) >> 12U;
+        index = 3 + (i / 8);
+        byte = i % 8;
+    }
+
+    return (m_fixed.at(index) >> (byte * 8)) & 0xFF;
+}
+
+// -----------------------------------------------------------------------------
+// MTRR Handler
+// -----------------------------------------------------------------------------
+
+mtrr_handler::mtrr_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
 {
-    bfignored(info);
+    using namespace vmcs_n;
+
+    if (vcpu->is_dom0()) {
+        return;
+    }
+
+    vcpu->add_exit_handler_for_reason(
+        exit_reason::basic_exit_reason::rdmsr,
+        {&mtrr_handler::handle_rdmsr, this}
+    );
 
-    vcpu->halt("wrmsr to 0x201 is not supported");
-    return false;
+    vcpu->add_exit_handler_for_reason(
+        exit_reason::basic_exit_reason::wrmsr,
+        {&mtrr_handler::handle_wrmsr, this}
+    );
 }
 
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The MTRRs are stored in the domain, and not in each vCPU. Guests program
+// the same MTRRs on every CPU, and storing them in the domain lets the
+// domain fold them into the memory type of its EPT entries.
+//
+
 bool
-mtrr_handler::handle_rdmsr_0x000002FF(
-    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+mtrr_handler::handle_rdmsr(vcpu_t *vcpu)
 {
-    bfignored(vcpu);
+    auto msr = gsl::narrow_cast<uint32_t>(vcpu->rcx());
+    auto &mtrrs = m_vcpu->dom()->mtrrs();
 
-    info.val = m_mtrr_def_type;
-    return true;
+    if (!mtrrs.is_mtrr(msr)) {
+        return false;
+    }
+
+    auto val = mtrrs.rdmsr(msr);
+
+    vcpu->set_rax(val & 0x00000000FFFFFFFF);
+    vcpu->set_rdx(val >> 32);
+
+    return vcpu->advance();
 }
 
 bool
-mtrr_handler::handle_wrmsr_0x000002FF(
-    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+mtrr_handler::handle_wrmsr(vcpu_t *vcpu)
 {
-    bfignored(vcpu);
+    auto msr = gsl::narrow_cast<uint32_t>(vcpu->rcx());
+    auto &mtrrs = m_vcpu->dom()->mtrrs();
 
-    m_mtrr_def_type = info.val;
-    return true;
+    if (!mtrrs.is_mtrr(msr)) {
+        return false;
+    }
+
+    auto val =
+        ((vcpu->rdx() & 0xFFFFFFFF) << 32U) | (vcpu->rax() & 0xFFFFFFFF);
+
+    if (!mtrrs.wrmsr(msr, val)) {
+        vcpu->inject_exception(13, 0);
+        return true;
+    }
+
+    return vcpu->advance();
 }
 
 }
@@ -0,0 +1,221 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/emulation/pio.h>
+#include <hve/arch/intel_x64/emulation/table.h>
+
+#include <algorithm>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// 0 means that nobody owns the port (i.e. the default policy), and the
+// largest value marks a pass-through port. Anything in between is the
+// index of the owning device plus 1.
+//
+
+constexpr const uint8_t owner_none{0x00};
+constexpr const uint8_t owner_pass_through{0xFF};
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+void
+pio_bus::add_device(port_type port, uint32_t size, const handler_delegate_t &d)
+{
+    expects(size != 0);
+
+    if (m_devices.size() + 1 >= owner_pass_through) {
+        throw std::runtime_error("pio_bus: too many devices");
+    }
+
+    for (uint32_t i = 0; i < size; i++) {
+        if (this->owner(gsl::narrow_cast<port_type>(port + i)) != owner_none) {
+            throw std::runtime_error("pio_bus: port already owned");
+        }
+    }
+
+    m_devices.push_back(d);
+    this->set_owner(port, size, gsl::narrow_cast<uint8_t>(m_devices.size()));
+}
+
+void
+pio_bus::add_pass_through(port_type port, uint32_t size, bool replace_device)
+{
+    expects(size != 0);
+
+    for (uint32_t i = 0; i < size && !replace_device; i++) {
+        auto owner = this->owner(gsl::narrow_cast<port_type>(port + i));
+        if (owner != owner_none && owner != owner_pass_through) {
+            throw std::runtime_error("pio_bus: port owned by a device");
+        }
+    }
+
+    m_pass_through.emplace_back(port, size);
+    this->set_owner(port, size, owner_pass_through);
+}
+
+void
+pio_bus::setup_vcpu(gsl::not_null<vcpu *> vcpu) const
+{
+    for (const auto &[port, size] : m_pass_through) {
+        for (uint32_t i = 0; i < size; i++) {
+            vcpu->pass_through_io_accesses(port + i);
+        }
+    }
+}
+
+bool
+pio_bus::handle(vcpu_t *vcpu) const
+{
+    namespace io = vmcs_n::exit_qualification::io_instruction;
+
+    auto eq = vmcs_n::exit_qualification::get();
+    auto port = gsl::narrow_cast<port_type>(io::port_number::get(eq));
+
+    auto owner = this->owner(port);
+
+    // Note:
+    //
+    // A pass-through port only exits if the access spans a port that is
+    // not passed through. That is not something we can emulate, so it is
+    // left to the base vCPU.
+    //
+
+    switch (owner) {
+        case owner_none:
+            return this->handle_default(vcpu);
+
+        case owner_pass_through:
+            return false;
+
+        default:
+            break;
+    }
+
+    if (m_devices[owner - 1U](vcpu)) {
+        return true;
+    }
+
+    return this->handle_default(vcpu);
+}
+
+uint8_t
+pio_bus::owner(port_type port) const noexcept
+{
+    if (const auto &page = m_owners[port >> 8U]) {
+        return (*page)[port & 0xFFU];
+    }
+
+    return owner_none;
+}
+
+void
+pio_bus::set_owner(port_type port, uint32_t size, uint8_t owner)
+{
+    if (port + size > 0x10000) {
+        throw std::runtime_error("pio_bus: invalid port range");
+    }
+
+    for (uint32_t i = port; i < port + size; i++) {
+        auto &page = m_owners.at(i >> 8U);
+
+        if (!page) {
+            page = std::make_unique<std::array<uint8_t, 256>>();
+            page->fill(owner_none);
+        }
+
+        page->at(i & 0xFFU) = owner;
+    }
+}
+
+bool
+pio_bus::handle_default(vcpu_t *vcpu) const
+{
+    namespace io = vmcs_n::exit_qualification::io_instruction;
+    auto eq = vmcs_n::exit_qualification::get();
+
+    auto size = io::size_of_access::get(eq) + 1;
+    auto in = io::direction::get(eq) == io::direction::in;
+
+    if (io::string_instruction::is_disabled(eq)) {
+        if (in) {
+            auto mask = (1ULL << (size * 8)) - 1;
+            auto rax = size == 4 ? 0 : vcpu->rax();
+
+            vcpu->set_rax(rax | mask);
+        }
+
+        return vcpu->advance();
+    }
+
+    // Note:
+    //
+    // A string instruction is emulated one iteration per exit (the same
+    // way the MMIO handler does it). INS stores all ones and OUTS is
+    // dropped. RIP is only advanced once RCX reaches 0. RDI, RSI and RCX
+    // are used at the instruction's address size.
+    //
+
+    auto addr_size = io_string_addr_size();
+
+    auto rep = io::rep_prefixed::is_enabled(eq);
+    if (rep && addr_reg(vcpu->rcx(), addr_size) == 0) {
+        return vcpu->advance();
+    }
+
+    auto step = size;
+    if ((vmcs_n::guest_rflags::get() &
+        ::x64::rflags::direction_flag::mask) != 0) {
+        step = ~size + 1;
+    }
+
+    if (in) {
+        auto dst = vcpu->map_gva_4k<uint8_t>(
+            addr_reg(vcpu->rdi(), addr_size), size);
+        std::fill(dst.get(), dst.get() + size, 0xFF);
+
+        vcpu->set_rdi(addr_add(vcpu->rdi(), step, addr_size));
+    }
+    else {
+        vcpu->set_rsi(addr_add(vcpu->rsi(), step, addr_size));
+    }
+
+    if (rep) {
+        vcpu->set_rcx(addr_add(vcpu->rcx(), ~0ULL, addr_size));
+        if (addr_reg(vcpu->rcx(), addr_size) != 0) {
+            return true;
+        }
+    }
+
+    return vcpu->advance();
+}
+
+}
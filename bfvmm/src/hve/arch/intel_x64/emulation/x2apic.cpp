@@ -21,12 +21,12 @@
 
 #include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/emulation/x2apic.h>
+#include <hve/arch/intel_x64/emulation/table.h>
 
 #include <iostream>
 
 #define EMULATE_MSR(a,r,w)                                                     \
-    m_vcpu->emulate_rdmsr(a, {&x2apic_handler::r, this});                      \
-    m_vcpu->emulate_wrmsr(a, {&x2apic_handler::w, this});
+    {a, &x2apic_handler::r, &x2apic_handler::w}
 
 // -----------------------------------------------------------------------------
 // Implementation
@@ -35,6 +35,43 @@
 namespace boxy::intel_x64
 {
 
+// -----------------------------------------------------------------------------
+// Emulated MSRs
+// -----------------------------------------------------------------------------
+
+static const msr_entry_t<x2apic_handler> s_msrs[] = {
+    EMULATE_MSR(0x0000001B, handle_rdmsr_0x0000001B, handle_wrmsr_0x0000001B),
+
+    EMULATE_MSR(0x00000802, handle_rdmsr_0x00000802, handle_wrmsr_0x00000802),
+    EMULATE_MSR(0x00000803, handle_rdmsr_0x00000803, handle_wrmsr_0x00000803),
+    EMULATE_MSR(0x00000808, handle_rdmsr_0x00000808, handle_wrmsr_0x00000808),
+    EMULATE_MSR(0x0000080B, handle_rdmsr_0x0000080B, handle_wrmsr_0x0000080B),
+    EMULATE_MSR(0x0000080F, handle_rdmsr_0x0000080F, handle_wrmsr_0x0000080F),
+    EMULATE_MSR(0x00000828, handle_rdmsr_0x00000828, handle_wrmsr_0x00000828),
+
+    EMULATE_MSR(0x00000810, handle_rdmsr_0x00000810, handle_wrmsr_0x00000810),
+    EMULATE_MSR(0x00000811, handle_rdmsr_0x00000811, handle_wrmsr_0x00000811),
+    EMULATE_MSR(0x00000812, handle_rdmsr_0x00000812, handle_wrmsr_0x00000812),
+    EMULATE_MSR(0x00000813, handle_rdmsr_0x00000813, handle_wrmsr_0x00000813),
+    EMULATE_MSR(0x00000814, handle_rdmsr_0x00000814, handle_wrmsr_0x00000814),
+    EMULATE_MSR(0x00000815, handle_rdmsr_0x00000815, handle_wrmsr_0x00000815),
+    EMULATE_MSR(0x00000816, handle_rdmsr_0x00000816, handle_wrmsr_0x00000816),
+    EMULATE_MSR(0x00000817, handle_rdmsr_0x00000817, handle_wrmsr_0x00000817),
+
+    EMULATE_MSR(0x00000820, handle_rdmsr_0x00000820, handle_wrmsr_0x00000820),
+    EMULATE_MSR(0x00000821, handle_rdmsr_0x00000821, handle_wrmsr_0x00000821),
+    EMULATE_MSR(0x00000822, handle_rdmsr_0x00000822, handle_wrmsr_0x00000822),
+    EMULATE_MSR(0x00000823, handle_rdmsr_0x00000823, handle_wrmsr_0x00000823),
+    EMULATE_MSR(0x00000824, handle_rdmsr_0x00000824, handle_wrmsr_0x00000824),
+    EMULATE_MSR(0x00000825, handle_rdmsr_0x00000825, handle_wrmsr_0x00000825),
+    EMULATE_MSR(0x00000826, handle_rdmsr_0x00000826, handle_wrmsr_0x00000826),
+    EMULATE_MSR(0x00000827, handle_rdmsr_0x00000827, handle_wrmsr_0x00000827),
+
+    EMULATE_MSR(0x00000835, handle_rdmsr_0x00000835, handle_wrmsr_0x00000835),
+    EMULATE_MSR(0x00000836, handle_rdmsr_0x00000836, handle_wrmsr_0x00000836),
+    EMULATE_MSR(0x00000837, handle_rdmsr_0x00000837, handle_wrmsr_0x00000837)
+};
+
 x2apic_handler::x2apic_handler(
     gsl::not_null<vcpu *> vcpu
 ) :
@@ -46,37 +83,29 @@ x2apic_handler::x2apic_handler(
         return;
     }
 
-    EMULATE_MSR(0x0000001B, handle_rdmsr_0x0000001B, handle_wrmsr_0x0000001B);
-
-    EMULATE_MSR(0x00000802, handle_rdmsr_0x00000802, handle_wrmsr_0x00000802);
-    EMULATE_MSR(0x00000803, handle_rdmsr_0x00000803, handle_wrmsr_0x00000803);
-    EMULATE_MSR(0x00000808, handle_rdmsr_0x00000808, handle_wrmsr_0x00000808);
-    EMULATE_MSR(0x0000080F, handle_rdmsr_0x0000080F, handle_wrmsr_0x0000080F);
-    EMULATE_MSR(0x00000828, handle_rdmsr_0x00000828, handle_wrmsr_0x00000828);
-
-    EMULATE_MSR(0x00000810, handle_rdmsr_0x00000810, handle_wrmsr_0x00000810);
-    EMULATE_MSR(0x00000811, handle_rdmsr_0x00000811, handle_wrmsr_0x00000811);
-    EMULATE_MSR(0x00000812, handle_rdmsr_0x00000812, handle_wrmsr_0x00000812);
-    EMULATE_MSR(0x00000813, handle_rdmsr_0x00000813, handle_wrmsr_0x00000813);
-    EMULATE_MSR(0x00000814, handle_rdmsr_0x00000814, handle_wrmsr_0x00000814);
-    EMULATE_MSR(0x00000815, handle_rdmsr_0x00000815, handle_wrmsr_0x00000815);
-    EMULATE_MSR(0x00000816, handle_rdmsr_0x00000816, handle_wrmsr_0x00000816);
-    EMULATE_MSR(0x00000817, handle_rdmsr_0x00000817, handle_wrmsr_0x00000817);
-
-    EMULATE_MSR(0x00000820, handle_rdmsr_0x00000820, handle_wrmsr_0x00000820);
-    EMULATE_MSR(0x00000821, handle_rdmsr_0x00000821, handle_wrmsr_0x00000821);
-    EMULATE_MSR(0x00000822, handle_rdmsr_0x00000822, handle_wrmsr_0x00000822);
-    EMULATE_MSR(0x00000823, handle_rdmsr_0x00000823, handle_wrmsr_0x00000823);
-    EMULATE_MSR(0x00000824, handle_rdmsr_0x00000824, handle_wrmsr_0x00000824);
-    EMULATE_MSR(0x00000825, handle_rdmsr_0x00000825, handle_wrmsr_0x00000825);
-    EMULATE_MSR(0x00000826, handle_rdmsr_0x00000826, handle_wrmsr_0x00000826);
-    EMULATE_MSR(0x00000827, handle_rdmsr_0x00000827, handle_wrmsr_0x00000827);
-
-    EMULATE_MSR(0x00000835, handle_rdmsr_0x00000835, handle_wrmsr_0x00000835);
-    EMULATE_MSR(0x00000836, handle_rdmsr_0x00000836, handle_wrmsr_0x00000836);
-    EMULATE_MSR(0x00000837, handle_rdmsr_0x00000837, handle_wrmsr_0x00000837);
+    vcpu->add_exit_handler_for_reason(
+        exit_reason::basic_exit_reason::rdmsr,
+        {&x2apic_handler::handle_rdmsr, this}
+    );
+
+    vcpu->add_exit_handler_for_reason(
+        exit_reason::basic_exit_reason::wrmsr,
+        {&x2apic_handler::handle_wrmsr, this}
+    );
 }
 
+// -----------------------------------------------------------------------------
+// Dispatch
+// -----------------------------------------------------------------------------
+
+bool
+x2apic_handler::handle_rdmsr(vcpu_t *vcpu)
+{ return emulate_rdmsr(this, vcpu, s_msrs); }
+
+bool
+x2apic_handler::handle_wrmsr(vcpu_t *vcpu)
+{ return emulate_wrmsr(this, vcpu, s_msrs); }
+
 // -----------------------------------------------------------------------------
 // General MSRs
 // -----------------------------------------------------------------------------
@@ -168,6 +197,33 @@ x2apic_handler::handle_wrmsr_0x00000808(
     return true;
 }
 
+bool
+x2apic_handler::handle_rdmsr_0x0000080B(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(info);
+
+    vcpu->halt("reading from the EOI register is not supported");
+    return true;
+}
+
+bool
+x2apic_handler::handle_wrmsr_0x0000080B(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+    bfignored(info);
+
+    // Note:
+    //
+    // Interrupts are injected directly and the ISR is never set, so there
+    // is nothing to acknowledge. This is needed by guests that use the
+    // APIC timer (i.e. TSC deadline mode) which EOI every tick.
+    //
+
+    return true;
+}
+
 bool
 x2apic_handler::handle_rdmsr_0x0000080F(
     vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
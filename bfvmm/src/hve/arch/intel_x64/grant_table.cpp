@@ -0,0 +1,414 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <bfgpalayout.h>
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/domain.h>
+#include <hve/arch/intel_x64/grant_table.h>
+
+#include <mutex>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+constexpr const uintptr_t page_mask_4k{0xFFF};
+
+static std::mutex s_mutex;
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+grant_table::grant_table(gsl::not_null<domain *> dom) :
+    m_domain{dom}
+{ }
+
+grant_table::~grant_table()
+{
+    std::lock_guard lock(s_mutex);
+    batch_t batch;
+
+    try {
+        for (const auto &[ref, user] : m_users) {
+            bfignored(ref);
+
+            user.peer->release(user.gpa);
+            batch.domains.insert(user.peer->m_domain);
+        }
+
+        m_users.clear();
+
+        // Note:
+        //
+        // Our own EPT is about to be destroyed, so the grants we have
+        // mapped only have to be forgotten by their granters (once we
+        // have synced, like any other unmap).
+        //
+
+        for (const auto &[gpa, mapping] : m_mapped) {
+            auto &users = mapping.granter->m_users;
+            auto [begin, end] = users.equal_range(mapping.ref);
+
+            for (auto iter = begin; iter != end; ++iter) {
+                if (iter->second.peer == this && iter->second.gpa == gpa) {
+                    users.erase(iter);
+                    break;
+                }
+            }
+
+            batch.domains.insert(m_domain);
+            batch.refs.emplace_back(mapping.granter, mapping.ref);
+        }
+
+        m_mapped.clear();
+    }
+    catchall({
+        bfalert_info(0, "grant_table: teardown failed");
+    })
+
+    // Note:
+    //
+    // Once we return, the domain's memory (including the pages it granted)
+    // is given back to dom0, so every peer must be done with them first.
+    //
+
+    flush(batch);
+}
+
+void
+grant_table::set_table(vcpu *vcpu, uintptr_t gva, uint64_t pages)
+{
+    std::lock_guard lock(s_mutex);
+
+    if (!m_users.empty()) {
+        throw std::runtime_error("grant_table: grants are still mapped");
+    }
+
+    if ((gva & page_mask_4k) != 0 || pages > BOXY_GRANT_TABLE_MAX_PAGES) {
+        throw std::runtime_error("grant_table: invalid table");
+    }
+
+    m_table.clear();
+    m_entries = 0;
+
+    if (gva == 0 || pages == 0) {
+        return;
+    }
+
+    // Note:
+    //
+    // Each page is translated exactly once, and mapped using the GPA that
+    // was checked, so the guest cannot swap a page of the table for one in
+    // its grant window (which a peer can take away at any time) by racing
+    // us with another vCPU.
+    //
+
+    decltype(m_table) table;
+
+    for (uint64_t i = 0; i < pages; i++) {
+        auto [gpa, unused] = vcpu->gva_to_gpa(gva + (i * (page_mask_4k + 1)));
+        bfignored(unused);
+
+        if (gpa >= GRANT_MAP_GPA && gpa < GRANT_MAP_GPA + GRANT_MAP_SIZE) {
+            throw std::runtime_error("grant_table: table in grant window");
+        }
+
+        table.push_back(
+            vcpu->map_gpa_4k<struct boxy_grant_entry>(
+                gpa, BOXY_GRANT_ENTRIES_PER_PAGE)
+        );
+    }
+
+    m_table = std::move(table);
+    m_entries = pages * BOXY_GRANT_ENTRIES_PER_PAGE;
+}
+
+bool
+grant_table::map(grant_table &granter, gsl::span<struct boxy_grant_op> ops)
+{
+    std::lock_guard lock(s_mutex);
+    auto success = true;
+
+    // Note:
+    //
+    // The ops live in guest memory, so each op is copied before it is
+    // validated. Otherwise, the guest could change it while it is used.
+    //
+
+    for (auto &op : ops) {
+        try {
+            struct boxy_grant_op copy = op;
+            this->map_one(granter, copy);
+            op.status = SUCCESS;
+        }
+        catchall({
+            op.status = FAILURE;
+            success = false;
+        })
+    }
+
+    return success;
+}
+
+bool
+grant_table::unmap(gsl::span<struct boxy_grant_op> ops)
+{
+    std::lock_guard lock(s_mutex);
+
+    auto success = true;
+    batch_t batch;
+
+    for (auto &op : ops) {
+        try {
+            this->unmap_one(op.gpa, batch);
+            op.status = SUCCESS;
+        }
+        catchall({
+            op.status = FAILURE;
+            success = false;
+        })
+    }
+
+    flush(batch);
+    return success;
+}
+
+bool
+grant_table::revoke(gsl::span<struct boxy_grant_op> ops)
+{
+    std::lock_guard lock(s_mutex);
+
+    auto success = true;
+    batch_t batch;
+
+    for (auto &op : ops) {
+        try {
+            this->revoke_one(op.ref, batch);
+            op.status = SUCCESS;
+        }
+        catchall({
+            op.status = FAILURE;
+            success = false;
+        })
+    }
+
+    flush(batch);
+    return success;
+}
+
+void
+grant_table::map_one(grant_table &granter, const struct boxy_grant_op &op)
+{
+    if (op.ref >= granter.m_entries) {
+        throw std::runtime_error("grant_table: invalid grant reference");
+    }
+
+    // Note:
+    //
+    // The entry belongs to the granter, who can change it at any time, so
+    // each field is read exactly once.
+    //
+
+    auto entry = granter.entry(op.ref);
+
+    uint64_t flags = *reinterpret_cast<volatile uint64_t *>(&entry->flags);
+    uint64_t domid = *reinterpret_cast<volatile uint64_t *>(&entry->domid);
+    uint64_t gpa = *reinterpret_cast<volatile uint64_t *>(&entry->gpa);
+
+    if ((flags & BOXY_GRANT_PERMIT) == 0 || domid != m_domain->id()) {
+        throw std::runtime_error("grant_table: access denied");
+    }
+
+    auto write = (op.flags & BOXY_GRANT_MAP_WRITE) != 0;
+    if (write && (flags & BOXY_GRANT_READONLY) != 0) {
+        throw std::runtime_error("grant_table: grant is read-only");
+    }
+
+    // Note:
+    //
+    // Only the granter's RAM can be granted. RAM stops below 4GB, so this
+    // also keeps the granter from passing on grants it has mapped from
+    // someone else.
+    //
+
+    if ((gpa & page_mask_4k) != 0 || gpa >= GRANT_MAP_GPA) {
+        throw std::runtime_error("grant_table: invalid grant");
+    }
+
+    if ((op.gpa & page_mask_4k) != 0 || op.gpa < GRANT_MAP_GPA ||
+        op.gpa >= GRANT_MAP_GPA + GRANT_MAP_SIZE) {
+        throw std::runtime_error("grant_table: gpa outside of grant window");
+    }
+
+    if (m_mapped.count(op.gpa) != 0) {
+        throw std::runtime_error("grant_table: gpa already mapped");
+    }
+
+    // Note:
+    //
+    // The granter cannot give away more than it has. Some of its pages are
+    // read-only (e.g. the pages bfbuilder donates with donate_page_r), so
+    // a writable grant needs a writable mapping in the granter's EPT.
+    //
+
+    auto [hpa, unused] = granter.m_domain->gpa_to_hpa(gpa);
+    bfignored(unused);
+
+    if (write && !granter.m_domain->is_writable(gpa)) {
+        throw std::runtime_error("grant_table: page is read-only");
+    }
+
+    m_mapped.emplace(op.gpa, mapping_t{&granter, op.ref});
+    auto user = granter.m_users.emplace(op.ref, user_t{this, op.gpa});
+
+    try {
+        if (write) {
+            m_domain->map_4k_rw(op.gpa, hpa);
+        }
+        else {
+            m_domain->map_4k_r(op.gpa, hpa);
+        }
+    }
+    catch (...) {
+        granter.m_users.erase(user);
+        m_mapped.erase(op.gpa);
+
+        throw;
+    }
+
+    granter.set_mapped(op.ref);
+}
+
+void
+grant_table::unmap_one(uintptr_t gpa, batch_t &batch)
+{
+    auto iter = m_mapped.find(gpa);
+    if (iter == m_mapped.end()) {
+        throw std::runtime_error("grant_table: gpa not mapped");
+    }
+
+    auto [granter, ref] = iter->second;
+    auto [begin, end] = granter->m_users.equal_range(ref);
+
+    batch.domains.insert(m_domain);
+    batch.refs.emplace_back(granter, ref);
+
+    for (auto user = begin; user != end; ++user) {
+        if (user->second.peer == this && user->second.gpa == gpa) {
+            granter->m_users.erase(user);
+            break;
+        }
+    }
+
+    this->release(gpa);
+}
+
+void
+grant_table::revoke_one(uint64_t ref, batch_t &batch)
+{
+    if (ref >= m_entries) {
+        throw std::runtime_error("grant_table: invalid grant reference");
+    }
+
+    auto [begin, end] = m_users.equal_range(ref);
+    if (begin == end) {
+        return;
+    }
+
+    batch.refs.emplace_back(this, ref);
+
+    for (auto user = begin; user != end; ++user) {
+        batch.domains.insert(user->second.peer->m_domain);
+    }
+
+    for (auto user = begin; user != end; ++user) {
+        user->second.peer->release(user->second.gpa);
+    }
+
+    m_users.erase(begin, end);
+}
+
+void
+grant_table::release(uintptr_t gpa)
+{
+    m_domain->unmap(gpa);
+    m_mapped.erase(gpa);
+}
+
+void
+grant_table::flush(const batch_t &batch) noexcept
+{
+    if (batch.domains.empty()) {
+        return;
+    }
+
+    // Note:
+    //
+    // The current CPU is flushed once for the whole batch. Every other CPU
+    // flushes when it next enters one of the stale domains, so we wait
+    // until every vCPU of those domains has either done so or left the
+    // guest. Only then are the granters told that their pages are free.
+    //
+
+    for (const auto dom : batch.domains) {
+        dom->invalidate_ept();
+    }
+
+    ::intel_x64::vmx::invept_global();
+
+    for (const auto dom : batch.domains) {
+        dom->sync_ept(dom->ept_generation());
+    }
+
+    for (const auto &[granter, ref] : batch.refs) {
+        granter->set_mapped(ref);
+    }
+}
+
+struct boxy_grant_entry *
+grant_table::entry(uint64_t ref) const noexcept
+{
+    auto page = ref / BOXY_GRANT_ENTRIES_PER_PAGE;
+    auto index = ref % BOXY_GRANT_ENTRIES_PER_PAGE;
+
+    return &m_table[page].get()[index];
+}
+
+void
+grant_table::set_mapped(uint64_t ref) noexcept
+{
+    if (ref >= m_entries) {
+        return;
+    }
+
+    auto entry = this->entry(ref);
+    auto mapped = reinterpret_cast<volatile uint64_t *>(&entry->mapped);
+
+    *mapped = m_users.count(ref);
+}
+
+}
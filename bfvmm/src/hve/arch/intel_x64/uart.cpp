@@ -23,90 +23,56 @@
 
 #include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/uart.h>
+#include <hve/arch/intel_x64/emulation/table.h>
 
 #include <iostream>
+#include <algorithm>
 
 //--------------------------------------------------------------------------
 // Implementation
 //--------------------------------------------------------------------------
 
 #define EMULATE_IO_INSTRUCTION(a,b,c)                                      \
-    vcpu->emulate_io_instruction(a, {&uart::b, this}, {&uart::c, this});
+    {a, &uart::b, &uart::c}
 
 namespace boxy::intel_x64
 {
 
+//--------------------------------------------------------------------------
+// Emulated Registers
+//--------------------------------------------------------------------------
+
+static const io_entry_t<uart> s_regs[] = {
+    EMULATE_IO_INSTRUCTION(0, reg0_in_handler, reg0_out_handler),
+    EMULATE_IO_INSTRUCTION(1, reg1_in_handler, reg1_out_handler),
+    EMULATE_IO_INSTRUCTION(2, reg2_in_handler, reg2_out_handler),
+    EMULATE_IO_INSTRUCTION(3, reg3_in_handler, reg3_out_handler),
+    EMULATE_IO_INSTRUCTION(4, reg4_in_handler, reg4_out_handler),
+    EMULATE_IO_INSTRUCTION(5, reg5_in_handler, reg5_out_handler),
+    EMULATE_IO_INSTRUCTION(6, reg6_in_handler, reg6_out_handler),
+    EMULATE_IO_INSTRUCTION(7, reg7_in_handler, reg7_out_handler)
+};
+
+static const io_entry_t<uart> s_disabled_regs[] = {
+    EMULATE_IO_INSTRUCTION(0, io_zero_handler, io_ignore_handler),
+    EMULATE_IO_INSTRUCTION(1, io_zero_handler, io_ignore_handler),
+    EMULATE_IO_INSTRUCTION(2, io_zero_handler, io_ignore_handler),
+    EMULATE_IO_INSTRUCTION(3, io_zero_handler, io_ignore_handler),
+    EMULATE_IO_INSTRUCTION(4, io_zero_handler, io_ignore_handler),
+    EMULATE_IO_INSTRUCTION(5, io_zero_handler, io_ignore_handler),
+    EMULATE_IO_INSTRUCTION(6, io_zero_handler, io_ignore_handler),
+    EMULATE_IO_INSTRUCTION(7, io_zero_handler, io_ignore_handler)
+};
+
 uart::uart(port_type port) :
     m_port{port}
 { }
 
 void
-uart::enable(gsl::not_null<vcpu *> vcpu)
+uart::enable() noexcept
 {
-    if (vcpu->is_dom0()) {
-        bfdebug_nhex(1, "uart: dom0 not supported", m_port);
-        return;
-    }
-
     bfdebug_nhex(1, "uart: enabling", m_port);
-    EMULATE_IO_INSTRUCTION(m_port + 0, reg0_in_handler, reg0_out_handler);
-    EMULATE_IO_INSTRUCTION(m_port + 1, reg1_in_handler, reg1_out_handler);
-    EMULATE_IO_INSTRUCTION(m_port + 2, reg2_in_handler, reg2_out_handler);
-    EMULATE_IO_INSTRUCTION(m_port + 3, reg3_in_handler, reg3_out_handler);
-    EMULATE_IO_INSTRUCTION(m_port + 4, reg4_in_handler, reg4_out_handler);
-    EMULATE_IO_INSTRUCTION(m_port + 5, reg5_in_handler, reg5_out_handler);
-    EMULATE_IO_INSTRUCTION(m_port + 6, reg6_in_handler, reg6_out_handler);
-    EMULATE_IO_INSTRUCTION(m_port + 7, reg7_in_handler, reg7_out_handler);
-
-    // vcpu->add_vmcall_handler(
-    //     vmcall_handler_delegate(uart, vmcall_dispatch)
-    // );
-}
-
-void
-uart::disable(gsl::not_null<vcpu *> vcpu)
-{
-    if (vcpu->is_dom0()) {
-        bfdebug_nhex(1, "uart: dom0 not supported", m_port);
-        return;
-    }
-
-    bfdebug_nhex(1, "uart: disabling", m_port);
-    EMULATE_IO_INSTRUCTION(m_port + 0, io_zero_handler, io_ignore_handler);
-    EMULATE_IO_INSTRUCTION(m_port + 1, io_zero_handler, io_ignore_handler);
-    EMULATE_IO_INSTRUCTION(m_port + 2, io_zero_handler, io_ignore_handler);
-    EMULATE_IO_INSTRUCTION(m_port + 3, io_zero_handler, io_ignore_handler);
-    EMULATE_IO_INSTRUCTION(m_port + 4, io_zero_handler, io_ignore_handler);
-    EMULATE_IO_INSTRUCTION(m_port + 5, io_zero_handler, io_ignore_handler);
-    EMULATE_IO_INSTRUCTION(m_port + 6, io_zero_handler, io_ignore_handler);
-    EMULATE_IO_INSTRUCTION(m_port + 7, io_zero_handler, io_ignore_handler);
-
-    // vcpu->add_vmcall_handler(
-    //     vmcall_handler_delegate(uart, vmcall_dispatch)
-    // );
-}
-
-void
-uart::pass_through(gsl::not_null<vcpu *> vcpu)
-{
-    if (vcpu->is_dom0()) {
-        bfdebug_nhex(1, "uart: dom0 not supported", m_port);
-        return;
-    }
-
-    bfdebug_nhex(1, "uart: passing through", m_port);
-    vcpu->pass_through_io_accesses(m_port + 0);
-    vcpu->pass_through_io_accesses(m_port + 1);
-    vcpu->pass_through_io_accesses(m_port + 2);
-    vcpu->pass_through_io_accesses(m_port + 3);
-    vcpu->pass_through_io_accesses(m_port + 4);
-    vcpu->pass_through_io_accesses(m_port + 5);
-    vcpu->pass_through_io_accesses(m_port + 6);
-    vcpu->pass_through_io_accesses(m_port + 7);
-
-    // vcpu->add_vmcall_handler(
-    //     vmcall_handler_delegate(uart, vmcall_dispatch)
-    // );
+    m_enabled = true;
 }
 
 uint64_t
@@ -120,9 +86,25 @@ uart::dump(const gsl::span<char> &buffer)
     }
 
     m_index = 0;
+    m_consumer = true;
+
     return i;
 }
 
+bool
+uart::io_handler(vcpu_t *vcpu)
+{
+    if (!m_enabled) {
+        return emulate_io_instruction(this, vcpu, m_port, s_disabled_regs);
+    }
+
+    if (this->outs_handler(vcpu)) {
+        return true;
+    }
+
+    return emulate_io_instruction(this, vcpu, m_port, s_regs);
+}
+
 bool
 uart::io_zero_handler(
     vcpu_t *vcpu, bfvmm::intel_x64::io_instruction_handler::info_t &info)
@@ -171,7 +153,7 @@ uart::reg1_in_handler(
         info.val = m_baud_rate_h;
     }
     else {
-        info.val = 0x0;
+        info.val = m_interrupt_enable_register;
     }
 
     return true;
@@ -182,10 +164,16 @@ uart::reg2_in_handler(
     vcpu_t *vcpu, bfvmm::intel_x64::io_instruction_handler::info_t &info)
 {
     bfignored(vcpu);
+    std::lock_guard lock(m_mutex);
 
-    info.val = 0x0;
-    bfalert_info(1, "uart: reg2 read not supported");
+    // Note:
+    //
+    // This is the IIR. Since the transmitter is always empty, no interrupt
+    // is ever pending (bit 0 set). Bits 6 and 7 report the FIFOs as
+    // enabled, which is what tells the guest that this is a 16550A.
+    //
 
+    info.val = this->fifo_enabled() ? 0xC1 : 0x01;
     return true;
 }
 
@@ -250,14 +238,24 @@ bool
 uart::reg0_out_handler(
     vcpu_t *vcpu, bfvmm::intel_x64::io_instruction_handler::info_t &info)
 {
-    bfignored(vcpu);
-    std::lock_guard lock(m_mutex);
+    uint64_t notify = 0;
+    std::size_t done = 0;
 
-    if (this->dlab()) {
-        m_baud_rate_l = gsl::narrow<data_type>(info.val);
+    auto c = gsl::narrow<char>(info.val);
+
+    {
+        std::lock_guard lock(m_mutex);
+
+        if (this->dlab()) {
+            m_baud_rate_l = gsl::narrow<data_type>(info.val);
+            return true;
+        }
+
+        done = this->transmit(gsl::span(&c, 1), notify);
     }
-    else {
-        this->write(gsl::narrow<char>(info.val));
+
+    if (notify != 0) {
+        this->notify(vcpu, notify, done == 1);
     }
 
     return true;
@@ -274,9 +272,8 @@ uart::reg1_out_handler(
         m_baud_rate_h = gsl::narrow<data_type>(info.val);
     }
     else {
-        if (info.val != 0) {
-            bfalert_info(1, "uart: none-zero write to reg1 unsupported");
-        }
+        m_interrupt_enable_register =
+            gsl::narrow<data_type>(info.val & 0x0F);
     }
 
     return true;
@@ -287,7 +284,21 @@ uart::reg2_out_handler(
     vcpu_t *vcpu, bfvmm::intel_x64::io_instruction_handler::info_t &info)
 {
     bfignored(vcpu);
-    bfignored(info);
+    std::lock_guard lock(m_mutex);
+
+    // Note:
+    //
+    // This is the FCR. The clear bits (1 and 2) are self clearing and there
+    // is nothing to clear as the FIFOs are always empty, so only the enable
+    // bit, the DMA mode bit and the trigger level are recorded.
+    //
+
+    if ((info.val & 0x01) != 0) {
+        m_fifo_control_register = gsl::narrow<data_type>(info.val & 0xC9);
+    }
+    else {
+        m_fifo_control_register = 0;
+    }
 
     return true;
 }
@@ -346,6 +357,135 @@ uart::reg7_out_handler(
     return true;
 }
 
+bool
+uart::outs_handler(vcpu_t *vcpu)
+{
+    namespace io = vmcs_n::exit_qualification::io_instruction;
+    auto eq = vmcs_n::exit_qualification::get();
+
+    // Note:
+    //
+    // The base I/O instruction handler only emulates one access per exit,
+    // which means a rep outsb to the THR would exit once per byte. Instead,
+    // we move as much of the string as we can per exit (limited to the
+    // current page of the source). If the string is not finished, the
+    // instruction is not advanced and the guest resumes the rep outsb with
+    // the remaining bytes, just like it would after an interrupt. Anything
+    // that is not a forward, byte sized outs to the THR is left to the base
+    // handler, and so is a segment override, as we do not apply segment
+    // bases. RSI and RCX are used at the instruction's address size.
+    //
+
+    if (io::string_instruction::is_disabled(eq)) {
+        return false;
+    }
+
+    if (io::direction::get(eq) != io::direction::out) {
+        return false;
+    }
+
+    if (io::size_of_access::get(eq) != io::size_of_access::one_byte) {
+        return false;
+    }
+
+    if (io::port_number::get(eq) != m_port) {
+        return false;
+    }
+
+    auto rflags = vmcs_n::guest_rflags::get();
+    if ((rflags & ::x64::rflags::direction_flag::mask) != 0) {
+        return false;
+    }
+
+    if (io_string_segment() != io_string_segment_ds) {
+        return false;
+    }
+
+    auto addr_size = io_string_addr_size();
+
+    auto rep = io::rep_prefixed::is_enabled(eq);
+    auto count = rep ? addr_reg(vcpu->rcx(), addr_size) : 1;
+
+    if (count == 0) {
+        return vcpu->advance();
+    }
+
+    auto addr = addr_reg(vcpu->rsi(), addr_size);
+    count = std::min(
+        count, BAREFLANK_PAGE_SIZE - (addr & (BAREFLANK_PAGE_SIZE - 1)));
+
+    auto src = vcpu->map_gva_4k<char>(addr, count);
+
+    uint64_t notify = 0;
+    std::size_t done = 0;
+
+    {
+        std::lock_guard lock(m_mutex);
+
+        if (this->dlab()) {
+            return false;
+        }
+
+        done = this->transmit(gsl::span(src.get(), count), notify);
+    }
+
+    vcpu->set_rsi(addr_add(vcpu->rsi(), done, addr_size));
+
+    if (rep) {
+        vcpu->set_rcx(addr_add(vcpu->rcx(), ~done + 1, addr_size));
+    }
+
+    auto complete = !rep || addr_reg(vcpu->rcx(), addr_size) == 0;
+
+    if (notify != 0) {
+        this->notify(vcpu, notify, complete);
+    }
+
+    return complete ? vcpu->advance() : true;
+}
+
+std::size_t
+uart::transmit(const gsl::span<const char> &data, uint64_t &notify)
+{
+    auto before = m_index;
+
+    if (!m_consumer) {
+        for (const auto &c : data) {
+            this->write(c);
+        }
+
+        return static_cast<std::size_t>(data.size());
+    }
+
+    auto len = std::min(
+        static_cast<std::size_t>(data.size()), m_buffer.size() - m_index);
+
+    for (std::size_t i = 0; i < len; i++) {
+        this->write(data.at(static_cast<std::ptrdiff_t>(i)));
+    }
+
+    // Note:
+    //
+    // dom0 is notified when the buffer goes from empty to non-empty, when
+    // the buffer crosses the watermark, or when the buffer is full and the
+    // guest has to wait for dom0 to drain it (i.e. len is short). Only a
+    // dump empties the buffer, so the first notification is only armed
+    // again once dom0 has dumped, and a guest that keeps writing while dom0
+    // is busy does not cost a world switch per write.
+    //
+
+    if (len != static_cast<std::size_t>(data.size())) {
+        notify = boxy_notify__uart_full;
+    }
+    else if ((before == 0 && m_index != 0) ||
+             (before < UART_NOTIFY_WATERMARK &&
+              m_index >= UART_NOTIFY_WATERMARK)) {
+        notify = boxy_notify__uart;
+    }
+
+    return len;
+}
+
 void
 uart::write(const char c)
 {
@@ -354,6 +494,31 @@ uart::write(const char c)
     }
 }
 
+void
+uart::notify(vcpu_t *vcpu, uint64_t event, bool advance)
+{
+    // Note:
+    //
+    // This does not return. If advance is false, the guest will re-execute
+    // the OUT once it is resumed. For boxy_notify__uart_full, dom0 does not
+    // resume the guest until it has drained the buffer, so the guest is
+    // blocked instead of bouncing between the OUT and dom0. Also note that
+    // the lock must not be held when this is called as the lock would
+    // never be released.
+    //
+
+    auto child = vcpu_cast(vcpu);
+
+    if (advance) {
+        child->advance();
+    }
+
+    child->begin_steal_time(::x64::tsc::get(), true);
+
+    child->parent_vcpu()->load();
+    child->parent_vcpu()->return_notify(event);
+}
+
 void
 uart::write(const char *str)
 {
@@ -20,6 +20,7 @@
 // SOFTWARE.
 
 #include <set>
+#include <algorithm>
 #include <intrinsics.h>
 
 #include <bfgpalayout.h>
@@ -93,19 +94,30 @@ vcpu::vcpu(
     m_nmi_window_handler{this},
     m_preemption_timer_handler{this},
     m_vmcall_handler{this},
+    m_xsetbv_handler{this},
 
     m_run_op_handler{this},
+    m_console_op_handler{this},
     m_domain_op_handler{this},
+    m_grant_op_handler{this},
     m_vcpu_op_handler{this},
 
     m_cpuid_handler{this},
+    m_mmio_handler{this},
     m_mtrr_handler{this},
     m_x2apic_handler{this},
 
+    m_pmu_handler{this},
     m_vclock_handler{this},
-    m_virq_handler{this}
+    m_virq_handler{this},
+    m_virtio_blk_handler{this},
+    m_virtio_net_handler{this},
+    m_virtio_vsock_handler{this}
 {
+    domain->vcpu_created();
+
     this->set_eptp(domain->ept());
+    this->setup_vpid();
 
     if (this->is_dom0()) {
         this->write_dom0_guest_state(domain);
@@ -124,6 +136,16 @@ vcpu::~vcpu()
             vcpu->reset_host_wallclock();
         }
     }
+
+    if (m_vpid != 0) {
+        try {
+            ::intel_x64::vmx::invvpid_single_context(m_vpid);
+        }
+        catch (...) {
+        }
+
+        g_vpid->free(m_vpid);
+    }
 }
 
 //------------------------------------------------------------------------------
@@ -142,6 +164,10 @@ domain::domainid_type
 vcpu::domid() const noexcept
 { return m_domain->id(); }
 
+domain *
+vcpu::dom() const noexcept
+{ return m_domain; }
+
 //------------------------------------------------------------------------------
 // VMCall
 //------------------------------------------------------------------------------
@@ -203,9 +229,19 @@ vcpu::return_continue()
 }
 
 void
-vcpu::return_yield(uint64_t nsec)
+vcpu::return_yield(uint64_t tsc)
 {
-    this->set_rax((nsec << 4) | hypercall_enum_run_op__yield);
+    // Note:
+    //
+    // The TSC does not fit in the 60 bits of the return value, so it is
+    // rounded up to a multiple of 16 (waking up at most 15 ticks late)
+    // instead of losing its top bits (see run_op_ret_yield_tsc).
+    //
+
+    auto arg = std::min<uint64_t>(
+        (tsc >> 4U) + ((tsc & 0xFU) != 0 ? 1 : 0), 0x0FFFFFFFFFFFFFFF);
+
+    this->set_rax((arg << 4U) | hypercall_enum_run_op__yield);
     this->prepare_for_world_switch();
     this->run();
 }
@@ -218,6 +254,14 @@ vcpu::return_set_wallclock()
     this->run();
 }
 
+void
+vcpu::return_notify(uint64_t event)
+{
+    this->set_rax((event << 4) | hypercall_enum_run_op__notify);
+    this->prepare_for_world_switch();
+    this->run();
+}
+
 //------------------------------------------------------------------------------
 // Control
 //------------------------------------------------------------------------------
@@ -246,6 +290,14 @@ void
 vcpu::inject_virtual_interrupt(uint64_t vector)
 { m_virq_handler.inject_virtual_interrupt(vector); }
 
+void
+vcpu::queue_virtual_interrupts(const gsl::span<const uint64_t> &vectors)
+{ m_virq_handler.queue_virtual_interrupts(vectors); }
+
+void
+vcpu::inject_virtual_interrupts(const gsl::span<const uint64_t> &vectors)
+{ m_virq_handler.inject_virtual_interrupts(vectors); }
+
 //------------------------------------------------------------------------------
 // Virtual Clock
 //------------------------------------------------------------------------------
@@ -266,6 +318,50 @@ std::pair<struct timespec, uint64_t>
 vcpu::get_host_wallclock() const
 { return m_vclock_handler.get_host_wallclock(); }
 
+uint64_t
+vcpu::tsc_freq_khz() const noexcept
+{ return m_vclock_handler.tsc_freq_khz(); }
+
+void
+vcpu::begin_steal_time(uint64_t tsc, bool preempted) noexcept
+{ m_vclock_handler.begin_steal_time(tsc, preempted); }
+
+void
+vcpu::end_steal_time() noexcept
+{ m_vclock_handler.end_steal_time(); }
+
+//------------------------------------------------------------------------------
+// PMU
+//------------------------------------------------------------------------------
+
+void
+vcpu::switch_pmu(gsl::not_null<vcpu *> guest)
+{ m_pmu_handler.switch_to(guest); }
+
+void
+vcpu::save_pmu()
+{ m_pmu_handler.save(); }
+
+void
+vcpu::load_pmu()
+{ m_pmu_handler.load(); }
+
+bool
+vcpu::is_pmu_active() const noexcept
+{ return m_pmu_handler.is_active(); }
+
+//------------------------------------------------------------------------------
+// VPID
+//------------------------------------------------------------------------------
+
+void
+vcpu::flush_vpid()
+{
+    if (m_vpid != 0) {
+        ::intel_x64::vmx::invvpid_single_context(m_vpid);
+    }
+}
+
 //------------------------------------------------------------------------------
 // Fault
 //------------------------------------------------------------------------------
@@ -310,7 +406,34 @@ vcpu::write_domU_guest_state(domain *domain)
     this->setup_default_controls();
     this->setup_default_handlers();
 
-    domain->setup_vcpu_uarts(this);
+    domain->pio().setup_vcpu(this);
+}
+
+void
+vcpu::setup_vpid()
+{
+    using namespace vmcs_n;
+    using namespace secondary_processor_based_vm_execution_controls;
+
+    // Note:
+    //
+    // Every vCPU (including dom0's) gets its own VPID so that VM entries
+    // and VM exits do not flush the TLB. Without this, every interrupt
+    // that bounces a guest back to dom0 (and then back into the guest)
+    // costs both the host and the guest their entire TLB. If we run out
+    // of VPIDs, the vCPU falls back to VPID 0, which flushes on every
+    // transition, but is otherwise correct.
+    //
+
+    m_vpid = g_vpid->allocate();
+
+    if (m_vpid != 0) {
+        virtual_processor_identifier::set(m_vpid);
+        enable_vpid::enable();
+    }
+    else {
+        enable_vpid::disable();
+    }
 }
 
 void
@@ -405,12 +528,41 @@ vcpu::setup_default_controls()
     using namespace primary_processor_based_vm_execution_controls;
     hlt_exiting::enable();
     mwait_exiting::enable();
-    rdpmc_exiting::enable();
     monitor_exiting::enable();
     use_tsc_offsetting::enable();
 
+    // Note:
+    //
+    // RDPMC only needs to exit if the guest has fewer counters than the
+    // hardware, as the counters it does not own still hold dom0's values.
+    // Until the guest enables a counter, none of them are its own (see
+    // pmu_handler::is_rdpmc_safe).
+    //
+
+    if (m_pmu_handler.is_rdpmc_safe()) {
+        rdpmc_exiting::disable();
+    }
+    else {
+        rdpmc_exiting::enable();
+    }
+
+    // Note:
+    //
+    // INVPCID is passed through (it does not exit unless INVLPG exiting is
+    // enabled) if the domain's CPUID table reports it. Otherwise it has to
+    // be disabled so that the guest gets a #UD instead.
+    //
+
     using namespace secondary_processor_based_vm_execution_controls;
-    enable_invpcid::disable();
+    auto leaf = m_domain->cpuid_leaf(0x00000007, 0);
+
+    if (leaf != nullptr && (leaf->ebx & 0x00000400) != 0) {
+        enable_invpcid::enable();
+    }
+    else {
+        enable_invpcid::disable();
+    }
+
     enable_xsaves_xrstors::disable();
 }
 
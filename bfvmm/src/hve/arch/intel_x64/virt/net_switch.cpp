@@ -0,0 +1,192 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/virt/net_switch.h>
+#include <hve/arch/intel_x64/virt/virtio_net.h>
+
+#include <algorithm>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+constexpr const std::size_t dst_mac{VIRTIO_NET_HDR_SIZE};
+constexpr const std::size_t src_mac{VIRTIO_NET_HDR_SIZE + 6};
+
+static uint64_t
+mac_to_key(const uint8_t *mac) noexcept
+{
+    uint64_t key = 0;
+
+    for (std::size_t i = 0; i < 6; i++) {
+        key = (key << 8U) | mac[i];
+    }
+
+    return key;
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+net_switch *
+net_switch::instance() noexcept
+{
+    static net_switch self;
+    return &self;
+}
+
+void
+net_switch::attach(virtio_net *port, uint64_t id)
+{
+    std::lock_guard lock(m_mutex);
+
+    if (port->m_port != 0) {
+        throw std::runtime_error("net_switch: device already attached");
+    }
+
+    for (const auto p : m_ports) {
+        if (p->m_port == id) {
+            throw std::runtime_error("net_switch: port already in use");
+        }
+    }
+
+    m_ports.push_back(port);
+    port->m_port = id;
+}
+
+void
+net_switch::detach(virtio_net *port) noexcept
+{
+    std::lock_guard lock(m_mutex);
+
+    m_ports.erase(
+        std::remove(m_ports.begin(), m_ports.end(), port), m_ports.end());
+
+    for (auto iter = m_macs.begin(); iter != m_macs.end();) {
+        if (iter->second == port) {
+            iter = m_macs.erase(iter);
+        }
+        else {
+            ++iter;
+        }
+    }
+}
+
+bool
+net_switch::forward(vcpu *vcpu, virtio_net *src)
+{
+    std::lock_guard lock(m_mutex);
+    auto forwarded = false;
+
+    while (true) {
+        {
+            std::lock_guard src_lock(src->m_mutex);
+
+            if (!src->switch_pop(vcpu, m_frame)) {
+                break;
+            }
+        }
+
+        this->learn(src);
+
+        // Note:
+        //
+        // Multicast MACs are never learned, so broadcast and multicast
+        // frames are flooded along with unknown unicast frames.
+        //
+
+        auto iter = m_macs.find(mac_to_key(&m_frame.hdr.at(dst_mac)));
+
+        if (iter != m_macs.end()) {
+            if (iter->second != src) {
+                this->deliver(vcpu, src, iter->second);
+            }
+        }
+        else {
+            for (const auto port : m_ports) {
+                if (port != src) {
+                    this->deliver(vcpu, src, port);
+                }
+            }
+        }
+
+        std::lock_guard src_lock(src->m_mutex);
+        src->switch_done(m_frame);
+
+        forwarded = true;
+    }
+
+    return forwarded;
+}
+
+void
+net_switch::learn(virtio_net *port) noexcept
+{
+    if ((m_frame.hdr.at(src_mac) & 1U) != 0) {
+        return;
+    }
+
+    auto key = mac_to_key(&m_frame.hdr.at(src_mac));
+
+    if (auto iter = m_macs.find(key); iter != m_macs.end()) {
+        iter->second = port;
+        return;
+    }
+
+    if (m_macs.size() < NET_SWITCH_MAX_MACS) {
+        try {
+            m_macs.emplace(key, port);
+        }
+        catch (...) { }
+    }
+}
+
+void
+net_switch::deliver(vcpu *vcpu, virtio_net *src, virtio_net *dst)
+{
+    std::scoped_lock lock(src->m_mutex, dst->m_mutex);
+
+    if (src->m_generation != m_frame.generation) {
+        return;
+    }
+
+    // Note:
+    //
+    // If the destination's vCPU is yielded, it is not resumed until its
+    // next timer expires, so the source's bfexec is asked to wake up the
+    // destination's bfexec. This is only done once until the destination
+    // has been resumed.
+    //
+
+    if (dst->switch_rx(vcpu, m_frame)) {
+        if (!src->switch_wake(dst->m_port)) {
+            dst->m_doorbell = false;
+        }
+    }
+}
+
+}
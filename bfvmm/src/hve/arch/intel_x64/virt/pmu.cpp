@@ -0,0 +1,675 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/virt/pmu.h>
+
+#include <algorithm>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+constexpr const uint32_t ia32_apic_base{0x0000001B};
+constexpr const uint32_t ia32_pmc0{0x000000C1};
+constexpr const uint32_t ia32_perfevtsel0{0x00000186};
+constexpr const uint32_t ia32_fixed_ctr0{0x00000309};
+constexpr const uint32_t ia32_perf_capabilities{0x00000345};
+constexpr const uint32_t ia32_fixed_ctr_ctrl{0x0000038D};
+constexpr const uint32_t ia32_perf_global_status{0x0000038E};
+constexpr const uint32_t ia32_perf_global_ctrl{0x0000038F};
+constexpr const uint32_t ia32_perf_global_ovf_ctrl{0x00000390};
+constexpr const uint32_t ia32_a_pmc0{0x000004C1};
+constexpr const uint32_t ia32_x2apic_lvt_pmi{0x00000834};
+
+constexpr const uint64_t perfevtsel_int{0x0000000000100000};
+constexpr const uint64_t apic_base_x2apic{0x0000000000000400};
+constexpr const uint64_t lvt_masked{0x0000000000010000};
+constexpr const uint64_t interruption_type_nmi{2};
+
+struct host_pmu_t {
+    uint32_t version;
+    uint32_t num_gp;
+    uint32_t num_fixed;
+    uint32_t gp_width;
+    uint32_t fixed_width;
+    bool full_width;
+};
+
+static host_pmu_t
+host_pmu()
+{
+    host_pmu_t host{};
+
+    auto [eax, ebx, ecx, edx] = ::x64::cpuid::get(0x0000000A, 0, 0, 0);
+    bfignored(ebx);
+    bfignored(ecx);
+
+    host.version = gsl::narrow_cast<uint32_t>(eax & 0xFF);
+    host.num_gp = gsl::narrow_cast<uint32_t>((eax >> 8U) & 0xFF);
+    host.gp_width = gsl::narrow_cast<uint32_t>((eax >> 16U) & 0xFF);
+
+    if (host.version >= 2) {
+        host.num_fixed = gsl::narrow_cast<uint32_t>(edx & 0x1F);
+        host.fixed_width = gsl::narrow_cast<uint32_t>((edx >> 5U) & 0xFF);
+    }
+
+    auto [eax_1, ebx_1, ecx_1, edx_1] = ::x64::cpuid::get(0x00000001, 0, 0, 0);
+    bfignored(eax_1);
+    bfignored(ebx_1);
+    bfignored(edx_1);
+
+    if ((ecx_1 & 0x8000) != 0) {
+        host.full_width =
+            (::x64::msrs::get(ia32_perf_capabilities) & 0x2000) != 0;
+    }
+
+    return host;
+}
+
+static uint64_t
+width_mask(uint32_t width) noexcept
+{
+    if (width >= 64) {
+        return 0xFFFFFFFFFFFFFFFF;
+    }
+
+    return (1ULL << width) - 1;
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+pmu_handler::pmu_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{
+    // Note:
+    //
+    // Only architectural PMUs with a global control MSR (i.e. version 2
+    // and above) are virtualized. Otherwise, the guest does not get a PMU,
+    // which is what it got before.
+    //
+
+    auto host = host_pmu();
+    if (host.version < 2) {
+        return;
+    }
+
+    m_version = 2;
+    m_num_gp = std::min<uint32_t>(host.num_gp, PMU_MAX_GP_COUNTERS);
+    m_num_fixed = std::min<uint32_t>(host.num_fixed, PMU_MAX_FIXED_COUNTERS);
+    m_gp_width_mask = width_mask(host.gp_width);
+    m_fixed_width_mask = width_mask(host.fixed_width);
+    m_full_width = host.full_width;
+
+    if (vcpu->is_dom0()) {
+        this->setup_dom0();
+        return;
+    }
+
+    auto leaf = vcpu->dom()->cpuid_leaf(0x0000000A, 0);
+    if (leaf == nullptr || (leaf->eax & 0xFF) < 2) {
+        m_version = 0;
+        m_num_gp = 0;
+        m_num_fixed = 0;
+        return;
+    }
+
+    m_num_gp = std::min<uint32_t>(m_num_gp, (leaf->eax >> 8U) & 0xFF);
+    m_num_fixed = std::min<uint32_t>(m_num_fixed, leaf->edx & 0x1F);
+
+    m_rdpmc_safe =
+        m_num_gp == host.num_gp && m_num_fixed == host.num_fixed;
+
+    // Note:
+    //
+    // A guest's PMI is a real PMI, which is delivered to dom0's local APIC
+    // as an NMI, and exits (see handle_nmi). The local APIC masks its PMI
+    // entry when it delivers the PMI, and dom0 will not unmask it for an
+    // NMI it never saw, so we have to, which we can only do if the local
+    // APIC is in x2APIC mode. Otherwise, the guest cannot enable PMIs.
+    //
+
+    m_pmi = (::x64::msrs::get(ia32_apic_base) & apic_base_x2apic) != 0;
+
+    this->setup_domU();
+}
+
+// -----------------------------------------------------------------------------
+// World Switch
+// -----------------------------------------------------------------------------
+
+void
+pmu_handler::switch_to(gsl::not_null<vcpu *> guest)
+{
+    using namespace ::x64::msrs;
+
+    if (m_guest == guest) {
+        return;
+    }
+
+    // Note:
+    //
+    // Most guests never enable a counter, in which case there is nothing
+    // to switch. The guest's global control MSR (which is 0) is loaded on
+    // VM entry, so whatever is in hardware does not count while the guest
+    // runs, and the guest's MSR accesses are emulated using its saved
+    // state. The VM exit clears the global control MSR, so if dom0's state
+    // is in hardware, it is only left there if dom0 is not counting
+    // either.
+    //
+
+    if (!guest->is_pmu_active() &&
+        (m_guest != nullptr || get(ia32_perf_global_ctrl) == 0)) {
+        return;
+    }
+
+    if (m_guest != nullptr) {
+        m_guest->save_pmu();
+    }
+    else {
+        this->save();
+    }
+
+    guest->load_pmu();
+    m_guest = guest;
+}
+
+void
+pmu_handler::save()
+{
+    using namespace ::x64::msrs;
+
+    for (uint32_t i = 0; i < m_num_gp; i++) {
+        m_pmc.at(i) = get(ia32_pmc0 + i) & m_gp_width_mask;
+    }
+
+    for (uint32_t i = 0; i < m_num_fixed; i++) {
+        m_fixed_ctr.at(i) = get(ia32_fixed_ctr0 + i) & m_fixed_width_mask;
+    }
+
+    if (m_vcpu->is_dom0()) {
+        for (uint32_t i = 0; i < m_num_gp; i++) {
+            m_evtsel.at(i) = get(ia32_perfevtsel0 + i);
+        }
+
+        m_fixed_ctr_ctrl = get(ia32_fixed_ctr_ctrl);
+        m_global_ctrl = get(ia32_perf_global_ctrl);
+
+        set(ia32_perf_global_ctrl, 0);
+        return;
+    }
+
+    // Note:
+    //
+    // The global control MSR was already cleared by the VM exit, so the
+    // guest's counters are stopped. Any overflow that occurred while the
+    // guest was running is moved into the guest's status MSR and cleared
+    // in hardware so that dom0 does not see it. An overflow that asked for
+    // a PMI is normally taken by handle_nmi(). This only catches one that
+    // raced with a VM exit, which gets its vIRQ the next time the guest is
+    // resumed.
+    //
+
+    if (auto status = get(ia32_perf_global_status) & this->global_ctrl_mask()) {
+        set(ia32_perf_global_ovf_ctrl, status);
+        m_global_status |= status;
+
+        if ((status & this->pmi_mask()) != 0) {
+            m_pending_pmi = true;
+        }
+    }
+}
+
+void
+pmu_handler::load()
+{
+    using namespace ::x64::msrs;
+
+    for (uint32_t i = 0; i < m_num_gp; i++) {
+        set(ia32_perfevtsel0 + i, m_evtsel.at(i));
+
+        if (m_full_width) {
+            set(ia32_a_pmc0 + i, m_pmc.at(i));
+        }
+        else {
+            set(ia32_pmc0 + i, m_pmc.at(i) & 0xFFFFFFFF);
+        }
+    }
+
+    for (uint32_t i = 0; i < m_num_fixed; i++) {
+        set(ia32_fixed_ctr0 + i, m_fixed_ctr.at(i));
+    }
+
+    set(ia32_fixed_ctr_ctrl, m_fixed_ctr_ctrl);
+
+    if (m_vcpu->is_dom0()) {
+        set(ia32_perf_global_ctrl, m_global_ctrl);
+    }
+}
+
+bool
+pmu_handler::is_active() const noexcept
+{ return m_active; }
+
+bool
+pmu_handler::is_rdpmc_safe() const noexcept
+{ return m_rdpmc_safe && m_active; }
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+pmu_handler::handle_rdmsr(vcpu_t *vcpu)
+{
+    uint64_t val{};
+
+    if (!this->rdmsr(gsl::narrow_cast<uint32_t>(vcpu->rcx()), val)) {
+        return false;
+    }
+
+    vcpu->set_rax(val & 0x00000000FFFFFFFF);
+    vcpu->set_rdx(val >> 32);
+
+    return vcpu->advance();
+}
+
+bool
+pmu_handler::handle_wrmsr(vcpu_t *vcpu)
+{
+    auto val =
+        ((vcpu->rdx() & 0xFFFFFFFF) << 32U) | (vcpu->rax() & 0xFFFFFFFF);
+
+    if (!this->wrmsr(gsl::narrow_cast<uint32_t>(vcpu->rcx()), val)) {
+        return false;
+    }
+
+    return vcpu->advance();
+}
+
+bool
+pmu_handler::handle_rdpmc(vcpu_t *vcpu)
+{
+    using namespace ::x64::msrs;
+
+    auto ecx = gsl::narrow_cast<uint32_t>(vcpu->rcx());
+    auto index = ecx & 0x3FFFFFFF;
+
+    uint64_t val{};
+
+    if ((ecx & 0x40000000) != 0 && index < m_num_fixed) {
+        val = m_active ?
+              get(ia32_fixed_ctr0 + index) & m_fixed_width_mask :
+              m_fixed_ctr.at(index);
+    }
+    else if ((ecx & 0x40000000) == 0 && index < m_num_gp) {
+        val = m_active ?
+              get(ia32_pmc0 + index) & m_gp_width_mask :
+              m_pmc.at(index);
+    }
+    else {
+        vcpu->inject_exception(13, 0);
+        return true;
+    }
+
+    if ((ecx & 0x80000000) != 0) {
+        val &= 0xFFFFFFFF;
+    }
+
+    vcpu->set_rax(val & 0x00000000FFFFFFFF);
+    vcpu->set_rdx(val >> 32);
+
+    return vcpu->advance();
+}
+
+bool
+pmu_handler::handle_nmi(vcpu_t *vcpu)
+{
+    using namespace ::x64::msrs;
+    bfignored(vcpu);
+
+    auto info = vmcs_n::vm_exit_interruption_information::get();
+    if (((info >> 8U) & 0x7) != interruption_type_nmi || !m_active) {
+        return false;
+    }
+
+    // Note:
+    //
+    // NMIs are not queued, so the PMI might have been merged with an NMI
+    // that was meant for dom0, but as only the guest's counters can run
+    // while it does, the NMI is treated as the guest's PMI as long as the
+    // guest has an overflow that asked for one. Everything else is handled
+    // (i.e. given to dom0) as usual.
+    //
+
+    auto status = get(ia32_perf_global_status) & this->global_ctrl_mask();
+    if ((status & this->pmi_mask()) == 0) {
+        return false;
+    }
+
+    set(ia32_perf_global_ovf_ctrl, status);
+    m_global_status |= status;
+
+    set(ia32_x2apic_lvt_pmi, get(ia32_x2apic_lvt_pmi) & ~lvt_masked);
+
+    m_vcpu->queue_virtual_interrupt(boxy_virq__pmu_interrupt);
+    return true;
+}
+
+void
+pmu_handler::resume_delegate_dom0(vcpu_t *vcpu)
+{
+    bfignored(vcpu);
+
+    // Note:
+    //
+    // This executes on every dom0 resume, so the common case (none of this
+    // vCPU's children have run since the last resume) is a single check.
+    // A child cannot be destroyed while its state is in hardware as the
+    // parent is always resumed (and saves the child) first.
+    //
+
+    if (m_guest == nullptr) {
+        return;
+    }
+
+    m_guest->save_pmu();
+    m_guest = nullptr;
+
+    this->load();
+}
+
+void
+pmu_handler::resume_delegate_domU(vcpu_t *vcpu)
+{
+    bfignored(vcpu);
+
+    if (auto parent_vcpu = m_vcpu->parent_vcpu()) {
+        parent_vcpu->switch_pmu(m_vcpu);
+    }
+
+    if (m_pending_pmi) {
+        m_pending_pmi = false;
+        m_vcpu->queue_virtual_interrupt(boxy_virq__pmu_interrupt);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Private Helpers
+// -----------------------------------------------------------------------------
+
+void
+pmu_handler::setup_dom0()
+{
+    m_vcpu->add_resume_delegate(
+    {&pmu_handler::resume_delegate_dom0, this}
+    );
+}
+
+void
+pmu_handler::setup_domU()
+{
+    using namespace vmcs_n;
+
+    vm_entry_controls::load_ia32_perf_global_ctrl::enable();
+    vm_exit_controls::load_ia32_perf_global_ctrl::enable();
+
+    guest_ia32_perf_global_ctrl::set(0);
+    host_ia32_perf_global_ctrl::set(0);
+
+    m_vcpu->add_resume_delegate(
+    {&pmu_handler::resume_delegate_domU, this}
+    );
+
+    m_vcpu->add_exit_handler_for_reason(
+        exit_reason::basic_exit_reason::rdmsr,
+        {&pmu_handler::handle_rdmsr, this}
+    );
+
+    m_vcpu->add_exit_handler_for_reason(
+        exit_reason::basic_exit_reason::wrmsr,
+        {&pmu_handler::handle_wrmsr, this}
+    );
+
+    m_vcpu->add_exit_handler_for_reason(
+        exit_reason::basic_exit_reason::rdpmc,
+        {&pmu_handler::handle_rdpmc, this}
+    );
+
+    if (m_pmi) {
+        m_vcpu->add_exit_handler_for_reason(
+            exit_reason::basic_exit_reason::exception_or_non_maskable_interrupt,
+            {&pmu_handler::handle_nmi, this}
+        );
+    }
+}
+
+bool
+pmu_handler::rdmsr(uint32_t msr, uint64_t &val)
+{
+    using namespace ::x64::msrs;
+
+    // Note:
+    //
+    // Once active, a domU's exits are always handled while its PMU state
+    // is in hardware (it is loaded before the vCPU is resumed, and is only
+    // saved once the parent is resumed), so the counters can be read
+    // directly. Until then, its saved state is used instead.
+    //
+
+    if (msr >= ia32_perfevtsel0 && msr < ia32_perfevtsel0 + m_num_gp) {
+        val = m_evtsel.at(msr - ia32_perfevtsel0);
+        return true;
+    }
+
+    if (msr >= ia32_pmc0 && msr < ia32_pmc0 + m_num_gp) {
+        val = m_active ?
+              get(msr) & m_gp_width_mask : m_pmc.at(msr - ia32_pmc0);
+        return true;
+    }
+
+    if (msr >= ia32_fixed_ctr0 && msr < ia32_fixed_ctr0 + m_num_fixed) {
+        val = m_active ?
+              get(msr) & m_fixed_width_mask :
+              m_fixed_ctr.at(msr - ia32_fixed_ctr0);
+        return true;
+    }
+
+    switch (msr) {
+        case ia32_fixed_ctr_ctrl:
+            val = m_fixed_ctr_ctrl;
+            return true;
+
+        case ia32_perf_global_status:
+            val = m_global_status;
+
+            if (m_active) {
+                val |= get(ia32_perf_global_status) & this->global_ctrl_mask();
+            }
+
+            return true;
+
+        case ia32_perf_global_ctrl:
+            val = m_global_ctrl;
+            return true;
+
+        case ia32_perf_global_ovf_ctrl:
+            val = 0;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+bool
+pmu_handler::wrmsr(uint32_t msr, uint64_t val)
+{
+    using namespace ::x64::msrs;
+
+    if (msr >= ia32_perfevtsel0 && msr < ia32_perfevtsel0 + m_num_gp) {
+        val &= m_pmi ? 0x00000000FFDFFFFF : 0x00000000FFCFFFFF;
+        m_evtsel.at(msr - ia32_perfevtsel0) = val;
+
+        if (m_active) {
+            set(msr, val);
+        }
+        else if (val != 0) {
+            this->activate();
+        }
+
+        return true;
+    }
+
+    if (msr >= ia32_pmc0 && msr < ia32_pmc0 + m_num_gp) {
+        if (m_active) {
+            set(msr, val & 0xFFFFFFFF);
+            return true;
+        }
+
+        // Note:
+        //
+        // Same as hardware, the write is sign extended from bit 31.
+        //
+
+        if ((val & 0x80000000) != 0) {
+            val |= 0xFFFFFFFF00000000;
+        }
+
+        m_pmc.at(msr - ia32_pmc0) = val & m_gp_width_mask;
+        return true;
+    }
+
+    if (msr >= ia32_fixed_ctr0 && msr < ia32_fixed_ctr0 + m_num_fixed) {
+        if (m_active) {
+            set(msr, val & m_fixed_width_mask);
+        }
+        else {
+            m_fixed_ctr.at(msr - ia32_fixed_ctr0) = val & m_fixed_width_mask;
+        }
+
+        return true;
+    }
+
+    switch (msr) {
+        case ia32_fixed_ctr_ctrl: {
+            uint64_t mask{};
+            for (uint32_t i = 0; i < m_num_fixed; i++) {
+                mask |= (m_pmi ? 0xBULL : 0x3ULL) << (i * 4U);
+            }
+
+            m_fixed_ctr_ctrl = val & mask;
+
+            if (m_active) {
+                set(msr, m_fixed_ctr_ctrl);
+            }
+            else if (m_fixed_ctr_ctrl != 0) {
+                this->activate();
+            }
+
+            return true;
+        }
+
+        case ia32_perf_global_ctrl:
+            m_global_ctrl = val & this->global_ctrl_mask();
+            vmcs_n::guest_ia32_perf_global_ctrl::set(m_global_ctrl);
+
+            if (!m_active && m_global_ctrl != 0) {
+                this->activate();
+            }
+
+            return true;
+
+        case ia32_perf_global_ovf_ctrl:
+            val &= this->global_ctrl_mask();
+            m_global_status &= ~val;
+
+            if (m_active) {
+                set(msr, val);
+            }
+
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+void
+pmu_handler::activate()
+{
+    using namespace vmcs_n;
+
+    // Note:
+    //
+    // The guest just enabled a counter for the first time, so from now
+    // on, its state is switched in whenever it runs, starting with right
+    // now (its saved state already has the write that enabled it).
+    //
+
+    m_active = true;
+
+    if (auto parent_vcpu = m_vcpu->parent_vcpu()) {
+        parent_vcpu->switch_pmu(m_vcpu);
+    }
+
+    if (m_rdpmc_safe) {
+        primary_processor_based_vm_execution_controls::rdpmc_exiting::disable();
+    }
+}
+
+uint64_t
+pmu_handler::global_ctrl_mask() const noexcept
+{
+    auto gp = (1ULL << m_num_gp) - 1;
+    auto fixed = (1ULL << m_num_fixed) - 1;
+
+    return gp | (fixed << 32U);
+}
+
+uint64_t
+pmu_handler::pmi_mask() const noexcept
+{
+    uint64_t mask{};
+
+    for (uint32_t i = 0; i < m_num_gp; i++) {
+        if ((m_evtsel.at(i) & perfevtsel_int) != 0) {
+            mask |= 1ULL << i;
+        }
+    }
+
+    for (uint32_t i = 0; i < m_num_fixed; i++) {
+        if ((m_fixed_ctr_ctrl & (0x8ULL << (i * 4U))) != 0) {
+            mask |= 1ULL << (32U + i);
+        }
+    }
+
+    return mask;
+}
+
+}
@@ -21,10 +21,21 @@
 
 #include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/virt/vclock.h>
+#include <hve/arch/intel_x64/emulation/table.h>
 #include <bftsc.h>
 
+#include <algorithm>
+#include <atomic>
+
 #define NSEC_PER_SEC 1000000000L
 
+#define EMULATE_MSR(a,r,w)                                                     \
+    {a, &vclock_handler::r, &vclock_handler::w}
+
+#define LVT_TIMER_MASKED (1ULL << 16U)
+#define LVT_TIMER_MODE(a) (((a) >> 17U) & 0x3U)
+#define LVT_TIMER_MODE_TSC_DEADLINE 0x2U
+
 // -----------------------------------------------------------------------------
 // Notes about Event Timer Injection
 // -----------------------------------------------------------------------------
@@ -52,6 +63,37 @@
 // in the guest when a world switch occurs loses time, but that is up to the
 // guest OS to sort out.
 //
+// Each vCPU can have up to VCLOCK_MAX_TIMERS outstanding timers, each of which
+// is identified by the vIRQ that is delivered when it expires (the legacy
+// set_next_event hypercall is simply the timer for the vclock event vIRQ).
+// The timers are stored in a min-heap ordered by deadline, so the preemption
+// timer is always armed for the earliest deadline, and when it fires, every
+// timer that has expired is popped and delivered as a single batch of vIRQs
+// using one Hypervisor Callback Vector IRQ.
+//
+// Guests that do not have a custom clock event device can use the APIC's
+// TSC deadline timer instead. The vclock owns the APIC timer registers (the
+// LVT timer, the initial/current count and the divide configuration) as well
+// as the IA32_TSC_DEADLINE MSR, and only TSC deadline mode is supported. A
+// write to the deadline MSR simply records the deadline (converted to a host
+// TSC) and returns, and the resume delegate arms the preemption timer for
+// whichever deadline comes first. When the deadline is reached, the vector
+// programmed in the LVT timer is injected instead of the vclock vIRQ, and the
+// deadline is cleared, just like real hardware.
+//
+
+// -----------------------------------------------------------------------------
+// Notes about Steal Time
+// -----------------------------------------------------------------------------
+
+// Boxy relies on the host's scheduler, which means that a vCPU can be runnable
+// while the bfexec thread that executes it is not. The guest has no way of
+// knowing this unless we tell it, so the guest can register a steal time
+// structure (same layout as KVM) and we track the time between handing the
+// vCPU back to its parent (return_continue / return_yield) and the next
+// run_op for this vCPU. If the vCPU yielded, it is not runnable until its
+// next clock event, so only the time after that event counts.
+//
 
 // -----------------------------------------------------------------------------
 // Notes about TSC <-> Nanonsecond Conversions
@@ -240,6 +282,12 @@
 // Helpers
 // -----------------------------------------------------------------------------
 
+static bool
+timer_cmp(
+    const boxy::intel_x64::vclock_handler::timer_t &lhs,
+    const boxy::intel_x64::vclock_handler::timer_t &rhs)
+{ return lhs.tsc > rhs.tsc; }
+
 static uint64_t
 mul_div(uint64_t x, uint64_t n, uint64_t d)
 { return ((x / d) * n) + (((x % d) * n) / d); }
@@ -276,6 +324,18 @@ sub_timespec(const struct timespec &ts1, const struct timespec &ts2)
 namespace boxy::intel_x64
 {
 
+// -----------------------------------------------------------------------------
+// Emulated MSRs
+// -----------------------------------------------------------------------------
+
+static const msr_entry_t<vclock_handler> s_msrs[] = {
+    EMULATE_MSR(0x000006E0, handle_rdmsr_0x000006E0, handle_wrmsr_0x000006E0),
+    EMULATE_MSR(0x00000832, handle_rdmsr_0x00000832, handle_wrmsr_0x00000832),
+    EMULATE_MSR(0x00000838, handle_rdmsr_0x00000838, handle_wrmsr_0x00000838),
+    EMULATE_MSR(0x00000839, handle_rdmsr_0x00000839, handle_wrmsr_0x00000839),
+    EMULATE_MSR(0x0000083E, handle_rdmsr_0x0000083E, handle_wrmsr_0x0000083E)
+};
+
 vclock_handler::vclock_handler(
     gsl::not_null<vcpu *> vcpu
 ) :
@@ -359,6 +419,47 @@ uint64_t
 vclock_handler::nsec_to_tsc(uint64_t nsec) const noexcept
 { return mul_div(nsec, m_tsc_freq_khz, 1000000); }
 
+//------------------------------------------------------------------------------
+// Steal Time
+//------------------------------------------------------------------------------
+
+void
+vclock_handler::begin_steal_time(uint64_t tsc, bool preempted) noexcept
+{
+    if (!m_steal_time) {
+        return;
+    }
+
+    m_steal_tsc = tsc;
+    m_steal_time->preempted = preempted ? 1 : 0;
+}
+
+void
+vclock_handler::end_steal_time() noexcept
+{
+    if (!m_steal_time) {
+        return;
+    }
+
+    auto steal_tsc = m_steal_tsc;
+    auto tsc = ::x64::tsc::get();
+
+    m_steal_tsc = 0;
+    m_steal_time->preempted = 0;
+
+    if (steal_tsc == 0 || tsc <= steal_tsc) {
+        return;
+    }
+
+    m_steal_time->version++;
+    std::atomic_thread_fence(std::memory_order_release);
+
+    m_steal_time->steal += this->tsc_to_nsec(tsc - steal_tsc);
+
+    std::atomic_thread_fence(std::memory_order_release);
+    m_steal_time->version++;
+}
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -366,18 +467,24 @@ vclock_handler::nsec_to_tsc(uint64_t nsec) const noexcept
 bool
 vclock_handler::handle_yield(vcpu *vcpu)
 {
-    auto next_event = m_next_event_tsc;
-
     vcpu->advance();
-    this->inject_vclock_event();
 
-    if (auto tsc = ::x64::tsc::get(); tsc < next_event) {
-        auto nsec = this->tsc_to_nsec(next_event - tsc);
+    if (m_tsc_deadline != 0) {
+        if (m_timers.empty() || m_tsc_deadline < m_timers.front().tsc) {
+            auto next_event = m_tsc_deadline;
 
-        vcpu->parent_vcpu()->load();
-        vcpu->parent_vcpu()->return_yield(nsec);
+            this->inject_tsc_deadline_event();
+            this->yield_until(vcpu, next_event);
+
+            return true;
+        }
     }
 
+    auto next_event = m_timers.empty() ? 0 : m_timers.front().tsc;
+
+    this->inject_next_timers();
+    this->yield_until(vcpu, next_event);
+
     return true;
 }
 
@@ -386,10 +493,158 @@ vclock_handler::handle_preemption_timer(vcpu *vcpu)
 {
     bfignored(vcpu);
 
-    this->queue_vclock_event();
+    this->queue_expired_events(::x64::tsc::get());
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// APIC Timer
+// -----------------------------------------------------------------------------
+
+bool
+vclock_handler::handle_rdmsr(vcpu_t *vcpu)
+{ return emulate_rdmsr(this, vcpu, s_msrs); }
+
+bool
+vclock_handler::handle_wrmsr(vcpu_t *vcpu)
+{ return emulate_wrmsr(this, vcpu, s_msrs); }
+
+bool
+vclock_handler::handle_rdmsr_0x000006E0(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    if (m_tsc_deadline == 0) {
+        info.val = 0;
+        return true;
+    }
+
+    info.val = m_tsc_deadline + vmcs_n::tsc_offset::get();
+    return true;
+}
+
+bool
+vclock_handler::handle_wrmsr_0x000006E0(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    // Note:
+    //
+    // This is on the hot path of a tickless guest, so all we do here is
+    // record the deadline. The preemption timer is armed by the resume
+    // delegate on the way back into the guest.
+    //
+
+    if (LVT_TIMER_MODE(m_0x00000832) != LVT_TIMER_MODE_TSC_DEADLINE) {
+        return true;
+    }
+
+    if (info.val == 0) {
+        m_tsc_deadline = 0;
+        return true;
+    }
+
+    m_tsc_deadline = info.val - vmcs_n::tsc_offset::get();
+    return true;
+}
+
+bool
+vclock_handler::handle_rdmsr_0x00000832(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    info.val = m_0x00000832 & 0xFFFFFFFF;
+    return true;
+}
+
+bool
+vclock_handler::handle_wrmsr_0x00000832(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    auto mode = LVT_TIMER_MODE(info.val);
+
+    if ((info.val & LVT_TIMER_MASKED) == 0) {
+        if (mode != LVT_TIMER_MODE_TSC_DEADLINE) {
+            vcpu->halt("only TSC deadline mode is supported by the APIC timer");
+        }
+    }
+
+    if (mode != LVT_TIMER_MODE(m_0x00000832)) {
+        m_tsc_deadline = 0;
+    }
+
+    m_0x00000832 = info.val & 0x000700FF;
+    return true;
+}
+
+bool
+vclock_handler::handle_rdmsr_0x00000838(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    info.val = 0;
+    return true;
+}
+
+bool
+vclock_handler::handle_wrmsr_0x00000838(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    if (info.val != 0) {
+        vcpu->halt("the APIC timer initial count is not supported");
+    }
+
+    return true;
+}
+
+bool
+vclock_handler::handle_rdmsr_0x00000839(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    info.val = 0;
+    return true;
+}
+
+bool
+vclock_handler::handle_wrmsr_0x00000839(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    bfignored(info);
+
+    vcpu->halt("writing to the APIC timer current count is not supported");
+    return true;
+}
+
+bool
+vclock_handler::handle_rdmsr_0x0000083E(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    info.val = m_0x0000083E & 0xFFFFFFFF;
+    return true;
+}
+
+bool
+vclock_handler::handle_wrmsr_0x0000083E(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    m_0x0000083E = info.val & 0x0000000B;
     return true;
 }
 
+// -----------------------------------------------------------------------------
+// Hypercalls
+// -----------------------------------------------------------------------------
+
 void
 vclock_handler::vclock_op__get_tsc_freq_khz(vcpu *vcpu)
 {
@@ -405,7 +660,60 @@ void
 vclock_handler::vclock_op__set_next_event(vcpu *vcpu)
 {
     try {
-        m_next_event_tsc = ::x64::tsc::get() + vcpu->rbx();
+        this->arm_timer(
+            boxy_virq__vclock_event_handler, ::x64::tsc::get() + vcpu->rbx()
+        );
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+vclock_handler::vclock_op__set_timer(vcpu *vcpu)
+{
+    try {
+        this->arm_timer(vcpu->rbx(), ::x64::tsc::get() + vcpu->rcx());
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+vclock_handler::vclock_op__cancel_timer(vcpu *vcpu)
+{
+    try {
+        this->cancel_timer(vcpu->rbx());
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+vclock_handler::vclock_op__set_steal_time_gpa(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == 0) {
+            m_steal_time.reset();
+            m_steal_tsc = 0;
+
+            vcpu->set_rax(SUCCESS);
+            return;
+        }
+
+        if ((vcpu->rbx() & (sizeof(struct boxy_steal_time) - 1)) != 0) {
+            throw std::runtime_error("steal time gpa must be 64 byte aligned");
+        }
+
+        m_steal_time = vcpu->map_gpa_4k<struct boxy_steal_time>(vcpu->rbx());
+        m_steal_tsc = 0;
+
         vcpu->set_rax(SUCCESS);
     }
     catchall({
@@ -539,6 +847,18 @@ vclock_handler::dispatch_domU(vcpu *vcpu)
             vclock_op__set_next_event(vcpu);
             break;
 
+        case hypercall_enum_vclock_op__set_timer:
+            vclock_op__set_timer(vcpu);
+            break;
+
+        case hypercall_enum_vclock_op__cancel_timer:
+            vclock_op__cancel_timer(vcpu);
+            break;
+
+        case hypercall_enum_vclock_op__set_steal_time_gpa:
+            vclock_op__set_steal_time_gpa(vcpu);
+            break;
+
         case hypercall_enum_vclock_op__reset_host_wallclock:
             vclock_op__reset_host_wallclock(vcpu);
             break;
@@ -565,19 +885,14 @@ vclock_handler::dispatch_domU(vcpu *vcpu)
 void
 vclock_handler::resume_delegate(vcpu_t *vcpu)
 {
-    if (m_next_event_tsc == 0 || m_guest_wc_tsc == 0) {
-        return;
-    }
+    auto tsc = ::x64::tsc::get();
+    this->queue_expired_events(tsc);
 
-    if (auto tsc = ::x64::tsc::get(); tsc < m_next_event_tsc) {
+    if (auto next_event = this->next_event_tsc(); next_event != 0) {
         vcpu->set_preemption_timer(
-            ((m_next_event_tsc - tsc) >> m_pet_decrement) + 1
+            ((next_event - tsc) >> m_pet_decrement) + 1
         );
-
-        return;
     }
-
-    this->queue_vclock_event();
 }
 
 // -----------------------------------------------------------------------------
@@ -602,6 +917,8 @@ vclock_handler::setup_domU()
         throw std::runtime_error("missing PET info. system not supported");
     }
 
+    m_timers.reserve(VCLOCK_MAX_TIMERS);
+
     m_vcpu->add_vmcall_handler(
     {&vclock_handler::dispatch_domU, this}
     );
@@ -617,24 +934,166 @@ vclock_handler::setup_domU()
     m_vcpu->add_preemption_timer_handler(
     {&vclock_handler::handle_preemption_timer, this}
     );
+
+    m_vcpu->add_exit_handler_for_reason(
+        vmcs_n::exit_reason::basic_exit_reason::rdmsr,
+        {&vclock_handler::handle_rdmsr, this}
+    );
+
+    m_vcpu->add_exit_handler_for_reason(
+        vmcs_n::exit_reason::basic_exit_reason::wrmsr,
+        {&vclock_handler::handle_wrmsr, this}
+    );
+}
+
+uint64_t
+vclock_handler::next_event_tsc() const noexcept
+{
+    uint64_t next_event = 0;
+
+    if (m_guest_wc_tsc != 0 && !m_timers.empty()) {
+        next_event = m_timers.front().tsc;
+    }
+
+    if (m_tsc_deadline != 0) {
+        if (next_event == 0 || m_tsc_deadline < next_event) {
+            next_event = m_tsc_deadline;
+        }
+    }
+
+    return next_event;
+}
+
+void
+vclock_handler::queue_expired_events(uint64_t tsc)
+{
+    if (m_tsc_deadline != 0 && m_tsc_deadline <= tsc) {
+        this->queue_tsc_deadline_event();
+    }
+
+    if (m_guest_wc_tsc == 0) {
+        return;
+    }
+
+    this->queue_expired_timers(tsc);
+}
+
+void
+vclock_handler::yield_until(vcpu *vcpu, uint64_t next_event)
+{
+    if (auto tsc = ::x64::tsc::get(); tsc < next_event) {
+        this->begin_steal_time(next_event, false);
+
+        vcpu->parent_vcpu()->load();
+        vcpu->parent_vcpu()->return_yield(next_event);
+    }
+}
+
+void
+vclock_handler::arm_timer(uint64_t virq, uint64_t tsc)
+{
+    this->cancel_timer(virq);
+
+    if (m_timers.size() == VCLOCK_MAX_TIMERS) {
+        throw std::runtime_error("too many outstanding vclock timers");
+    }
+
+    m_timers.push_back({tsc, virq});
+    std::push_heap(m_timers.begin(), m_timers.end(), timer_cmp);
+}
+
+void
+vclock_handler::cancel_timer(uint64_t virq)
+{
+    auto iter = std::find_if(m_timers.begin(), m_timers.end(), [&](auto & t) {
+        return t.virq == virq;
+    });
+
+    if (iter == m_timers.end()) {
+        return;
+    }
+
+    *iter = m_timers.back();
+    m_timers.pop_back();
+
+    std::make_heap(m_timers.begin(), m_timers.end(), timer_cmp);
+}
+
+std::size_t
+vclock_handler::pop_timers(
+    uint64_t tsc, std::array<uint64_t, VCLOCK_MAX_TIMERS> &virqs)
+{
+    std::size_t num = 0;
+
+    while (!m_timers.empty() && m_timers.front().tsc <= tsc) {
+        std::pop_heap(m_timers.begin(), m_timers.end(), timer_cmp);
+
+        virqs.at(num++) = m_timers.back().virq;
+        m_timers.pop_back();
+    }
+
+    return num;
+}
+
+void
+vclock_handler::queue_expired_timers(uint64_t tsc)
+{
+    std::array<uint64_t, VCLOCK_MAX_TIMERS> virqs{};
+
+    if (auto num = this->pop_timers(tsc, virqs); num > 0) {
+        m_vcpu->disable_preemption_timer();
+        m_vcpu->queue_virtual_interrupts(
+            gsl::span<const uint64_t>(
+                virqs.data(), gsl::narrow_cast<std::ptrdiff_t>(num)));
+    }
+}
+
+void
+vclock_handler::inject_next_timers()
+{
+    std::array<uint64_t, VCLOCK_MAX_TIMERS> virqs{};
+
+    m_vcpu->disable_preemption_timer();
+
+    // Note:
+    //
+    // If the guest yields without a timer armed, we still wake it with a
+    // vclock event so that it does not wait forever.
+    //
+
+    if (m_timers.empty()) {
+        m_vcpu->inject_virtual_interrupt(boxy_virq__vclock_event_handler);
+        return;
+    }
+
+    auto num = this->pop_timers(m_timers.front().tsc, virqs);
+    m_vcpu->inject_virtual_interrupts(
+        gsl::span<const uint64_t>(
+            virqs.data(), gsl::narrow_cast<std::ptrdiff_t>(num)));
 }
 
 void
-vclock_handler::queue_vclock_event()
+vclock_handler::queue_tsc_deadline_event()
 {
     m_vcpu->disable_preemption_timer();
-    m_vcpu->queue_virtual_interrupt(boxy_virq__vclock_event_handler);
 
-    m_next_event_tsc = 0;
+    if ((m_0x00000832 & LVT_TIMER_MASKED) == 0) {
+        m_vcpu->queue_external_interrupt(m_0x00000832 & 0xFF);
+    }
+
+    m_tsc_deadline = 0;
 }
 
 void
-vclock_handler::inject_vclock_event()
+vclock_handler::inject_tsc_deadline_event()
 {
     m_vcpu->disable_preemption_timer();
-    m_vcpu->inject_virtual_interrupt(boxy_virq__vclock_event_handler);
 
-    m_next_event_tsc = 0;
+    if ((m_0x00000832 & LVT_TIMER_MASKED) == 0) {
+        m_vcpu->inject_external_interrupt(m_0x00000832 & 0xFF);
+    }
+
+    m_tsc_deadline = 0;
 }
 
 }
@@ -61,6 +61,60 @@ virq_handler::inject_virtual_interrupt(uint64_t vector)
     m_vcpu->inject_external_interrupt(m_hypervisor_callback_vector);
 }
 
+void
+virq_handler::queue_virtual_interrupts(
+    const gsl::span<const uint64_t> &vectors)
+{
+    if (vectors.empty()) {
+        return;
+    }
+
+    if (!m_batching) {
+        for (const auto &vector : vectors) {
+            this->queue_virtual_interrupt(vector);
+        }
+
+        return;
+    }
+
+    for (const auto &vector : vectors) {
+        m_interrupt_queue.push(vector);
+    }
+
+    m_vcpu->queue_external_interrupt(m_hypervisor_callback_vector);
+}
+
+void
+virq_handler::inject_virtual_interrupts(
+    const gsl::span<const uint64_t> &vectors)
+{
+    if (vectors.empty()) {
+        return;
+    }
+
+    // Note:
+    //
+    // Only one interrupt can be injected, so without batching, the first
+    // vIRQ is injected and the rest are queued behind it.
+    //
+
+    if (!m_batching) {
+        this->inject_virtual_interrupt(vectors[0]);
+
+        for (const auto &vector : vectors.subspan(1)) {
+            this->queue_virtual_interrupt(vector);
+        }
+
+        return;
+    }
+
+    for (const auto &vector : vectors) {
+        m_interrupt_queue.push(vector);
+    }
+
+    m_vcpu->inject_external_interrupt(m_hypervisor_callback_vector);
+}
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -93,6 +147,13 @@ virq_handler::virq_op__get_next_virq(vcpu *vcpu)
     })
 }
 
+void
+virq_handler::virq_op__enable_virq_batching(vcpu *vcpu)
+{
+    m_batching = true;
+    vcpu->set_rax(SUCCESS);
+}
+
 bool
 virq_handler::dispatch(vcpu *vcpu)
 {
@@ -109,6 +170,10 @@ virq_handler::dispatch(vcpu *vcpu)
             virq_op__get_next_virq(vcpu);
             break;
 
+        case hypercall_enum_virq_op__enable_virq_batching:
+            virq_op__enable_virq_batching(vcpu);
+            break;
+
         default:
             vcpu->halt("unknown virq op");
     };
@@ -0,0 +1,494 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <bfgpalayout.h>
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/domain.h>
+#include <hve/arch/intel_x64/virt/virtio_blk.h>
+
+#include <cstring>
+#include <algorithm>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+constexpr const uint32_t virtio_id_block{2};
+
+constexpr const uint64_t virtio_blk_f_size_max{1ULL << 1};
+constexpr const uint64_t virtio_blk_f_seg_max{1ULL << 2};
+constexpr const uint64_t virtio_blk_f_flush{1ULL << 9};
+
+// Note:
+//
+// Each data segment is limited to a page (size_max), and a request is
+// limited to as many segments as fit in a slot (seg_max), so every
+// request fits in a single slot of the ring.
+//
+
+constexpr const uint32_t size_max{0x1000};
+constexpr const uint32_t seg_max{VIRTIO_BLK_SLOT_SIZE / size_max};
+
+constexpr const char virtio_blk_id[] = "boxy-virtio-blk";
+constexpr const uint32_t virtio_blk_id_len{20};
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+using segs_t = std::vector<std::pair<uintptr_t, uint32_t>>;
+
+static void
+copy_from_guest(vcpu *vcpu, uint8_t *dst, const segs_t &segs)
+{
+    for (const auto &[gpa, len] : segs) {
+        auto src = vcpu->map_gpa_4k<uint8_t>(gpa, len);
+        std::memcpy(dst, src.get(), len);
+
+        dst += len;
+    }
+}
+
+static uint64_t
+copy_to_guest(vcpu *vcpu, const uint8_t *src, uint64_t size, const segs_t &segs)
+{
+    uint64_t done = 0;
+
+    for (const auto &[gpa, len] : segs) {
+        auto bytes = std::min<uint64_t>(len, size - done);
+        if (bytes == 0) {
+            break;
+        }
+
+        auto dst = vcpu->map_gpa_4k<uint8_t>(gpa, bytes);
+        std::memcpy(dst.get(), src + done, bytes);
+
+        done += bytes;
+    }
+
+    return done;
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+virtio_blk::virtio_blk(bfvmm::x64::unique_map<ring_type> &&ring) :
+    virtio_mmio{
+        virtio_id_block,
+        virtio_blk_f_size_max | virtio_blk_f_seg_max | virtio_blk_f_flush |
+        virtio_ring_f_event_idx | virtio_f_version_1,
+        1,
+        VIRTIO_BLK_QUEUE_SIZE,
+        boxy_virq__virtio_blk
+    },
+    m_ring{std::move(ring)}
+{
+    auto r = m_ring.get();
+
+    m_capacity = r->capacity;
+    m_req_prod = r->req_prod;
+
+    m_free_slots.reserve(VIRTIO_BLK_RING_SLOTS);
+    for (uint64_t i = VIRTIO_BLK_RING_SLOTS; i > 0; i--) {
+        m_free_slots.push_back(i - 1);
+    }
+
+    for (auto &slot : m_slots) {
+        slot.segs.reserve(seg_max);
+    }
+
+    m_chain.reserve(VIRTIO_BLK_QUEUE_SIZE);
+}
+
+bool
+virtio_blk::resume(vcpu *vcpu)
+{
+    auto r = m_ring.get();
+
+    auto rsp_prod = reinterpret_cast<volatile uint64_t *>(&r->rsp_prod);
+    auto rsp_cons = reinterpret_cast<volatile uint64_t *>(&r->rsp_cons);
+
+    if (*rsp_prod == *rsp_cons && !m_kick) {
+        return false;
+    }
+
+    std::lock_guard lock(m_mutex);
+
+    this->process_completions(vcpu);
+
+    if (m_stalled) {
+        this->process_queue(vcpu);
+    }
+
+    this->notify_guest(vcpu);
+    return m_kick.exchange(false);
+}
+
+// -----------------------------------------------------------------------------
+// Virtio MMIO Device
+// -----------------------------------------------------------------------------
+
+uint64_t
+virtio_blk::read_config(uint64_t offset, uint64_t size) const noexcept
+{
+    // Note:
+    //
+    // struct virtio_blk_config: capacity (in 512 byte sectors), size_max
+    // and seg_max. Everything after seg_max is for a feature that we do
+    // not offer, and reads as 0.
+    //
+
+    std::array<uint8_t, 16> config{};
+
+    std::memcpy(&config.at(0), &m_capacity, sizeof(uint64_t));
+    std::memcpy(&config.at(8), &size_max, sizeof(uint32_t));
+    std::memcpy(&config.at(12), &seg_max, sizeof(uint32_t));
+
+    uint64_t val = 0;
+
+    if (offset + size <= config.size()) {
+        std::memcpy(&val, &config.at(offset), size);
+    }
+
+    return val;
+}
+
+void
+virtio_blk::queue_notify(vcpu *vcpu, std::size_t index)
+{
+    bfignored(index);
+
+    this->process_queue(vcpu);
+    this->notify_guest(vcpu);
+}
+
+void
+virtio_blk::device_status(uint32_t status) noexcept
+{
+    if (status != 0) {
+        return;
+    }
+
+    // Note:
+    //
+    // bfexec might still be working on requests from before the reset.
+    // Their slots stay busy until bfexec completes them, but nothing is
+    // written back to the guest.
+    //
+
+    for (auto &slot : m_slots) {
+        if (slot.busy) {
+            slot.orphaned = true;
+        }
+    }
+
+    m_stalled = false;
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+void
+virtio_blk::process_queue(vcpu *vcpu)
+{
+    auto &q = this->queue(0);
+    auto posted = false;
+
+    m_stalled = false;
+
+    try {
+        while (true) {
+            if (m_free_slots.empty()) {
+
+                // bfexec has every slot, so there is no point in being
+                // notified. The queue is restarted once a slot is freed.
+
+                q.disable_notify();
+                m_stalled = true;
+                break;
+            }
+
+            uint16_t head;
+            if (!q.pop(head)) {
+                q.enable_notify();
+
+                if (q.empty()) {
+                    break;
+                }
+
+                continue;
+            }
+
+            if (this->process_request(vcpu, head)) {
+                posted = true;
+            }
+        }
+    }
+    catchall({
+        this->needs_reset();
+    })
+
+    if (posted) {
+        auto req_prod =
+            reinterpret_cast<volatile uint64_t *>(&m_ring.get()->req_prod);
+
+        std::atomic_thread_fence(std::memory_order_release);
+        *req_prod = m_req_prod;
+
+        m_kick = true;
+    }
+}
+
+bool
+virtio_blk::process_request(vcpu *vcpu, uint16_t head)
+{
+    auto &q = this->queue(0);
+
+    if (!q.chain(head, m_chain) || m_chain.size() < 2) {
+        q.push(head, 0);
+        return false;
+    }
+
+    auto hdr = m_chain.front();
+    auto sts = m_chain.back();
+
+    if (hdr.len < 16 || (hdr.flags & virtq_desc_f_write) != 0 ||
+        sts.len < 1 || (sts.flags & virtq_desc_f_write) == 0) {
+        q.push(head, 0);
+        return false;
+    }
+
+    uint32_t type;
+    uint64_t sector;
+
+    {
+        auto map = vcpu->map_gpa_4k<uint8_t>(hdr.addr, 16);
+
+        std::memcpy(&type, map.get(), sizeof(type));
+        std::memcpy(&sector, map.get() + 8, sizeof(sector));
+    }
+
+    auto id = m_free_slots.back();
+    auto &slot = m_slots.at(id);
+
+    auto in = type == VIRTIO_BLK_T_IN || type == VIRTIO_BLK_T_GET_ID;
+    auto valid = true;
+
+    uint64_t len = 0;
+    slot.segs.clear();
+
+    for (std::size_t i = 1; i + 1 < m_chain.size(); i++) {
+        const auto &desc = m_chain.at(i);
+
+        if (desc.len == 0 || desc.len > size_max ||
+            slot.segs.size() == seg_max ||
+            ((desc.flags & virtq_desc_f_write) != 0) != in) {
+            valid = false;
+            break;
+        }
+
+        slot.segs.emplace_back(desc.addr, desc.len);
+        len += desc.len;
+    }
+
+    switch (type) {
+        case VIRTIO_BLK_T_IN:
+        case VIRTIO_BLK_T_OUT:
+            if (!valid || (len % VIRTIO_BLK_SECTOR_SIZE) != 0 ||
+                sector > m_capacity ||
+                len / VIRTIO_BLK_SECTOR_SIZE > m_capacity - sector) {
+                this->complete(vcpu, head, sts.addr, VIRTIO_BLK_S_IOERR, 1);
+                return false;
+            }
+            break;
+
+        case VIRTIO_BLK_T_FLUSH:
+            len = 0;
+            break;
+
+        case VIRTIO_BLK_T_GET_ID: {
+            if (!valid) {
+                this->complete(vcpu, head, sts.addr, VIRTIO_BLK_S_IOERR, 1);
+                return false;
+            }
+
+            std::array<uint8_t, virtio_blk_id_len> id_str{};
+            std::memcpy(id_str.data(), virtio_blk_id, sizeof(virtio_blk_id));
+
+            auto done = copy_to_guest(
+                            vcpu, id_str.data(), id_str.size(), slot.segs);
+            this->complete(
+                vcpu, head, sts.addr, VIRTIO_BLK_S_OK,
+                gsl::narrow_cast<uint32_t>(done + 1)
+            );
+
+            return false;
+        }
+
+        default:
+            this->complete(vcpu, head, sts.addr, VIRTIO_BLK_S_UNSUPP, 1);
+            return false;
+    }
+
+    auto r = m_ring.get();
+
+    if (type == VIRTIO_BLK_T_OUT) {
+        copy_from_guest(vcpu, &r->data[id][0], slot.segs);
+    }
+
+    m_free_slots.pop_back();
+
+    slot.busy = true;
+    slot.orphaned = false;
+    slot.head = head;
+    slot.type = type;
+    slot.len = len;
+    slot.status = sts.addr;
+
+    auto &req = r->req[m_req_prod % VIRTIO_BLK_RING_SLOTS];
+
+    req.type = type;
+    req.status = 0;
+    req.sector = sector;
+    req.len = len;
+    req.slot = id;
+
+    m_req_prod++;
+    return true;
+}
+
+void
+virtio_blk::process_completions(vcpu *vcpu)
+{
+    auto r = m_ring.get();
+
+    auto rsp_prod = reinterpret_cast<volatile uint64_t *>(&r->rsp_prod);
+    auto rsp_cons = reinterpret_cast<volatile uint64_t *>(&r->rsp_cons);
+
+    uint64_t prod = *rsp_prod;
+    uint64_t cons = *rsp_cons;
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (prod - cons > VIRTIO_BLK_RING_SLOTS) {
+        bfalert_info(0, "virtio_blk: rsp ring corrupt");
+        cons = prod;
+    }
+
+    while (cons != prod) {
+        auto rsp = r->rsp[cons % VIRTIO_BLK_RING_SLOTS];
+        cons++;
+
+        if (rsp.slot >= VIRTIO_BLK_RING_SLOTS) {
+            continue;
+        }
+
+        auto &slot = m_slots.at(rsp.slot);
+        if (!slot.busy) {
+            continue;
+        }
+
+        if (!slot.orphaned && this->queue(0).ready()) {
+            uint32_t written = 1;
+            uint8_t status = rsp.status <= VIRTIO_BLK_S_UNSUPP ?
+                             gsl::narrow_cast<uint8_t>(rsp.status) :
+                             VIRTIO_BLK_S_IOERR;
+
+            if (slot.type == VIRTIO_BLK_T_IN && status == VIRTIO_BLK_S_OK) {
+                auto data = &r->data[rsp.slot][0];
+
+                written += gsl::narrow_cast<uint32_t>(
+                    copy_to_guest(vcpu, data, slot.len, slot.segs)
+                );
+            }
+
+            this->complete(vcpu, slot.head, slot.status, status, written);
+        }
+
+        slot.busy = false;
+        m_free_slots.push_back(rsp.slot);
+    }
+
+    std::atomic_thread_fence(std::memory_order_release);
+    *rsp_cons = cons;
+}
+
+void
+virtio_blk::complete(
+    vcpu *vcpu, uint16_t head, uintptr_t status, uint8_t val, uint32_t len)
+{
+    {
+        auto map = vcpu->map_gpa_4k<uint8_t>(status, 1);
+        *map.get() = val;
+    }
+
+    this->queue(0).push(head, len);
+}
+
+// -----------------------------------------------------------------------------
+// vCPU Handler
+// -----------------------------------------------------------------------------
+
+virtio_blk_handler::virtio_blk_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{
+    if (vcpu->is_dom0() || vcpu->dom()->blk() == nullptr) {
+        return;
+    }
+
+    vcpu->add_resume_delegate(
+        {&virtio_blk_handler::resume_delegate, this}
+    );
+}
+
+void
+virtio_blk_handler::resume_delegate(vcpu_t *vcpu)
+{
+    bfignored(vcpu);
+
+    if (!m_vcpu->dom()->blk()->resume(m_vcpu)) {
+        return;
+    }
+
+    // Note:
+    //
+    // This does not return. bfexec is told about every request that was
+    // posted since the last time the guest was resumed with a single
+    // notification, and the guest is resumed once bfexec has woken up its
+    // disk thread.
+    //
+
+    m_vcpu->begin_steal_time(::x64::tsc::get(), true);
+
+    m_vcpu->parent_vcpu()->load();
+    m_vcpu->parent_vcpu()->return_notify(boxy_notify__virtio_blk);
+}
+
+}
@@ -0,0 +1,846 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/virt/virtio_mmio.h>
+
+#include <cstring>
+#include <algorithm>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+constexpr const uint64_t reg_magic_value{0x000};
+constexpr const uint64_t reg_version{0x004};
+constexpr const uint64_t reg_device_id{0x008};
+constexpr const uint64_t reg_vendor_id{0x00C};
+constexpr const uint64_t reg_device_features{0x010};
+constexpr const uint64_t reg_device_features_sel{0x014};
+constexpr const uint64_t reg_driver_features{0x020};
+constexpr const uint64_t reg_driver_features_sel{0x024};
+constexpr const uint64_t reg_queue_sel{0x030};
+constexpr const uint64_t reg_queue_num_max{0x034};
+constexpr const uint64_t reg_queue_num{0x038};
+constexpr const uint64_t reg_queue_ready{0x044};
+constexpr const uint64_t reg_queue_notify{0x050};
+constexpr const uint64_t reg_interrupt_status{0x060};
+constexpr const uint64_t reg_interrupt_ack{0x064};
+constexpr const uint64_t reg_status{0x070};
+constexpr const uint64_t reg_queue_desc_low{0x080};
+constexpr const uint64_t reg_queue_desc_high{0x084};
+constexpr const uint64_t reg_queue_driver_low{0x090};
+constexpr const uint64_t reg_queue_driver_high{0x094};
+constexpr const uint64_t reg_queue_device_low{0x0A0};
+constexpr const uint64_t reg_queue_device_high{0x0A4};
+constexpr const uint64_t reg_config_generation{0x0FC};
+constexpr const uint64_t reg_config{0x100};
+
+constexpr const uint64_t virtio_mmio_size{0x1000};
+
+constexpr const uint32_t virtio_magic_value{0x74726976};
+constexpr const uint32_t virtio_version{2};
+
+constexpr const uint32_t status_device_needs_reset{0x40};
+constexpr const uint32_t interrupt_used_buffer{0x1};
+
+constexpr const uint16_t virtq_desc_f_indirect{0x4};
+constexpr const uint16_t virtq_avail_f_no_interrupt{0x1};
+constexpr const uint16_t virtq_used_f_no_notify{0x1};
+
+constexpr const std::size_t rxq{0};
+constexpr const std::size_t txq{1};
+
+// -----------------------------------------------------------------------------
+// Virtqueue
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+virtq::virtq(uint32_t num_max) noexcept :
+    m_num_max{num_max},
+    m_num{num_max}
+{ }
+
+void
+virtq::setup(vcpu_t *vcpu, bool event_idx)
+{
+    // Note:
+    //
+    // The avail ring is flags, idx, ring[num] and used_event, and the used
+    // ring is flags, idx, ring[num] (8 bytes each) and avail_event, so
+    // both are mapped as an array of 16 bit values.
+    //
+
+    m_desc = vcpu->map_gpa_4k<uint64_t>(m_desc_gpa, m_num * 2);
+    m_avail = vcpu->map_gpa_4k<uint16_t>(m_driver_gpa, m_num + 3);
+    m_used = vcpu->map_gpa_4k<uint16_t>(m_device_gpa, (m_num * 4) + 3);
+
+    m_event_idx = event_idx;
+    m_last_avail = 0;
+    m_used_idx = 0;
+    m_used_published = 0;
+    m_ready = 1;
+}
+
+void
+virtq::reset() noexcept
+{
+    m_num = m_num_max;
+    m_ready = 0;
+    m_desc_gpa = 0;
+    m_driver_gpa = 0;
+    m_device_gpa = 0;
+
+    m_desc = bfvmm::x64::unique_map<uint64_t>{};
+    m_avail = bfvmm::x64::unique_map<uint16_t>{};
+    m_used = bfvmm::x64::unique_map<uint16_t>{};
+
+    m_event_idx = false;
+    m_last_avail = 0;
+    m_used_idx = 0;
+    m_used_published = 0;
+}
+
+bool
+virtq::ready() const noexcept
+{ return m_ready != 0; }
+
+bool
+virtq::empty() const noexcept
+{
+    if (m_ready == 0) {
+        return true;
+    }
+
+    return *this->avail(1) == m_last_avail;
+}
+
+bool
+virtq::pop(uint16_t &head)
+{
+    if (m_ready == 0) {
+        return false;
+    }
+
+    uint16_t idx = *this->avail(1);
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (idx == m_last_avail) {
+        return false;
+    }
+
+    if (gsl::narrow_cast<uint16_t>(idx - m_last_avail) > m_num) {
+        throw std::runtime_error("virtq: avail ring corrupt");
+    }
+
+    head = *this->avail(2 + (m_last_avail % m_num));
+    m_last_avail++;
+
+    return true;
+}
+
+bool
+virtq::chain(uint16_t head, std::vector<virtq_desc_t> &chain) const
+{
+    auto table = static_cast<const volatile uint64_t *>(m_desc.get());
+
+    chain.clear();
+
+    for (uint16_t i = head; ;) {
+        if (i >= m_num || chain.size() >= m_num) {
+            return false;
+        }
+
+        uint64_t addr = table[(i * 2) + 0];
+        uint64_t rest = table[(i * 2) + 1];
+
+        virtq_desc_t desc = {
+            addr,
+            gsl::narrow_cast<uint32_t>(rest),
+            gsl::narrow_cast<uint16_t>(rest >> 32),
+            gsl::narrow_cast<uint16_t>(rest >> 48)
+        };
+
+        if ((desc.flags & virtq_desc_f_indirect) != 0) {
+            return false;
+        }
+
+        chain.push_back(desc);
+
+        if ((desc.flags & virtq_desc_f_next) == 0) {
+            break;
+        }
+
+        i = desc.next;
+    }
+
+    return true;
+}
+
+void
+virtq::push(uint16_t head, uint32_t len) noexcept
+{
+    auto i = m_used_idx % m_num;
+
+    *this->used32((i * 2) + 0) = head;
+    *this->used32((i * 2) + 1) = len;
+
+    m_used_idx++;
+}
+
+bool
+virtq::publish() noexcept
+{
+    if (m_ready == 0 || m_used_idx == m_used_published) {
+        return false;
+    }
+
+    auto old_idx = m_used_published;
+    auto new_idx = m_used_idx;
+
+    std::atomic_thread_fence(std::memory_order_release);
+    *this->used16(1) = new_idx;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    m_used_published = new_idx;
+
+    // Note:
+    //
+    // With VIRTIO_RING_F_EVENT_IDX, the guest tells us which used index
+    // it wants to be interrupted at (used_event), and we only interrupt
+    // the guest if this publish moved the used index past it. This is the
+    // same check as Linux's vring_need_event().
+    //
+
+    if (m_event_idx) {
+        uint16_t event = *this->avail(2 + m_num);
+
+        return gsl::narrow_cast<uint16_t>(new_idx - event - 1) <
+               gsl::narrow_cast<uint16_t>(new_idx - old_idx);
+    }
+
+    return (*this->avail(0) & virtq_avail_f_no_interrupt) == 0;
+}
+
+void
+virtq::enable_notify() noexcept
+{
+    if (m_ready == 0) {
+        return;
+    }
+
+    if (m_event_idx) {
+        *this->used16(2 + (m_num * 4)) = m_last_avail;
+    }
+    else {
+        *this->used16(0) = 0;
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void
+virtq::disable_notify() noexcept
+{
+    // Note:
+    //
+    // With VIRTIO_RING_F_EVENT_IDX, notifications are disabled by simply
+    // not moving avail_event forward.
+    //
+
+    if (m_ready == 0 || m_event_idx) {
+        return;
+    }
+
+    *this->used16(0) = virtq_used_f_no_notify;
+}
+
+volatile uint16_t *
+virtq::avail(std::size_t i) const noexcept
+{ return static_cast<volatile uint16_t *>(m_avail.get()) + i; }
+
+volatile uint16_t *
+virtq::used16(std::size_t i) const noexcept
+{ return static_cast<volatile uint16_t *>(m_used.get()) + i; }
+
+volatile uint32_t *
+virtq::used32(std::size_t i) const noexcept
+{
+    auto ring = static_cast<volatile uint16_t *>(m_used.get()) + 2;
+    return reinterpret_cast<volatile uint32_t *>(ring) + i;
+}
+
+// -----------------------------------------------------------------------------
+// Virtio MMIO Device
+// -----------------------------------------------------------------------------
+
+virtio_mmio::virtio_mmio(
+    uint32_t device_id, uint64_t features, std::size_t queues,
+    uint32_t queue_size, uint64_t virq
+) :
+    m_device_id{device_id},
+    m_device_features{features},
+    m_virq{virq}
+{
+    m_queues.reserve(queues);
+    for (std::size_t i = 0; i < queues; i++) {
+        m_queues.emplace_back(queue_size);
+    }
+}
+
+bool
+virtio_mmio::mmio_read(vcpu *vcpu, mmio_bus::info_t &info)
+{
+    bfignored(vcpu);
+    std::lock_guard lock(m_mutex);
+
+    auto offset = info.gpa & (virtio_mmio_size - 1);
+
+    if (offset >= reg_config) {
+        info.val = this->read_config(offset - reg_config, info.size);
+        return true;
+    }
+
+    if (info.size != 4) {
+        info.val = 0;
+        return true;
+    }
+
+    auto q = m_queue_sel < m_queues.size() ? &m_queues[m_queue_sel] : nullptr;
+
+    switch (offset) {
+        case reg_magic_value:
+            info.val = virtio_magic_value;
+            break;
+
+        case reg_version:
+            info.val = virtio_version;
+            break;
+
+        case reg_device_id:
+            info.val = m_device_id;
+            break;
+
+        case reg_vendor_id:
+            info.val = boxy_cpuid_signature;
+            break;
+
+        case reg_device_features:
+            info.val = m_device_features_sel < 2 ?
+                       (m_device_features >> (m_device_features_sel * 32)) &
+                       0xFFFFFFFF : 0;
+            break;
+
+        case reg_queue_num_max:
+            info.val = q != nullptr ? q->m_num_max : 0;
+            break;
+
+        case reg_queue_ready:
+            info.val = q != nullptr ? q->m_ready : 0;
+            break;
+
+        case reg_interrupt_status:
+            info.val = m_interrupt_status;
+            break;
+
+        case reg_status:
+            info.val = m_status;
+            break;
+
+        case reg_config_generation:
+            info.val = m_config_generation;
+            break;
+
+        default:
+            info.val = 0;
+            break;
+    }
+
+    return true;
+}
+
+bool
+virtio_mmio::mmio_write(vcpu *vcpu, mmio_bus::info_t &info)
+{
+    std::lock_guard lock(m_mutex);
+
+    auto offset = info.gpa & (virtio_mmio_size - 1);
+    auto val = gsl::narrow_cast<uint32_t>(info.val);
+
+    // Note:
+    //
+    // The config space is read-only, and the registers are all 32 bits.
+    // Anything else is ignored. A queue's registers can only be changed
+    // while the queue is not ready.
+    //
+
+    if (offset >= reg_config || info.size != 4) {
+        return true;
+    }
+
+    auto q = m_queue_sel < m_queues.size() ? &m_queues[m_queue_sel] : nullptr;
+    auto queue_writable = q != nullptr && q->m_ready == 0;
+
+    auto val64 = static_cast<uint64_t>(val);
+
+    // Note:
+    //
+    // The queue's address registers are passed as member pointers so that
+    // q is only dereferenced once we know that queue_sel is valid.
+    //
+
+    auto set_low = [&](uint64_t virtq::*reg) {
+        if (queue_writable) {
+            q->*reg = (q->*reg & 0xFFFFFFFF00000000) | val64;
+        }
+    };
+
+    auto set_high = [&](uint64_t virtq::*reg) {
+        if (queue_writable) {
+            q->*reg = (q->*reg & 0x00000000FFFFFFFF) | (val64 << 32);
+        }
+    };
+
+    switch (offset) {
+        case reg_device_features_sel:
+            m_device_features_sel = val;
+            break;
+
+        case reg_driver_features:
+            if (m_driver_features_sel < 2) {
+                auto shift = m_driver_features_sel * 32;
+
+                m_driver_features &= ~(0xFFFFFFFFULL << shift);
+                m_driver_features |= (val64 << shift) & m_device_features;
+            }
+            break;
+
+        case reg_driver_features_sel:
+            m_driver_features_sel = val;
+            break;
+
+        case reg_queue_sel:
+            m_queue_sel = val;
+            break;
+
+        case reg_queue_num:
+            if (queue_writable && val != 0 && val <= q->m_num_max &&
+                (val & (val - 1)) == 0) {
+                q->m_num = val;
+            }
+            break;
+
+        case reg_queue_ready:
+            if (q == nullptr) {
+                break;
+            }
+
+            if ((val & 0x1) == 0) {
+                q->m_ready = 0;
+                break;
+            }
+
+            if (q->m_ready == 0) {
+                try {
+                    q->setup(vcpu, this->negotiated(virtio_ring_f_event_idx));
+                }
+                catchall({
+                    this->needs_reset();
+                })
+            }
+            break;
+
+        case reg_queue_notify:
+            if (val < m_queues.size() && m_queues[val].ready()) {
+                this->queue_notify(vcpu, val);
+            }
+            break;
+
+        case reg_interrupt_ack:
+            m_interrupt_status &= ~val;
+            break;
+
+        case reg_status:
+            if (val == 0) {
+                this->reset();
+            }
+            else {
+                m_status = val;
+            }
+
+            this->device_status(val);
+            break;
+
+        case reg_queue_desc_low:
+            set_low(&virtq::m_desc_gpa);
+            break;
+
+        case reg_queue_desc_high:
+            set_high(&virtq::m_desc_gpa);
+            break;
+
+        case reg_queue_driver_low:
+            set_low(&virtq::m_driver_gpa);
+            break;
+
+        case reg_queue_driver_high:
+            set_high(&virtq::m_driver_gpa);
+            break;
+
+        case reg_queue_device_low:
+            set_low(&virtq::m_device_gpa);
+            break;
+
+        case reg_queue_device_high:
+            set_high(&virtq::m_device_gpa);
+            break;
+
+        default:
+            break;
+    }
+
+    return true;
+}
+
+bool
+virtio_mmio::negotiated(uint64_t feature) const noexcept
+{ return (m_driver_features & feature) != 0; }
+
+uint64_t
+virtio_mmio::features() const noexcept
+{ return m_driver_features; }
+
+virtq &
+virtio_mmio::queue(std::size_t index)
+{ return m_queues.at(index); }
+
+void
+virtio_mmio::needs_reset() noexcept
+{
+    for (auto &q : m_queues) {
+        q.m_ready = 0;
+    }
+
+    m_status |= status_device_needs_reset;
+}
+
+void
+virtio_mmio::notify_guest(vcpu *vcpu)
+{
+    auto interrupt = false;
+
+    for (auto &q : m_queues) {
+        if (q.publish()) {
+            interrupt = true;
+        }
+    }
+
+    if (!interrupt || (m_interrupt_status & interrupt_used_buffer) != 0) {
+        return;
+    }
+
+    m_interrupt_status |= interrupt_used_buffer;
+    vcpu->queue_virtual_interrupt(m_virq);
+}
+
+void
+virtio_mmio::reset() noexcept
+{
+    m_status = 0;
+    m_device_features_sel = 0;
+    m_driver_features_sel = 0;
+    m_driver_features = 0;
+    m_interrupt_status = 0;
+    m_queue_sel = 0;
+
+    for (auto &q : m_queues) {
+        q.reset();
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Bounce Ring
+// -----------------------------------------------------------------------------
+
+virtio_bounce::virtio_bounce(
+    uint32_t device_id, uint64_t features, std::size_t queues,
+    uint32_t queue_size, uint64_t virq, const bounce_ring_t &ring
+) :
+    virtio_mmio{device_id, features, queues, queue_size, virq},
+    m_bounce{ring}
+{
+    m_tx_prod = *m_bounce.tx_prod;
+    m_chain.reserve(queue_size);
+}
+
+void
+virtio_bounce::rx_done(uint64_t len) noexcept
+{ bfignored(len); }
+
+bool
+virtio_bounce::rx_pending() const noexcept
+{ return *m_bounce.rx_prod != *m_bounce.rx_cons && !m_rx_stalled; }
+
+bool
+virtio_bounce::tx_pending() const noexcept
+{
+    return m_tx_stalled &&
+           *m_bounce.tx_prod - *m_bounce.tx_cons < m_bounce.slots;
+}
+
+void
+virtio_bounce::reset_bounce() noexcept
+{
+    m_rx_stalled = false;
+    m_tx_stalled = false;
+}
+
+uint64_t
+virtio_bounce::chain_room(const virtq &q, uint16_t head)
+{
+    uint64_t room = 0;
+
+    if (!q.chain(head, m_chain)) {
+        return 0;
+    }
+
+    for (const auto &desc : m_chain) {
+        if ((desc.flags & virtq_desc_f_write) == 0) {
+            return 0;
+        }
+
+        room += desc.len;
+    }
+
+    return room;
+}
+
+void
+virtio_bounce::process_rx(vcpu *vcpu)
+{
+    auto &q = this->queue(rxq);
+
+    uint64_t prod = *m_bounce.rx_prod;
+    uint64_t cons = *m_bounce.rx_cons;
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (prod - cons > m_bounce.slots) {
+        bfalert_info(0, "virtio_bounce: rx ring corrupt");
+        cons = prod;
+    }
+
+    auto full = prod - cons == m_bounce.slots;
+    auto start = cons;
+
+    m_rx_stalled = false;
+
+    try {
+        while (cons != prod) {
+            auto slot = cons % m_bounce.slots;
+
+            auto data = &m_bounce.rx[slot * m_bounce.slot_size];
+            auto len = m_bounce.rx_len[slot];
+
+            if (len > m_bounce.slot_size || !this->rx_accept(data, len)) {
+                cons++;
+                continue;
+            }
+
+            if (!this->receive(vcpu, data, len)) {
+
+                // The guest is out of receive buffers. The buffer stays in
+                // the ring until the guest notifies the queue.
+
+                q.enable_notify();
+
+                if (q.empty()) {
+                    m_rx_stalled = true;
+                    break;
+                }
+
+                continue;
+            }
+
+            cons++;
+        }
+    }
+    catchall({
+        this->needs_reset();
+    })
+
+    std::atomic_thread_fence(std::memory_order_release);
+    *m_bounce.rx_cons = cons;
+
+    if (!m_rx_stalled) {
+        q.disable_notify();
+    }
+
+    // Note:
+    //
+    // bfexec stops reading from the backend when the rx half is full, so
+    // if we made room, it has to be told.
+    //
+
+    if (full && cons != start) {
+        m_kick = true;
+    }
+}
+
+bool
+virtio_bounce::receive(vcpu *vcpu, const uint8_t *data, uint64_t len)
+{
+    auto &q = this->queue(rxq);
+
+    uint16_t head;
+    if (!q.pop(head)) {
+        return false;
+    }
+
+    // Note:
+    //
+    // Every buffer goes into a single descriptor chain. If it does not
+    // fit, it is dropped, and the chain is returned to the guest empty.
+    //
+
+    if (this->chain_room(q, head) < len) {
+        q.push(head, 0);
+        return true;
+    }
+
+    uint64_t done = 0;
+
+    for (const auto &desc : m_chain) {
+        auto bytes = std::min<uint64_t>(desc.len, len - done);
+        if (bytes == 0) {
+            break;
+        }
+
+        auto dst = vcpu->map_gpa_4k<uint8_t>(desc.addr, bytes);
+        std::memcpy(dst.get(), data + done, bytes);
+
+        done += bytes;
+    }
+
+    q.push(head, gsl::narrow_cast<uint32_t>(done));
+    this->rx_done(len);
+
+    return true;
+}
+
+void
+virtio_bounce::process_tx(vcpu *vcpu)
+{
+    auto &q = this->queue(txq);
+    auto posted = false;
+
+    m_tx_stalled = false;
+
+    try {
+        while (true) {
+            if (m_tx_prod - *m_bounce.tx_cons >= m_bounce.slots) {
+
+                // bfexec has every slot, so there is no point in being
+                // notified. The queue is restarted once bfexec catches up.
+
+                q.disable_notify();
+                m_tx_stalled = true;
+                break;
+            }
+
+            uint16_t head;
+            if (!q.pop(head)) {
+                q.enable_notify();
+
+                if (q.empty()) {
+                    break;
+                }
+
+                continue;
+            }
+
+            if (this->transmit(vcpu, head)) {
+                posted = true;
+            }
+        }
+    }
+    catchall({
+        this->needs_reset();
+    })
+
+    if (posted) {
+        std::atomic_thread_fence(std::memory_order_release);
+        *m_bounce.tx_prod = m_tx_prod;
+
+        m_kick = true;
+    }
+}
+
+bool
+virtio_bounce::transmit(vcpu *vcpu, uint16_t head)
+{
+    auto &q = this->queue(txq);
+
+    // Note:
+    //
+    // The buffer is copied out of the guest right away, so the chain is
+    // returned to the guest before bfexec has seen it.
+    //
+
+    auto slot = m_tx_prod % m_bounce.slots;
+    auto data = &m_bounce.tx[slot * m_bounce.slot_size];
+
+    uint64_t len = 0;
+    auto valid = q.chain(head, m_chain);
+
+    for (const auto &desc : m_chain) {
+        if (!valid) {
+            break;
+        }
+
+        if ((desc.flags & virtq_desc_f_write) != 0 ||
+            desc.len > m_bounce.slot_size - len) {
+            valid = false;
+            break;
+        }
+
+        auto src = vcpu->map_gpa_4k<uint8_t>(desc.addr, desc.len);
+        std::memcpy(data + len, src.get(), desc.len);
+
+        len += desc.len;
+    }
+
+    q.push(head, 0);
+
+    if (!this->tx_accept(data, valid ? len : 0)) {
+        return false;
+    }
+
+    m_bounce.tx_len[slot] = len;
+    m_tx_prod++;
+
+    return true;
+}
+
+}
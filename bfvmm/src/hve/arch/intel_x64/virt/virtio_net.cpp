@@ -0,0 +1,611 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <bfgpalayout.h>
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/domain.h>
+#include <hve/arch/intel_x64/virt/virtio_net.h>
+
+#include <cstring>
+#include <algorithm>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+constexpr const uint32_t virtio_id_net{1};
+
+constexpr const std::size_t rxq{0};
+constexpr const std::size_t txq{1};
+
+constexpr const uint64_t virtio_net_f_csum{1ULL << VIRTIO_NET_F_CSUM};
+constexpr const uint64_t virtio_net_f_guest_csum{
+    1ULL << VIRTIO_NET_F_GUEST_CSUM
+};
+constexpr const uint64_t virtio_net_f_mac{1ULL << 5};
+constexpr const uint64_t virtio_net_f_guest_tso4{
+    1ULL << VIRTIO_NET_F_GUEST_TSO4
+};
+constexpr const uint64_t virtio_net_f_guest_tso6{
+    1ULL << VIRTIO_NET_F_GUEST_TSO6
+};
+constexpr const uint64_t virtio_net_f_host_tso4{
+    1ULL << VIRTIO_NET_F_HOST_TSO4
+};
+constexpr const uint64_t virtio_net_f_host_tso6{
+    1ULL << VIRTIO_NET_F_HOST_TSO6
+};
+constexpr const uint64_t virtio_net_f_status{1ULL << 16};
+
+constexpr const uint64_t device_features{
+    virtio_net_f_csum |
+    virtio_net_f_guest_csum |
+    virtio_net_f_mac |
+    virtio_net_f_guest_tso4 |
+    virtio_net_f_guest_tso6 |
+    virtio_net_f_host_tso4 |
+    virtio_net_f_host_tso6 |
+    virtio_net_f_status |
+    boxy::intel_x64::virtio_ring_f_event_idx |
+    boxy::intel_x64::virtio_f_version_1
+};
+
+constexpr const uint16_t virtio_net_s_link_up{1};
+
+constexpr const uint8_t virtio_net_hdr_f_needs_csum{1};
+constexpr const uint8_t virtio_net_hdr_gso_none{0};
+constexpr const uint8_t virtio_net_hdr_gso_tcpv4{1};
+constexpr const uint8_t virtio_net_hdr_gso_tcpv6{4};
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+virtio_net::virtio_net(bfvmm::x64::unique_map<ring_type> &&ring) :
+    virtio_bounce{
+        virtio_id_net,
+        device_features,
+        2,
+        VIRTIO_NET_QUEUE_SIZE,
+        boxy_virq__virtio_net,
+        make_bounce_ring(ring.get())
+    },
+    m_ring{std::move(ring)}
+{
+    std::memcpy(m_mac.data(), &m_ring.get()->mac[0], m_mac.size());
+}
+
+virtio_net::~virtio_net()
+{
+    if (m_port != 0) {
+        g_net_switch->detach(this);
+    }
+}
+
+void
+virtio_net::attach(uint64_t port)
+{
+    if (port == 0) {
+        throw std::runtime_error("virtio_net: invalid port");
+    }
+
+    g_net_switch->attach(this, port);
+}
+
+uint64_t
+virtio_net::port() const noexcept
+{ return m_port; }
+
+void
+virtio_net::set_vcpu(vcpu *vcpu)
+{
+    std::lock_guard lock(m_mutex);
+
+    if (m_switch_vcpu == nullptr) {
+        m_switch_vcpu = vcpu;
+    }
+}
+
+void
+virtio_net::clear_vcpu(vcpu *vcpu)
+{
+    std::lock_guard lock(m_mutex);
+
+    if (m_switch_vcpu == vcpu) {
+        m_switch_vcpu = nullptr;
+    }
+}
+
+bool
+virtio_net::resume(vcpu *vcpu)
+{
+    auto forwarded = false;
+
+    // Note:
+    //
+    // The switch takes the lock of the source and the destination itself,
+    // so the frames the guest transmitted are forwarded before our lock
+    // is taken.
+    //
+
+    if (m_switch_tx.exchange(false)) {
+        forwarded = g_net_switch->forward(vcpu, this);
+    }
+
+    auto rx = this->rx_pending();
+    auto tx = this->tx_pending();
+
+    if (!rx && !tx && !forwarded && !m_switch_rx && !m_kick) {
+        return false;
+    }
+
+    std::lock_guard lock(m_mutex);
+
+    if (m_switch_rx.exchange(false)) {
+        m_doorbell = false;
+    }
+
+    if (rx) {
+        this->process_rx(vcpu);
+    }
+
+    if (tx) {
+        this->process_tx(vcpu);
+    }
+
+    this->notify_guest(vcpu);
+    return m_kick.exchange(false);
+}
+
+// -----------------------------------------------------------------------------
+// Virtio MMIO Device
+// -----------------------------------------------------------------------------
+
+uint64_t
+virtio_net::read_config(uint64_t offset, uint64_t size) const noexcept
+{
+    // Note:
+    //
+    // struct virtio_net_config: mac and status. Everything after status
+    // is for a feature that we do not offer, and reads as 0.
+    //
+
+    std::array<uint8_t, 8> config{};
+
+    std::memcpy(&config.at(0), m_mac.data(), m_mac.size());
+    std::memcpy(&config.at(6), &virtio_net_s_link_up, sizeof(uint16_t));
+
+    uint64_t val = 0;
+
+    if (offset + size <= config.size()) {
+        std::memcpy(&val, &config.at(offset), size);
+    }
+
+    return val;
+}
+
+void
+virtio_net::queue_notify(vcpu *vcpu, std::size_t index)
+{
+    // Note:
+    //
+    // When attached to the switch, the transmit queue is drained by the
+    // switch the next time this vCPU is resumed (which is right after the
+    // guest's notification is emulated), so until then, the guest does
+    // not need to notify us again.
+    //
+
+    if (index == rxq) {
+        this->process_rx(vcpu);
+    }
+    else if (m_port != 0) {
+        this->queue(txq).disable_notify();
+        m_switch_tx = true;
+    }
+    else {
+        this->process_tx(vcpu);
+    }
+
+    this->notify_guest(vcpu);
+}
+
+void
+virtio_net::device_status(uint32_t status) noexcept
+{
+    bfignored(status);
+
+    // Note:
+    //
+    // bfexec configures the backend's offloads using the features that the
+    // guest accepted, so it is told every time they change (the guest can
+    // only change them while it is setting up the device, or by resetting
+    // the device).
+    //
+
+    auto r = m_ring.get();
+    auto features = reinterpret_cast<volatile uint64_t *>(&r->features);
+
+    if (*features != this->features()) {
+        *features = this->features();
+        m_kick = true;
+    }
+
+    if (status == 0) {
+        this->reset_bounce();
+        m_switch_tx = false;
+        m_generation++;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Bounce Ring
+// -----------------------------------------------------------------------------
+
+bool
+virtio_net::rx_accept(uint8_t *data, uint64_t len) noexcept
+{
+    if (!this->rx_allowed(data, len)) {
+        m_ring.get()->stats.dropped++;
+        return false;
+    }
+
+    // Note:
+    //
+    // Without VIRTIO_NET_F_MRG_RXBUF, every frame goes into a single
+    // descriptor chain, and num_buffers must be 1.
+    //
+
+    data[10] = 1;
+    data[11] = 0;
+
+    return true;
+}
+
+void
+virtio_net::rx_done(uint64_t len) noexcept
+{
+    auto r = m_ring.get();
+
+    r->stats.rx_packets++;
+    r->stats.rx_bytes += len - VIRTIO_NET_HDR_SIZE;
+}
+
+bool
+virtio_net::tx_accept(const uint8_t *data, uint64_t len) noexcept
+{
+    auto r = m_ring.get();
+    bfignored(data);
+
+    if (len <= VIRTIO_NET_HDR_SIZE) {
+        r->stats.dropped++;
+        return false;
+    }
+
+    r->stats.tx_packets++;
+    r->stats.tx_bytes += len - VIRTIO_NET_HDR_SIZE;
+
+    return true;
+}
+
+bool
+virtio_net::rx_allowed(const uint8_t *hdr, uint64_t len) const noexcept
+{
+    if (len < VIRTIO_NET_HDR_SIZE || len > VIRTIO_NET_SLOT_SIZE) {
+        return false;
+    }
+
+    // Note:
+    //
+    // The header is passed through from the backend (or the sending
+    // guest) as is, so a frame that relies on an offload the guest did not
+    // accept is dropped.
+    //
+
+    if ((hdr[0] & virtio_net_hdr_f_needs_csum) != 0 &&
+        !this->negotiated(virtio_net_f_guest_csum)) {
+        return false;
+    }
+
+    switch (hdr[1]) {
+        case virtio_net_hdr_gso_none:
+            return true;
+
+        case virtio_net_hdr_gso_tcpv4:
+            return this->negotiated(virtio_net_f_guest_tso4);
+
+        case virtio_net_hdr_gso_tcpv6:
+            return this->negotiated(virtio_net_f_guest_tso6);
+
+        default:
+            return false;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Net Switch
+// -----------------------------------------------------------------------------
+
+bool
+virtio_net::switch_pop(vcpu *vcpu, net_switch::frame_t &frame)
+{
+    auto r = m_ring.get();
+    auto &q = this->queue(txq);
+
+    frame.generation = m_generation;
+
+    try {
+        while (true) {
+            if (!q.pop(frame.head)) {
+                q.enable_notify();
+
+                if (q.empty()) {
+                    return false;
+                }
+
+                continue;
+            }
+
+            if (this->switch_chain(vcpu, frame)) {
+                return true;
+            }
+
+            q.push(frame.head, 0);
+            r->stats.dropped++;
+        }
+    }
+    catchall({
+        this->needs_reset();
+    })
+
+    return false;
+}
+
+bool
+virtio_net::switch_chain(vcpu *vcpu, net_switch::frame_t &frame)
+{
+    auto &q = this->queue(txq);
+
+    if (!q.chain(frame.head, frame.chain)) {
+        return false;
+    }
+
+    frame.len = 0;
+
+    for (const auto &desc : frame.chain) {
+        if ((desc.flags & virtq_desc_f_write) != 0 ||
+            desc.len > VIRTIO_NET_SLOT_SIZE - frame.len) {
+            return false;
+        }
+
+        frame.len += desc.len;
+    }
+
+    if (frame.len < frame.hdr.size()) {
+        return false;
+    }
+
+    // Note:
+    //
+    // The switch needs the header and the MACs to route the frame, which
+    // the guest might have split across descriptors.
+    //
+
+    uint64_t done = 0;
+
+    for (const auto &desc : frame.chain) {
+        auto bytes = std::min<uint64_t>(desc.len, frame.hdr.size() - done);
+        if (bytes == 0) {
+            break;
+        }
+
+        auto src = vcpu->map_gpa_4k<uint8_t>(desc.addr, bytes);
+        std::memcpy(&frame.hdr.at(done), src.get(), bytes);
+
+        done += bytes;
+    }
+
+    return true;
+}
+
+void
+virtio_net::switch_done(const net_switch::frame_t &frame) noexcept
+{
+    auto r = m_ring.get();
+
+    if (frame.generation != m_generation) {
+        return;
+    }
+
+    this->queue(txq).push(frame.head, 0);
+
+    r->stats.tx_packets++;
+    r->stats.tx_bytes += frame.len - VIRTIO_NET_HDR_SIZE;
+}
+
+bool
+virtio_net::switch_rx(vcpu *vcpu, const net_switch::frame_t &frame)
+{
+    auto r = m_ring.get();
+    auto &q = this->queue(rxq);
+
+    uint16_t head;
+
+    try {
+        if (m_switch_vcpu == nullptr ||
+            !this->rx_allowed(frame.hdr.data(), frame.len) ||
+            !q.pop(head)) {
+            r->stats.dropped++;
+            return false;
+        }
+
+        if (this->chain_room(q, head) < frame.len) {
+            q.push(head, 0);
+            m_switch_rx = true;
+
+            r->stats.dropped++;
+            return false;
+        }
+
+        // Note:
+        //
+        // This is the only copy the frame goes through. Each piece of the
+        // sender's chain is mapped using the sender's vCPU, and written
+        // into our chain, which is mapped using our recorded vCPU. Same
+        // as rx_accept(), num_buffers must be 1.
+        //
+
+        auto dst = m_chain.begin();
+        uint64_t dst_off = 0;
+
+        auto write = [&](const uint8_t *data, uint64_t bytes) {
+            while (bytes != 0) {
+                while (dst_off == dst->len) {
+                    ++dst;
+                    dst_off = 0;
+                }
+
+                auto n = std::min<uint64_t>(bytes, dst->len - dst_off);
+                auto map = m_switch_vcpu->map_gpa_4k<uint8_t>(
+                    dst->addr + dst_off, n);
+
+                std::memcpy(map.get(), data, n);
+
+                data += n;
+                bytes -= n;
+                dst_off += n;
+            }
+        };
+
+        std::array<uint8_t, VIRTIO_NET_HDR_SIZE> hdr{};
+        std::memcpy(hdr.data(), frame.hdr.data(), hdr.size());
+
+        hdr[10] = 1;
+        hdr[11] = 0;
+
+        write(hdr.data(), hdr.size());
+
+        uint64_t skip = VIRTIO_NET_HDR_SIZE;
+
+        for (const auto &desc : frame.chain) {
+            if (desc.len <= skip) {
+                skip -= desc.len;
+                continue;
+            }
+
+            auto src = vcpu->map_gpa_4k<uint8_t>(
+                desc.addr + skip, desc.len - skip);
+
+            write(src.get(), desc.len - skip);
+            skip = 0;
+        }
+
+        q.push(head, gsl::narrow_cast<uint32_t>(frame.len));
+    }
+    catchall({
+        this->needs_reset();
+        return false;
+    })
+
+    r->stats.rx_packets++;
+    r->stats.rx_bytes += frame.len - VIRTIO_NET_HDR_SIZE;
+
+    m_switch_rx = true;
+    return !m_doorbell.exchange(true);
+}
+
+bool
+virtio_net::switch_wake(uint64_t port) noexcept
+{
+    auto r = m_ring.get();
+
+    auto wake_prod = reinterpret_cast<volatile uint64_t *>(&r->wake_prod);
+    auto wake_cons = reinterpret_cast<volatile uint64_t *>(&r->wake_cons);
+
+    uint64_t prod = *wake_prod;
+
+    if (prod - *wake_cons >= VIRTIO_NET_RING_SLOTS) {
+        return false;
+    }
+
+    r->wake[prod % VIRTIO_NET_RING_SLOTS] = port;
+
+    std::atomic_thread_fence(std::memory_order_release);
+    *wake_prod = prod + 1;
+
+    m_kick = true;
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// vCPU Handler
+// -----------------------------------------------------------------------------
+
+virtio_net_handler::virtio_net_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{
+    if (vcpu->is_dom0() || vcpu->dom()->net() == nullptr) {
+        return;
+    }
+
+    vcpu->dom()->net()->set_vcpu(vcpu);
+
+    vcpu->add_resume_delegate(
+        {&virtio_net_handler::resume_delegate, this}
+    );
+}
+
+virtio_net_handler::~virtio_net_handler()
+{
+    if (m_vcpu->is_dom0() || m_vcpu->dom()->net() == nullptr) {
+        return;
+    }
+
+    m_vcpu->dom()->net()->clear_vcpu(m_vcpu);
+}
+
+void
+virtio_net_handler::resume_delegate(vcpu_t *vcpu)
+{
+    bfignored(vcpu);
+
+    if (!m_vcpu->dom()->net()->resume(m_vcpu)) {
+        return;
+    }
+
+    // Note:
+    //
+    // This does not return. See virtio_blk_handler::resume_delegate.
+    //
+
+    m_vcpu->begin_steal_time(::x64::tsc::get(), true);
+
+    m_vcpu->parent_vcpu()->load();
+    m_vcpu->parent_vcpu()->return_notify(boxy_notify__virtio_net);
+}
+
+}
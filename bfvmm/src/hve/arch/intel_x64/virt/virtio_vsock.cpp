@@ -0,0 +1,235 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <bfgpalayout.h>
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/domain.h>
+#include <hve/arch/intel_x64/virt/virtio_vsock.h>
+
+#include <array>
+#include <cstring>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+constexpr const uint32_t virtio_id_vsock{19};
+
+constexpr const std::size_t rxq{0};
+constexpr const std::size_t txq{1};
+
+constexpr const uint64_t device_features{
+    boxy::intel_x64::virtio_ring_f_event_idx |
+    boxy::intel_x64::virtio_f_version_1
+};
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+virtio_vsock::virtio_vsock(bfvmm::x64::unique_map<ring_type> &&ring) :
+    virtio_bounce{
+        virtio_id_vsock,
+        device_features,
+        3,
+        VIRTIO_VSOCK_QUEUE_SIZE,
+        boxy_virq__virtio_vsock,
+        make_bounce_ring(ring.get())
+    },
+    m_ring{std::move(ring)}
+{
+    m_guest_cid = m_ring.get()->guest_cid;
+}
+
+bool
+virtio_vsock::resume(vcpu *vcpu)
+{
+    auto rx = this->rx_pending();
+    auto tx = this->tx_pending();
+
+    if (!rx && !tx && !m_kick) {
+        return false;
+    }
+
+    std::lock_guard lock(m_mutex);
+
+    if (rx) {
+        this->process_rx(vcpu);
+    }
+
+    if (tx) {
+        this->process_tx(vcpu);
+    }
+
+    this->notify_guest(vcpu);
+    return m_kick.exchange(false);
+}
+
+// -----------------------------------------------------------------------------
+// Virtio MMIO Device
+// -----------------------------------------------------------------------------
+
+uint64_t
+virtio_vsock::read_config(uint64_t offset, uint64_t size) const noexcept
+{
+    // Note:
+    //
+    // struct virtio_vsock_config: guest_cid (64 bits), which is all there
+    // is.
+    //
+
+    std::array<uint8_t, 8> config{};
+    std::memcpy(config.data(), &m_guest_cid, config.size());
+
+    uint64_t val = 0;
+
+    if (offset + size <= config.size()) {
+        std::memcpy(&val, &config.at(offset), size);
+    }
+
+    return val;
+}
+
+void
+virtio_vsock::queue_notify(vcpu *vcpu, std::size_t index)
+{
+    // Note:
+    //
+    // The event queue is only used to tell the guest that its CID changed
+    // (e.g. after a migration), which never happens, so the buffers the
+    // guest makes available on it are left alone.
+    //
+
+    if (index == rxq) {
+        this->process_rx(vcpu);
+    }
+    else if (index == txq) {
+        this->process_tx(vcpu);
+    }
+    else {
+        this->queue(index).disable_notify();
+    }
+
+    this->notify_guest(vcpu);
+}
+
+void
+virtio_vsock::device_status(uint32_t status) noexcept
+{
+    if (status != 0) {
+        return;
+    }
+
+    // Note:
+    //
+    // A reset closes every socket in the guest, without a single packet
+    // being sent, so bfexec has to be told to close the host side of every
+    // connection. Packets that are still in the ring belong to connections
+    // that no longer exist, which bfexec answers with a reset, and the
+    // guest ignores.
+    //
+
+    auto r = m_ring.get();
+    auto resets = reinterpret_cast<volatile uint64_t *>(&r->resets);
+
+    *resets = *resets + 1;
+
+    this->reset_bounce();
+    m_kick = true;
+}
+
+// -----------------------------------------------------------------------------
+// Bounce Ring
+// -----------------------------------------------------------------------------
+
+bool
+virtio_vsock::rx_accept(uint8_t *data, uint64_t len) noexcept
+{
+    bfignored(data);
+
+    // Note:
+    //
+    // bfexec never posts more payload than a guest receive buffer holds,
+    // so a packet only ends up being dropped if the guest's buffers are
+    // broken (or bfexec is).
+    //
+
+    return len >= VIRTIO_VSOCK_HDR_SIZE;
+}
+
+bool
+virtio_vsock::tx_accept(const uint8_t *data, uint64_t len) noexcept
+{
+    bfignored(data);
+
+    // Note:
+    //
+    // The guest only sends as much as bfexec gave it credit for, so
+    // bfexec always has room for the payload.
+    //
+
+    return len >= VIRTIO_VSOCK_HDR_SIZE;
+}
+
+// -----------------------------------------------------------------------------
+// vCPU Handler
+// -----------------------------------------------------------------------------
+
+virtio_vsock_handler::virtio_vsock_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{
+    if (vcpu->is_dom0() || vcpu->dom()->vsock() == nullptr) {
+        return;
+    }
+
+    vcpu->add_resume_delegate(
+        {&virtio_vsock_handler::resume_delegate, this}
+    );
+}
+
+void
+virtio_vsock_handler::resume_delegate(vcpu_t *vcpu)
+{
+    bfignored(vcpu);
+
+    if (!m_vcpu->dom()->vsock()->resume(m_vcpu)) {
+        return;
+    }
+
+    // Note:
+    //
+    // This does not return. See virtio_blk_handler::resume_delegate.
+    //
+
+    m_vcpu->begin_steal_time(::x64::tsc::get(), true);
+
+    m_vcpu->parent_vcpu()->load();
+    m_vcpu->parent_vcpu()->return_notify(boxy_notify__virtio_vsock);
+}
+
+}
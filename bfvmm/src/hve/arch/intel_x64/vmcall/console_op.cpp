@@ -0,0 +1,94 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/domain.h>
+#include <hve/arch/intel_x64/vmcall/console_op.h>
+
+namespace boxy::intel_x64
+{
+
+console_op_handler::console_op_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{
+    if (vcpu->is_dom0()) {
+        return;
+    }
+
+    vcpu->add_vmcall_handler({&console_op_handler::dispatch, this});
+}
+
+void
+console_op_handler::console_op__get_ring(vcpu *vcpu)
+{
+    try {
+        auto gpa = get_domain(vcpu->domid())->console_ring();
+        vcpu->set_rax(gpa != 0 ? gpa : FAILURE);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+console_op_handler::console_op__notify(vcpu *vcpu)
+{
+    // Note:
+    //
+    // The guest only rings the doorbell when it writes to an empty ring, so
+    // all we have to do is hand control back to bfexec so that it can wake
+    // up whatever is draining the ring. bfexec reads the ring directly, so
+    // no data is copied here.
+    //
+
+    vcpu->set_rax(SUCCESS);
+    vcpu->begin_steal_time(::x64::tsc::get(), true);
+
+    vcpu->parent_vcpu()->load();
+    vcpu->parent_vcpu()->return_notify(boxy_notify__console);
+}
+
+bool
+console_op_handler::dispatch(vcpu *vcpu)
+{
+    if (bfopcode(vcpu->rax()) != hypercall_enum_console_op) {
+        return false;
+    }
+
+    switch (vcpu->rax()) {
+        case hypercall_enum_console_op__get_ring:
+            this->console_op__get_ring(vcpu);
+            return true;
+
+        case hypercall_enum_console_op__notify:
+            this->console_op__notify(vcpu);
+            return true;
+
+        default:
+            break;
+    };
+
+    throw std::runtime_error("unknown console opcode");
+}
+
+}
@@ -111,11 +111,18 @@ void
 domain_op_handler::domain_op__dump_uart(vcpu *vcpu)
 {
     try {
+        auto domain = get_domain(vcpu->rbx());
+
+        if (domain->has_uart_buffer()) {
+            vcpu->set_rax(domain->dump_uart());
+            return;
+        }
+
         auto buffer =
             vcpu->map_gva_4k<char>(vcpu->rcx(), UART_MAX_BUFFER);
 
         auto bytes_transferred =
-            get_domain(vcpu->rbx())->dump_uart(
+            domain->dump_uart(
                 gsl::span(buffer.get(), UART_MAX_BUFFER)
             );
 
@@ -126,6 +133,198 @@ domain_op_handler::domain_op__dump_uart(vcpu *vcpu)
     })
 }
 
+void
+domain_op_handler::domain_op__register_uart_buffer(vcpu *vcpu)
+{
+    try {
+        get_domain(vcpu->rbx())->register_uart_buffer(
+            vcpu->map_gva_4k<char>(vcpu->rcx(), UART_MAX_BUFFER)
+        );
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__set_console_ring(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__set_console_ring: self not supported");
+        }
+
+        if ((vcpu->rcx() & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+            throw std::runtime_error(
+                "domain_op__set_console_ring: ring must be page aligned");
+        }
+
+        std::array<uintptr_t, CONSOLE_RING_PAGES> hpas{};
+
+        for (std::size_t i = 0; i < hpas.size(); i++) {
+            auto [gpa, unused1] =
+                vcpu->gva_to_gpa(vcpu->rcx() + (i * BAREFLANK_PAGE_SIZE));
+            auto [hpa, unused2] =
+                vcpu->gpa_to_hpa(gpa);
+
+            hpas.at(i) = hpa;
+        }
+
+        get_domain(vcpu->rbx())->set_console_ring(hpas);
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__set_cpuid_leaf(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__set_cpuid_leaf: self not supported");
+        }
+
+        auto regs = vcpu->map_gva_4k<struct boxy_cpuid_leaf>(vcpu->rdx(), 1);
+
+        get_domain(vcpu->rbx())->set_cpuid_leaf(
+            gsl::narrow_cast<uint32_t>(vcpu->rcx()),
+            gsl::narrow_cast<uint32_t>(vcpu->rcx() >> 32),
+            *regs.get()
+        );
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__add_pt_io(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__add_pt_io: self not supported");
+        }
+
+        get_domain(vcpu->rbx())->add_pt_io(
+            gsl::narrow<pio_bus::port_type>(vcpu->rcx()),
+            gsl::narrow<uint32_t>(vcpu->rdx())
+        );
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__set_virtio_blk_ring(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__set_virtio_blk_ring: self not supported");
+        }
+
+        if ((vcpu->rcx() & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+            throw std::runtime_error(
+                "domain_op__set_virtio_blk_ring: ring must be page aligned");
+        }
+
+        get_domain(vcpu->rbx())->set_virtio_blk_ring(
+            vcpu->map_gva_4k<struct boxy_virtio_blk_ring>(vcpu->rcx(), 1)
+        );
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__set_virtio_net_ring(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__set_virtio_net_ring: self not supported");
+        }
+
+        if ((vcpu->rcx() & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+            throw std::runtime_error(
+                "domain_op__set_virtio_net_ring: ring must be page aligned");
+        }
+
+        get_domain(vcpu->rbx())->set_virtio_net_ring(
+            vcpu->map_gva_4k<struct boxy_virtio_net_ring>(vcpu->rcx(), 1)
+        );
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__attach_net_switch(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__attach_net_switch: self not supported");
+        }
+
+        auto net = get_domain(vcpu->rbx())->net();
+
+        if (net == nullptr) {
+            throw std::runtime_error(
+                "domain_op__attach_net_switch: no virtio-net device");
+        }
+
+        net->attach(vcpu->rcx());
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__set_virtio_vsock_ring(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error(
+                "domain_op__set_virtio_vsock_ring: self not supported");
+        }
+
+        if ((vcpu->rcx() & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+            throw std::runtime_error(
+                "domain_op__set_virtio_vsock_ring: ring must be page aligned");
+        }
+
+        get_domain(vcpu->rbx())->set_virtio_vsock_ring(
+            vcpu->map_gva_4k<struct boxy_virtio_vsock_ring>(vcpu->rcx(), 1)
+        );
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
 void
 domain_op_handler::domain_op__share_page_r(vcpu *vcpu)
 {
@@ -450,6 +649,14 @@ domain_op_handler::dispatch(vcpu *vcpu)
             dispatch_case(set_uart)
             dispatch_case(set_pt_uart)
             dispatch_case(dump_uart)
+            dispatch_case(set_console_ring)
+            dispatch_case(register_uart_buffer)
+            dispatch_case(set_cpuid_leaf)
+            dispatch_case(add_pt_io)
+            dispatch_case(set_virtio_blk_ring)
+            dispatch_case(set_virtio_net_ring)
+            dispatch_case(attach_net_switch)
+            dispatch_case(set_virtio_vsock_ring)
 
             dispatch_case(share_page_r)
             dispatch_case(share_page_rw)
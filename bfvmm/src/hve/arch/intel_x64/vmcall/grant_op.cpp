@@ -0,0 +1,234 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/domain.h>
+#include <hve/arch/intel_x64/vmcall/grant_op.h>
+
+namespace boxy::intel_x64
+{
+
+grant_op_handler::grant_op_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{
+    if (vcpu->is_dom0()) {
+        return;
+    }
+
+    vcpu->add_vmcall_handler({&grant_op_handler::dispatch, this});
+
+    vcpu->add_exit_handler(
+        {&grant_op_handler::exit_handler, this}
+    );
+
+    vcpu->add_resume_delegate(
+        {&grant_op_handler::resume_delegate, this}
+    );
+
+    vcpu->dom()->add_ept_user(&m_ept_state);
+}
+
+grant_op_handler::~grant_op_handler()
+{
+    if (m_vcpu->is_domU()) {
+        m_vcpu->dom()->remove_ept_user(&m_ept_state);
+    }
+}
+
+bool
+grant_op_handler::exit_handler(vcpu_t *vcpu)
+{
+    bfignored(vcpu);
+
+    // Note:
+    //
+    // This is executed on every exit, so keep it to a single store. Once
+    // we have left the guest, we cannot use a stale mapping until the
+    // next resume, which flushes if needed (see domain::sync_ept()).
+    //
+
+    m_ept_state = ept_state_exited;
+    return false;
+}
+
+void
+grant_op_handler::resume_delegate(vcpu_t *vcpu)
+{
+    bfignored(vcpu);
+
+    // Note:
+    //
+    // Mappings removed from the domain's EPT are only flushed from the CPU
+    // that removed them (see grant_table), so this CPU might still have
+    // stale entries if mappings were removed since we last flushed, or if
+    // we have moved to this CPU since (the parent vCPU is pinned). A
+    // domain that never lost a mapping never has to flush.
+    //
+    // The state is cleared before the generation is read, so that
+    // domain::sync_ept() either sees us as exited before we read the
+    // generation, or waits until we publish the generation we entered at.
+    //
+
+    m_ept_state = 0;
+
+    auto generation = m_vcpu->dom()->ept_generation();
+    if (generation != 0) {
+        if (generation != m_ept_generation ||
+            m_vcpu->parent_vcpu() != m_ept_parent) {
+            ::intel_x64::vmx::invept_global();
+            this->flushed();
+        }
+    }
+
+    m_ept_state = generation;
+}
+
+void
+grant_op_handler::grant_op__set_table(vcpu *vcpu)
+{
+    try {
+        vcpu->dom()->grants().set_table(vcpu, vcpu->rbx(), vcpu->rcx());
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+grant_op_handler::grant_op__map(vcpu *vcpu)
+{
+    try {
+        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+            throw std::runtime_error("grant_op__map: self not supported");
+        }
+
+        auto num = vcpu->rdx();
+        if (num == 0 || num > BOXY_GRANT_BATCH_MAX) {
+            throw std::runtime_error("grant_op__map: invalid batch size");
+        }
+
+        auto ops = vcpu->map_gva_4k<struct boxy_grant_op>(vcpu->rcx(), num);
+        auto &granter = get_domain(vcpu->rbx())->grants();
+
+        auto ret = vcpu->dom()->grants().map(
+            granter, gsl::span<struct boxy_grant_op>(ops.get(), num));
+
+        vcpu->set_rax(ret ? SUCCESS : FAILURE);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+grant_op_handler::grant_op__unmap(vcpu *vcpu)
+{
+    try {
+        auto num = vcpu->rcx();
+        if (num == 0 || num > BOXY_GRANT_BATCH_MAX) {
+            throw std::runtime_error("grant_op__unmap: invalid batch size");
+        }
+
+        auto ops = vcpu->map_gva_4k<struct boxy_grant_op>(vcpu->rbx(), num);
+
+        auto ret = vcpu->dom()->grants().unmap(
+            gsl::span<struct boxy_grant_op>(ops.get(), num));
+
+        this->flushed();
+        vcpu->set_rax(ret ? SUCCESS : FAILURE);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+grant_op_handler::grant_op__revoke(vcpu *vcpu)
+{
+    try {
+        auto num = vcpu->rcx();
+        if (num == 0 || num > BOXY_GRANT_BATCH_MAX) {
+            throw std::runtime_error("grant_op__revoke: invalid batch size");
+        }
+
+        auto ops = vcpu->map_gva_4k<struct boxy_grant_op>(vcpu->rbx(), num);
+
+        auto ret = vcpu->dom()->grants().revoke(
+            gsl::span<struct boxy_grant_op>(ops.get(), num));
+
+        this->flushed();
+        vcpu->set_rax(ret ? SUCCESS : FAILURE);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+grant_op_handler::flushed() noexcept
+{
+    // Note:
+    //
+    // The grant table has just executed INVEPT on this CPU (if anything was
+    // removed), which covers every removal up to now, so the next resume
+    // does not have to flush again.
+    //
+
+    m_ept_generation = m_vcpu->dom()->ept_generation();
+    m_ept_parent = m_vcpu->parent_vcpu();
+}
+
+bool
+grant_op_handler::dispatch(vcpu *vcpu)
+{
+    if (bfopcode(vcpu->rax()) != hypercall_enum_grant_op) {
+        return false;
+    }
+
+    switch (vcpu->rax()) {
+        case hypercall_enum_grant_op__set_table:
+            this->grant_op__set_table(vcpu);
+            return true;
+
+        case hypercall_enum_grant_op__map:
+            this->grant_op__map(vcpu);
+            return true;
+
+        case hypercall_enum_grant_op__unmap:
+            this->grant_op__unmap(vcpu);
+            return true;
+
+        case hypercall_enum_grant_op__revoke:
+            this->grant_op__revoke(vcpu);
+            return true;
+
+        default:
+            break;
+    };
+
+    throw std::runtime_error("unknown grant opcode");
+}
+
+}
@@ -65,9 +65,20 @@ run_op_handler::dispatch(vcpu *vcpu)
             m_child_vcpuid = vcpu->rbx();
         }
 
-        m_child_vcpu->set_parent_vcpu(vcpu);
+        // Note:
+        //
+        // The parent vCPU is pinned to a physical CPU, so a new parent
+        // means that the child has moved to a different CPU, and that
+        // CPU's TLB entries for the child's VPID might be stale.
+        //
+
+        if (m_child_vcpu->parent_vcpu() != vcpu) {
+            m_child_vcpu->set_parent_vcpu(vcpu);
+            m_child_vcpu->flush_vpid();
+        }
 
         if (m_child_vcpu->is_alive()) {
+            m_child_vcpu->end_steal_time();
             m_child_vcpu->load();
 
             try {
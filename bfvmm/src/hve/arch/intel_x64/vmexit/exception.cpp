@@ -53,6 +53,7 @@ exception_handler::handle(
 {
     bfignored(vcpu);
     auto parent_vcpu = m_vcpu->parent_vcpu();
+    m_vcpu->begin_steal_time(::x64::tsc::get(), true);
 
     parent_vcpu->load();
     parent_vcpu->inject_exception(info.vector);
@@ -48,6 +48,7 @@ external_interrupt_handler::handle(
 {
     bfignored(vcpu);
     auto parent_vcpu = m_vcpu->parent_vcpu();
+    m_vcpu->begin_steal_time(::x64::tsc::get(), true);
 
     parent_vcpu->load();
     parent_vcpu->queue_external_interrupt(info.vector);
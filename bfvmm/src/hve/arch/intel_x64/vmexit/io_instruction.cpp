@@ -30,13 +30,38 @@ namespace boxy::intel_x64
 {
 
 io_instruction_handler::io_instruction_handler(
-    gsl::not_null<vcpu *> vcpu)
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
 {
+    using namespace vmcs_n;
+
     if (vcpu->is_dom0()) {
         return;
     }
 
+    // Note:
+    //
+    // All of the I/O ports are trapped, and a single exit handler hands
+    // each access to the domain's pio_bus. The ports that are passed
+    // through are cleared from the I/O bitmaps once the domain is set up
+    // (see pio_bus::setup_vcpu).
+    //
+
     vcpu->trap_on_all_io_instruction_accesses();
+
+    vcpu->add_exit_handler_for_reason(
+        exit_reason::basic_exit_reason::io_instruction,
+        {&io_instruction_handler::handle, this}
+    );
 }
 
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+io_instruction_handler::handle(vcpu_t *vcpu)
+{ return m_vcpu->dom()->pio().handle(vcpu); }
+
 }
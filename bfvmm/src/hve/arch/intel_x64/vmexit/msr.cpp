@@ -21,13 +21,13 @@
 
 #include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/vmexit/msr.h>
+#include <hve/arch/intel_x64/emulation/table.h>
 
 #define ADD_WRMSR_HANDLER(a,w)                                                 \
     m_vcpu->add_wrmsr_handler(a, {&msr_handler::w, this});
 
 #define EMULATE_MSR(a,r,w)                                                     \
-    m_vcpu->emulate_rdmsr(a, {&msr_handler::r, this});                         \
-    m_vcpu->emulate_wrmsr(a, {&msr_handler::w, this});
+    {a, &msr_handler::r, &msr_handler::w}
 
 // -----------------------------------------------------------------------------
 // Implementation
@@ -36,6 +36,17 @@
 namespace boxy::intel_x64
 {
 
+// -----------------------------------------------------------------------------
+// Emulated MSRs
+// -----------------------------------------------------------------------------
+
+static const msr_entry_t<msr_handler> s_msrs[] = {
+    EMULATE_MSR(0x00000034, handle_rdmsr_0x00000034, handle_wrmsr_0x00000034),
+    EMULATE_MSR(0x00000140, handle_rdmsr_0x00000140, handle_wrmsr_0x00000140),
+    EMULATE_MSR(0x000001A0, handle_rdmsr_0x000001A0, handle_wrmsr_0x000001A0),
+    EMULATE_MSR(0x0000064E, handle_rdmsr_0x0000064E, handle_wrmsr_0x0000064E)
+};
+
 msr_handler::msr_handler(
     gsl::not_null<vcpu *> vcpu
 ) :
@@ -69,10 +80,15 @@ msr_handler::msr_handler(
     vcpu->pass_through_msr_access(::intel_x64::msrs::ia32_sysenter_eip::addr);
     vcpu->pass_through_msr_access(::intel_x64::msrs::ia32_sysenter_esp::addr);
 
-    EMULATE_MSR(0x00000034, handle_rdmsr_0x00000034, handle_wrmsr_0x00000034);
-    EMULATE_MSR(0x00000140, handle_rdmsr_0x00000140, handle_wrmsr_0x00000140);
-    EMULATE_MSR(0x000001A0, handle_rdmsr_0x000001A0, handle_wrmsr_0x000001A0);
-    EMULATE_MSR(0x0000064E, handle_rdmsr_0x0000064E, handle_wrmsr_0x0000064E);
+    vcpu->add_exit_handler_for_reason(
+        exit_reason::basic_exit_reason::rdmsr,
+        {&msr_handler::handle_rdmsr, this}
+    );
+
+    vcpu->add_exit_handler_for_reason(
+        exit_reason::basic_exit_reason::wrmsr,
+        {&msr_handler::handle_wrmsr, this}
+    );
 }
 
 // -----------------------------------------------------------------------------
@@ -197,6 +213,14 @@ msr_handler::isolate_msr__on_write(
 // Handlers
 // -----------------------------------------------------------------------------
 
+bool
+msr_handler::handle_rdmsr(vcpu_t *vcpu)
+{ return emulate_rdmsr(this, vcpu, s_msrs); }
+
+bool
+msr_handler::handle_wrmsr(vcpu_t *vcpu)
+{ return emulate_wrmsr(this, vcpu, s_msrs); }
+
 bool
 msr_handler::handle_rdmsr_0x00000034(
     vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
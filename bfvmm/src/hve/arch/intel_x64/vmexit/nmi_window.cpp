@@ -55,6 +55,7 @@ nmi_window_handler::handle(vcpu_t *vcpu)
     primary_processor_based_vm_execution_controls::nmi_window_exiting::disable();
 
     auto parent_vcpu = m_vcpu->parent_vcpu();
+    m_vcpu->begin_steal_time(::x64::tsc::get(), true);
 
     parent_vcpu->load();
     parent_vcpu->inject_nmi();
@@ -0,0 +1,119 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/vmexit/xsetbv.h>
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+static bool
+is_valid_xcr0(uint64_t xcr0, uint64_t supported) noexcept
+{
+    constexpr const uint64_t x87{1U << 0U};
+    constexpr const uint64_t sse{1U << 1U};
+    constexpr const uint64_t avx{1U << 2U};
+    constexpr const uint64_t avx512{0xE0U};
+
+    if ((xcr0 & ~supported) != 0) {
+        return false;
+    }
+
+    if ((xcr0 & x87) == 0) {
+        return false;
+    }
+
+    if ((xcr0 & avx) != 0 && (xcr0 & sse) == 0) {
+        return false;
+    }
+
+    if ((xcr0 & avx512) != 0) {
+        if ((xcr0 & avx512) != avx512 || (xcr0 & avx) == 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+xsetbv_handler::xsetbv_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{
+    using namespace vmcs_n;
+
+    if (vcpu->is_dom0()) {
+        return;
+    }
+
+    vcpu->add_exit_handler_for_reason(
+        exit_reason::basic_exit_reason::xsetbv,
+        {&xsetbv_handler::handle, this}
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+xsetbv_handler::handle(vcpu_t *vcpu)
+{
+    // Note:
+    //
+    // The XCR0 bits a guest is allowed to set are the bits reported by
+    // CPUID leaf 0xD, subleaf 0 (i.e. the domain's CPUID table), which
+    // never includes anything the host does not support. A valid write
+    // is left to the base vCPU, which records the guest's XCR0 so that
+    // its extended state is saved/restored on each world switch. An
+    // invalid write gets a #GP, just like it would on hardware.
+    //
+
+    constexpr const uint64_t gp_exception{13U};
+
+    auto xcr0 =
+        ((vcpu->rdx() & 0xFFFFFFFF) << 32U) | (vcpu->rax() & 0xFFFFFFFF);
+
+    auto leaf = m_vcpu->dom()->cpuid_leaf(0x0000000D, 0);
+
+    uint64_t supported{};
+    if (leaf != nullptr) {
+        supported = (static_cast<uint64_t>(leaf->edx) << 32U) | leaf->eax;
+    }
+
+    if ((vcpu->rcx() & 0xFFFFFFFF) != 0 || !is_valid_xcr0(xcr0, supported)) {
+        vcpu->inject_exception(gp_exception, 0);
+        return true;
+    }
+
+    return false;
+}
+
+}
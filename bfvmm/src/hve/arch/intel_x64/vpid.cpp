@@ -0,0 +1,74 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <bfgsl.h>
+#include <hve/arch/intel_x64/vpid.h>
+
+namespace boxy::intel_x64
+{
+
+vpid_allocator *
+vpid_allocator::instance() noexcept
+{
+    static vpid_allocator self;
+    return &self;
+}
+
+uint16_t
+vpid_allocator::allocate() noexcept
+{
+    std::lock_guard lock(m_mutex);
+
+    // Note:
+    //
+    // The search starts after the last VPID that was handed out so that a
+    // VPID that was just freed is the last one to be reused. This gives
+    // the TLB entries of the old vCPU the best chance of being evicted
+    // before the VPID is recycled.
+    //
+
+    for (uint64_t i = 0; i < VPID_MAX; i++) {
+        auto vpid = m_next;
+        m_next = (m_next == VPID_MAX) ? 1 : m_next + 1;
+
+        auto &word = m_used.at(vpid / 64);
+        if ((word & (1ULL << (vpid % 64))) == 0) {
+            word |= 1ULL << (vpid % 64);
+            return gsl::narrow_cast<uint16_t>(vpid);
+        }
+    }
+
+    return 0;
+}
+
+void
+vpid_allocator::free(uint16_t vpid) noexcept
+{
+    if (vpid == 0 || vpid > VPID_MAX) {
+        return;
+    }
+
+    std::lock_guard lock(m_mutex);
+    m_used.at(vpid / 64) &= ~(1ULL << (vpid % 64));
+}
+
+}